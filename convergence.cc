@@ -11,8 +11,11 @@
 #include "easylog.h"
 #include "rundata.h"
 
+#include <algorithm>
 #include <iostream>
+#include <math.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -383,3 +386,224 @@ void LMConvergenceDetector::Dump(ostream &out, const string &indent) const
         << endl;
     out << indent << "Previous Free Energy == " << m_prev << endl;
 }
+
+void ParamChangeConvergenceDetector::Initialize(FabberRunData &params)
+{
+    CountingConvergenceDetector::Initialize(params);
+
+    m_max_mean_change = params.GetDoubleDefault("max-mean-change", 0.001);
+    if (m_max_mean_change <= 0)
+        throw InvalidOptionValue(
+            "max-mean-change", stringify(m_max_mean_change), "Must be positive");
+
+    m_max_var_change = params.GetDoubleDefault("max-var-change", 0.01);
+    if (m_max_var_change <= 0)
+        throw InvalidOptionValue("max-var-change", stringify(m_max_var_change), "Must be positive");
+    Reset();
+}
+
+void ParamChangeConvergenceDetector::Reset(double F)
+{
+    CountingConvergenceDetector::Reset();
+    m_have_prev = false;
+    m_finite = true;
+    m_mean_change = 0;
+    m_var_change = 0;
+}
+
+void ParamChangeConvergenceDetector::UpdateParams(const MVNDist &post)
+{
+    m_means = post.means;
+    m_vars.ReSize(m_means.Nrows());
+    const NEWMAT::SymmetricMatrix &cov = post.GetCovariance();
+    m_finite = true;
+    for (int i = 1; i <= m_means.Nrows(); i++)
+    {
+        m_vars(i) = cov(i, i);
+        if (!(m_means(i) - m_means(i) == 0) || !(m_vars(i) - m_vars(i) == 0))
+            m_finite = false;
+    }
+}
+
+bool ParamChangeConvergenceDetector::Test(double F)
+{
+    if (!m_finite)
+    {
+        m_reason = "Non-finite parameters";
+        return true;
+    }
+
+    bool converged = false;
+    if (m_have_prev)
+    {
+        m_mean_change = 0;
+        m_var_change = 0;
+        for (int i = 1; i <= m_means.Nrows(); i++)
+        {
+            double scale = fabs(m_prev_means(i));
+            if (m_vars(i) > 0 && sqrt(m_vars(i)) > scale)
+                scale = sqrt(m_vars(i));
+            if (scale > 0)
+                m_mean_change = max(m_mean_change, fabs(m_means(i) - m_prev_means(i)) / scale);
+
+            if (m_prev_vars(i) > 0)
+                m_var_change = max(m_var_change, fabs(m_vars(i) - m_prev_vars(i)) / m_prev_vars(i));
+        }
+        converged = (m_mean_change <= m_max_mean_change) && (m_var_change <= m_max_var_change);
+    }
+    m_prev_means = m_means;
+    m_prev_vars = m_vars;
+    m_have_prev = true;
+
+    if (converged)
+    {
+        m_reason = "Parameter change less than tolerance";
+        return true;
+    }
+    else
+        return CountingConvergenceDetector::Test(F);
+}
+
+void ParamChangeConvergenceDetector::Dump(ostream &out, const string &indent) const
+{
+    out << indent << "Iteration " << m_its << " of at most " << m_max_its << " : " << m_reason
+        << endl;
+    out << indent << "Relative change in means == " << m_mean_change
+        << ", variances == " << m_var_change << endl;
+}
+
+void SpatialConvergenceDetector::Initialize(FabberRunData &params)
+{
+    CountingConvergenceDetector::Initialize(params);
+
+    m_min_its = params.GetIntDefault("spatial-min-iterations", 3, 1);
+    m_max_fchange = params.GetDoubleDefault("spatial-fchange", 1e-4, 0);
+    m_max_ak_change = params.GetDoubleDefault("spatial-ak-change", 0.01, 0);
+    m_max_mean_change = params.GetDoubleDefault("spatial-mean-change", 0.01, 0);
+    m_mean_percentile = params.GetDoubleDefault("spatial-mean-percentile", 95, 0, 100);
+    Reset();
+}
+
+void SpatialConvergenceDetector::Reset(double F)
+{
+    CountingConvergenceDetector::Reset();
+    m_prev_f = F;
+    m_ak.clear();
+    m_prev_ak.clear();
+    m_means.clear();
+    m_sds.clear();
+    m_prev_means.clear();
+    m_have_prev = false;
+    m_save = false;
+    m_revert = false;
+    m_fchange = 0;
+    m_ak_change = 0;
+    m_mean_change_max = 0;
+    m_mean_change_pc = 0;
+}
+
+void SpatialConvergenceDetector::UpdateParams(const MVNDist &post)
+{
+    const NEWMAT::SymmetricMatrix &cov = post.GetCovariance();
+    NEWMAT::ColumnVector sds(post.means.Nrows());
+    for (int i = 1; i <= sds.Nrows(); i++)
+    {
+        sds(i) = cov(i, i) > 0 ? sqrt(cov(i, i)) : 0;
+    }
+    m_means.push_back(post.means);
+    m_sds.push_back(sds);
+}
+
+void SpatialConvergenceDetector::UpdateaK(const vector<double> &aK)
+{
+    m_ak = aK;
+}
+
+bool SpatialConvergenceDetector::Test(double F)
+{
+    // Written so that a non-finite free energy counts as a decrease
+    bool finite = (F - F == 0);
+    bool decreased = m_have_prev && !(F >= m_prev_f);
+    bool converged = false;
+    m_save = false;
+    m_revert = false;
+
+    if (m_have_prev && finite)
+    {
+        m_fchange = fabs(F - m_prev_f);
+        if (m_prev_f != 0)
+            m_fchange /= fabs(m_prev_f);
+
+        m_ak_change = 0;
+        for (unsigned int k = 0; k < m_ak.size() && k < m_prev_ak.size(); k++)
+        {
+            if (m_prev_ak[k] > 0)
+                m_ak_change = max(m_ak_change, fabs(m_ak[k] - m_prev_ak[k]) / m_prev_ak[k]);
+        }
+
+        vector<double> changes(m_means.size(), 0);
+        for (unsigned int v = 0; v < m_means.size() && v < m_prev_means.size(); v++)
+        {
+            for (int i = 1; i <= m_means[v].Nrows(); i++)
+            {
+                double scale = max(fabs(m_prev_means[v](i)), m_sds[v](i));
+                if (scale > 0)
+                    changes[v]
+                        = max(changes[v], fabs(m_means[v](i) - m_prev_means[v](i)) / scale);
+            }
+        }
+        m_mean_change_max = 0;
+        m_mean_change_pc = 0;
+        if (!changes.empty())
+        {
+            m_mean_change_max = *max_element(changes.begin(), changes.end());
+            int idx = int(ceil(m_mean_percentile / 100 * changes.size())) - 1;
+            idx = max(0, min(idx, int(changes.size()) - 1));
+            nth_element(changes.begin(), changes.begin() + idx, changes.end());
+            m_mean_change_pc = changes[idx];
+        }
+
+        converged = (m_fchange <= m_max_fchange) && (m_ak_change <= m_max_ak_change)
+            && (m_mean_change_pc <= m_max_mean_change);
+    }
+
+    if (decreased && (m_its + 1 >= m_min_its))
+    {
+        // Keep the previous values so the reverted iteration is what is reported
+        ++m_its;
+        m_means.clear();
+        m_sds.clear();
+        m_reason = "Free energy decreased";
+        m_revert = true;
+        return true;
+    }
+
+    m_prev_f = F;
+    m_prev_ak = m_ak;
+    m_prev_means.swap(m_means);
+    m_means.clear();
+    m_sds.clear();
+    m_have_prev = true;
+    m_save = finite;
+
+    if (converged && (m_its + 1 >= m_min_its))
+    {
+        ++m_its;
+        m_reason = "Free energy, spatial precision and means converged";
+        return true;
+    }
+    else
+    {
+        return CountingConvergenceDetector::Test(F);
+    }
+}
+
+void SpatialConvergenceDetector::Dump(ostream &out, const string &indent) const
+{
+    out << indent << "Iteration " << m_its << " of at most " << m_max_its << " : " << m_reason
+        << endl;
+    out << indent << "Relative change in free energy == " << m_fchange
+        << ", spatial precision == " << m_ak_change << endl;
+    out << indent << "Relative change in means == " << m_mean_change_max << " (max), "
+        << m_mean_change_pc << " (" << m_mean_percentile << "th percentile)" << endl;
+}
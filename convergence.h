@@ -8,11 +8,15 @@
 
 #pragma once
 
+#include "dist_mvn.h"
 #include "factories.h"
 #include "rundata.h"
 
+#include <newmat.h>
+
 #include <ostream>
 #include <string>
+#include <vector>
 
 /**
  * Abstract base class for method of testing whether the free energy maximisation algorithm has
@@ -52,6 +56,22 @@ public:
     {
         return false;
     }
+    /**
+     * Whether detector uses the posterior distribution of the model parameters
+     *
+     * If so, UpdateParams is called with the current posterior before each
+     * call to Test
+     */
+    virtual bool UseParams() const
+    {
+        return false;
+    }
+    /**
+     * Pass the current posterior distribution of the model parameters
+     */
+    virtual void UpdateParams(const MVNDist &post)
+    {
+    }
     /**
      * Do we need to save the last set of parameters?
      *
@@ -306,6 +326,145 @@ private:
     double m_alphamax;
 };
 
+/**
+ * Converges when the relative changes in the posterior means and variances
+ * of the model parameters are sufficiently small
+ *
+ * Does not need the free energy. The change in each mean is measured relative
+ * to the larger of the previous mean and the posterior standard deviation, so
+ * parameters whose mean is close to zero do not prevent convergence.
+ */
+class ParamChangeConvergenceDetector : public CountingConvergenceDetector
+{
+public:
+    static ConvergenceDetector *NewInstance()
+    {
+        return new ParamChangeConvergenceDetector();
+    }
+    virtual void Initialize(FabberRunData &params);
+
+    /**
+     * @return true if the relative changes in all means and variances since
+     *         the previous iteration are within the configured tolerances,
+     *         if the parameters have become non-finite, or if the maximum
+     *         number of iterations has been reached.
+     */
+    virtual bool Test(double F);
+
+    virtual void Reset(double F = -99e99);
+
+    virtual bool UseParams() const
+    {
+        return true;
+    }
+    virtual void UpdateParams(const MVNDist &post);
+
+    /** Save the parameters whenever they are finite */
+    virtual bool NeedSave()
+    {
+        return m_finite;
+    }
+    /** Revert to the last finite parameters if they have become non-finite */
+    virtual bool NeedRevert()
+    {
+        return !m_finite;
+    }
+    virtual void Dump(std::ostream &out, const std::string &indent = "") const;
+
+protected:
+    double m_max_mean_change;
+    double m_max_var_change;
+    NEWMAT::ColumnVector m_means;
+    NEWMAT::ColumnVector m_vars;
+    NEWMAT::ColumnVector m_prev_means;
+    NEWMAT::ColumnVector m_prev_vars;
+    bool m_have_prev;
+    bool m_finite;
+    double m_mean_change;
+    double m_var_change;
+};
+
+/**
+ * Global convergence for spatial VB
+ *
+ * Converges when the relative changes in the global free energy, in the
+ * spatial precision (aK) of each parameter and in the posterior means of
+ * the voxels are all sufficiently small, after a minimum number of
+ * iterations. The change in the means of a voxel is the largest change of
+ * any parameter, measured as in ParamChangeConvergenceDetector, and the
+ * given percentile of this over the voxels is compared to the tolerance so
+ * a few slowly converging voxels do not prevent convergence.
+ *
+ * If the free energy decreases after the minimum number of iterations it
+ * stops and asks for the previous iteration to be restored.
+ *
+ * This is not available as a per-voxel detector. UpdateaK and UpdateParams
+ * (for every voxel, in the same order) must be called before each Test.
+ */
+class SpatialConvergenceDetector : public CountingConvergenceDetector
+{
+public:
+    virtual void Initialize(FabberRunData &params);
+
+    /**
+     * @return true if the free energy has decreased, if the free energy,
+     *         spatial precisions and means have converged, or if the maximum
+     *         number of iterations has been reached.
+     */
+    virtual bool Test(double F);
+
+    virtual void Reset(double F = -99e99);
+
+    virtual bool UseF() const
+    {
+        return true;
+    }
+    virtual bool UseParams() const
+    {
+        return true;
+    }
+
+    /** Add the posterior of the next voxel for this iteration */
+    virtual void UpdateParams(const MVNDist &post);
+
+    /** Set the spatial precisions of this iteration, one per spatial prior */
+    void UpdateaK(const std::vector<double> &aK);
+
+    /** Save the parameters whenever the free energy has not decreased */
+    virtual bool NeedSave()
+    {
+        return m_save;
+    }
+    /** Revert to the previous iteration if the free energy has decreased */
+    virtual bool NeedRevert()
+    {
+        return m_revert;
+    }
+    virtual void Dump(std::ostream &out, const std::string &indent = "") const;
+
+protected:
+    int m_min_its;
+    double m_max_fchange;
+    double m_max_ak_change;
+    double m_max_mean_change;
+    double m_mean_percentile;
+
+    double m_prev_f;
+    std::vector<double> m_ak;
+    std::vector<double> m_prev_ak;
+    std::vector<NEWMAT::ColumnVector> m_means;
+    std::vector<NEWMAT::ColumnVector> m_sds;
+    std::vector<NEWMAT::ColumnVector> m_prev_means;
+    bool m_have_prev;
+    bool m_save;
+    bool m_revert;
+
+    double m_fchange;
+    double m_ak_change;
+    double m_mean_change_max;
+    double m_mean_change_pc;
+};
+
 inline std::ostream &operator<<(std::ostream &out, const ConvergenceDetector &conv)
 {
     conv.Dump(out);
@@ -1,6 +1,7 @@
 #include "covariance_cache.h"
 
 #include "easylog.h"
+#include "linalg.h"
 #include "rundata.h"
 
 #include <newmat.h>
@@ -202,7 +203,9 @@ const SymmetricMatrix &CovarianceCache::GetCinv(double delta) const
 #else
     if (m_cinv_cache[delta].Nrows() == 0)
     {
-        m_cinv_cache[delta] = GetC(delta).i();
+        SymmetricMatrix C = GetC(delta);
+        if (!fabber::linalg::InvertSPD(C, m_cinv_cache[delta]))
+            m_cinv_cache[delta] = C.i();
     }
 
     return m_cinv_cache[delta];
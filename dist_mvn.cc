@@ -8,6 +8,7 @@
 
 #include "dist_mvn.h"
 #include "easylog.h"
+#include "linalg.h"
 #include "tools.h"
 
 #include <math.h>
@@ -207,19 +208,23 @@ const SymmetricMatrix &MVNDist::GetPrecisions() const
         assert(covarianceValid);
         // precisions and precisionsValid are mutable,
         // so we can change them even in a const function
-        try
+        if (!fabber::linalg::InvertSPD(covariance, precisions))
         {
-            precisions = covariance.i();
-        }
-        catch (Exception)
-        {
-            // Failure to invert matrix - this hack adds a tiny amount to the diagonal and tries
-            // again
-            WARN_ONCE("MVN precision (m_size==" + stringify(m_size)
-                + ") was singular, adding 1e-10 to diagonal");
-            LOG << means.t() << endl;
-            LOG << covariance << endl;
-            precisions = (covariance + IdentityMatrix(m_size) * 1e-10).i();
+            // Not positive definite - fall back to a general inverse
+            try
+            {
+                precisions = covariance.i();
+            }
+            catch (Exception)
+            {
+                // Failure to invert matrix - this hack adds a tiny amount to the diagonal and tries
+                // again
+                WARN_ONCE("MVN precision (m_size==" + stringify(m_size)
+                    + ") was singular, adding 1e-10 to diagonal");
+                LOG << means.t() << endl;
+                LOG << covariance << endl;
+                precisions = (covariance + IdentityMatrix(m_size) * 1e-10).i();
+            }
         }
         precisionsValid = true;
     }
@@ -242,19 +247,23 @@ const SymmetricMatrix &MVNDist::GetCovariance() const
         assert(precisionsValid);
         // covariance and covarianceValid are mutable,
         // so we can change them even in a const function
-        try
+        if (!fabber::linalg::InvertSPD(precisions, covariance))
         {
-            covariance = precisions.i();
-        }
-        catch (Exception)
-        {
-            // Failure to invert matrix - this hack adds a tiny amount to the diagonal and tries
-            // again
-            WARN_ONCE("MVN precision (m_size==" + stringify(m_size)
-                + ") was singular, adding 1e-10 to diagonal");
-            LOG << means.t() << endl;
-            LOG << precisions << endl;
-            covariance = (precisions + IdentityMatrix(m_size) * 1e-10).i();
+            // Not positive definite - fall back to a general inverse
+            try
+            {
+                covariance = precisions.i();
+            }
+            catch (Exception)
+            {
+                // Failure to invert matrix - this hack adds a tiny amount to the diagonal and tries
+                // again
+                WARN_ONCE("MVN precision (m_size==" + stringify(m_size)
+                    + ") was singular, adding 1e-10 to diagonal");
+                LOG << means.t() << endl;
+                LOG << precisions << endl;
+                covariance = (precisions + IdentityMatrix(m_size) * 1e-10).i();
+            }
         }
         covarianceValid = true;
     }
@@ -18,17 +18,228 @@
 
 #include "newmat.h"
 
+#include <algorithm>
+#include <deque>
 #include <sstream>
 #include <stdexcept>
+#include <streambuf>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <stdio.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 using NEWMAT::Matrix;
 using namespace std;
 
+/**
+ * Stream buffer which only keeps the start of the output
+ *
+ * Used by fabber_dorun so that the memory used by the log is limited to
+ * what the caller's buffer can hold
+ */
+class TruncatingLogBuf : public std::streambuf
+{
+public:
+    explicit TruncatingLogBuf(size_t max_size)
+        : m_max_size(max_size)
+    {
+    }
+
+    const string &str() const
+    {
+        return m_text;
+    }
+
+protected:
+    int overflow(int c)
+    {
+        if ((c != EOF) && (m_text.size() < m_max_size))
+            m_text += char(c);
+        return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char *s, streamsize n)
+    {
+        if (m_text.size() < m_max_size)
+            m_text.append(s, min(size_t(n), m_max_size - m_text.size()));
+        return n;
+    }
+
+private:
+    size_t m_max_size;
+    string m_text;
+};
+
+/**
+ * Stream buffer which passes each complete line of the log to a callback
+ *
+ * Lines are queued and the callback is called from a background thread, so
+ * the run is not held up by a slow callback unless the queue is full. Lines
+ * starting with WARNING are given the warning level, other lines the level
+ * set by SetLevel.
+ */
+class CallbackLogBuf : public std::streambuf
+{
+public:
+    CallbackLogBuf(void (*cb)(int, const char *), int min_level)
+        : m_cb(cb)
+        , m_min_level(min_level)
+        , m_level(FABBER_LOG_INFO)
+        , m_finished(false)
+    {
+#ifndef _WIN32
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_not_empty, NULL);
+        pthread_cond_init(&m_not_full, NULL);
+        m_stop = false;
+        m_have_thread = (pthread_create(&m_thread, NULL, ThreadMain, this) == 0);
+#endif
+    }
+
+    ~CallbackLogBuf()
+    {
+        Finish();
+#ifndef _WIN32
+        pthread_cond_destroy(&m_not_full);
+        pthread_cond_destroy(&m_not_empty);
+        pthread_mutex_destroy(&m_mutex);
+#endif
+    }
+
+    /**
+     * Set the level of subsequent lines
+     */
+    void SetLevel(int level)
+    {
+        m_level = level;
+    }
+
+    /**
+     * Send any incomplete line and wait for all lines to be delivered
+     */
+    void Finish()
+    {
+        if (m_finished)
+            return;
+        m_finished = true;
+        if (!m_line.empty())
+            EndLine();
+#ifndef _WIN32
+        if (m_have_thread)
+        {
+            pthread_mutex_lock(&m_mutex);
+            m_stop = true;
+            pthread_cond_signal(&m_not_empty);
+            pthread_mutex_unlock(&m_mutex);
+            pthread_join(m_thread, NULL);
+        }
+#endif
+    }
+
+protected:
+    int overflow(int c)
+    {
+        if (c == '\n')
+            EndLine();
+        else if (c != EOF)
+            m_line += char(c);
+        return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char *s, streamsize n)
+    {
+        for (streamsize i = 0; i < n; i++)
+        {
+            if (s[i] == '\n')
+                EndLine();
+            else
+                m_line += s[i];
+        }
+        return n;
+    }
+
+private:
+    /** Maximum number of lines waiting to be delivered */
+    static const size_t MAX_QUEUED = 1000;
+
+    void EndLine()
+    {
+        int level = (m_line.compare(0, 7, "WARNING") == 0) ? FABBER_LOG_WARN : m_level;
+        if (level >= m_min_level)
+            Send(level, m_line);
+        m_line.clear();
+    }
+
+    void Send(int level, const string &line)
+    {
+#ifndef _WIN32
+        if (m_have_thread)
+        {
+            pthread_mutex_lock(&m_mutex);
+            while (m_queue.size() >= MAX_QUEUED)
+            {
+                pthread_cond_wait(&m_not_full, &m_mutex);
+            }
+            m_queue.push_back(make_pair(level, line));
+            pthread_cond_signal(&m_not_empty);
+            pthread_mutex_unlock(&m_mutex);
+            return;
+        }
+#endif
+        m_cb(level, line.c_str());
+    }
+
+#ifndef _WIN32
+    static void *ThreadMain(void *buf)
+    {
+        static_cast<CallbackLogBuf *>(buf)->DeliverLines();
+        return NULL;
+    }
+
+    void DeliverLines()
+    {
+        pthread_mutex_lock(&m_mutex);
+        while (true)
+        {
+            while (m_queue.empty() && !m_stop)
+            {
+                pthread_cond_wait(&m_not_empty, &m_mutex);
+            }
+            if (m_queue.empty())
+                break;
+
+            pair<int, string> item = m_queue.front();
+            m_queue.pop_front();
+            pthread_cond_signal(&m_not_full);
+            pthread_mutex_unlock(&m_mutex);
+            m_cb(item.first, item.second.c_str());
+            pthread_mutex_lock(&m_mutex);
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    pthread_t m_thread;
+    bool m_have_thread;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_not_empty;
+    pthread_cond_t m_not_full;
+    bool m_stop;
+    deque<pair<int, string> > m_queue;
+#endif
+
+    void (*m_cb)(int, const char *);
+    int m_min_level;
+    int m_level;
+    bool m_finished;
+    string m_line;
+};
+
 static int fabber_err(int code, const char *msg, char *err_buf)
 {
     // Error buffer is optional
@@ -44,14 +255,17 @@ static int fabber_err(int code, const char *msg, char *err_buf)
 
 void *fabber_new(char *err_buf)
 {
+    // Reference keeps the factories alive while this handle exists,
+    // regardless of other handles being destroyed
+    FabberSetup::AddRef();
     try
     {
-        FabberSetup::SetupDefaults();
         FabberRunDataArray *rundata = new FabberRunDataArray(false);
         return rundata;
     }
     catch (...)
     {
+        FabberSetup::Release();
         fabber_err(FABBER_ERR_FATAL, "Failed to allocate memory for run data", err_buf);
         return NULL;
     }
@@ -206,27 +420,19 @@ int fabber_get_data(void *fab, const char *name, float *data_buf, char *err_buf)
     }
 }
 
-int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
-    void (*progress_cb)(int, int))
+/**
+ * Run Fabber, logging any error and setting the error buffer
+ *
+ * @param stream_buf If the log is being streamed, the stream buffer so that
+ *                   error messages can be given the error level. May be NULL
+ */
+static int DoRun(FabberRunDataArray *rundata, EasyLog &log, char *err_buf,
+    void (*progress_cb)(int, int), CallbackLogBuf *stream_buf)
 {
-    EasyLog log;
-
-    if (!fab)
-        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
-    if (!log_buf)
-        return fabber_err(FABBER_ERR_FATAL, "Log buffer is NULL", err_buf);
-    if (!err_buf)
-        return fabber_err(FABBER_ERR_FATAL, "Error buffer is NULL", err_buf);
-    if (log_bufsize > 0 && !log_buf)
-        return fabber_err(FABBER_ERR_FATAL, "Log buffer is NULL", err_buf);
-
     int ret = 0;
-    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-    rundata->SetLogger(&log);
-    stringstream logstr;
+    string msg;
     try
     {
-        log.StartLog(logstr);
         if (progress_cb)
         {
             CallbackProgressCheck prog(progress_cb);
@@ -240,33 +446,87 @@ int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_b
     }
     catch (const FabberError &e)
     {
-        log.ReissueWarnings();
-        log.LogStream() << e.what() << endl;
+        msg = e.what();
         ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
     }
     catch (NEWMAT::Exception &e)
     {
-        log.ReissueWarnings();
-        log.LogStream() << "NEWMAT exception caught in fabber:\n  " << e.what() << endl;
+        msg = string("NEWMAT exception caught in fabber:\n  ") + e.what();
         ret = fabber_err(FABBER_ERR_NEWMAT, e.what(), err_buf);
     }
     catch (const exception &e)
     {
-        log.ReissueWarnings();
-        log.LogStream() << "STL exception caught in fabber:\n  " << e.what() << endl;
+        msg = string("STL exception caught in fabber:\n  ") + e.what();
         ret = fabber_err(FABBER_ERR_FATAL, e.what(), err_buf);
     }
     catch (...)
     {
-        log.ReissueWarnings();
-        log.LogStream() << "Some other exception caught in fabber!" << endl;
+        msg = "Some other exception caught in fabber!";
         ret = fabber_err(FABBER_ERR_FATAL, "Unrecognized exception", err_buf);
     }
 
+    if (ret != 0)
+    {
+        log.ReissueWarnings();
+        if (stream_buf)
+            stream_buf->SetLevel(FABBER_LOG_ERROR);
+        log.LogStream() << msg << endl;
+    }
+    return ret;
+}
+
+int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
+    void (*progress_cb)(int, int))
+{
+    EasyLog log;
+
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    if (!log_buf)
+        return fabber_err(FABBER_ERR_FATAL, "Log buffer is NULL", err_buf);
+    if (!err_buf)
+        return fabber_err(FABBER_ERR_FATAL, "Error buffer is NULL", err_buf);
+    if (log_bufsize > 0 && !log_buf)
+        return fabber_err(FABBER_ERR_FATAL, "Log buffer is NULL", err_buf);
+
+    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+    rundata->SetLogger(&log);
+
+    // Only keep as much of the log as the caller can receive
+    TruncatingLogBuf logbuf(log_bufsize > 0 ? log_bufsize - 1 : 0);
+    ostream logstr(&logbuf);
+    log.StartLog(logstr);
+    int ret = DoRun(rundata, log, err_buf, progress_cb, NULL);
     log.StopLog();
 
-    strncpy(log_buf, logstr.str().c_str(), log_bufsize - 1);
-    log_buf[log_bufsize - 1] = '\0';
+    if (log_bufsize > 0)
+    {
+        strncpy(log_buf, logbuf.str().c_str(), log_bufsize - 1);
+        log_buf[log_bufsize - 1] = '\0';
+    }
+
+    return ret;
+}
+
+int fabber_dorun_stream(void *fab, int min_level, void (*log_cb)(int, const char *),
+    char *err_buf, void (*progress_cb)(int, int))
+{
+    EasyLog log;
+
+    if (!fab)
+        return fabber_err(FABBER_ERR_FATAL, "Rundata is NULL", err_buf);
+    if (!log_cb)
+        return fabber_err(FABBER_ERR_FATAL, "Log callback is NULL", err_buf);
+
+    FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
+    rundata->SetLogger(&log);
+
+    CallbackLogBuf logbuf(log_cb, min_level);
+    ostream logstr(&logbuf);
+    log.StartLog(logstr);
+    int ret = DoRun(rundata, log, err_buf, progress_cb, &logbuf);
+    log.StopLog();
+    logbuf.Finish();
 
     return ret;
 }
@@ -275,10 +535,11 @@ void fabber_destroy(void *fab)
 {
     if (fab)
     {
-        // Get rid of registered models etc
-        FabberSetup::Destroy();
         FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
         delete rundata;
+
+        // Get rid of registered models etc if no other handles are using them
+        FabberSetup::Release();
     }
 }
 
@@ -415,6 +676,21 @@ int fabber_get_methods(void *fab, unsigned int out_bufsize, char *out_buf, char
     }
 }
 
+/**
+ * Create the forward model given by the options
+ *
+ * For a model comparison run (model1, model2, ...) this is the first model
+ */
+static FwdModel *NewModel(FabberRunData &rundata)
+{
+    vector<string> models = rundata.GetStringList("model");
+    if (models.empty())
+    {
+        throw MandatoryOptionMissing("model");
+    }
+    return FwdModel::NewFromName(models[0]);
+}
+
 int fabber_get_model_params(void *fab, unsigned int out_bufsize, char *out_buf, char *err_buf)
 {
     if (!fab)
@@ -425,7 +701,7 @@ int fabber_get_model_params(void *fab, unsigned int out_bufsize, char *out_buf,
     try
     {
         FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-        std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
+        std::auto_ptr<FwdModel> model(NewModel(*rundata));
         EasyLog log;
         model->SetLogger(&log); // We ignore the log but this stops it going to cerr
         model->Initialize(*rundata);
@@ -466,7 +742,7 @@ int fabber_get_model_param_descs(void *fab, unsigned int out_bufsize, char *out_
     try
     {
         FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-        std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
+        std::auto_ptr<FwdModel> model(NewModel(*rundata));
         EasyLog log;
         model->SetLogger(&log); // We ignore the log but this stops it going to cerr
         model->Initialize(*rundata);
@@ -512,7 +788,7 @@ int fabber_get_model_outputs(void *fab, unsigned int out_bufsize, char *out_buf,
     try
     {
         FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-        std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
+        std::auto_ptr<FwdModel> model(NewModel(*rundata));
         EasyLog log;
         model->SetLogger(&log); // We ignore the log but this stops it going to cerr
         model->Initialize(*rundata);
@@ -568,7 +844,7 @@ int fabber_model_evaluate_output(void *fab, unsigned int n_params, float *params
     try
     {
         FabberRunDataArray *rundata = (FabberRunDataArray *)fab;
-        std::auto_ptr<FwdModel> model(FwdModel::NewFromName(rundata->GetString("model")));
+        std::auto_ptr<FwdModel> model(NewModel(*rundata));
 
         log.StartLog(logstr);
         model->SetLogger(&log);
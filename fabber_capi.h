@@ -25,6 +25,11 @@
 #define FABBER_ERR_FATAL -255
 #define FABBER_ERR_NEWMAT -254
 
+// Log levels for fabber_dorun_stream
+#define FABBER_LOG_INFO 1
+#define FABBER_LOG_WARN 2
+#define FABBER_LOG_ERROR 3
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,6 +37,9 @@ extern "C" {
 /**
  * Create a new context for running fabber.
  *
+ * Contexts are independent and may be used concurrently from different
+ * threads, provided each context is only used by one thread at a time
+ *
  * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
  *
  * @return A handle to the context. This should not be used for any purpose apart from
@@ -73,7 +81,8 @@ FABBER_DLL_API int fabber_set_extent(
 /**
  * Destroy fabber context previously created in fabber_new
  *
- * Will not return any errors.
+ * Registered models, methods, etc. are only removed once all contexts
+ * have been destroyed. Will not return any errors.
  *
  * @param fab Fabber context, returned by fabber_new. NULL will be ignored. Anything
  *            else will probably cause a crash.
@@ -138,7 +147,8 @@ FABBER_DLL_API int fabber_get_data(void *fab, const char *name, float *data_buf,
  *
  * @param fab Fabber context, returned by fabber_new
  * @param log_bufsize Size of the log buffer. If too small, only this number of characters
- *                    will be returned.
+ *                    will be returned. Use fabber_dorun_stream to receive the whole log
+ *                    without buffering it.
  * @param log_buf Char buffer of size log_bufsize to receive output log
  * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
  * @param progress_cb Function pointer which takes two integers (current voxel, total voxels). Pass
@@ -149,6 +159,29 @@ FABBER_DLL_API int fabber_get_data(void *fab, const char *name, float *data_buf,
 FABBER_DLL_API int fabber_dorun(void *fab, unsigned int log_bufsize, char *log_buf, char *err_buf,
     void (*progress_cb)(int, int));
 
+/**
+ * Run Fabber model fitting, passing the log to a callback as the run progresses
+ *
+ * Unlike fabber_dorun the log is not collected in memory. Each complete line
+ * is passed to the callback (without the trailing newline) together with its
+ * level. The callback is called from a separate thread so that a slow callback
+ * does not hold up the calculation, however the run will wait if the callback
+ * falls too far behind. All lines have been delivered by the time this function
+ * returns.
+ *
+ * @param fab Fabber context, returned by fabber_new
+ * @param min_level Only lines with at least this level are passed to the callback
+ *                  (FABBER_LOG_INFO, FABBER_LOG_WARN or FABBER_LOG_ERROR)
+ * @param log_cb Function pointer which takes the log level and a log line. Not NULL
+ * @param err_buf Optional buffer for error message. Max message length=FABBER_ERR_MAXC
+ * @param progress_cb Function pointer which takes two integers (current voxel, total voxels). Pass
+ * NULL if not required
+ *
+ * @return 0 on success, <0 on failure
+ */
+FABBER_DLL_API int fabber_dorun_stream(void *fab, int min_level, void (*log_cb)(int, const char *),
+    char *err_buf, void (*progress_cb)(int, int));
+
 /**
  * Get fabber options, optionally for a specific method or model
  *
@@ -201,6 +234,9 @@ FABBER_DLL_API int fabber_get_methods(
  * Get a list of model parameters that will be output. Note that this will depend
  * on the options specified, so must be called after all options are set
  *
+ * For a model comparison run (model1, model2, ...) this and the other model
+ * functions below use the first model
+ *
  * @param fab Fabber context, returned by fabber_new
  * @param out_bufsize Size of the output buffer. If too small, no output is returned
  * @param out_buf Char buffer of size out_bufsize to receive output. Will contain
@@ -9,6 +9,7 @@
 #include "fabber_core.h"
 #include "fwdmodel.h"
 #include "inference.h"
+#include "result_container.h"
 #include "rundata_newimage.h"
 #include "version.h"
 #include "tools.h"
@@ -213,6 +214,48 @@ int execute(int argc, char **argv)
 
             return 0;
         }
+        else if (params->HaveKey("convert-matrix"))
+        {
+            string infile = params->GetString("convert-matrix");
+            string outfile = params->GetStringDefault("convert-output", infile + ".bin");
+            Matrix mat = fabber::read_matrix_file(infile);
+            fabber::write_binary_matrix(mat, outfile);
+            cout << "Converted " << mat.Nrows() << "x" << mat.Ncols() << " matrix to " << outfile
+                 << endl;
+
+            return 0;
+        }
+        else if (params->HaveKey("export-container"))
+        {
+            string infile = params->GetString("export-container");
+            fabber::ResultContainer results(infile);
+            vector<string> names = results.GetNames();
+            if (params->HaveKey("export-output"))
+                names.assign(1, params->GetString("export-output"));
+
+            string dir = ".";
+            size_t slash = infile.rfind('/');
+            if (slash != string::npos)
+                dir = infile.substr(0, slash);
+            for (unsigned int i = 0; i < names.size(); i++)
+            {
+                cout << "Exported " << names[i] << " to "
+                     << results.ExportNifti(
+                            names[i], dir + "/" + names[i], params->GetBool("export-compress"))
+                     << endl;
+            }
+
+            return 0;
+        }
+        else if (params->HaveKey("write-model-manifest"))
+        {
+            string library = params->GetString("write-model-manifest");
+            vector<string> models = FwdModel::WriteModelManifest(library);
+            cout << "Wrote " << models.size() << " models to "
+                 << FwdModel::ManifestFilename(library) << endl;
+
+            return 0;
+        }
         else if (params->HaveKey("evaluate")) 
         {
             string model = params->GetStringDefault("model", "");
@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include "thread_pool.h"
+
 #include <iostream>
 #include <map>
 #include <string>
@@ -58,6 +60,12 @@ public:
      */
     bool HasName(const std::string &name);
 
+protected:
+    /**
+     * @return function pointer with the given name, or NULL if not known
+     */
+    Function Find(const std::string &name);
+
 private:
     /** Map from names to function pointers. */
     std::map<std::string, Function> functionMap_;
@@ -95,9 +103,21 @@ template <class T> void TemplateFactory<T>::Add(const std::string &name, Functio
 
 template <class T> T *TemplateFactory<T>::Create(const std::string &name)
 {
-    if (functionMap_.count(name))
+    Function function = Find(name);
+    if (function)
+    {
+        return function();
+    }
+    return NULL;
+}
+
+template <class T>
+typename TemplateFactory<T>::Function TemplateFactory<T>::Find(const std::string &name)
+{
+    typename std::map<std::string, Function>::iterator it = functionMap_.find(name);
+    if (it != functionMap_.end())
     {
-        return functionMap_[name]();
+        return it->second;
     }
     return NULL;
 }
@@ -106,10 +126,17 @@ template <class T> T *TemplateFactory<T>::Create(const std::string &name)
  * Singleton template factory class.
  *
  * Maintains a singleton instance of a \ref TemplateFactory.
+ *
+ * All methods are thread-safe, so the factory can be used from multiple
+ * concurrent runs. However Destroy must not be called while any other
+ * thread may be using the instance - see \ref FabberSetup::AddRef for
+ * how this is managed.
  */
 template <class T> class SingletonFactory : public TemplateFactory<T>
 {
 public:
+    typedef typename TemplateFactory<T>::Function Function;
+
     /**
      * Returns pointer to singleton instance of this class.
      * @return instance.
@@ -120,9 +147,16 @@ public:
      */
     static void Destroy();
 
+    void Add(const std::string &name, Function function);
+    T *Create(const std::string &name);
+    std::vector<std::string> GetNames();
+    bool HasName(const std::string &name);
+
 private:
     /** Singleton instance of this class. */
     static SingletonFactory *singleton_;
+    /** Guards the singleton instance and its contents */
+    static fabber_mutex_t mutex_;
     /** Constructor. */
     SingletonFactory();
 };
@@ -134,6 +168,7 @@ template <class T> SingletonFactory<T>::SingletonFactory()
 
 template <class T> void SingletonFactory<T>::Destroy()
 {
+    ScopedLock lock(mutex_);
     if (singleton_ != NULL)
     {
         delete singleton_;
@@ -143,8 +178,11 @@ template <class T> void SingletonFactory<T>::Destroy()
 
 template <class T> SingletonFactory<T> *SingletonFactory<T>::singleton_ = NULL;
 
+template <class T> fabber_mutex_t SingletonFactory<T>::mutex_ = FABBER_MUTEX_INITIALIZER;
+
 template <class T> SingletonFactory<T> *SingletonFactory<T>::GetInstance()
 {
+    ScopedLock lock(mutex_);
     if (singleton_ == NULL)
     {
         singleton_ = new SingletonFactory<T>();
@@ -152,6 +190,40 @@ template <class T> SingletonFactory<T> *SingletonFactory<T>::GetInstance()
     return singleton_;
 }
 
+template <class T> void SingletonFactory<T>::Add(const std::string &name, Function function)
+{
+    ScopedLock lock(mutex_);
+    TemplateFactory<T>::Add(name, function);
+}
+
+template <class T> T *SingletonFactory<T>::Create(const std::string &name)
+{
+    // Do not hold the lock while creating the instance, in case the
+    // constructor uses the factory itself
+    Function function;
+    {
+        ScopedLock lock(mutex_);
+        function = TemplateFactory<T>::Find(name);
+    }
+    if (function)
+    {
+        return function();
+    }
+    return NULL;
+}
+
+template <class T> std::vector<std::string> SingletonFactory<T>::GetNames()
+{
+    ScopedLock lock(mutex_);
+    return TemplateFactory<T>::GetNames();
+}
+
+template <class T> bool SingletonFactory<T>::HasName(const std::string &name)
+{
+    ScopedLock lock(mutex_);
+    return TemplateFactory<T>::HasName(name);
+}
+
 /**
  * Template class for registration of classes with factories.
  * Assumes T supports a GetInstance function which returns an object
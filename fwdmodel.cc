@@ -11,15 +11,23 @@
 #include "easylog.h"
 #include "priors.h"
 #include "rundata.h"
+#include "thread_pool.h"
 #include "transforms.h"
 
 #include <newmatio.h>
 
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include <string.h>
+#include <sys/stat.h>
+
 using namespace std;
 
 typedef int (*GetNumModelsFptr)(void);
@@ -60,7 +68,218 @@ string GetLastErrorAsString()
 #define GETERROR dlerror
 #endif
 
-void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
+/**
+ * Remembers recent model evaluations for each voxel
+ *
+ * Entries are matched on the exact bits of the parameter vector and the
+ * output key. The entries for a voxel are discarded if the data passed
+ * in for that voxel changes, e.g. because of motion correction.
+ *
+ * May be used from multiple threads, e.g. when the Jacobian is evaluated
+ * in parallel for reentrant models
+ */
+class EvaluationCache
+{
+public:
+    explicit EvaluationCache(unsigned int size)
+        : m_size(size)
+        , m_voxel(0)
+        , m_have_voxel(false)
+        , m_hits(0)
+        , m_misses(0)
+    {
+#ifndef _WIN32
+        pthread_mutex_init(&m_mutex, NULL);
+#endif
+    }
+
+    ~EvaluationCache()
+    {
+#ifndef _WIN32
+        pthread_mutex_destroy(&m_mutex);
+#endif
+    }
+
+    unsigned int Size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Set the current voxel and its data
+     */
+    void SetVoxel(unsigned int voxel, const NEWMAT::ColumnVector &data,
+        const NEWMAT::ColumnVector &suppdata, const NEWMAT::ColumnVector &coords)
+    {
+        unsigned long hash = Hash(data, Hash(suppdata, Hash(coords, 2166136261ul)));
+        ScopedLock lock(m_mutex);
+        m_voxel = voxel;
+        m_have_voxel = true;
+        VoxelEntries &vox = m_voxels[voxel];
+        if (vox.hash != hash)
+        {
+            vox.hash = hash;
+            vox.entries.clear();
+        }
+    }
+
+    /**
+     * Discard the entries for a voxel
+     */
+    void Forget(unsigned int voxel)
+    {
+        ScopedLock lock(m_mutex);
+        m_voxels.erase(voxel);
+        if (m_have_voxel && (m_voxel == voxel))
+            m_have_voxel = false;
+    }
+
+    /**
+     * Look for a previous evaluation for the current voxel
+     *
+     * @return true if found, in which case result is set
+     */
+    bool Find(const NEWMAT::ColumnVector &params, const string &key, NEWMAT::ColumnVector &result)
+    {
+        ScopedLock lock(m_mutex);
+        if (!m_have_voxel)
+            return false;
+
+        deque<Entry> &entries = m_voxels[m_voxel].entries;
+        for (deque<Entry>::iterator iter = entries.begin(); iter != entries.end(); ++iter)
+        {
+            if (iter->Matches(params, key))
+            {
+                result = iter->result;
+                // Most recently used entries are kept at the front
+                if (iter != entries.begin())
+                {
+                    Entry entry = *iter;
+                    entries.erase(iter);
+                    entries.push_front(entry);
+                }
+                m_hits++;
+                return true;
+            }
+        }
+        m_misses++;
+        return false;
+    }
+
+    /**
+     * Remember an evaluation for the current voxel
+     */
+    void Store(const NEWMAT::ColumnVector &params, const string &key, const NEWMAT::ColumnVector &result)
+    {
+        ScopedLock lock(m_mutex);
+        if (!m_have_voxel)
+            return;
+
+        Entry entry;
+        entry.key = key;
+        entry.params.assign(params.Store(), params.Store() + params.Nrows());
+        entry.result = result;
+
+        deque<Entry> &entries = m_voxels[m_voxel].entries;
+        entries.push_front(entry);
+        if (entries.size() > m_size)
+            entries.pop_back();
+    }
+
+    long Hits() const
+    {
+        return m_hits;
+    }
+
+    long Misses() const
+    {
+        return m_misses;
+    }
+
+private:
+    struct Entry
+    {
+        string key;
+        vector<double> params;
+        NEWMAT::ColumnVector result;
+
+        bool Matches(const NEWMAT::ColumnVector &p, const string &k) const
+        {
+            return (int(params.size()) == p.Nrows()) && (key == k)
+                && ((params.size() == 0)
+                       || (memcmp(&params[0], p.Store(), params.size() * sizeof(double)) == 0));
+        }
+    };
+
+    struct VoxelEntries
+    {
+        VoxelEntries()
+            : hash(0)
+        {
+        }
+        unsigned long hash;
+        deque<Entry> entries;
+    };
+
+    /** FNV-1a hash of the bytes of a vector */
+    static unsigned long Hash(const NEWMAT::ColumnVector &vec, unsigned long hash)
+    {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(vec.Store());
+        size_t len = vec.Nrows() * sizeof(double);
+        for (size_t i = 0; i < len; i++)
+        {
+            hash = (hash ^ bytes[i]) * 16777619ul;
+        }
+        return hash;
+    }
+
+    unsigned int m_size;
+    unsigned int m_voxel;
+    bool m_have_voxel;
+    long m_hits;
+    long m_misses;
+    map<unsigned int, VoxelEntries> m_voxels;
+    fabber_mutex_t m_mutex;
+};
+
+EvaluationCacheHolder::EvaluationCacheHolder(const EvaluationCacheHolder &from)
+    : m_cache(from.m_cache ? new EvaluationCache(from.m_cache->Size()) : NULL)
+{
+}
+
+EvaluationCacheHolder &EvaluationCacheHolder::operator=(const EvaluationCacheHolder &from)
+{
+    if (this != &from)
+        Reset(from.m_cache ? new EvaluationCache(from.m_cache->Size()) : NULL);
+    return *this;
+}
+
+EvaluationCacheHolder::~EvaluationCacheHolder()
+{
+    delete m_cache;
+}
+
+void EvaluationCacheHolder::Reset(EvaluationCache *cache)
+{
+    delete m_cache;
+    m_cache = cache;
+}
+
+/**
+ * Models listed in manifests whose library has not yet been opened, and the
+ * library which provides each of them
+ */
+static map<string, string> g_pending_models;
+static fabber_mutex_t g_pending_mutex = FABBER_MUTEX_INITIALIZER;
+
+/**
+ * Open a model library and add all its models to the FwdModelFactory
+ *
+ * @param lazy If true, resolve symbols in the library when first used
+ *             rather than when it is opened
+ * @return names of the models in the library
+ */
+static vector<string> OpenModelLibrary(const std::string &filename, EasyLog *log, bool lazy)
 {
     FwdModelFactory *factory = FwdModelFactory::GetInstance();
     GetNumModelsFptr get_num_models;
@@ -72,7 +291,7 @@ void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
 #ifdef _WIN32
     HINSTANCE libptr = LoadLibrary(filename.c_str());
 #else
-    void *libptr = dlopen(filename.c_str(), RTLD_NOW);
+    void *libptr = dlopen(filename.c_str(), lazy ? RTLD_LAZY : RTLD_NOW);
 #endif
     if (!libptr)
     {
@@ -101,6 +320,7 @@ void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
             string("Failed to resolve symbol 'get_new_instance_func' ") + GETERROR());
     }
 
+    vector<string> names;
     int num_models = get_num_models();
     if (log)
         log->LogStream() << "Loading " << num_models << " models" << endl;
@@ -124,14 +344,111 @@ void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
                         + model_name);
             }
             factory->Add(model_name, new_instance_fptr);
+            names.push_back(model_name);
         }
     }
+    return names;
+}
+
+/**
+ * Read the manifest of a model library, if there is an up to date one
+ *
+ * @return true if the manifest was read. False if it does not exist, is
+ *         older than the library or lists no models
+ */
+static bool ReadModelManifest(const std::string &filename, vector<string> &names, EasyLog *log)
+{
+    string manifest = FwdModel::ManifestFilename(filename);
+    struct stat lib_stat, manifest_stat;
+    if ((stat(manifest.c_str(), &manifest_stat) != 0) || (stat(filename.c_str(), &lib_stat) != 0))
+    {
+        return false;
+    }
+    if (lib_stat.st_mtime > manifest_stat.st_mtime)
+    {
+        if (log)
+            log->LogStream() << "Ignoring out of date model manifest " << manifest << endl;
+        return false;
+    }
+
+    ifstream is(manifest.c_str());
+    string line;
+    names.clear();
+    while (getline(is, line))
+    {
+        // Ignore comments and surrounding whitespace
+        line = line.substr(0, line.find("#"));
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first != string::npos)
+            names.push_back(line.substr(first, line.find_last_not_of(" \t\r") - first + 1));
+    }
+    return !names.empty();
+}
+
+void FwdModel::LoadFromDynamicLibrary(const std::string &filename, EasyLog *log)
+{
+    // If the library has a manifest, just remember which models it provides
+    // and only open it if one of them is used
+    vector<string> names;
+    if (ReadModelManifest(filename, names, log))
+    {
+        if (log)
+            log->LogStream() << "Found manifest for " << filename << " - " << names.size()
+                             << " models will be loaded when first used" << endl;
+        FwdModelFactory *factory = FwdModelFactory::GetInstance();
+        ScopedLock lock(g_pending_mutex);
+        for (unsigned int i = 0; i < names.size(); i++)
+        {
+            if (!factory->HasName(names[i]))
+                g_pending_models[names[i]] = filename;
+        }
+        return;
+    }
+
+    OpenModelLibrary(filename, log, false);
+}
+
+string FwdModel::ManifestFilename(const std::string &filename)
+{
+    return filename + ".models";
+}
+
+std::vector<std::string> FwdModel::WriteModelManifest(const std::string &filename, EasyLog *log)
+{
+    // Binding all symbols now checks the library can be used before
+    // writing the manifest
+    vector<string> names = OpenModelLibrary(filename, log, false);
+
+    string manifest = ManifestFilename(filename);
+    ofstream os(manifest.c_str());
+    os << "# Fabber models provided by " << filename << endl;
+    for (unsigned int i = 0; i < names.size(); i++)
+    {
+        os << names[i] << endl;
+    }
+    os.close();
+    if (!os)
+    {
+        throw FabberRunDataError("Failed to write model manifest " + manifest);
+    }
+    return names;
 }
 
 std::vector<std::string> FwdModel::GetKnown()
 {
     FwdModelFactory *factory = FwdModelFactory::GetInstance();
-    return factory->GetNames();
+    vector<string> names = factory->GetNames();
+    {
+        ScopedLock lock(g_pending_mutex);
+        for (map<string, string>::iterator it = g_pending_models.begin();
+             it != g_pending_models.end(); ++it)
+        {
+            names.push_back(it->first);
+        }
+    }
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+    return names;
 }
 
 FwdModel *FwdModel::NewFromName(const string &name)
@@ -139,6 +456,30 @@ FwdModel *FwdModel::NewFromName(const string &name)
     FwdModelFactory *factory = FwdModelFactory::GetInstance();
     FwdModel *model = factory->Create(name);
     if (model == NULL)
+    {
+        // Open the library which provides the model, if it has not been opened
+        // yet. The lock is held while it is opened so another thread asking
+        // for one of its models waits for it to be added to the factory.
+        // Symbols are bound lazily as the library was checked when the
+        // manifest was written.
+        ScopedLock lock(g_pending_mutex);
+        map<string, string>::iterator pending = g_pending_models.find(name);
+        if (pending != g_pending_models.end())
+        {
+            string library = pending->second;
+            vector<string> names = OpenModelLibrary(library, NULL, true);
+            for (unsigned int i = 0; i < names.size(); i++)
+            {
+                g_pending_models.erase(names[i]);
+            }
+            g_pending_models.erase(name);
+        }
+    }
+    if (model == NULL)
+    {
+        model = factory->Create(name);
+    }
+    if (model == NULL)
     {
         throw InvalidOptionValue("model", name, "Unrecognized forward model");
     }
@@ -150,6 +491,17 @@ void FwdModel::Initialize(FabberRunData &args)
     m_log = args.GetLogger();
 }
 
+void FwdModel::SetEvaluationCacheSize(unsigned int size)
+{
+    m_eval_cache.Reset(size > 0 ? new EvaluationCache(size) : NULL);
+}
+
+void FwdModel::ForgetEvaluations(unsigned int voxel_idx)
+{
+    if (m_eval_cache.Get())
+        m_eval_cache.Get()->Forget(voxel_idx);
+}
+
 void FwdModel::UsageFromName(const string &name, std::ostream &stream)
 {
     std::auto_ptr<FwdModel> model(NewFromName(name));
@@ -202,6 +554,8 @@ void FwdModel::PassData(unsigned int voxel_idx, const NEWMAT::ColumnVector &voxd
     data = voxdata;
     suppdata = voxsuppdata;
     coords = voxcoords;
+    if (m_eval_cache.Get())
+        m_eval_cache.Get()->SetVoxel(voxel_idx, voxdata, voxsuppdata, voxcoords);
     coord_x = coords(1);
     coord_y = coords(2);
     coord_z = coords(3);
@@ -366,6 +720,10 @@ void FwdModel::EvaluateFabber(
     const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result, const std::string &key) const
 {
     assert((m_params.size() == 0) || (int(m_params.size()) == params.Nrows()));
+    EvaluationCache *cache = m_eval_cache.Get();
+    if (cache && cache->Find(params, key, result))
+        return;
+
     if (m_params.size() == 0)
     {
         EvaluateModel(params, result, key);
@@ -379,6 +737,19 @@ void FwdModel::EvaluateFabber(
         }
         EvaluateModel(tparams, result, key);
     }
+
+    if (cache)
+        cache->Store(params, key, result);
+}
+
+void FwdModel::ReportEvaluationCache() const
+{
+    EvaluationCache *cache = m_eval_cache.Get();
+    if (cache)
+    {
+        LOG << "FwdModel::Evaluation cache: " << cache->Hits() << " hits, " << cache->Misses()
+            << " misses" << endl;
+    }
 }
 
 void FwdModel::DumpParameters(const NEWMAT::ColumnVector &params, const string &indent) const
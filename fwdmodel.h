@@ -56,6 +56,38 @@ struct Parameter
     std::map<std::string, std::string> options;
 };
 
+class EvaluationCache;
+
+/**
+ * Owner of a model's evaluation cache
+ *
+ * Copies get their own empty cache of the same size, so models can be
+ * copied as normal
+ */
+class EvaluationCacheHolder
+{
+public:
+    EvaluationCacheHolder()
+        : m_cache(NULL)
+    {
+    }
+    EvaluationCacheHolder(const EvaluationCacheHolder &from);
+    EvaluationCacheHolder &operator=(const EvaluationCacheHolder &from);
+    ~EvaluationCacheHolder();
+
+    /** @return the cache, or NULL if disabled */
+    EvaluationCache *Get() const
+    {
+        return m_cache;
+    }
+
+    /** Replace the cache. Takes ownership of the new cache, which may be NULL */
+    void Reset(EvaluationCache *cache);
+
+private:
+    EvaluationCache *m_cache;
+};
+
 class FwdModel : public Loggable
 {
 public:
@@ -152,6 +184,20 @@ public:
         Evaluate(params, result);
     }
 
+    /**
+     * Whether EvaluateModel may be called concurrently from multiple threads
+     *
+     * This allows the numerical Jacobian to be calculated in parallel. Models
+     * should only return true if evaluation does not modify any shared state
+     * (e.g. mutable caches) or otherwise handles concurrent calls safely.
+     *
+     * @return false by default
+     */
+    virtual bool IsReentrant() const
+    {
+        return false;
+    }
+
     /**
      * Get parameter descriptions for this model.
      *
@@ -214,10 +260,37 @@ public:
      *            prediction. Otherwise can specify a model-specific alternative output
      *            (which must be timeseries data). A list of alternative outputs is
      *            provided by the model in GetOutputs.
+     *
+     * If the eval-cache-size option is set, results are remembered for each voxel
+     * and the model is not re-evaluated if called again with exactly the same
+     * parameters for the same voxel data.
      */
     void EvaluateFabber(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
         const std::string &key = "") const;
 
+    /**
+     * Set the number of evaluations to remember for each voxel
+     *
+     * This is called by the inference technique from the eval-cache-size option
+     * so models which override Initialize do not need to do anything.
+     *
+     * @param size Number of evaluations per voxel. 0 disables the cache
+     */
+    void SetEvaluationCacheSize(unsigned int size);
+
+    /**
+     * Discard any remembered evaluations for a voxel
+     *
+     * Used once a voxel's result has been saved and the voxel will not be
+     * visited again, so the cache does not grow with the number of voxels
+     */
+    void ForgetEvaluations(unsigned int voxel_idx);
+
+    /**
+     * Log the number of hits and misses for the evaluation cache, if enabled
+     */
+    void ReportEvaluationCache() const;
+
     /**
      * Transform an MVN containing model values to Fabber internal values.
      *
@@ -234,9 +307,29 @@ public:
 
     /**
      * Load models from a dynamic library, adding them to the FwdModelFactory
+     *
+     * If the library has an up to date manifest (see WriteModelManifest) it
+     * is not opened until one of the models it lists is created
      */
     static void LoadFromDynamicLibrary(const std::string &filename, EasyLog *log = 0);
 
+    /**
+     * Write a manifest listing the models in a dynamic library
+     *
+     * The manifest is a text file with one model name per line, which allows
+     * LoadFromDynamicLibrary to defer opening the library. It is ignored if
+     * the library is modified after the manifest was written.
+     *
+     * @return names of the models in the library
+     */
+    static std::vector<std::string> WriteModelManifest(
+        const std::string &filename, EasyLog *log = 0);
+
+    /**
+     * @return name of the manifest file for a dynamic library
+     */
+    static std::string ManifestFilename(const std::string &filename);
+
     /**
      * Static member function to return the names of all known
      * models
@@ -368,6 +461,10 @@ protected:
 #endif
 
     std::vector<Parameter> m_params;
+
+private:
+    /** Cache of model evaluations */
+    EvaluationCacheHolder m_eval_cache;
 };
 
 /**
@@ -10,6 +10,7 @@
 
 #include "dist_mvn.h"
 #include "easylog.h"
+#include "linalg.h"
 #include "rundata.h"
 #include "tools.h"
 #include "version.h"
@@ -22,6 +23,7 @@
 #include <vector>
 
 using fabber::read_matrix_file;
+using fabber::SparseMatrix;
 using namespace std;
 using namespace NEWMAT;
 
@@ -30,7 +32,13 @@ FwdModel *LinearFwdModel::NewInstance()
     return new LinearFwdModel();
 }
 
-static OptionSpec OPTIONS[] = { { "basis", OPT_MATRIX, "Design matrix", OPT_REQ, "" }, { "" } };
+static OptionSpec OPTIONS[] = {
+    { "basis", OPT_MATRIX, "Design matrix", OPT_REQ, "" },
+    { "sparse-basis-threshold", OPT_FLOAT, "Store the design matrix in sparse form if the fraction "
+                                           "of zero entries is greater than this. 1=never",
+        OPT_NONREQ, "0.75" },
+    { "" },
+};
 
 void LinearFwdModel::GetOptions(std::vector<OptionSpec> &opts) const
 {
@@ -78,6 +86,19 @@ void LinearFwdModel::Initialize(FabberRunData &args)
         m_jacobian = m_jacobian | ones;
         m_centre.ReSize(Nbasis + 1);
     }
+
+    // Large designs (e.g. FIR or multi-session) are often mostly zeros,
+    // in which case the sparse form saves both memory and time
+    double threshold = args.GetDoubleDefault("sparse-basis-threshold", 0.75, 0, 1);
+    double sparsity = SparseMatrix::Sparsity(m_jacobian);
+    m_sparse = (sparsity > threshold);
+    if (m_sparse)
+    {
+        m_sparse_jacobian = SparseMatrix(m_jacobian);
+        m_jacobian.CleanUp();
+        LOG << "LinearFwdModel::Using sparse design matrix with " << m_sparse_jacobian.NonZeros()
+            << " non-zero entries (" << sparsity * 100 << "% zeros)" << endl;
+    }
 }
 
 void LinearFwdModel::GetParameterDefaults(std::vector<Parameter> &params) const
@@ -92,14 +113,43 @@ void LinearFwdModel::GetParameterDefaults(std::vector<Parameter> &params) const
 void LinearFwdModel::EvaluateModel(
     const ColumnVector &params, ColumnVector &result, const std::string &key) const
 {
-    result = m_jacobian * (params - m_centre) + m_offset;
+    const SparseMatrix *sparse = SparseJacobian();
+    if (sparse != NULL)
+    {
+        result = sparse->Multiply(params - m_centre) + m_offset;
+    }
+    else
+    {
+        ColumnVector delta = params - m_centre;
+        result = fabber::linalg::Multiply(m_jacobian, delta) + m_offset;
+    }
 }
 
 ReturnMatrix LinearFwdModel::Jacobian() const
 {
+    const SparseMatrix *sparse = SparseJacobian();
+    if (sparse != NULL)
+    {
+        return sparse->Dense();
+    }
     return m_jacobian;
 }
 
+const SparseMatrix *LinearFwdModel::SparseJacobian() const
+{
+    return m_sparse ? &m_sparse_jacobian : NULL;
+}
+
+bool LinearFwdModel::HasIdentityTransforms() const
+{
+    for (size_t p = 0; p < m_params.size(); p++)
+    {
+        if (m_params[p].transform != TRANSFORM_IDENTITY())
+            return false;
+    }
+    return true;
+}
+
 ReturnMatrix LinearFwdModel::Centre() const
 {
     return m_centre;
@@ -110,8 +160,10 @@ ReturnMatrix LinearFwdModel::Offset() const
     return m_offset;
 }
 
-LinearizedFwdModel::LinearizedFwdModel(const FwdModel *model)
+LinearizedFwdModel::LinearizedFwdModel(const FwdModel *model, ThreadPool *pool)
     : m_model(model)
+    , m_pool(pool)
+    , m_shared_sparse(NULL)
 {
     SetLogger(model->GetLogger());
 }
@@ -119,28 +171,172 @@ LinearizedFwdModel::LinearizedFwdModel(const FwdModel *model)
 LinearizedFwdModel::LinearizedFwdModel(const LinearizedFwdModel &from)
     : LinearFwdModel(from)
     , m_model(from.m_model)
+    , m_jacobian_centre(from.m_jacobian_centre)
+    , m_pool(from.m_pool)
+    , m_shared_sparse(from.m_shared_sparse)
 {
     SetLogger(from.GetLogger());
 }
 
-void LinearizedFwdModel::ReCentre(const ColumnVector &about)
+/**
+ * Step size for numerical differentiation with respect to a parameter
+ */
+static double JacobianDelta(double centre)
 {
-    assert(about == about); // isfinite
+    double delta = centre * 1e-5;
+    if (delta < 0)
+        delta = -delta;
+    if (delta < 1e-10)
+        delta = 1e-10;
+    return delta;
+}
 
-    // Store new centre & offset
-    m_centre = about;
+/**
+ * Single evaluation of a model, so that evaluations can be run in a ThreadPool
+ */
+class ModelEvaluationTask : public ThreadTask
+{
+public:
+    ModelEvaluationTask(const FwdModel *model, const ColumnVector &params)
+        : model(model)
+        , params(params)
+    {
+    }
+
+    void Run()
+    {
+        model->EvaluateFabber(params, result);
+    }
+
+    const FwdModel *model;
+    ColumnVector params;
+    ColumnVector result;
+};
+
+void LinearizedFwdModel::EvaluateParallel(const vector<bool> &frozen)
+{
+    // First evaluation is the centre, then a pair for each parameter
+    // whose Jacobian column is being recalculated
+    int nparams = m_centre.Nrows();
+    vector<int> active;
+    vector<ModelEvaluationTask> evals;
+    evals.reserve(2 * nparams + 1);
+    evals.push_back(ModelEvaluationTask(m_model, m_centre));
+    for (int i = 1; i <= nparams; i++)
+    {
+        if (!frozen.empty() && frozen[i - 1])
+            continue;
+        double delta = JacobianDelta(m_centre(i));
+        ColumnVector centre2 = m_centre;
+        ColumnVector centre3 = m_centre;
+        centre2(i) += delta;
+        centre3(i) -= delta;
+        evals.push_back(ModelEvaluationTask(m_model, centre2));
+        evals.push_back(ModelEvaluationTask(m_model, centre3));
+        active.push_back(i);
+    }
+
+    vector<ThreadTask *> tasks(evals.size());
+    for (size_t t = 0; t < evals.size(); t++)
+    {
+        tasks[t] = &evals[t];
+    }
+    m_pool->Run(tasks);
+
+    m_offset = evals[0].result;
+    if ((m_jacobian.Nrows() != m_offset.Nrows()) || (m_jacobian.Ncols() != nparams))
+    {
+        m_jacobian.ReSize(m_offset.Nrows(), nparams);
+    }
+    for (size_t a = 0; a < active.size(); a++)
+    {
+        int i = active[a];
+        const ModelEvaluationTask &plus = evals[2 * a + 1];
+        const ModelEvaluationTask &minus = evals[2 * a + 2];
+        m_jacobian.Column(i) = (plus.result - minus.result) / (plus.params(i) - minus.params(i));
+    }
+}
 
+const SparseMatrix *LinearizedFwdModel::SparseJacobian() const
+{
+    return m_shared_sparse;
+}
+
+void LinearizedFwdModel::EvaluateOffset()
+{
     m_model->EvaluateFabber(m_centre, m_offset);
     if (0 * m_offset != 0 * m_offset)
     {
-        LOG_ERR("LinearizedFwdModel::about:\n" << about);
+        LOG_ERR("LinearizedFwdModel::about:\n" << m_centre);
         LOG_ERR("LinearizedFwdModel::m_offset:\n" << m_offset.t());
         throw FabberInternalError(
             "LinearizedFwdModel::ReCentre: Non-finite values found in offset");
     }
+}
+
+void LinearizedFwdModel::MoveCentre(const ColumnVector &about)
+{
+    assert(about == about); // isfinite
+    assert(HasJacobian());
+    m_centre = about;
+    EvaluateOffset();
+}
+
+void LinearizedFwdModel::ReCentre(const ColumnVector &about)
+{
+    ReCentre(about, vector<bool>());
+}
+
+void LinearizedFwdModel::ReCentre(const ColumnVector &about, const vector<bool> &frozen)
+{
+    assert(about == about); // isfinite
+    assert(frozen.empty() || (int(frozen.size()) == about.Nrows()));
+
+    // Store new centre & offset
+    m_centre = about;
+    m_jacobian_centre = about;
+
+    // If the underlying model is linear with a sparse design matrix, the
+    // Jacobian is just the design matrix so share it rather than
+    // calculating a dense copy numerically
+    const LinearFwdModel *linear = dynamic_cast<const LinearFwdModel *>(m_model);
+    bool share_sparse = linear && linear->SparseJacobian() && linear->HasIdentityTransforms();
+
+    // The offset and the Jacobian columns are independent evaluations of the
+    // model which can be run concurrently if we have a thread pool
+    bool parallel = !share_sparse && m_pool && (m_pool->NumThreads() > 1);
+
+    // Frozen columns can only be kept if we already have a dense Jacobian
+    // of the right size
+    vector<bool> keep;
+    if (!share_sparse && !m_shared_sparse && (m_jacobian.Ncols() == m_centre.Nrows())
+        && (m_jacobian.Nrows() == m_offset.Nrows()))
+    {
+        keep = frozen;
+    }
+
+    if (parallel)
+    {
+        EvaluateParallel(keep);
+    }
+    else
+    {
+        EvaluateOffset();
+    }
+
+    if (share_sparse)
+    {
+        m_shared_sparse = linear->SparseJacobian();
+        m_jacobian.CleanUp();
+        return;
+    }
+    m_shared_sparse = NULL;
 
     // Calculate the Jacobian numerically.  jacobian is len(y)-by-len(m)
-    m_jacobian.ReSize(m_offset.Nrows(), m_centre.Nrows());
+    if ((m_jacobian.Nrows() != m_offset.Nrows()) || (m_jacobian.Ncols() != m_centre.Nrows()))
+    {
+        m_jacobian.ReSize(m_offset.Nrows(), m_centre.Nrows());
+    }
 
     // Try and get the gradient matrix (Jacobian) from the model first
     // FIXME this is broken when transforms are used
@@ -148,17 +344,15 @@ void LinearizedFwdModel::ReCentre(const ColumnVector &about)
 
     // If the gradient is not supported by the model, use
     // numerical differentiation to calculate it.
-    if (true)
+    if (!parallel)
     {
         ColumnVector centre2, centre3;
         ColumnVector offset2, offset3;
         for (int i = 1; i <= m_centre.Nrows(); i++)
         {
-            double delta = m_centre(i) * 1e-5;
-            if (delta < 0)
-                delta = -delta;
-            if (delta < 1e-10)
-                delta = 1e-10;
+            if (!keep.empty() && keep[i - 1])
+                continue;
+            double delta = JacobianDelta(m_centre(i));
 
             // Take derivative numerically
             centre3 = m_centre;
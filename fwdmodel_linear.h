@@ -9,6 +9,8 @@
 #pragma once
 
 #include "fwdmodel.h"
+#include "sparse_matrix.h"
+#include "thread_pool.h"
 
 #include <newmat.h>
 
@@ -30,6 +32,11 @@ class LinearFwdModel : public FwdModel
 public:
     static FwdModel *NewInstance();
 
+    LinearFwdModel()
+        : m_sparse(false)
+    {
+    }
+
     virtual void GetOptions(std::vector<OptionSpec> &opts) const;
     virtual std::string GetDescription() const;
     virtual std::string ModelVersion() const;
@@ -65,11 +72,32 @@ public:
     virtual void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
         const std::string &key = "") const;
 
+    virtual bool IsReentrant() const
+    {
+        return true;
+    }
+
     /**
      * @return the Jacobian, or design matrix
      */
     NEWMAT::ReturnMatrix Jacobian() const;
 
+    /**
+     * Get the Jacobian in sparse form, if available
+     *
+     * This allows callers to use sparse matrix products in place
+     * of the dense Jacobian
+     *
+     * @return sparse Jacobian, or NULL if the Jacobian is dense
+     */
+    virtual const fabber::SparseMatrix *SparseJacobian() const;
+
+    /**
+     * @return true if all parameters use the identity transform, so the design
+     *         matrix is also the Jacobian with respect to the inferred parameters
+     */
+    bool HasIdentityTransforms() const;
+
     /**
      * @return the vector used to recentre the parameters
      */
@@ -86,6 +114,10 @@ protected:
     NEWMAT::Matrix m_jacobian;     // J (tranposed?)
     NEWMAT::ColumnVector m_centre; // m
     NEWMAT::ColumnVector m_offset; // g(m) - The amount to effectively subtract from Y is g(m)-J*m
+
+    /** Sparse form of the design matrix. If used, m_jacobian is empty */
+    fabber::SparseMatrix m_sparse_jacobian;
+    bool m_sparse;
 };
 
 /**
@@ -108,8 +140,13 @@ public:
      * centre.
      *
      * The model pointer is not owned by this class and will not be freed
+     *
+     * @param pool If given, and it has more than one thread, the model
+     *             evaluations needed for the numerical Jacobian are run
+     *             concurrently using it. The model must be re-entrant. The
+     *             pool is not owned by this class
      */
-    explicit LinearizedFwdModel(const FwdModel *model);
+    explicit LinearizedFwdModel(const FwdModel *model, ThreadPool *pool = NULL);
 
     /**
      * Copy constructor (needed for using vector<LinearizedFwdModel>)
@@ -139,6 +176,77 @@ public:
      */
     void ReCentre(const NEWMAT::ColumnVector &about);
 
+    /**
+     * Re-calculate the linearized model, keeping some Jacobian columns
+     *
+     * As ReCentre(about), but the columns of the Jacobian for parameters
+     * marked as frozen are kept from the previous calculation rather than
+     * being recalculated. This saves two model evaluations for each frozen
+     * parameter. If there is no previous dense Jacobian all columns are
+     * calculated.
+     *
+     * @param frozen Flag for each parameter. If empty no columns are frozen
+     */
+    void ReCentre(const NEWMAT::ColumnVector &about, const std::vector<bool> &frozen);
+
+    /**
+     * Move the centre without recalculating the Jacobian
+     *
+     * The offset is re-evaluated at the new centre so Evaluate is still
+     * correct there, but the Jacobian from the last call to ReCentre is
+     * kept. Intended for when the centre has moved so little that the
+     * Jacobian would not change significantly, as this needs one model
+     * evaluation rather than 2P+1.
+     *
+     * ReCentre must have been called first
+     */
+    void MoveCentre(const NEWMAT::ColumnVector &about);
+
+    /**
+     * @return true if ReCentre has been called so there is a Jacobian
+     */
+    bool HasJacobian() const
+    {
+        return m_jacobian_centre.Nrows() > 0;
+    }
+
+    /**
+     * @return the centre at which the Jacobian was last calculated
+     */
+    const NEWMAT::ColumnVector &JacobianCentre() const
+    {
+        return m_jacobian_centre;
+    }
+
+    /**
+     * @return the sparse Jacobian of the underlying model if it is linear
+     *         with a sparse design matrix, otherwise NULL
+     */
+    virtual const fabber::SparseMatrix *SparseJacobian() const;
+
 private:
+    /**
+     * Evaluate the offset and numerical Jacobian about m_centre using
+     * the thread pool. Columns for frozen parameters are not changed
+     */
+    void EvaluateParallel(const std::vector<bool> &frozen);
+
+    /**
+     * Evaluate the offset at m_centre, checking it is finite
+     */
+    void EvaluateOffset();
+
     const FwdModel *m_model;
+
+    /** Centre at which the Jacobian was calculated. May differ from m_centre after MoveCentre */
+    NEWMAT::ColumnVector m_jacobian_centre;
+
+    /** Thread pool for model evaluations, or NULL to evaluate serially */
+    ThreadPool *m_pool;
+
+    /**
+     * Sparse Jacobian shared with the underlying model, if it is linear
+     * and sparse. This avoids each voxel holding a dense copy
+     */
+    const fabber::SparseMatrix *m_shared_sparse;
 };
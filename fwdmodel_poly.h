@@ -40,6 +40,10 @@ public:
     void Initialize(FabberRunData &args);
     void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
         const std::string &key = "") const;
+    bool IsReentrant() const
+    {
+        return true;
+    }
 
 protected:
     virtual void GetParameterDefaults(std::vector<Parameter> &params) const;
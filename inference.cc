@@ -8,6 +8,7 @@
 
 #include "inference.h"
 #include "easylog.h"
+#include "progressive_output.h"
 
 #include <newmat.h>
 
@@ -56,6 +57,9 @@ InferenceTechnique::InferenceTechnique()
     : m_model(NULL)
     , m_num_params(0)
     , m_halt_bad_voxel(true)
+    , m_progressive(false)
+    , m_progressive_F(NULL)
+    , m_progressive_its(NULL)
 {
 }
 
@@ -67,6 +71,7 @@ void InferenceTechnique::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
         LOG << setprecision(17);
 
     m_model = fwd_model;
+    m_model->SetEvaluationCacheSize(rundata.GetIntDefault("eval-cache-size", 0, 0));
     vector<Parameter> params;
     m_model->GetParameters(rundata, params);
 
@@ -145,11 +150,12 @@ void InferenceTechnique::SaveResults(FabberRunData &rundata) const
                 paramStd(1, vox) = std;
             }
 
-            if (rundata.GetBool("save-mean"))
+            // Means and std devs have already been written if using progressive output
+            if (rundata.GetBool("save-mean") && !m_progressive)
                 rundata.SaveVoxelData("mean_" + params.at(i - 1).name, paramMean);
             if (rundata.GetBool("save-zstat"))
                 rundata.SaveVoxelData("zstat_" + params.at(i - 1).name, paramZstat);
-            if (rundata.GetBool("save-std"))
+            if (rundata.GetBool("save-std") && !m_progressive)
                 rundata.SaveVoxelData("std_" + params.at(i - 1).name, paramStd);
             if (rundata.GetBool("save-var"))
                 rundata.SaveVoxelData("var_" + params.at(i - 1).name, paramVar);
@@ -277,6 +283,7 @@ void InferenceTechnique::SaveResults(FabberRunData &rundata) const
 	}
 #endif
 
+    m_model->ReportEvaluationCache();
     LOG << "InferenceTechnique::Done writing results." << endl;
 }
 
@@ -432,6 +439,91 @@ void InferenceTechnique::InitMVNFromFile(FabberRunData &rundata, string paramFil
     }
 }
 
+void InferenceTechnique::OpenProgressiveOutputs(FabberRunData &rundata)
+{
+    if (!rundata.GetBool("progressive-output"))
+        return;
+
+    // The number of iterations is always written so it is clear which voxels
+    // have finished
+    m_progressive_its = rundata.CreateProgressiveOutput("iterations", 1);
+    if (!m_progressive_its)
+    {
+        WARN_ONCE("Progressive output is not supported - outputs will be saved at the end");
+        return;
+    }
+    m_progressive = true;
+
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    for (unsigned int i = 0; i < params.size(); i++)
+    {
+        m_progressive_mean.push_back(rundata.GetBool("save-mean")
+                ? rundata.CreateProgressiveOutput("mean_" + params[i].name, 1)
+                : NULL);
+        m_progressive_std.push_back(rundata.GetBool("save-std")
+                ? rundata.CreateProgressiveOutput("std_" + params[i].name, 1)
+                : NULL);
+    }
+    if (rundata.GetBool("save-free-energy"))
+        m_progressive_F = rundata.CreateProgressiveOutput("freeEnergy", 1);
+}
+
+void InferenceTechnique::WriteProgressiveOutputs(int v, double F, int iterations)
+{
+    if (!m_progressive || !resultMVNs.at(v - 1))
+        return;
+
+    ColumnVector val(1);
+    MVNDist result = *resultMVNs[v - 1];
+    m_model->ToModel(result);
+    for (unsigned int i = 1; i <= m_progressive_mean.size(); i++)
+    {
+        if (m_progressive_mean[i - 1])
+        {
+            val(1) = result.means(i);
+            m_progressive_mean[i - 1]->SetVoxel(v, val);
+        }
+        if (m_progressive_std[i - 1])
+        {
+            val(1) = sqrt(result.GetCovariance()(i, i));
+            m_progressive_std[i - 1]->SetVoxel(v, val);
+        }
+    }
+    if (m_progressive_F)
+    {
+        val(1) = F;
+        m_progressive_F->SetVoxel(v, val);
+    }
+    val(1) = iterations;
+    m_progressive_its->SetVoxel(v, val);
+}
+
+/**
+ * Close and delete a progressive output
+ */
+static void CloseProgressiveOutput(fabber::ProgressiveOutput *&output, bool close)
+{
+    if (output)
+    {
+        if (close)
+            output->Close();
+        delete output;
+        output = NULL;
+    }
+}
+
+void InferenceTechnique::CloseProgressiveOutputs()
+{
+    for (unsigned int i = 0; i < m_progressive_mean.size(); i++)
+    {
+        CloseProgressiveOutput(m_progressive_mean[i], true);
+        CloseProgressiveOutput(m_progressive_std[i], true);
+    }
+    CloseProgressiveOutput(m_progressive_F, true);
+    CloseProgressiveOutput(m_progressive_its, true);
+}
+
 InferenceTechnique::~InferenceTechnique()
 {
     while (!resultMVNs.empty())
@@ -439,4 +531,14 @@ InferenceTechnique::~InferenceTechnique()
         delete resultMVNs.back();
         resultMVNs.pop_back();
     }
+
+    // Only reached without closing if the run failed. Whatever was written
+    // is left in the files
+    for (unsigned int i = 0; i < m_progressive_mean.size(); i++)
+    {
+        CloseProgressiveOutput(m_progressive_mean[i], false);
+        CloseProgressiveOutput(m_progressive_std[i], false);
+    }
+    CloseProgressiveOutput(m_progressive_F, false);
+    CloseProgressiveOutput(m_progressive_its, false);
 }
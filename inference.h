@@ -96,6 +96,20 @@ public:
      */
     virtual void SaveResults(FabberRunData &rundata) const;
 
+    /**
+     * Get the final free energy for each voxel
+     *
+     * This is used for model comparison. Inference methods which do not
+     * calculate the free energy need not implement it.
+     *
+     * @param fe Will be set to contain the free energy for each voxel
+     * @return true if the free energy was available
+     */
+    virtual bool GetFreeEnergy(std::vector<double> &fe) const
+    {
+        return false;
+    }
+
     /**
      * Destructor.
      */
@@ -104,6 +118,29 @@ public:
 protected:
     void InitMVNFromFile(FabberRunData &rundata, std::string paramFilename);
 
+    /**
+     * Create progressive outputs if --progressive-output was given
+     *
+     * The parameter means and standard deviations and the free energy, if
+     * they are being saved, and the number of iterations are then written
+     * by WriteProgressiveOutputs as each voxel finishes, rather than by
+     * SaveResults. Nothing is done if the run data does not support
+     * progressive output.
+     */
+    void OpenProgressiveOutputs(FabberRunData &rundata);
+
+    /**
+     * Write the results of a voxel to the progressive outputs, if there are any
+     *
+     * @param v Voxel index, starting at 1. Its entry in resultMVNs must be set
+     * @param F Free energy of the voxel
+     * @param iterations Number of iterations done for the voxel
+     */
+    void WriteProgressiveOutputs(int v, double F, int iterations);
+
+    /** Finish writing the progressive outputs */
+    void CloseProgressiveOutputs();
+
     /**
      * Pointer to forward model, passed in to initialize.
      *
@@ -148,6 +185,17 @@ protected:
      */
     bool m_debug;
 
+    /** True if results are being written by WriteProgressiveOutputs */
+    bool m_progressive;
+
+    /** Progressive outputs of each parameter's mean and std. dev., or NULL if not saved */
+    std::vector<fabber::ProgressiveOutput *> m_progressive_mean;
+    std::vector<fabber::ProgressiveOutput *> m_progressive_std;
+
+    /** Progressive outputs of the free energy (NULL if not saved) and iterations */
+    fabber::ProgressiveOutput *m_progressive_F;
+    fabber::ProgressiveOutput *m_progressive_its;
+
 private:
     /**
      * Private to prevent assignment
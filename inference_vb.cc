@@ -12,13 +12,25 @@
 #include "easylog.h"
 #include "priors.h"
 #include "run_context.h"
+#include "supervoxels.h"
 #include "tools.h"
 #include "version.h"
 
 #include <miscmaths/miscmaths.h>
 #include <newmatio.h>
 
+#include <algorithm>
+#include <limits>
+#include <map>
 #include <math.h>
+#include <queue>
+#include <string>
+#include <time.h>
+#include <utility>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 
 using MISCMATHS::sign;
 
@@ -45,6 +57,13 @@ static OptionSpec OPTIONS[] = {
     { "noise-pattern", OPT_STR, "repeating pattern of noise variances for each point (e.g. 12 "
                                 "gives odd and even data points different variances)",
         OPT_NONREQ, "1" },
+    { "posterior-cov", OPT_STR, "Structure of the model parameter posterior covariance: full, "
+                                "diag (independent parameters) or block (independent groups "
+                                "of parameters given by cov-block<n>). White noise only",
+        OPT_NONREQ, "full" },
+    { "cov-block<n>", OPT_INT, "Number of parameters in covariance group <n> when "
+                               "posterior-cov=block. Groups are consecutive parameters",
+        OPT_NONREQ, "" },
     { "PSP_byname<n>", OPT_STR, "Name of model parameter to use image prior", OPT_NONREQ, "" },
     { "PSP_byname<n>_type", OPT_STR, "Type of image prior to use for parameter <n> - I=image prior",
         OPT_NONREQ, "" },
@@ -66,6 +85,94 @@ static OptionSpec OPTIONS[] = {
     { "update-spatial-prior-on-first-iteration", OPT_BOOL, "", OPT_NONREQ, "" },
     { "locked-linear-from-mvn", OPT_MVN, "MVN file containing fixed centres for linearization",
         OPT_NONREQ, "" },
+    { "dedup-voxels", OPT_BOOL, "Fit voxels with identical data, supplementary data, image priors "
+                                "and initial posterior only once and copy the result to the others. "
+                                "Ignored when spatial priors are used. Not suitable for models "
+                                "which depend on the voxel co-ordinates",
+        OPT_NONREQ, "" },
+    { "max-mean-change", OPT_FLOAT, "When using the pchange convergence detector, the relative "
+                                    "change in the parameter means to stop at",
+        OPT_NONREQ, "0.001" },
+    { "max-var-change", OPT_FLOAT, "When using the pchange convergence detector, the relative "
+                                   "change in the parameter variances to stop at",
+        OPT_NONREQ, "0.01" },
+    { "subsample-stride", OPT_INT, "Initial spacing of time points used in early iterations. "
+                                   "The spacing is halved each time the free energy stabilises "
+                                   "until all time points are used. 1=no subsampling. Ignored "
+                                   "when spatial priors are used",
+        OPT_NONREQ, "1" },
+    { "subsample-fchange", OPT_FLOAT, "Relative change in free energy below which more time "
+                                      "points are used when subsampling",
+        OPT_NONREQ, "0.01" },
+    { "subsample-max-iterations", OPT_INT,
+        "Maximum number of iterations at each subsampling level", OPT_NONREQ, "5" },
+    { "jacobian-threads", OPT_INT, "Number of threads used to evaluate the model for the numerical "
+                                   "Jacobian. 0=automatic: use all processors if there are fewer "
+                                   "voxels than processors and the model supports concurrent "
+                                   "evaluation, otherwise 1",
+        OPT_NONREQ, "0" },
+    { "jacobian-pin-threads", OPT_BOOL, "Pin the Jacobian threads to processors, starting with the "
+                                        "NUMA node of the main thread",
+        OPT_NONREQ, "" },
+    { "recentre-tol", OPT_FLOAT, "Keep the existing Jacobian when no parameter mean has moved from "
+                                 "the linearization centre by more than this many posterior standard "
+                                 "deviations. 0=always recalculate the Jacobian",
+        OPT_NONREQ, "0" },
+    { "jacobian-freeze-tol", OPT_FLOAT,
+        "Reuse the Jacobian column of a parameter whose posterior mean has moved by less than this "
+        "many standard deviations, and whose variance has changed by less than this fraction, since "
+        "the last iteration. 0=always recalculate every column",
+        OPT_NONREQ, "0" },
+    { "jacobian-refresh", OPT_INT, "When using jacobian-freeze-tol, recalculate every column of the "
+                                   "Jacobian after this many iterations with frozen columns",
+        OPT_NONREQ, "5" },
+    { "supervoxels", OPT_INT, "Number of supervoxels to cluster the voxels into. Spatial VB is "
+                              "first run on the average data of each supervoxel and used to "
+                              "initialize the voxelwise spatial iterations. 0=disabled",
+        OPT_NONREQ, "0" },
+    { "supervoxel-iterations", OPT_INT, "Number of spatial iterations on the supervoxel data",
+        OPT_NONREQ, "10" },
+    { "supervoxel-compactness", OPT_FLOAT, "Weight given to spatial distance relative to data "
+                                           "similarity when forming supervoxels",
+        OPT_NONREQ, "1" },
+    { "screen-snr", OPT_FLOAT, "Screen out voxels whose signal to noise ratio (RMS of the data "
+                               "divided by the noise estimated from successive time points) is "
+                               "below this value. 0=no screening. Ignored when spatial priors "
+                               "are used",
+        OPT_NONREQ, "0" },
+    { "screen-action", OPT_STR, "What to do with screened voxels: skip (output the prior without "
+                                "fitting) or reduce (fit with at most screen-max-iterations)",
+        OPT_NONREQ, "skip" },
+    { "screen-max-iterations", OPT_INT, "Maximum number of iterations for screened voxels when "
+                                        "screen-action=reduce",
+        OPT_NONREQ, "2" },
+    { "time-budget", OPT_FLOAT, "Wall clock time in seconds for voxelwise VB. Every voxel is "
+                                "given time-budget-min-iterations, then the remaining time is "
+                                "spent on the voxels whose free energy is improving the most. "
+                                "0=no time limit",
+        OPT_NONREQ, "0" },
+    { "time-budget-min-iterations", OPT_INT, "Number of iterations every voxel is given before "
+                                             "the rest of the time budget is shared out",
+        OPT_NONREQ, "2" },
+    { "spatial-convergence", OPT_BOOL, "Stop spatial VB when the global free energy, spatial "
+                                       "precisions and posterior means have converged, rather "
+                                       "than after max-iterations",
+        OPT_NONREQ, "" },
+    { "spatial-min-iterations", OPT_INT, "Minimum number of spatial iterations when using "
+                                         "spatial-convergence",
+        OPT_NONREQ, "3" },
+    { "spatial-fchange", OPT_FLOAT, "When using spatial-convergence, the relative change in the "
+                                    "global free energy to stop at",
+        OPT_NONREQ, "0.0001" },
+    { "spatial-ak-change", OPT_FLOAT, "When using spatial-convergence, the relative change in the "
+                                      "spatial precision of each parameter to stop at",
+        OPT_NONREQ, "0.01" },
+    { "spatial-mean-change", OPT_FLOAT, "When using spatial-convergence, the relative change in the "
+                                        "posterior means to stop at",
+        OPT_NONREQ, "0.01" },
+    { "spatial-mean-percentile", OPT_FLOAT, "Percentile of the voxels whose change in the means "
+                                            "must be within spatial-mean-change. 100=all voxels",
+        OPT_NONREQ, "95" },
     { "" },
 };
 
@@ -119,8 +226,61 @@ void Vb::Initialize(FwdModel *fwd_model, FabberRunData &rundata)
         WARN_ONCE("spatial-dims=2 may not work the way you expect");
     }
 
+    // Global convergence of spatial VB
+    m_spatial_convergence = rundata.GetBool("spatial-convergence");
+
     // Locked linearizations, if requested
     m_locked_linear = rundata.GetStringDefault("locked-linear-from-mvn", "") != "";
+
+    // Threads for numerical Jacobian - pool is created once we know the number of voxels
+    m_jacobian_threads = rundata.GetIntDefault("jacobian-threads", 0, 0);
+    m_jacobian_pin = rundata.GetBool("jacobian-pin-threads");
+
+    // Tolerance for keeping the Jacobian when the linearization centre moves
+    m_recentre_tol = rundata.GetDoubleDefault("recentre-tol", 0, 0);
+
+    // Freezing of Jacobian columns for parameters which have stabilised
+    m_freeze_tol = rundata.GetDoubleDefault("jacobian-freeze-tol", 0, 0);
+    m_freeze_refresh = rundata.GetIntDefault("jacobian-refresh", 5, 1);
+
+    // Progressive subsampling of time points in early iterations
+    m_subsample_stride = rundata.GetIntDefault("subsample-stride", 1, 1);
+    m_subsample_fchange = rundata.GetDoubleDefault("subsample-fchange", 0.01, 0);
+    m_subsample_maxits = rundata.GetIntDefault("subsample-max-iterations", 5, 1);
+    if (m_subsample_stride > 1)
+    {
+        // Check up front that the noise model can mask time points
+        try
+        {
+            m_noise->SetMaskedTimepoints(vector<int>(1, 1));
+            m_noise->SetMaskedTimepoints(m_masked_tpoints);
+        }
+        catch (FabberRunDataError &e)
+        {
+            throw InvalidOptionValue("subsample-stride", stringify(m_subsample_stride),
+                "Noise model does not support masked time points");
+        }
+    }
+
+    // Initialization of spatial VB from supervoxel-averaged data
+    m_supervoxels = rundata.GetIntDefault("supervoxels", 0, 0);
+    m_supervoxel_its = rundata.GetIntDefault("supervoxel-iterations", 10, 1);
+    m_supervoxel_compactness = rundata.GetDoubleDefault("supervoxel-compactness", 1, 0);
+
+    // Screening of voxels with little or no signal
+    m_screen_snr = rundata.GetDoubleDefault("screen-snr", 0, 0);
+    string screen_action = rundata.GetStringDefault("screen-action", "skip");
+    if ((screen_action != "skip") && (screen_action != "reduce"))
+    {
+        throw InvalidOptionValue("screen-action", screen_action, "Must be skip or reduce");
+    }
+    m_screen_skip = (screen_action == "skip");
+    m_screen_maxits = rundata.GetIntDefault("screen-max-iterations", 2, 1);
+
+    // Time limit for voxelwise VB
+    m_time_budget = rundata.GetDoubleDefault("time-budget", 0, 0);
+    m_budget_min_its = rundata.GetIntDefault("time-budget-min-iterations", 2, 1);
+
 }
 
 void Vb::InitializeNoiseFromParam(FabberRunData &rundata, NoiseParams *dist, string param_key)
@@ -143,10 +303,16 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
     m_ctx->fwd_post.resize(m_nvoxels);
 
     // Re-centred in voxel loop below
-    m_lin_model.resize(m_nvoxels, LinearizedFwdModel(m_model));
+    SetupJacobianThreads();
+    m_lin_model.resize(m_nvoxels, LinearizedFwdModel(m_model, m_jacobian_pool.get()));
 
     // Initialized in voxel loop below
     m_conv.resize(m_nvoxels, NULL);
+    m_freeze_means.clear();
+    m_freeze_means.resize(m_nvoxels);
+    m_freeze_vars.clear();
+    m_freeze_vars.resize(m_nvoxels);
+    m_freeze_count.assign(m_nvoxels, 0);
     string conv_name = rundata.GetStringDefault("convergence", "maxits");
 
     // Model prior is updated during main voxel loop
@@ -241,6 +407,47 @@ void Vb::SetupPerVoxelDists(FabberRunData &rundata)
     }
 }
 
+void Vb::SetupJacobianThreads()
+{
+    int nthreads = m_jacobian_threads;
+    if (nthreads == 0)
+    {
+        nthreads = 1;
+        int nprocs = ThreadPool::NumProcessors();
+        if (m_model->IsReentrant() && (m_nvoxels < nprocs))
+        {
+            nthreads = nprocs;
+        }
+    }
+    else if ((nthreads > 1) && !m_model->IsReentrant())
+    {
+        WARN_ONCE("Model does not declare support for concurrent evaluation - parallel Jacobian "
+                  "evaluation may give incorrect results");
+    }
+
+    // No point in more threads than model evaluations
+    nthreads = min(nthreads, 2 * m_num_params + 1);
+    if (nthreads > 1)
+    {
+        m_jacobian_pool.reset(new ThreadPool(nthreads, m_jacobian_pin));
+        LOG << "Vb::Using " << m_jacobian_pool->NumThreads() << " threads for Jacobian evaluation"
+            << endl;
+        if (m_jacobian_pool->IsPinned())
+        {
+            LOG << "Vb::Jacobian threads pinned to processors ("
+                << ThreadPool::NumaNodes().size() << " NUMA nodes)" << endl;
+        }
+        else if (m_jacobian_pin)
+        {
+            WARN_ONCE("Could not pin Jacobian threads to processors on this platform");
+        }
+    }
+    else
+    {
+        m_jacobian_pool.reset();
+    }
+}
+
 void Vb::PassModelData(int v)
 {
     // Pass in data, coords and supplemental data for this voxel
@@ -291,12 +498,12 @@ void Vb::IgnoreVoxel(int v)
 }
 
 /**
- * Calculate free energy. Note that this is currently unused in spatial VB
+ * Calculate free energy. In spatial VB this is only used for global convergence
  */
 double Vb::CalculateF(int v, string label, double Fprior)
 {
     double F = 1234.5678;
-    if (m_needF)
+    if (m_needF || m_budget_needF)
     {
         F = m_noise->CalcFreeEnergy(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
             m_ctx->fwd_post[v - 1], m_ctx->fwd_prior[v - 1], m_lin_model[v - 1],
@@ -308,9 +515,166 @@ double Vb::CalculateF(int v, string label, double Fprior)
             LOG << "Vb::F" << label << " = " << F << endl;
         }
     }
+    else
+    {
+        m_num_f_skipped++;
+    }
     return F;
 }
 
+void Vb::ReCentre(int v)
+{
+    LinearizedFwdModel &lin = m_lin_model[v - 1];
+    const ColumnVector &means = m_ctx->fwd_post[v - 1].means;
+    m_num_recentres++;
+
+    if ((m_recentre_tol <= 0 && m_freeze_tol <= 0) || !lin.HasJacobian())
+    {
+        lin.ReCentre(means);
+        return;
+    }
+
+    // Movement is measured in posterior standard deviations so the tolerances
+    // do not depend on the scale of each parameter
+    const SymmetricMatrix &cov = m_ctx->fwd_post[v - 1].GetCovariance();
+    if (m_recentre_tol > 0)
+    {
+        const ColumnVector &jcentre = lin.JacobianCentre();
+        bool moved = false;
+        for (int i = 1; i <= means.Nrows() && !moved; i++)
+        {
+            moved = !(fabs(means(i) - jcentre(i)) <= m_recentre_tol * sqrt(cov(i, i)));
+        }
+        if (!moved)
+        {
+            m_num_recentre_skipped++;
+            ColumnVector centre = lin.Centre();
+            if (centre != means)
+            {
+                lin.MoveCentre(means);
+            }
+            return;
+        }
+    }
+
+    if (m_freeze_tol <= 0 || lin.SparseJacobian())
+    {
+        lin.ReCentre(means);
+        return;
+    }
+
+    // Freeze the Jacobian columns of parameters whose posterior has stabilised
+    // since the last recentre, with a full recalculation every m_freeze_refresh
+    // times so that frozen columns do not get too far out of date
+    ColumnVector &prev_means = m_freeze_means[v - 1];
+    ColumnVector &prev_vars = m_freeze_vars[v - 1];
+    int nparams = means.Nrows();
+    vector<bool> frozen(nparams, false);
+    int nfrozen = 0;
+    if ((prev_means.Nrows() == nparams) && (m_freeze_count[v - 1] < m_freeze_refresh))
+    {
+        for (int i = 1; i <= nparams; i++)
+        {
+            double var = cov(i, i);
+            frozen[i - 1] = (fabs(means(i) - prev_means(i)) <= m_freeze_tol * sqrt(var))
+                && (fabs(var - prev_vars(i)) <= m_freeze_tol * var);
+            if (frozen[i - 1])
+                nfrozen++;
+        }
+    }
+    prev_means = means;
+    prev_vars.ReSize(nparams);
+    for (int i = 1; i <= nparams; i++)
+    {
+        prev_vars(i) = cov(i, i);
+    }
+
+    if (nfrozen > 0)
+    {
+        lin.ReCentre(means, frozen);
+        m_freeze_count[v - 1]++;
+    }
+    else
+    {
+        lin.ReCentre(means);
+        m_freeze_count[v - 1] = 0;
+    }
+    m_num_columns += nparams;
+    m_num_columns_frozen += nfrozen;
+}
+
+void Vb::DoSubsampledIterations(int v, const vector<Prior *> &priors)
+{
+    int ntimes = m_origdata->Nrows();
+    vector<bool> user_masked(ntimes, false);
+    for (unsigned int i = 0; i < m_masked_tpoints.size(); i++)
+    {
+        int t = m_masked_tpoints[i];
+        if (t >= 1 && t <= ntimes)
+            user_masked[t - 1] = true;
+    }
+
+    try
+    {
+        for (int stride = m_subsample_stride; stride > 1; stride /= 2)
+        {
+            // Use every stride'th time point, as well as respecting the
+            // user-specified masked time points
+            vector<int> masked = m_masked_tpoints;
+            for (int t = 1; t <= ntimes; t++)
+            {
+                if (((t - 1) % stride != 0) && !user_masked[t - 1])
+                    masked.push_back(t);
+            }
+
+            // Not worth it if there are too few points to determine the parameters
+            if (ntimes - int(masked.size()) <= m_num_params)
+                continue;
+
+            m_noise->SetMaskedTimepoints(masked);
+
+            double Fprev = 0;
+            for (int it = 0; it < m_subsample_maxits; it++)
+            {
+                double Fprior = 0;
+                for (int k = 0; k < m_num_params; k++)
+                {
+                    Fprior = priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
+                }
+
+                m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
+                    m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
+                m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
+                    m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
+                ReCentre(v);
+
+                // F is always needed here to decide when to move on, regardless of
+                // whether the convergence detector uses it
+                double F = m_noise->CalcFreeEnergy(*m_ctx->noise_post[v - 1],
+                               *m_ctx->noise_prior[v - 1], m_ctx->fwd_post[v - 1],
+                               m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v))
+                    + Fprior;
+                if (m_debug)
+                {
+                    LOG << "Vb::Subsampling stride " << stride << " iteration " << it + 1
+                        << " F=" << F << endl;
+                }
+                if ((it > 0) && (fabs(F - Fprev) <= m_subsample_fchange * fabs(F)))
+                    break;
+                Fprev = F;
+            }
+        }
+    }
+    catch (...)
+    {
+        m_noise->SetMaskedTimepoints(m_masked_tpoints);
+        throw;
+    }
+
+    // Remaining iterations use all the (unmasked) time points
+    m_noise->SetMaskedTimepoints(m_masked_tpoints);
+}
+
 void Vb::DebugVoxel(int v, const string &where)
 {
     LOG << where << " - voxel " << v << " of " << m_nvoxels << endl;
@@ -383,11 +747,40 @@ void Vb::DoCalculations(FabberRunData &rundata)
     }
     else if (IsSpatial(rundata))
     {
+        if (m_subsample_stride > 1)
+        {
+            WARN_ONCE("Vb::subsample-stride is ignored when spatial priors are used");
+        }
+        if (m_screen_snr > 0)
+        {
+            WARN_ONCE("Vb::screen-snr is ignored when spatial priors are used");
+        }
+        if (m_time_budget > 0)
+        {
+            WARN_ONCE("Vb::time-budget is ignored when spatial priors are used");
+        }
+        if (rundata.GetBool("progressive-output"))
+        {
+            WARN_ONCE("Vb::progressive-output is ignored when spatial priors are used");
+        }
         DoCalculationsSpatial(rundata);
     }
     else
     {
-        DoCalculationsVoxelwise(rundata);
+        if (m_supervoxels > 0)
+        {
+            WARN_ONCE("Vb::supervoxels is ignored unless spatial priors are used");
+        }
+        if (m_spatial_convergence)
+        {
+            WARN_ONCE("Vb::spatial-convergence is ignored unless spatial priors are used");
+        }
+        OpenProgressiveOutputs(rundata);
+        if (m_time_budget > 0)
+            DoCalculationsBudgeted(rundata);
+        else
+            DoCalculationsVoxelwise(rundata);
+        CloseProgressiveOutputs();
     }
 
     if (!m_needF)
@@ -395,7 +788,27 @@ void Vb::DoCalculations(FabberRunData &rundata)
         // clearing resultFs here should prevent an F image from being saved.
         resultFs.clear();
     }
+    if (m_num_f_skipped > 0)
+    {
+        LOG << "Vb::Free energy not required - skipped " << m_num_f_skipped << " evaluations"
+            << endl;
+    }
+    if (m_recentre_tol > 0)
+    {
+        LOG << "Vb::Kept the existing Jacobian for " << m_num_recentre_skipped << " of "
+            << m_num_recentres << " recentres (recentre-tol=" << m_recentre_tol << ")" << endl;
+    }
+    if (m_freeze_tol > 0)
+    {
+        LOG << "Vb::Reused " << m_num_columns_frozen << " of " << m_num_columns
+            << " Jacobian columns (jacobian-freeze-tol=" << m_freeze_tol << ")" << endl;
+    }
+
+    FreePerVoxelDists();
+}
 
+void Vb::FreePerVoxelDists()
+{
     // Delete stuff (avoid memory leaks)
     for (int v = 1; v <= m_nvoxels; v++)
     {
@@ -403,7 +816,79 @@ void Vb::DoCalculations(FabberRunData &rundata)
         delete m_ctx->noise_prior[v - 1];
         delete m_conv[v - 1];
     }
+    m_conv.clear();
     delete m_ctx;
+    m_ctx = NULL;
+}
+
+/**
+ * Append the exact bit pattern of a number to a voxel signature
+ */
+static void AppendBits(string &sig, double val)
+{
+    sig.append(reinterpret_cast<const char *>(&val), sizeof(double));
+}
+
+static void AppendBits(string &sig, const NEWMAT::ColumnVector &vals)
+{
+    for (int i = 1; i <= vals.Nrows(); i++)
+    {
+        AppendBits(sig, vals(i));
+    }
+}
+
+void Vb::FindDuplicateVoxels(
+    FabberRunData &rundata, const vector<Parameter> &params, vector<int> &source)
+{
+    // Image prior data is the only other per-voxel input which is
+    // not already reflected in the initial posterior
+    vector<NEWMAT::RowVector> images;
+    for (size_t p = 0; p < params.size(); p++)
+    {
+        if (params[p].prior_type == PRIOR_IMAGE)
+        {
+            string key = params[p].options.find("image")->second;
+            images.push_back(rundata.GetVoxelData(key).AsRow());
+        }
+    }
+
+    // Signature is compared exactly so voxels are only treated as duplicates
+    // if their inputs are bit-identical
+    map<string, int> first_voxel;
+    source.resize(m_nvoxels);
+    int num_unique = 0;
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        string sig;
+        AppendBits(sig, m_origdata->Column(v));
+        if (m_suppdata->Ncols() > 0)
+            AppendBits(sig, m_suppdata->Column(v));
+        for (size_t i = 0; i < images.size(); i++)
+        {
+            AppendBits(sig, images[i](v));
+        }
+        ColumnVector cov = m_ctx->fwd_post[v - 1].GetCovariance().AsColumn();
+        ColumnVector centre = m_lin_model[v - 1].Centre();
+        AppendBits(sig, m_ctx->fwd_post[v - 1].means);
+        AppendBits(sig, cov);
+        AppendBits(sig, m_ctx->noise_post[v - 1]->OutputAsMVN().means);
+        AppendBits(sig, centre);
+
+        map<string, int>::iterator iter = first_voxel.find(sig);
+        if (iter == first_voxel.end())
+        {
+            first_voxel[sig] = v;
+            source[v - 1] = v;
+            num_unique++;
+        }
+        else
+        {
+            source[v - 1] = iter->second;
+        }
+    }
+
+    LOG << "Vb::Voxel deduplication: " << num_unique << " unique voxels out of " << m_nvoxels
+        << endl;
 }
 
 void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
@@ -412,15 +897,57 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
     m_model->GetParameters(rundata, params);
     vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
 
+    // Voxels with identical input only need to be fitted once
+    vector<int> source;
+    if (rundata.GetBool("dedup-voxels"))
+    {
+        FindDuplicateVoxels(rundata, params, source);
+    }
+
+    // Voxels with little or no signal can be skipped or given fewer iterations
+    if (m_screen_snr > 0)
+    {
+        ScreenVoxels();
+    }
+
+    // Iterations for each voxel, so duplicates can be given the same number
+    vector<int> iterations(m_nvoxels, 0);
+
     LOG << "Vb::Voxelwise calculations loop" << endl;
     // Loop over voxels
     for (int v = 1; v <= m_nvoxels; v++)
     {
+        if (!source.empty() && source[v - 1] != v)
+        {
+            // Duplicate of a voxel which has already been fitted, so just copy its results
+            int src = source[v - 1];
+            rundata.Progress(v, m_nvoxels);
+            *m_ctx->noise_post[v - 1] = *m_ctx->noise_post[src - 1];
+            m_ctx->fwd_post[v - 1] = m_ctx->fwd_post[src - 1];
+            m_ctx->fwd_prior[v - 1] = m_ctx->fwd_prior[src - 1];
+            resultMVNs.at(v - 1) = new MVNDist(*resultMVNs.at(src - 1));
+            resultFs.at(v - 1) = resultFs.at(src - 1);
+            resultFsHistory.at(v - 1) = resultFsHistory.at(src - 1);
+            iterations[v - 1] = iterations[src - 1];
+            WriteProgressiveOutputs(v, m_needF ? resultFs.at(v - 1) : 0, iterations[v - 1]);
+            continue;
+        }
+
         PassModelData(v);
 
         m_ctx->v = v;
         m_ctx->it = 0;
 
+        bool screened = !m_screened.empty() && m_screened[v - 1];
+        if (screened && m_screen_skip)
+        {
+            rundata.Progress(v, m_nvoxels);
+            double F = SkipVoxel(v, priors);
+            WriteProgressiveOutputs(v, F, 0);
+            m_model->ForgetEvaluations(v);
+            continue;
+        }
+
         // Save our model parameters in case we need to revert later.
         // Note need to save prior in case ARD is being used
         NoiseParams *const noisePosteriorSave = m_ctx->noise_post[v - 1]->Clone();
@@ -434,9 +961,15 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
 
         try
         {
-            m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+            ReCentre(v);
             m_conv[v - 1]->Reset();
 
+            // Cheap early iterations using a subset of the time points
+            if (m_subsample_stride > 1)
+            {
+                DoSubsampledIterations(v, priors);
+            }
+
             // START the VB updates and run through the relevant iterations (according to the
             // convergence testing)
             do
@@ -451,47 +984,10 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
                         DebugVoxel(v, "Saving as best solution so far");
                 }
 
-                for (int k = 0; k < m_num_params; k++)
-                {
-                    Fprior = priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
-                }
-
-                if (m_debug)
-                    DebugVoxel(v, "Applied priors");
-
-                F = CalculateF(v, "before", Fprior);
-
-                m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
-                    m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL,
-                    m_conv[v - 1]->LMalpha());
-
-                if (m_debug)
-                    DebugVoxel(v, "Updated params");
-
-                F = CalculateF(v, "theta", Fprior);
-
-                m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
-                    m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
-
-                if (m_debug)
-                    DebugVoxel(v, "Updated noise");
-
-                F = CalculateF(v, "phi", Fprior);
-
-                // Linearization update
-                // Update the linear model before doing Free energy calculation
-                // (and ready for next round of theta and phi updates)
-                m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
-
-                if (m_debug)
-                    DebugVoxel(v, "Re-centered");
-
-                F = CalculateF(v, "lin", Fprior);
-                if (m_saveFsHistory) 
-                    resultFsHistory.at(v - 1).push_back(F);
+                F = VoxelIteration(v, priors, Fprior);
 
                 ++m_ctx->it;
-            } while (!m_conv[v - 1]->Test(F));
+            } while (!m_conv[v - 1]->Test(F) && !(screened && (m_ctx->it >= m_screen_maxits)));
 
             if (m_debug)
                 LOG << "Converged after " << m_ctx->it << " iterations" << endl;
@@ -512,7 +1008,7 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
                 *m_ctx->noise_post[v - 1] = *noisePosteriorSave;
                 m_ctx->fwd_post[v - 1] = fwdPosteriorSave;
                 m_ctx->fwd_prior[v - 1] = fwdPriorSave;
-                m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+                ReCentre(v);
                 if (m_debug)
                         DebugVoxel(v, "Reverted to better solution");
                 F = CalculateF(v, "revert", Fprior);
@@ -537,31 +1033,10 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
                 throw;
         }
 
-        // now write the results to resultMVNs
-        try
-        {
-            resultMVNs.at(v - 1)
-                = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
-            if (m_needF)
-                resultFs.at(v - 1) = F;
-            if (m_saveFsHistory) 
-                resultFsHistory.at(v - 1).push_back(F);
-        }
-        catch (...)
-        {
-            // Even that can fail, due to results being singular
-            LOG << "Vb::Can't give any sensible answer for this voxel; outputting zero +- "
-                   "identity\n";
-            MVNDist *tmp = new MVNDist(m_log);
-            tmp->SetSize(m_ctx->fwd_post[v - 1].means.Nrows()
-                + m_ctx->noise_post[v - 1]->OutputAsMVN().means.Nrows());
-            tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
-            resultMVNs.at(v - 1) = tmp;
-            if (m_needF)
-                resultFs.at(v - 1) = F;
-            if (m_saveFsHistory) 
-                resultFsHistory.at(v - 1).push_back(F);
-        }
+        SaveVoxelResult(v, F);
+        iterations[v - 1] = m_ctx->it;
+        WriteProgressiveOutputs(v, F, m_ctx->it);
+        m_model->ForgetEvaluations(v);
     }
     for (unsigned int i = 0; i < priors.size(); i++)
     {
@@ -569,155 +1044,601 @@ void Vb::DoCalculationsVoxelwise(FabberRunData &rundata)
     }
 }
 
-void Vb::DoCalculationsSpatial(FabberRunData &rundata)
+double Vb::SkipVoxel(int v, const vector<Prior *> &priors)
 {
-    // Pass in some (dummy) data/coords here just in case the model relies upon it
-    // use the first voxel values as our dummies FIXME this shouldn't really be
-    // necessary, need to find way for model to know about the data beforehand.
-    if (m_nvoxels > 0)
-        PassModelData(1);
+    // No fitting - the posterior is the prior
+    double Fprior = 0;
+    for (int k = 0; k < m_num_params; k++)
+    {
+        Fprior = priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
+    }
+    m_ctx->fwd_post[v - 1] = m_ctx->fwd_prior[v - 1];
+    *m_ctx->noise_post[v - 1] = *m_ctx->noise_prior[v - 1];
 
-    // Make the neighbours[] lists if required
-    // if (m_prior_types_str.find_first_of("mMpP") != string::npos)
-    if (true) // FIXME
+    // The free energy of the prior, so skipped voxels do not appear to fit
+    // better than fitted ones
+    double F = std::numeric_limits<double>::quiet_NaN();
+    if (m_needF)
     {
-        CalcNeighbours(*m_coords);
+        try
+        {
+            ReCentre(v);
+            F = CalculateF(v, "skip", Fprior);
+        }
+        catch (FabberInternalError &e)
+        {
+            LOG << "Vb::Could not calculate free energy for skipped voxel " << v << " : "
+                << e.what() << endl;
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            LOG << "Vb::Could not calculate free energy for skipped voxel " << v << " : "
+                << e.what() << endl;
+        }
+        resultFs.at(v - 1) = F;
     }
+    resultMVNs.at(v - 1)
+        = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
+    return F;
+}
 
-    vector<Parameter> params;
-    m_model->GetParameters(rundata, params);
-    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+double Vb::VoxelIteration(int v, const vector<Prior *> &priors, double &Fprior)
+{
+    for (int k = 0; k < m_num_params; k++)
+    {
+        Fprior = priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
+    }
 
-    // Spatial loop currently uses a global convergence detector FIXME
-    // needs to change
-    CountingConvergenceDetector conv;
-    conv.Initialize(rundata);
-    double Fglobal = 1234.5678;
-    int maxits = convertTo<int>(rundata.GetStringDefault("max-iterations", "10"));
+    if (m_debug)
+        DebugVoxel(v, "Applied priors");
 
-    // MAIN ITERATION LOOP
-    do
-    {
-        LOG << endl << "*** Spatial iteration *** " << (m_ctx->it + 1) << endl;
+    double F = CalculateF(v, "before", Fprior);
 
-        // Give an indication of the progress through the voxels;
-        rundata.Progress(m_ctx->it, maxits);
-        double Fprior = 0;
+    m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
+        m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL,
+        m_conv[v - 1]->LMalpha());
 
-        // ITERATE OVER VOXELS
-        for (int v = 1; v <= m_nvoxels; v++)
-        {
-            m_ctx->v = v;
+    if (m_debug)
+        DebugVoxel(v, "Updated params");
 
-            PassModelData(v);
+    F = CalculateF(v, "theta", Fprior);
 
-            // The steps below are essentially the same as regular VB, although
-            // the code looks different as the per-voxel dists are set up at the
-            // start rather than as we go
-            try
-            {
-                Fprior = 0;
+    m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
+        m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
 
-                // Apply prior updates for spatial or ARD priors
-                for (int k = 0; k < m_num_params; k++)
-                {
-                    Fprior += priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
-                }
-                if (m_debug)
-                    DebugVoxel(v, "Priors set");
+    if (m_debug)
+        DebugVoxel(v, "Updated noise");
 
-                // Ignore voxels where numerical issues have occurred
-                if (std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
-                    != m_ctx->ignore_voxels.end())
-                {
-                    LOG << "Ignoring voxel " << v << endl;
-                    continue;
-                }
+    F = CalculateF(v, "phi", Fprior);
 
-                CalculateF(v, "before", Fprior);
+    // Linearization update
+    // Update the linear model before doing Free energy calculation
+    // (and ready for next round of theta and phi updates)
+    ReCentre(v);
 
-                m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
-                    m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL, 0);
-                if (m_debug)
-                    DebugVoxel(v, "Theta updated");
+    if (m_debug)
+        DebugVoxel(v, "Re-centered");
+
+    F = CalculateF(v, "lin", Fprior);
+    if (m_saveFsHistory)
+        resultFsHistory.at(v - 1).push_back(F);
+
+    if (m_conv[v - 1]->UseParams())
+        m_conv[v - 1]->UpdateParams(m_ctx->fwd_post[v - 1]);
+
+    return F;
+}
+
+void Vb::SaveVoxelResult(int v, double F)
+{
+    try
+    {
+        resultMVNs.at(v - 1)
+            = new MVNDist(m_ctx->fwd_post[v - 1], m_ctx->noise_post[v - 1]->OutputAsMVN());
+        if (m_needF)
+            resultFs.at(v - 1) = F;
+        if (m_saveFsHistory)
+            resultFsHistory.at(v - 1).push_back(F);
+    }
+    catch (...)
+    {
+        // Even that can fail, due to results being singular
+        LOG << "Vb::Can't give any sensible answer for this voxel; outputting zero +- "
+               "identity\n";
+        MVNDist *tmp = new MVNDist(m_log);
+        tmp->SetSize(m_ctx->fwd_post[v - 1].means.Nrows()
+            + m_ctx->noise_post[v - 1]->OutputAsMVN().means.Nrows());
+        tmp->SetCovariance(IdentityMatrix(tmp->means.Nrows()));
+        resultMVNs.at(v - 1) = tmp;
+        if (m_needF)
+            resultFs.at(v - 1) = F;
+        if (m_saveFsHistory)
+            resultFsHistory.at(v - 1).push_back(F);
+    }
+}
+
+/**
+ * Wall clock time in seconds, for the time budget
+ */
+static double WallClockSeconds()
+{
+#ifndef _WIN32
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#else
+    return double(time(NULL));
+#endif
+}
+
+bool Vb::BudgetIteration(
+    int v, const vector<Prior *> &priors, BudgetVoxel &state, double &improvement)
+{
+    // Save old values if the convergence detector found that they were the best so far
+    if (m_conv[v - 1]->NeedSave())
+    {
+        *state.noise_save = *m_ctx->noise_post[v - 1];
+        state.post_save = m_ctx->fwd_post[v - 1];
+        state.prior_save = m_ctx->fwd_prior[v - 1];
+        state.F_save = (state.its > 0) ? state.F : -HUGE_VAL;
+    }
+
+    double Fprev = state.F;
+    state.F = VoxelIteration(v, priors, state.Fprior);
+    improvement = (state.its > 0) ? state.F - Fprev : HUGE_VAL;
+    if (!(improvement == improvement))
+        improvement = 0;
+    ++m_ctx->it;
+    ++state.its;
+
+    bool screened = !m_screened.empty() && m_screened[v - 1];
+    if (!m_conv[v - 1]->Test(state.F) && !(screened && (m_ctx->it >= m_screen_maxits)))
+        return false;
+
+    if (m_conv[v - 1]->NeedSave())
+    {
+        *state.noise_save = *m_ctx->noise_post[v - 1];
+        state.post_save = m_ctx->fwd_post[v - 1];
+        state.prior_save = m_ctx->fwd_prior[v - 1];
+        state.F_save = state.F;
+    }
+    if (m_conv[v - 1]->NeedRevert())
+    {
+        *m_ctx->noise_post[v - 1] = *state.noise_save;
+        m_ctx->fwd_post[v - 1] = state.post_save;
+        m_ctx->fwd_prior[v - 1] = state.prior_save;
+        ReCentre(v);
+        state.F = CalculateF(v, "revert", state.Fprior);
+    }
+    return true;
+}
+
+void Vb::DoCalculationsBudgeted(FabberRunData &rundata)
+{
+    double start = WallClockSeconds();
+
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+
+    vector<int> source;
+    if (rundata.GetBool("dedup-voxels"))
+    {
+        FindDuplicateVoxels(rundata, params, source);
+    }
+    if (m_screen_snr > 0)
+    {
+        ScreenVoxels();
+    }
+
+    // The free energy is needed to decide which voxels to spend the remaining time
+    // on, even if it is not otherwise needed or saved
+    m_budget_needF = true;
+
+    LOG << "Vb::Voxelwise calculations with a time budget of " << m_time_budget << " seconds"
+        << endl;
+    m_converged.assign(m_nvoxels, 0);
+    vector<BudgetVoxel> state(m_nvoxels);
+    vector<bool> active(m_nvoxels, false);
+    int num_unique = m_nvoxels, num_started = 0;
+    for (unsigned int v = 1; v <= source.size(); v++)
+    {
+        if (source[v - 1] != int(v))
+            num_unique--;
+    }
+
+    // Each voxel which is fitted, and the improvement in its free energy at the
+    // last iteration. Voxels which have improved the most get the next iteration
+    priority_queue<pair<double, int> > queue;
+
+    // First give every voxel the minimum number of iterations
+    bool out_of_time = false;
+    for (int v = 1; v <= m_nvoxels && !out_of_time; v++)
+    {
+        rundata.Progress(v, m_nvoxels);
+        if (!source.empty() && source[v - 1] != v)
+            continue;
+
+        PassModelData(v);
+        m_ctx->v = v;
+        m_ctx->it = 0;
+        num_started++;
+        if (!m_screened.empty() && m_screened[v - 1] && m_screen_skip)
+        {
+            double F = SkipVoxel(v, priors);
+            WriteProgressiveOutputs(v, F, 0);
+            m_converged[v - 1] = 1;
+            continue;
+        }
+
+        BudgetVoxel &voxel = state[v - 1];
+        voxel.noise_save = m_ctx->noise_post[v - 1]->Clone();
+        voxel.post_save = m_ctx->fwd_post[v - 1];
+        voxel.prior_save = m_ctx->fwd_prior[v - 1];
+        active[v - 1] = true;
+
+        double improvement = 0;
+        try
+        {
+            ReCentre(v);
+            m_conv[v - 1]->Reset();
+            if (m_subsample_stride > 1)
+            {
+                DoSubsampledIterations(v, priors);
+            }
+            bool finished = false;
+            while (!finished && voxel.its < m_budget_min_its)
+            {
+                finished = BudgetIteration(v, priors, voxel, improvement);
+            }
+            if (finished)
+            {
+                SaveVoxelResult(v, voxel.F);
+                WriteProgressiveOutputs(v, voxel.F, voxel.its);
+                m_converged[v - 1] = 1;
+                active[v - 1] = false;
+            }
+            else
+            {
+                queue.push(make_pair(improvement, v));
+            }
+        }
+        catch (FabberInternalError &e)
+        {
+            LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+            if (m_halt_bad_voxel)
+                throw;
+            active[v - 1] = false;
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+            if (m_halt_bad_voxel)
+                throw;
+            active[v - 1] = false;
+        }
+        out_of_time = (WallClockSeconds() - start) >= m_time_budget;
+    }
+
+    // Then spend the rest of the budget on the voxels which are improving the most
+    while (!queue.empty() && !out_of_time)
+    {
+        int v = queue.top().second;
+        queue.pop();
+
+        PassModelData(v);
+        m_ctx->v = v;
+        m_ctx->it = state[v - 1].its;
+        double improvement = 0;
+        try
+        {
+            if (BudgetIteration(v, priors, state[v - 1], improvement))
+            {
+                SaveVoxelResult(v, state[v - 1].F);
+                WriteProgressiveOutputs(v, state[v - 1].F, state[v - 1].its);
+                m_converged[v - 1] = 1;
+                active[v - 1] = false;
+            }
+            else
+            {
+                queue.push(make_pair(improvement, v));
+            }
+        }
+        catch (FabberInternalError &e)
+        {
+            LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+            if (m_halt_bad_voxel)
+                throw;
+            active[v - 1] = false;
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+            if (m_halt_bad_voxel)
+                throw;
+            active[v - 1] = false;
+        }
+        out_of_time = (WallClockSeconds() - start) >= m_time_budget;
+    }
 
-                CalculateF(v, "theta", Fprior);
+    // Write results for every voxel which has not finished. Voxels which were
+    // still being fitted revert to the best solution saved by the convergence
+    // detector if it is better than the latest one, as they would on convergence
+    int num_converged = 0;
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        if (!source.empty() && source[v - 1] != v)
+            continue;
+        if (active[v - 1] && state[v - 1].F_save > state[v - 1].F)
+        {
+            BudgetVoxel &voxel = state[v - 1];
+            try
+            {
+                PassModelData(v);
+                m_ctx->v = v;
+                *m_ctx->noise_post[v - 1] = *voxel.noise_save;
+                m_ctx->fwd_post[v - 1] = voxel.post_save;
+                m_ctx->fwd_prior[v - 1] = voxel.prior_save;
+                ReCentre(v);
+                voxel.F = CalculateF(v, "revert", voxel.Fprior);
             }
             catch (FabberInternalError &e)
             {
                 LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
                     << " : " << e.what() << endl;
-
                 if (m_halt_bad_voxel)
                     throw;
-                else
-                    IgnoreVoxel(v);
             }
             catch (NEWMAT::Exception &e)
             {
                 LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
                     << " : " << e.what() << endl;
-
                 if (m_halt_bad_voxel)
                     throw;
-                else
-                    IgnoreVoxel(v);
             }
         }
+        if (resultMVNs.at(v - 1) == NULL && state[v - 1].its == 0)
+        {
+            // Not started before the time ran out, or failed before completing
+            // an iteration, so output the prior as for a voxel which is skipped
+            PassModelData(v);
+            m_ctx->v = v;
+            double F = SkipVoxel(v, priors);
+            WriteProgressiveOutputs(v, F, 0);
+        }
+        else if (resultMVNs.at(v - 1) == NULL)
+        {
+            SaveVoxelResult(v, state[v - 1].F);
+            WriteProgressiveOutputs(v, state[v - 1].F, state[v - 1].its);
+        }
+        delete state[v - 1].noise_save;
+        num_converged += m_converged[v - 1];
+    }
+    m_budget_needF = false;
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        if (!source.empty() && source[v - 1] != v)
+        {
+            int src = source[v - 1];
+            *m_ctx->noise_post[v - 1] = *m_ctx->noise_post[src - 1];
+            m_ctx->fwd_post[v - 1] = m_ctx->fwd_post[src - 1];
+            m_ctx->fwd_prior[v - 1] = m_ctx->fwd_prior[src - 1];
+            resultMVNs.at(v - 1) = new MVNDist(*resultMVNs.at(src - 1));
+            resultFs.at(v - 1) = resultFs.at(src - 1);
+            resultFsHistory.at(v - 1) = resultFsHistory.at(src - 1);
+            m_converged[v - 1] = m_converged[src - 1];
+            num_converged += m_converged[v - 1];
+            WriteProgressiveOutputs(v, resultFs.at(v - 1), state[src - 1].its);
+        }
+    }
 
-        Fglobal = 0;
-        for (int v = 1; v <= m_nvoxels; v++)
+    LOG << "Vb::Time budget: " << num_converged << " of " << m_nvoxels << " voxels converged in "
+        << WallClockSeconds() - start << " seconds" << endl;
+    if (out_of_time)
+    {
+        LOG << "Vb::Time budget: ran out of time with " << queue.size()
+            << " voxels still being fitted and " << num_unique - num_started
+            << " voxels not started" << endl;
+    }
+
+    for (unsigned int i = 0; i < priors.size(); i++)
+    {
+        delete priors[i];
+    }
+}
+
+void Vb::ScreenVoxels()
+{
+    m_snr.resize(m_nvoxels);
+    m_screened.assign(m_nvoxels, 0);
+    int num_screened = 0;
+
+    // Time points used for screening, found once rather than for every voxel
+    vector<bool> use(m_origdata->Nrows(), true);
+    for (unsigned int i = 0; i < m_masked_tpoints.size(); i++)
+    {
+        int t = m_masked_tpoints[i];
+        if (t >= 1 && t <= int(use.size()))
+            use[t - 1] = false;
+    }
+
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        m_snr[v - 1] = ScreeningSnr(m_origdata->Column(v), use);
+        if (m_snr[v - 1] < m_screen_snr)
         {
-            try {
-                // Ignore voxels where numerical issues have occurred
-                if (std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
-                    != m_ctx->ignore_voxels.end())
-                {
-                    LOG << "Ignoring voxel " << v << endl;
-                    continue;
-                }
+            m_screened[v - 1] = 1;
+            num_screened++;
+        }
+    }
 
-                PassModelData(v);
+    LOG << "Vb::Screening: " << num_screened << " of " << m_nvoxels
+        << " voxels have SNR below " << m_screen_snr;
+    if (m_screen_skip)
+        LOG << " and will not be fitted" << endl;
+    else
+        LOG << " and will be fitted with at most " << m_screen_maxits << " iterations" << endl;
 
-                m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
-                    m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
-                if (m_debug)
-                    DebugVoxel(v, "Noise updated");
+    if (m_nvoxels > 0)
+    {
+        vector<double> sorted(m_snr);
+        std::sort(sorted.begin(), sorted.end());
+        LOG << "Vb::Screening: SNR minimum " << sorted.front() << ", median "
+            << sorted[sorted.size() / 2] << ", maximum " << sorted.back() << endl;
+    }
+}
 
-                CalculateF(v, "noise", Fprior);
+double Vb::ScreeningSnr(const ColumnVector &data, const vector<bool> &use) const
+{
+    double sumsq = 0, diffsq = 0, prev = 0;
+    int n = 0;
+    for (int t = 1; t <= data.Nrows(); t++)
+    {
+        if (!use[t - 1])
+            continue;
+
+        sumsq += data(t) * data(t);
+        if (n > 0)
+            diffsq += (data(t) - prev) * (data(t) - prev);
+        prev = data(t);
+        n++;
+    }
 
-                if (!m_locked_linear)
-                    m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
-                if (m_debug)
-                    DebugVoxel(v, "Re-centre");
+    // The difference of two independent samples has twice the noise variance
+    double noise = (n > 1) ? sqrt(diffsq / (2 * (n - 1))) : 0;
+    if (noise > 0)
+        return sqrt(sumsq / n) / noise;
+    else
+        return (sumsq > 0) ? HUGE_VAL : 0;
+}
 
-                Fglobal += CalculateF(v, "lin", Fprior);
-            }
-            catch (FabberInternalError &e)
-            {
-                LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
-                    << " : " << e.what() << endl;
+void Vb::DoCalculationsSpatial(FabberRunData &rundata)
+{
+    // Pass in some (dummy) data/coords here just in case the model relies upon it
+    // use the first voxel values as our dummies FIXME this shouldn't really be
+    // necessary, need to find way for model to know about the data beforehand.
+    if (m_nvoxels > 0)
+        PassModelData(1);
 
-                if (m_halt_bad_voxel)
-                    throw;
+    // Make the neighbours[] lists if required
+    // if (m_prior_types_str.find_first_of("mMpP") != string::npos)
+    if (true) // FIXME
+    {
+        CalcNeighbours(*m_coords);
+    }
+
+    vector<Parameter> params;
+    m_model->GetParameters(rundata, params);
+    vector<Prior *> priors = PriorFactory(rundata).CreatePriors(params);
+
+    if (m_supervoxels > 0)
+    {
+        DoSupervoxelCalculations(rundata, params, priors);
+    }
+
+    // By default a fixed number of iterations is done. The global convergence
+    // detector needs the free energy and is given the spatial precisions and
+    // posteriors after every iteration
+    CountingConvergenceDetector counting;
+    SpatialConvergenceDetector global;
+    CountingConvergenceDetector &conv = m_spatial_convergence ? global : counting;
+    conv.Initialize(rundata);
+    if (m_spatial_convergence)
+    {
+        m_needF = true;
+    }
+    double Fglobal = 1234.5678;
+    int maxits = convertTo<int>(rundata.GetStringDefault("max-iterations", "10"));
+
+    // Previous iteration, in case the free energy decreases
+    vector<MVNDist> fwdPosteriorSave, fwdPriorSave;
+    vector<NoiseParams *> noisePosteriorSave;
+    vector<double> aKSave(priors.size(), 0);
+
+    // MAIN ITERATION LOOP
+    do
+    {
+        if (conv.NeedSave())
+        {
+            fwdPosteriorSave = m_ctx->fwd_post;
+            fwdPriorSave = m_ctx->fwd_prior;
+            for (int v = 1; v <= m_nvoxels; v++)
+            {
+                if (noisePosteriorSave.size() < (unsigned int)v)
+                    noisePosteriorSave.push_back(m_ctx->noise_post[v - 1]->Clone());
                 else
-                    IgnoreVoxel(v);
+                    *noisePosteriorSave[v - 1] = *m_ctx->noise_post[v - 1];
             }
-            catch (NEWMAT::Exception &e)
+            for (unsigned int k = 0; k < priors.size(); k++)
             {
-                LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
-                    << " : " << e.what() << endl;
+                SpatialPrior *prior = dynamic_cast<SpatialPrior *>(priors[k]);
+                if (prior)
+                    aKSave[k] = prior->GetaK();
+            }
+        }
 
-                if (m_halt_bad_voxel)
-                    throw;
-                else
-                    IgnoreVoxel(v);
+        LOG << endl << "*** Spatial iteration *** " << (m_ctx->it + 1) << endl;
+
+        // Give an indication of the progress through the voxels;
+        rundata.Progress(m_ctx->it, maxits);
+        Fglobal = SpatialIteration(priors);
+
+        if (conv.UseParams())
+        {
+            vector<double> aK;
+            for (int k = 0; k < m_num_params; k++)
+            {
+                SpatialPrior *prior = dynamic_cast<SpatialPrior *>(priors[k]);
+                if (prior)
+                    aK.push_back(prior->GetaK());
+            }
+            global.UpdateaK(aK);
+            for (int v = 1; v <= m_nvoxels; v++)
+            {
+                global.UpdateParams(m_ctx->fwd_post[v - 1]);
             }
         }
 
         ++m_ctx->it;
     } while (!conv.Test(Fglobal));
 
+    if (m_spatial_convergence)
+    {
+        LOG << "Vb::Spatial iterations finished" << endl;
+        conv.Dump(LOG, "Vb::");
+    }
+
+    // Go back to the previous iteration if the free energy decreased
+    if (conv.NeedRevert())
+    {
+        m_ctx->fwd_post = fwdPosteriorSave;
+        m_ctx->fwd_prior = fwdPriorSave;
+        for (unsigned int k = 0; k < priors.size(); k++)
+        {
+            SpatialPrior *prior = dynamic_cast<SpatialPrior *>(priors[k]);
+            if (prior)
+                prior->SetaK(aKSave[k]);
+        }
+        for (int v = 1; v <= m_nvoxels; v++)
+        {
+            *m_ctx->noise_post[v - 1] = *noisePosteriorSave[v - 1];
+            if (!m_locked_linear)
+            {
+                PassModelData(v);
+                ReCentre(v);
+            }
+        }
+        LOG << "Vb::Reverted to previous spatial iteration" << endl;
+    }
+    for (unsigned int v = 0; v < noisePosteriorSave.size(); v++)
+    {
+        delete noisePosteriorSave[v];
+    }
+
     // Interesting addition: calculate "coefficient resels" from Penny et al. 2005
     for (int k = 1; k <= m_num_params; k++)
     {
@@ -760,6 +1681,241 @@ void Vb::DoCalculationsSpatial(FabberRunData &rundata)
     }
 }
 
+double Vb::SpatialIteration(vector<Prior *> &priors)
+{
+    // Prior contribution to the free energy of each voxel, needed again once
+    // the noise has been updated
+    vector<double> Fprior(m_nvoxels, 0);
+
+    // ITERATE OVER VOXELS
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        m_ctx->v = v;
+
+        PassModelData(v);
+
+        // The steps below are essentially the same as regular VB, although
+        // the code looks different as the per-voxel dists are set up at the
+        // start rather than as we go
+        try
+        {
+            // Apply prior updates for spatial or ARD priors
+            for (int k = 0; k < m_num_params; k++)
+            {
+                Fprior[v - 1] += priors[k]->ApplyToMVN(&m_ctx->fwd_prior[v - 1], *m_ctx);
+            }
+            if (m_debug)
+                DebugVoxel(v, "Priors set");
+
+            // Ignore voxels where numerical issues have occurred
+            if (std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
+                != m_ctx->ignore_voxels.end())
+            {
+                LOG << "Ignoring voxel " << v << endl;
+                continue;
+            }
+
+            CalculateF(v, "before", Fprior[v - 1]);
+
+            m_noise->UpdateTheta(*m_ctx->noise_post[v - 1], m_ctx->fwd_post[v - 1],
+                m_ctx->fwd_prior[v - 1], m_lin_model[v - 1], m_origdata->Column(v), NULL, 0);
+            if (m_debug)
+                DebugVoxel(v, "Theta updated");
+
+            CalculateF(v, "theta", Fprior[v - 1]);
+        }
+        catch (FabberInternalError &e)
+        {
+            LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+
+            if (m_halt_bad_voxel)
+                throw;
+            else
+                IgnoreVoxel(v);
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+
+            if (m_halt_bad_voxel)
+                throw;
+            else
+                IgnoreVoxel(v);
+        }
+    }
+
+    double Fglobal = 0;
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        try {
+            // Ignore voxels where numerical issues have occurred
+            if (std::find(m_ctx->ignore_voxels.begin(), m_ctx->ignore_voxels.end(), v)
+                != m_ctx->ignore_voxels.end())
+            {
+                LOG << "Ignoring voxel " << v << endl;
+                continue;
+            }
+
+            PassModelData(v);
+
+            m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
+                m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
+            if (m_debug)
+                DebugVoxel(v, "Noise updated");
+
+            CalculateF(v, "noise", Fprior[v - 1]);
+
+            if (!m_locked_linear)
+                ReCentre(v);
+            if (m_debug)
+                DebugVoxel(v, "Re-centre");
+
+            Fglobal += CalculateF(v, "lin", Fprior[v - 1]);
+        }
+        catch (FabberInternalError &e)
+        {
+            LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+
+            if (m_halt_bad_voxel)
+                throw;
+            else
+                IgnoreVoxel(v);
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+
+            if (m_halt_bad_voxel)
+                throw;
+            else
+                IgnoreVoxel(v);
+        }
+    }
+
+    return Fglobal;
+}
+
+void Vb::DoSupervoxelCalculations(
+    FabberRunData &rundata, const vector<Parameter> &params, vector<Prior *> &priors)
+{
+    if (m_supervoxels >= m_nvoxels)
+    {
+        LOG << "Vb::Not using supervoxels - no more voxels than supervoxels" << endl;
+        return;
+    }
+    if (m_locked_linear || (rundata.GetStringDefault("continue-from-mvn", "") != ""))
+    {
+        WARN_ONCE("Vb::supervoxels is ignored when the initial posterior or linearization "
+                  "is given for each voxel");
+        return;
+    }
+    for (unsigned int k = 0; k < params.size(); k++)
+    {
+        // Image priors are per voxel, and the priors without boundary correction
+        // assume a regular grid of 2 * spatial-dims neighbours
+        char type = params[k].prior_type;
+        if ((type == PRIOR_IMAGE) || (type == PRIOR_SPATIAL_m) || (type == PRIOR_SPATIAL_p))
+        {
+            WARN_ONCE("Vb::supervoxels is ignored when image priors or spatial priors without "
+                      "boundary correction (m, p) are used");
+            return;
+        }
+    }
+
+    fabber::Supervoxels sv(*m_origdata, *m_coords, m_ctx->neighbours, m_supervoxels,
+        m_supervoxel_compactness, m_spatial_dims);
+    const vector<int> &labels = sv.Labels();
+    int nsv = sv.Num();
+    LOG << "Vb::Clustered " << m_nvoxels << " voxels into " << nsv << " supervoxels" << endl;
+
+    Matrix svdata = sv.Average(*m_origdata);
+    Matrix svcoords = sv.Average(*m_coords);
+    Matrix svsuppdata;
+    if (m_suppdata->Ncols() > 0)
+        svsuppdata = sv.Average(*m_suppdata);
+
+    // Run spatial VB on the supervoxel data, treating each supervoxel as a
+    // voxel whose neighbours are the adjacent supervoxels
+    Vb coarse;
+    coarse.Initialize(m_model, rundata);
+    coarse.m_origdata = &svdata;
+    coarse.m_coords = &svcoords;
+    coarse.m_suppdata = &svsuppdata;
+    coarse.m_nvoxels = nsv;
+    coarse.m_ctx = new RunContext(nsv);
+    coarse.SetupPerVoxelDists(rundata);
+    coarse.m_ctx->neighbours = sv.Neighbours(m_ctx->neighbours);
+    coarse.CalcSecondNeighbours();
+
+    vector<Prior *> svpriors = PriorFactory(rundata).CreatePriors(params);
+    for (int it = 0; it < m_supervoxel_its; it++)
+    {
+        LOG << endl << "*** Supervoxel iteration *** " << (it + 1) << endl;
+        coarse.SpatialIteration(svpriors);
+        ++coarse.m_ctx->it;
+    }
+
+    // Start each voxel from its supervoxel's posterior, linearized about it.
+    // The noise is not copied as averaging reduces the noise of the supervoxel
+    // data, instead each voxel's noise is estimated from its own residuals
+    const vector<int> &ignored = coarse.m_ctx->ignore_voxels;
+    for (int v = 1; v <= m_nvoxels; v++)
+    {
+        if (std::find(ignored.begin(), ignored.end(), labels[v - 1]) != ignored.end())
+            continue;
+
+        try
+        {
+            PassModelData(v);
+            m_ctx->fwd_post[v - 1] = coarse.m_ctx->fwd_post[labels[v - 1] - 1];
+            m_lin_model[v - 1].ReCentre(m_ctx->fwd_post[v - 1].means);
+            m_noise->UpdateNoise(*m_ctx->noise_post[v - 1], *m_ctx->noise_prior[v - 1],
+                m_ctx->fwd_post[v - 1], m_lin_model[v - 1], m_origdata->Column(v));
+        }
+        catch (FabberInternalError &e)
+        {
+            LOG << "Vb::Internal error for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+
+            if (m_halt_bad_voxel)
+                throw;
+            else
+                IgnoreVoxel(v);
+        }
+        catch (NEWMAT::Exception &e)
+        {
+            LOG << "Vb::NEWMAT exception for voxel " << v << " at " << m_coords->Column(v).t()
+                << " : " << e.what() << endl;
+
+            if (m_halt_bad_voxel)
+                throw;
+            else
+                IgnoreVoxel(v);
+        }
+    }
+
+    // Start the spatial priors from the supervoxel spatial precisions. Neighbouring
+    // supervoxels are further apart than neighbouring voxels, so this is a
+    // conservative (weaker) starting value
+    for (unsigned int k = 0; k < priors.size(); k++)
+    {
+        SpatialPrior *from = dynamic_cast<SpatialPrior *>(svpriors[k]);
+        SpatialPrior *to = dynamic_cast<SpatialPrior *>(priors[k]);
+        if (from && to)
+        {
+            LOG << "Vb::Initial aK for parameter " << params[k].name << " from supervoxels: "
+                << from->GetaK() << endl;
+            to->SetaK(from->GetaK());
+        }
+        delete svpriors[k];
+    }
+    coarse.FreePerVoxelDists();
+}
+
 void Vb::CheckCoordMatrixCorrectlyOrdered(const Matrix &coords)
 {
     // Only 3D
@@ -923,9 +2079,17 @@ void Vb::CalcNeighbours(const Matrix &coords)
         }
     }
 
+    CalcSecondNeighbours();
+}
+
+void Vb::CalcSecondNeighbours()
+{
+    const int nVoxels = m_ctx->neighbours.size();
+
     // Similar algorithm but looking for Neighbours-of-neighbours, excluding self,
     // but including duplicates if there are two routes to get there
     // (diagonally connected)
+    m_ctx->neighbours2.clear();
     m_ctx->neighbours2.resize(nVoxels);
 
     for (int vid = 1; vid <= nVoxels; vid++)
@@ -957,6 +2121,15 @@ void Vb::CalcNeighbours(const Matrix &coords)
     }
 }
 
+bool Vb::GetFreeEnergy(std::vector<double> &fe) const
+{
+    if (resultFs.empty())
+        return false;
+
+    fe = resultFs;
+    return true;
+}
+
 void Vb::SaveResults(FabberRunData &rundata) const
 {
     InferenceTechnique::SaveResults(rundata);
@@ -989,8 +2162,8 @@ void Vb::SaveResults(FabberRunData &rundata) const
         }
     }
 
-    // Save the Free Energy estimates
-    if (m_saveF && !resultFs.empty())
+    // Save the Free Energy estimates, unless already written progressively
+    if (m_saveF && !resultFs.empty() && !m_progressive)
     {
         LOG << "Vb::Writing free energy" << endl;
         assert((int)resultFs.size() == nVoxels);
@@ -1002,7 +2175,7 @@ void Vb::SaveResults(FabberRunData &rundata) const
         }
         rundata.SaveVoxelData("freeEnergy", freeEnergy);
     }
-    else
+    else if (!m_progressive)
     {
         LOG << "Vb::Free energy wasn't recorded, so no freeEnergy data saved" << endl;
     }
@@ -1040,6 +2213,32 @@ void Vb::SaveResults(FabberRunData &rundata) const
         }
         rundata.SaveVoxelData("freeEnergyHistory", freeEnergyHistory);
     }
+
+    // Flag voxels which were screened out, and save the SNR used to screen them
+    if (!m_screened.empty())
+    {
+        LOG << "Vb::Writing voxel screening results" << endl;
+        Matrix screened(1, nVoxels), snr(1, nVoxels);
+        for (int vox = 1; vox <= nVoxels; vox++)
+        {
+            screened(1, vox) = m_screened[vox - 1];
+            snr(1, vox) = m_snr[vox - 1];
+        }
+        rundata.SaveVoxelData("screened", screened);
+        rundata.SaveVoxelData("screen_snr", snr);
+    }
+
+    // Flag voxels which finished fitting within the time budget
+    if (!m_converged.empty())
+    {
+        LOG << "Vb::Writing convergence flags" << endl;
+        Matrix converged(1, nVoxels);
+        for (int vox = 1; vox <= nVoxels; vox++)
+        {
+            converged(1, vox) = m_converged[vox - 1];
+        }
+        rundata.SaveVoxelData("converged", converged);
+    }
     
     LOG << "Vb::Done writing results." << endl;
 }
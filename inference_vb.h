@@ -8,8 +8,12 @@
 
 #include "convergence.h"
 #include "inference.h"
+#include "priors.h"
 #include "run_context.h"
+#include "thread_pool.h"
 
+#include <math.h>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -24,12 +28,35 @@ public:
         , m_needF(false)
         , m_printF(false)
         , m_saveF(false)
+        , m_num_f_skipped(0)
         , m_origdata(NULL)
         , m_coords(NULL)
         , m_suppdata(NULL)
         , m_num_mcsteps(0)
         , m_spatial_dims(-1)
         , m_locked_linear(false)
+        , m_subsample_stride(1)
+        , m_subsample_fchange(0)
+        , m_subsample_maxits(0)
+        , m_jacobian_threads(1)
+        , m_jacobian_pin(false)
+        , m_recentre_tol(0)
+        , m_num_recentres(0)
+        , m_num_recentre_skipped(0)
+        , m_freeze_tol(0)
+        , m_freeze_refresh(0)
+        , m_num_columns(0)
+        , m_num_columns_frozen(0)
+        , m_supervoxels(0)
+        , m_supervoxel_its(0)
+        , m_supervoxel_compactness(0)
+        , m_screen_snr(0)
+        , m_screen_skip(false)
+        , m_screen_maxits(0)
+        , m_spatial_convergence(false)
+        , m_time_budget(0)
+        , m_budget_min_its(0)
+        , m_budget_needF(false)
     {
     }
 
@@ -41,6 +68,7 @@ public:
     virtual void DoCalculations(FabberRunData &data);
 
     virtual void SaveResults(FabberRunData &rundata) const;
+    virtual bool GetFreeEnergy(std::vector<double> &fe) const;
 
 protected:
     /**
@@ -72,17 +100,152 @@ protected:
      */
     virtual void DoCalculationsVoxelwise(FabberRunData &data);
 
+    /**
+     * Do voxelwise calculations within a wall clock time budget
+     *
+     * Every voxel is first given m_budget_min_its iterations. The rest
+     * of the time is spent one iteration at a time on the unconverged voxel
+     * whose free energy improved the most at its last iteration. When the
+     * time runs out voxels which are still being fitted are output with the
+     * best posterior found so far, voxels which were not started are output
+     * with the prior as if they had been skipped, and m_converged records
+     * which voxels had finished fitting.
+     */
+    void DoCalculationsBudgeted(FabberRunData &data);
+
+    /** State of a voxel which is being fitted within the time budget */
+    struct BudgetVoxel
+    {
+        BudgetVoxel()
+            : its(0)
+            , F(0)
+            , Fprior(0)
+            , F_save(-HUGE_VAL)
+            , noise_save(NULL)
+        {
+        }
+        int its;
+        double F;
+        double Fprior;
+        /** Free energy of the saved solution, -HUGE_VAL if not known */
+        double F_save;
+        /** Best solution so far, in case the convergence detector reverts */
+        NoiseParams *noise_save;
+        MVNDist post_save;
+        MVNDist prior_save;
+    };
+
+    /**
+     * Do one iteration of a voxel being fitted within the time budget
+     *
+     * @param improvement Set to the change in free energy from the previous
+     *                    iteration
+     * @return true if the voxel has finished fitting
+     */
+    bool BudgetIteration(int v, const std::vector<Prior *> &priors, BudgetVoxel &state,
+        double &improvement);
+
+    /** One VB iteration for a voxel - returns the free energy */
+    double VoxelIteration(int v, const std::vector<Prior *> &priors, double &Fprior);
+
+    /**
+     * Output the prior as the posterior of a voxel which is not fitted
+     *
+     * @return free energy of the prior if it is needed, otherwise NaN
+     */
+    double SkipVoxel(int v, const std::vector<Prior *> &priors);
+
+    /** Store the current posterior and free energy of a voxel as its result */
+    void SaveVoxelResult(int v, double F);
+
+    /**
+     * Find voxels whose input is identical to that of an earlier voxel
+     *
+     * The data, supplementary data, image prior data, initial posterior and
+     * linearization centre are compared. Only meaningful for voxelwise
+     * calculations as spatial priors couple voxels together.
+     *
+     * @param source Will be set to contain, for each voxel, the index (starting
+     *               at 1) of the first voxel with identical input. This will be
+     *               the voxel itself if it is unique.
+     */
+    void FindDuplicateVoxels(FabberRunData &rundata, const std::vector<Parameter> &params,
+        std::vector<int> &source);
+
+    /**
+     * Run early VB iterations for a voxel on a subset of the time points
+     *
+     * Starts using every m_subsample_stride'th time point and halves the
+     * stride each time the free energy stabilises (or the maximum number
+     * of iterations is reached). On return the original masked time points
+     * have been restored so the normal iterations can continue using all
+     * the data.
+     */
+    void DoSubsampledIterations(int v, const std::vector<Prior *> &priors);
+
+    /**
+     * Find voxels with little or no signal before fitting
+     *
+     * Sets m_snr and m_screened and logs a summary of the screening
+     */
+    void ScreenVoxels();
+
+    /**
+     * Model-free signal to noise ratio of a voxel's data
+     *
+     * This is the RMS of the data divided by the noise standard deviation
+     * estimated from the differences between successive time points, so
+     * pure zero-mean noise gives a value of about 1. If the noise cannot be
+     * estimated the SNR is infinite, unless the data is all zero.
+     *
+     * @param use For each time point, false if it is masked and should not
+     *            be used
+     */
+    double ScreeningSnr(const NEWMAT::ColumnVector &data, const std::vector<bool> &use) const;
+
     /**
      * Do calculations loop in spatial mode (i.e. one iteration of all
      * voxels, then next iteration of all voxels, etc)
      */
     virtual void DoCalculationsSpatial(FabberRunData &data);
 
+    /**
+     * Do one spatial iteration of all voxels
+     *
+     * @return global free energy (sum over voxels)
+     */
+    double SpatialIteration(std::vector<Prior *> &priors);
+
+    /**
+     * Initialize spatial VB from a fit to supervoxel-averaged data
+     *
+     * The voxels are clustered into m_supervoxels supervoxels and spatial VB
+     * is run on the average data of each supervoxel, using the adjacency of
+     * the supervoxels as the neighbour graph. Each voxel is then initialized
+     * from the posterior of its supervoxel, and the spatial priors from the
+     * spatial precision (aK) found for the supervoxels, so that few
+     * iterations are needed at full resolution.
+     */
+    void DoSupervoxelCalculations(
+        FabberRunData &rundata, const std::vector<Parameter> &params, std::vector<Prior *> &priors);
+
     /**
      * Calculate free energy if required, and display if required
      */
     double CalculateF(int v, std::string label, double Fprior);
 
+    /**
+     * Move the linearization centre of a voxel to its current posterior means
+     *
+     * If no mean has moved from the centre of the current Jacobian by more
+     * than m_recentre_tol posterior standard deviations, the Jacobian is
+     * kept and only the offset is re-evaluated (or nothing at all if the
+     * centre is unchanged). Otherwise the Jacobian is recalculated, apart
+     * from the columns of any parameters whose posterior has stabilised
+     * when m_freeze_tol is set.
+     */
+    void ReCentre(int v);
+
     /**
      * Output detailed debugging information for a voxel
      */
@@ -99,6 +262,11 @@ protected:
      */
     void SetupPerVoxelDists(FabberRunData &allData);
 
+    /**
+     * Free the per-voxel distributions and run context
+     */
+    void FreePerVoxelDists();
+
     /**
     * Check voxels are listed in order
     *
@@ -115,6 +283,11 @@ protected:
     */
     void CalcNeighbours(const NEWMAT::Matrix &voxelCoords);
 
+    /**
+     * Calculate second nearest neighbours from the nearest neighbours
+     */
+    void CalcSecondNeighbours();
+
     /**
      * Ignore this voxel in future updates.
      *
@@ -124,6 +297,15 @@ protected:
      */
     void IgnoreVoxel(int v);
 
+    /**
+     * Create the thread pool used to evaluate the numerical Jacobian, if any
+     *
+     * Voxels are processed one at a time, so when there are fewer voxels than
+     * processors the spare processors are used to evaluate the model
+     * concurrently within each voxel instead
+     */
+    void SetupJacobianThreads();
+
     /** Number of voxels in data */
     int m_nvoxels;
 
@@ -149,6 +331,9 @@ protected:
     /** True if we need to to save the free energy history */
     bool m_saveFsHistory;
 
+    /** Number of free energy calculations skipped because F was not required */
+    long m_num_f_skipped;
+
     /** Free energy for each voxel */
     std::vector<double> resultFs;
 
@@ -170,6 +355,53 @@ protected:
     /** Stores current run state (parameters, MVNs, linearization centres etc */
     RunContext *m_ctx;
 
+    /**
+     * Number of threads requested for Jacobian evaluation. 0=automatic
+     */
+    int m_jacobian_threads;
+
+    /** If true, pin the Jacobian threads to processors */
+    bool m_jacobian_pin;
+
+    /** Thread pool for Jacobian evaluation, NULL if evaluating serially */
+    std::auto_ptr<ThreadPool> m_jacobian_pool;
+
+    /**
+     * Movement of the linearization centre, in posterior standard deviations,
+     * below which the Jacobian is not recalculated. 0=always recalculate
+     */
+    double m_recentre_tol;
+
+    /** Number of times the linearization centre was moved */
+    long m_num_recentres;
+
+    /** Number of those for which the existing Jacobian was kept */
+    long m_num_recentre_skipped;
+
+    /**
+     * Tolerance for freezing the Jacobian column of a parameter whose posterior
+     * has stabilised. 0=never freeze columns
+     */
+    double m_freeze_tol;
+
+    /** Maximum number of consecutive recentres with frozen columns before a full recalculation */
+    int m_freeze_refresh;
+
+    /** Posterior means of each voxel at the last recentre, for detecting stabilised parameters */
+    std::vector<NEWMAT::ColumnVector> m_freeze_means;
+
+    /** Posterior variances of each voxel at the last recentre */
+    std::vector<NEWMAT::ColumnVector> m_freeze_vars;
+
+    /** Number of consecutive recentres with frozen columns for each voxel */
+    std::vector<int> m_freeze_count;
+
+    /** Number of Jacobian columns needed when freezing is enabled */
+    long m_num_columns;
+
+    /** Number of those which were reused rather than recalculated */
+    long m_num_columns_frozen;
+
     /** Linearized wrapper around the forward model */
     std::vector<LinearizedFwdModel> m_lin_model;
 
@@ -193,4 +425,58 @@ protected:
      * centres are generally loaded from an MVN file
      */
     bool m_locked_linear;
+
+    /** Initial spacing of time points used in early iterations. 1=no subsampling */
+    int m_subsample_stride;
+
+    /** Relative change in F at which the subsampling stride is reduced */
+    double m_subsample_fchange;
+
+    /** Maximum number of iterations at each subsampling stride */
+    int m_subsample_maxits;
+
+    /** Number of supervoxels to initialize spatial VB from. 0=fit voxels directly */
+    int m_supervoxels;
+
+    /** Number of spatial iterations on the supervoxel-averaged data */
+    int m_supervoxel_its;
+
+    /** Weight of spatial distance relative to data similarity when forming supervoxels */
+    double m_supervoxel_compactness;
+
+    /** SNR below which voxels are screened out before fitting. 0=no screening */
+    double m_screen_snr;
+
+    /** If true, screened voxels are not fitted, otherwise they get a reduced iteration budget */
+    bool m_screen_skip;
+
+    /** Maximum number of iterations for screened voxels which are fitted */
+    int m_screen_maxits;
+
+    /** Screening SNR of each voxel, empty if screening is not used */
+    std::vector<double> m_snr;
+
+    /** Whether each voxel was screened out, empty if screening is not used */
+    std::vector<int> m_screened;
+
+    /**
+     * If true, spatial VB stops when the global free energy, spatial precisions
+     * and means have converged, otherwise after max-iterations
+     */
+    bool m_spatial_convergence;
+
+    /** Wall clock time limit in seconds for voxelwise VB. 0=no limit */
+    double m_time_budget;
+
+    /** Iterations every voxel gets before the rest of the time budget is shared out */
+    int m_budget_min_its;
+
+    /**
+     * True while fitting within a time budget, which needs the free energy to
+     * choose which voxel to iterate next even if m_needF is false
+     */
+    bool m_budget_needF;
+
+    /** Whether each voxel finished fitting within the time budget, empty if no budget */
+    std::vector<int> m_converged;
 };
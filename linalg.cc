@@ -0,0 +1,283 @@
+/*  linalg.cc - Dense linear algebra operations used in the inference core
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "linalg.h"
+
+#include <newmat.h>
+
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace NEWMAT;
+using namespace std;
+
+#ifdef FABBER_USE_BLAS
+// Fortran interfaces to BLAS and LAPACK. These are used rather than CBLAS/LAPACKE
+// as they are provided by every implementation
+extern "C" {
+void dgemm_(const char *transa, const char *transb, const int *m, const int *n, const int *k,
+    const double *alpha, const double *a, const int *lda, const double *b, const int *ldb,
+    const double *beta, double *c, const int *ldc);
+void dsyrk_(const char *uplo, const char *trans, const int *n, const int *k, const double *alpha,
+    const double *a, const int *lda, const double *beta, double *c, const int *ldc);
+void dgemv_(const char *trans, const int *m, const int *n, const double *alpha, const double *a,
+    const int *lda, const double *x, const int *incx, const double *beta, double *y,
+    const int *incy);
+double ddot_(const int *n, const double *x, const int *incx, const double *y, const int *incy);
+void dpotrf_(const char *uplo, const int *n, double *a, const int *lda, int *info);
+void dpotri_(const char *uplo, const int *n, double *a, const int *lda, int *info);
+}
+#endif
+
+namespace fabber
+{
+namespace linalg
+{
+#ifdef FABBER_USE_BLAS
+
+// BLAS expects column-major arrays. armawrap stores matrices column by column
+// so Store() can be passed straight through. NEWMAT stores them row by row, so
+// Store() of an m x n matrix is the column-major array of its n x m transpose,
+// which BLAS can also use without copying by swapping the transpose flags.
+// Vectors are contiguous whatever the storage order. Symmetric matrices have
+// packed storage in both and are copied as full arrays holding the lower
+// triangle.
+
+/**
+ * @return true if the matrix library stores matrices column by column
+ */
+static bool DetectColumnMajor()
+{
+    Matrix probe(2, 2);
+    probe << 1 << 2 << 3 << 4;
+    return probe.Store()[1] == probe(2, 1);
+}
+
+static bool ColumnMajor()
+{
+    static const bool column_major = DetectColumnMajor();
+    return column_major;
+}
+
+/** Copy lower triangle of a symmetric matrix to a column-major array */
+static void ToLowerArray(const SymmetricMatrix &A, vector<double> &a)
+{
+    int n = A.Nrows();
+    a.assign(n * n, 0);
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = j; i < n; i++)
+        {
+            a[i + j * n] = A(i + 1, j + 1);
+        }
+    }
+}
+
+string Backend()
+{
+    return "blas";
+}
+
+ReturnMatrix Multiply(const Matrix &A, const Matrix &B, bool transpose_a)
+{
+    int m = transpose_a ? A.Ncols() : A.Nrows();
+    int k = transpose_a ? A.Nrows() : A.Ncols();
+    int n = B.Ncols();
+    assert(B.Nrows() == k);
+
+    Matrix C(m, n);
+    if (m == 0 || n == 0 || k == 0)
+    {
+        C = 0;
+        C.Release();
+        return C;
+    }
+
+    const double *a = A.Store();
+    const double *b = B.Store();
+    double *c = C.Store();
+    double one = 1, zero = 0;
+    int inc = 1;
+    if (m == 1 && n == 1)
+    {
+        // Row of op(A) and column of B are both contiguous
+        c[0] = ddot_(&k, a, &inc, b, &inc);
+    }
+    else if (n == 1)
+    {
+        // Matrix-vector product. In row-major storage the array holds A' so
+        // the opposite transpose is needed
+        int rows = A.Nrows(), cols = A.Ncols();
+        char trans = transpose_a ? 'T' : 'N';
+        if (!ColumnMajor())
+        {
+            std::swap(rows, cols);
+            trans = transpose_a ? 'N' : 'T';
+        }
+        dgemv_(&trans, &rows, &cols, &one, a, &rows, b, &inc, &zero, c, &inc);
+    }
+    else if (ColumnMajor())
+    {
+        const char transa = transpose_a ? 'T' : 'N';
+        int lda = A.Nrows();
+        dgemm_(&transa, "N", &m, &n, &k, &one, a, &lda, b, &k, &zero, c, &m);
+    }
+    else
+    {
+        // Row-major: compute C' = B' * op(A)' using the transposed views
+        const char transa = transpose_a ? 'T' : 'N';
+        int lda = A.Ncols();
+        dgemm_("N", &transa, &n, &m, &k, &one, b, &n, a, &lda, &zero, c, &n);
+    }
+    C.Release();
+    return C;
+}
+
+ReturnMatrix CrossProduct(const Matrix &J, const DiagonalMatrix &W)
+{
+    assert(W.Nrows() == J.Nrows());
+    int n = J.Nrows();
+    int p = J.Ncols();
+
+    // Weights are normally precisions so non-negative, in which case
+    // J'WJ = S'S where S = sqrt(W)J, which can be done with SYRK
+    bool nonneg = true;
+    for (int r = 1; r <= n; r++)
+    {
+        if (W(r) < 0)
+            nonneg = false;
+    }
+
+    SymmetricMatrix result(p);
+    if (!nonneg)
+    {
+        Matrix WJ = W * J;
+        result << Multiply(J, WJ, true);
+    }
+    else if (n == 0 || p == 0)
+    {
+        result = 0;
+    }
+    else
+    {
+        // Column-major n x p array holding S
+        vector<double> s(n * p);
+        for (int r = 0; r < n; r++)
+        {
+            double w = sqrt(W(r + 1));
+            for (int col = 0; col < p; col++)
+            {
+                s[r + col * n] = w * J(r + 1, col + 1);
+            }
+        }
+
+        vector<double> c(p * p);
+        double one = 1, zero = 0;
+        dsyrk_("L", "T", &p, &n, &one, &s[0], &n, &zero, &c[0], &p);
+        for (int col = 0; col < p; col++)
+        {
+            for (int row = col; row < p; row++)
+            {
+                result(row + 1, col + 1) = c[row + col * p];
+            }
+        }
+    }
+    result.Release();
+    return result;
+}
+
+ReturnMatrix CrossProduct(const Matrix &J, const SymmetricMatrix &X)
+{
+    assert(X.Nrows() == J.Nrows());
+    Matrix Xfull = X;
+    Matrix XJ = Multiply(Xfull, J);
+    SymmetricMatrix result;
+    result << Multiply(J, XJ, true);
+    result.Release();
+    return result;
+}
+
+bool InvertSPD(const SymmetricMatrix &A, SymmetricMatrix &inv)
+{
+    int n = A.Nrows();
+    inv.ReSize(n);
+    if (n == 0)
+        return true;
+
+    vector<double> a;
+    ToLowerArray(A, a);
+    int info = 0;
+    dpotrf_("L", &n, &a[0], &n, &info);
+    if (info != 0)
+        return false;
+    dpotri_("L", &n, &a[0], &n, &info);
+    if (info != 0)
+        return false;
+
+    for (int j = 0; j < n; j++)
+    {
+        for (int i = j; i < n; i++)
+        {
+            inv(i + 1, j + 1) = a[i + j * n];
+        }
+    }
+    return true;
+}
+
+#else
+
+string Backend()
+{
+    return "reference";
+}
+
+ReturnMatrix Multiply(const Matrix &A, const Matrix &B, bool transpose_a)
+{
+    Matrix C;
+    if (transpose_a)
+        C = A.t() * B;
+    else
+        C = A * B;
+    C.Release();
+    return C;
+}
+
+ReturnMatrix CrossProduct(const Matrix &J, const DiagonalMatrix &W)
+{
+    SymmetricMatrix result;
+    result << J.t() * W * J;
+    result.Release();
+    return result;
+}
+
+ReturnMatrix CrossProduct(const Matrix &J, const SymmetricMatrix &X)
+{
+    SymmetricMatrix result;
+    result << J.t() * X * J;
+    result.Release();
+    return result;
+}
+
+bool InvertSPD(const SymmetricMatrix &A, SymmetricMatrix &inv)
+{
+    // Same method as used previously so results are unchanged
+    try
+    {
+        inv = A.i();
+        return true;
+    }
+    catch (Exception)
+    {
+        return false;
+    }
+}
+
+#endif
+}
+}
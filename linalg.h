@@ -0,0 +1,62 @@
+/*  linalg.h - Dense linear algebra operations used in the inference core
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <newmat.h>
+
+#include <string>
+
+namespace fabber
+{
+/**
+ * Dense linear algebra operations used in hot loops of the inference core
+ *
+ * Two implementations are available, selected at build time. The reference
+ * implementation uses NEWMAT directly and gives the same results as the
+ * NEWMAT expressions it replaces. If FABBER_USE_BLAS is defined, BLAS and
+ * LAPACK routines (GEMM, GEMV, DOT, SYRK, POTRF, POTRI) are used instead so
+ * an optimised library such as OpenBLAS can be linked in. Callers do not need
+ * to know which is in use.
+ *
+ * The operations take and return NEWMAT types so they can be dropped in
+ * where the equivalent NEWMAT expression was previously used.
+ */
+namespace linalg
+{
+/**
+ * @return name of the backend in use ("reference" or "blas")
+ */
+std::string Backend();
+
+/**
+ * General matrix product (GEMM, or GEMV/DOT when B has one column)
+ *
+ * @param transpose_a If true, return A' * B rather than A * B
+ */
+NEWMAT::ReturnMatrix Multiply(const NEWMAT::Matrix &A, const NEWMAT::Matrix &B, bool transpose_a = false);
+
+/**
+ * @return J' * W * J as a symmetric matrix, for diagonal W (SYRK)
+ */
+NEWMAT::ReturnMatrix CrossProduct(const NEWMAT::Matrix &J, const NEWMAT::DiagonalMatrix &W);
+
+/**
+ * @return J' * X * J as a symmetric matrix, for symmetric X
+ */
+NEWMAT::ReturnMatrix CrossProduct(const NEWMAT::Matrix &J, const NEWMAT::SymmetricMatrix &X);
+
+/**
+ * Invert a symmetric positive definite matrix
+ *
+ * @return false if the inverse could not be calculated, e.g. because the
+ *         matrix is not positive definite, in which case inv is undefined.
+ *         Callers should fall back to a more general method in this case.
+ *         The reference backend uses NEWMAT's general symmetric inverse so
+ *         does not require positive definiteness
+ */
+bool InvertSPD(const NEWMAT::SymmetricMatrix &A, NEWMAT::SymmetricMatrix &inv);
+}
+}
@@ -7,17 +7,26 @@
 
 #include "dist_mvn.h"
 #include "rundata_newimage.h"
+#include "thread_pool.h"
 
+#include <math.h>
+
+#include <algorithm>
 #include <exception>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace std;
 
 /* Function declarations */
 void Usage(const string &errorString = "");
+int ExtractStats(FabberRunDataNewimage &args, const string &infile, const string &outdir,
+    EasyLog *log, bool verbose);
 
 int main(int argc, char **argv)
 {
@@ -58,6 +67,12 @@ int main(int argc, char **argv)
         // we get to save
         args.Unset("output");
 
+        // Extract several maps from one read of the MVN
+        if (args.HaveKey("stats") || args.GetBool("corr"))
+        {
+            return ExtractStats(args, infile, (outfile == infile) ? "" : outfile, &log, verbose);
+        }
+
         bool ins;
         bool write;
 
@@ -402,6 +417,234 @@ int main(int argc, char **argv)
     return 1;
 }
 
+/** Per-parameter statistics which can be requested with --stats */
+enum Stat
+{
+    STAT_MEAN,
+    STAT_VAR,
+    STAT_STD,
+    STAT_ZSTAT,
+    NUM_STATS
+};
+static const char *STAT_NAMES[NUM_STATS] = { "mean", "var", "std", "zstat" };
+
+/**
+ * Split a comma separated list, ignoring empty items
+ */
+static vector<string> SplitList(const string &list)
+{
+    vector<string> items;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        if (item != "")
+            items.push_back(item);
+    }
+    return items;
+}
+
+/**
+ * Calculates the requested maps for a range of voxels
+ *
+ * Maps are in the order: each statistic for the first parameter, then for the
+ * second parameter, etc, followed by the correlation of each pair of parameters
+ */
+class StatsTask : public ThreadTask
+{
+public:
+    StatsTask(const vector<MVNDist *> &mvns, const vector<int> &params, const vector<int> &stats,
+        bool corr, vector<Matrix> &maps, int start, int end)
+        : m_mvns(&mvns)
+        , m_params(&params)
+        , m_stats(&stats)
+        , m_corr(corr)
+        , m_maps(&maps)
+        , m_start(start)
+        , m_end(end)
+    {
+    }
+
+    void Run()
+    {
+        const vector<int> &params = *m_params;
+        vector<Matrix> &maps = *m_maps;
+        for (int v = m_start; v < m_end; v++)
+        {
+            const MVNDist &mvn = *(*m_mvns)[v];
+            const SymmetricMatrix &cov = mvn.GetCovariance();
+            unsigned int m = 0;
+            for (unsigned int p = 0; p < params.size(); p++)
+            {
+                double mean = mvn.means(params[p]);
+                double var = cov(params[p], params[p]);
+                double sd = (var > 0) ? sqrt(var) : 0;
+                for (unsigned int s = 0; s < m_stats->size(); s++)
+                {
+                    double val = mean;
+                    if ((*m_stats)[s] == STAT_VAR)
+                        val = var;
+                    else if ((*m_stats)[s] == STAT_STD)
+                        val = sd;
+                    else if ((*m_stats)[s] == STAT_ZSTAT)
+                        val = (sd > 0) ? mean / sd : 0;
+                    maps[m++](1, v + 1) = val;
+                }
+            }
+            for (unsigned int p = 0; m_corr && (p < params.size()); p++)
+            {
+                for (unsigned int q = p + 1; q < params.size(); q++)
+                {
+                    double norm = cov(params[p], params[p]) * cov(params[q], params[q]);
+                    maps[m++](1, v + 1) = (norm > 0) ? cov(params[p], params[q]) / sqrt(norm) : 0;
+                }
+            }
+        }
+    }
+
+private:
+    const vector<MVNDist *> *m_mvns;
+    const vector<int> *m_params;
+    const vector<int> *m_stats;
+    bool m_corr;
+    vector<Matrix> *m_maps;
+    int m_start, m_end;
+};
+
+/**
+ * Extract any number of per-parameter maps from a single read of an MVN
+ *
+ * @param outdir Directory to save maps to. If blank, the directory containing the input
+ */
+int ExtractStats(FabberRunDataNewimage &args, const string &infile, const string &outdir,
+    EasyLog *log, bool verbose)
+{
+    vector<int> stats;
+    vector<string> stat_names = SplitList(args.GetStringDefault("stats", ""));
+    for (unsigned int i = 0; i < stat_names.size(); i++)
+    {
+        int s = find(STAT_NAMES, STAT_NAMES + NUM_STATS, stat_names[i]) - STAT_NAMES;
+        if (s == NUM_STATS)
+            throw InvalidOptionValue("stats", stat_names[i], "Must be mean, var, std or zstat");
+        stats.push_back(s);
+    }
+    bool corr = args.GetBool("corr");
+
+    if (verbose)
+        cout << "Read file" << endl;
+    vector<MVNDist *> mvns;
+    MVNDist::Load(mvns, "input", args, log);
+    int nvoxels = mvns.size();
+    int nparams = (nvoxels > 0) ? mvns[0]->GetSize() : 0;
+
+    // Parameter names are only used for naming the output files, so use the
+    // parameter numbers if no list is given. The MVN may also contain noise
+    // parameters which are not in the list
+    vector<string> names;
+    string plistfile = args.GetStringDefault("param-list", "");
+    if (plistfile != "")
+    {
+        ifstream paramFile(plistfile.c_str());
+        if (!paramFile)
+            throw DataNotFound(plistfile, "Could not read parameter list");
+        string name;
+        while (getline(paramFile, name))
+        {
+            if (name != "")
+                names.push_back(name);
+        }
+        if (int(names.size()) > nparams)
+            throw FabberRunDataError("Parameter list " + plistfile + " has " + stringify(names.size())
+                + " parameters but the MVN only has " + stringify(nparams));
+    }
+    else
+    {
+        for (int i = 1; i <= nparams; i++)
+        {
+            names.push_back(stringify(i));
+        }
+    }
+
+    vector<int> params;
+    if (args.HaveKey("params"))
+    {
+        vector<string> requested = SplitList(args.GetString("params"));
+        for (unsigned int i = 0; i < requested.size(); i++)
+        {
+            int p = find(names.begin(), names.end(), requested[i]) - names.begin();
+            if (p == int(names.size()))
+                cout << "Parameter " << requested[i] << " not found - skipping" << endl;
+            else
+                params.push_back(p + 1);
+        }
+    }
+    else
+    {
+        for (unsigned int i = 1; i <= names.size(); i++)
+        {
+            params.push_back(i);
+        }
+    }
+
+    vector<string> map_names;
+    for (unsigned int p = 0; p < params.size(); p++)
+    {
+        for (unsigned int s = 0; s < stats.size(); s++)
+        {
+            map_names.push_back(string(STAT_NAMES[stats[s]]) + "_" + names[params[p] - 1]);
+        }
+    }
+    for (unsigned int p = 0; corr && (p < params.size()); p++)
+    {
+        for (unsigned int q = p + 1; q < params.size(); q++)
+        {
+            map_names.push_back("corr_" + names[params[p] - 1] + "_" + names[params[q] - 1]);
+        }
+    }
+
+    // Voxels are split between threads, each calculating all the maps for its voxels
+    vector<Matrix> maps(map_names.size(), Matrix(1, nvoxels));
+    int nthreads = args.GetIntDefault("threads", ThreadPool::NumProcessors(), 1);
+    nthreads = max(1, min(nthreads, nvoxels));
+    if (verbose)
+        cout << "Calculating " << maps.size() << " maps using " << nthreads << " threads" << endl;
+    int chunk = (nvoxels + nthreads - 1) / nthreads;
+    vector<StatsTask> tasks;
+    for (int start = 0; start < nvoxels; start += chunk)
+    {
+        tasks.push_back(
+            StatsTask(mvns, params, stats, corr, maps, start, min(start + chunk, nvoxels)));
+    }
+    vector<ThreadTask *> task_ptrs;
+    for (unsigned int i = 0; i < tasks.size(); i++)
+    {
+        task_ptrs.push_back(&tasks[i]);
+    }
+    ThreadPool pool(nthreads);
+    pool.Run(task_ptrs);
+
+    string dir = outdir;
+    if (dir == "")
+    {
+        size_t slash = infile.rfind('/');
+        dir = (slash == string::npos) ? "." : infile.substr(0, slash);
+    }
+    for (unsigned int m = 0; m < maps.size(); m++)
+    {
+        if (verbose)
+            cout << "Writing " << map_names[m] << endl;
+        args.SaveVoxelData(dir + "/" + map_names[m], maps[m]);
+    }
+
+    for (unsigned int v = 0; v < mvns.size(); v++)
+    {
+        delete mvns[v];
+    }
+    if (verbose)
+        cout << "Done." << endl;
+    return 0;
+}
+
 void Usage(const string &errorString)
 {
     cout << "\nUsage: mvntool <arguments>\n"
@@ -425,5 +668,18 @@ void Usage(const string &errorString)
          << " --varim=<NIFITfile> : Image to write for variance of parameter." << endl
          << " --val=<mean_value>  : Mean value for parameter to be written." << endl
          << " --var=<variance>    : Variance of parameter to be written." << endl
+         << endl
+         << " Multiple map behaviour (reads the MVN once, --param is not used):" << endl
+         << " --stats=<list> : Comma separated statistics to write for each parameter," << endl
+         << "                  any of mean, var, std, zstat. Saved as <stat>_<param>" << endl
+         << "   [--corr] : Write the correlation of each pair of parameters as corr_<p1>_<p2>"
+         << endl
+         << "   [--param-list=<file>] : Parameter names, e.g. paramnames.txt. Without this"
+         << endl
+         << "                           parameters are named by number" << endl
+         << "   [--params=<list>] : Comma separated parameters to use. Default is all" << endl
+         << "   [--output=<dir>] : Directory for output. Default is the directory of the input"
+         << endl
+         << "   [--threads=<n>] : Number of threads. Default is the number of processors" << endl
          << endl;
 }
@@ -9,6 +9,7 @@
 #include "noisemodel.h"
 
 #include "rundata.h"
+#include "simd_kernels.h"
 #include "tools.h"
 
 #include <miscmaths/miscmaths.h>
@@ -16,7 +17,6 @@
 #include <math.h>
 #include <string>
 
-using MISCMATHS::digamma;
 using namespace std;
 
 NoiseModel *NoiseModel::NewFromName(const string &name)
@@ -48,17 +48,23 @@ double NoiseModel::SetupARD(vector<int> ardindices, const MVNDist &theta, MVNDis
         PriorPrec = thetaPrior.GetPrecisions();
         SymmetricMatrix PostCov = theta.GetCovariance();
 
+        vector<double> b(ardindices.size()), logb(ardindices.size());
         for (size_t i = 0; i < ardindices.size(); i++)
         {
             PriorPrec(ardindices[i], ardindices[i])
                 = 1e-12; // set prior to be initally non-informative
             thetaPrior.means(ardindices[i]) = 0;
 
-            // set the Free energy contribution from ARD term
-            double b = 2 / (theta.means(ardindices[i]) * theta.means(ardindices[i])
-                               + PostCov(ardindices[i], ardindices[i]));
-            Fard += -1.5 * (log(b) + digamma(0.5)) - 0.5 - gammaln(0.5)
-                - 0.5 * log(b); // taking c as 0.5 - which it will be!
+            b[i] = 2 / (theta.means(ardindices[i]) * theta.means(ardindices[i])
+                           + PostCov(ardindices[i], ardindices[i]));
+        }
+
+        // set the Free energy contribution from ARD term
+        fabber::simd::Log(&b[0], &logb[0], int(b.size()));
+        for (size_t i = 0; i < ardindices.size(); i++)
+        {
+            Fard += -1.5 * (logb[i] + DIGAMMA_HALF) - 0.5 - GAMMALN_HALF
+                - 0.5 * logb[i]; // taking c as 0.5 - which it will be!
         }
 
         thetaPrior.SetPrecisions(PriorPrec);
@@ -79,17 +85,23 @@ double NoiseModel::UpdateARD(
         PriorCov = thetaPrior.GetCovariance();
         PostCov = theta.GetCovariance();
 
+        vector<double> b(ardindices.size()), logb(ardindices.size());
         for (size_t i = 0; i < ardindices.size(); i++)
         {
             PriorCov(ardindices[i], ardindices[i])
                 = theta.means(ardindices[i]) * theta.means(ardindices[i])
                 + PostCov(ardindices[i], ardindices[i]);
 
-            // set the Free energy contribution from ARD term
-            double b = 2 / (theta.means(ardindices[i]) * theta.means(ardindices[i])
-                               + PostCov(ardindices[i], ardindices[i]));
-            Fard += -1.5 * (log(b) + digamma(0.5)) - 0.5 - gammaln(0.5)
-                - 0.5 * log(b); // taking c as 0.5 - which it will be!
+            b[i] = 2 / (theta.means(ardindices[i]) * theta.means(ardindices[i])
+                           + PostCov(ardindices[i], ardindices[i]));
+        }
+
+        // set the Free energy contribution from ARD term
+        fabber::simd::Log(&b[0], &logb[0], int(b.size()));
+        for (size_t i = 0; i < ardindices.size(); i++)
+        {
+            Fard += -1.5 * (logb[i] + DIGAMMA_HALF) - 0.5 - GAMMALN_HALF
+                - 0.5 * logb[i]; // taking c as 0.5 - which it will be!
         }
 
         thetaPrior.SetCovariance(PriorCov);
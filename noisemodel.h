@@ -159,6 +159,28 @@ public:
      */
     virtual int NumParams() = 0;
 
+    /**
+     * Set the list of masked time points
+     *
+     * This replaces any masked time points given in the options and can be
+     * used to temporarily exclude time points from the calculations. Noise
+     * models which do not support masked time points should throw an exception.
+     *
+     * @param masked Time points to mask, indexed from 1
+     */
+    virtual void SetMaskedTimepoints(const std::vector<int> &masked)
+    {
+        m_masked_tpoints = masked;
+    }
+
+    /**
+     * Get the current list of masked time points
+     */
+    const std::vector<int> &GetMaskedTimepoints() const
+    {
+        return m_masked_tpoints;
+    }
+
 protected:
     /**
      * List of masked timepoints
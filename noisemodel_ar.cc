@@ -9,7 +9,9 @@
 #include "noisemodel_ar.h"
 
 #include "easylog.h"
+#include "linalg.h"
 #include "rundata.h"
+#include "simd_kernels.h"
 #include "tools.h"
 
 #include <miscmaths/miscmaths.h>
@@ -19,7 +21,6 @@
 
 #define AR1_BANDWIDTH 3
 
-using MISCMATHS::digamma;
 
 /**
  * There seem to be compatibility problems using SymmetricBandMatrix 
@@ -343,6 +344,21 @@ void Ar1cNoiseModel::Initialize(FabberRunData &args)
         throw InvalidOptionValue(
             "mt1", "", "Masked time points are not supported for the AR noise model");
     }
+
+    string cov_type = args.GetStringDefault("posterior-cov", "full");
+    if (cov_type != "full")
+    {
+        throw InvalidOptionValue("posterior-cov", cov_type,
+            "Only full posterior covariance is supported for the AR noise model");
+    }
+}
+
+void Ar1cNoiseModel::SetMaskedTimepoints(const std::vector<int> &masked)
+{
+    if (!masked.empty())
+    {
+        throw FabberRunDataError("Masked time points are not supported for the AR noise model");
+    }
 }
 
 Ar1cParams *Ar1cNoiseModel::NewParams() const
@@ -577,8 +593,7 @@ void Ar1cNoiseModel::UpdateTheta(const NoiseParams &noise, MVNDist &theta,
     //
     // use << instead of = because this is considered a lossy assignment
     // (since NEWMAT isn't smart enough to know J'*X*J is always symmetric)
-    SymmetricMatrix Ltmp;
-    Ltmp << J.t() * X * J;
+    SymmetricMatrix Ltmp = fabber::linalg::CrossProduct(J, X);
     theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
 
     // Error checking
@@ -677,20 +692,38 @@ double Ar1cNoiseModel::CalcFreeEnergy(const NoiseParams &noise, const NoiseParam
     for (int i = 0; i < 10; i++)
         expectedLogPosteriorParts[i] = 0;
 
+    // Special functions of all the phis are evaluated together using the vectorised kernels
+    vector<double> c(nPhis), b(nPhis), cPrior(nPhis), bPrior(nPhis);
+    for (int i = 0; i < nPhis; i++)
+    {
+        c[i] = posterior.phis[i].c;
+        b[i] = posterior.phis[i].b;
+        cPrior[i] = prior.phis[i].c;
+        bPrior[i] = prior.phis[i].b;
+    }
+    vector<double> gammalnC(nPhis), digammaC(nPhis), logB(nPhis);
+    vector<double> gammalnCPrior(nPhis), logBPrior(nPhis);
+    fabber::simd::LogGamma(&c[0], &gammalnC[0], nPhis);
+    fabber::simd::Digamma(&c[0], &digammaC[0], nPhis);
+    fabber::simd::Log(&b[0], &logB[0], nPhis);
+    fabber::simd::LogGamma(&cPrior[0], &gammalnCPrior[0], nPhis);
+    fabber::simd::Log(&bPrior[0], &logBPrior[0], nPhis);
+
     for (int i = 0; i < nPhis; i++)
     {
-        double si = posterior.phis[i].b;
-        double ci = posterior.phis[i].c;
-        double siPrior = prior.phis[i].b;
-        double ciPrior = prior.phis[i].c;
+        double si = b[i];
+        double ci = c[i];
+        double siPrior = bPrior[i];
+        double ciPrior = cPrior[i];
 
-        expectedLogPhiDist += -gammaln(ci) - ci * log(si) - ci + (ci - 1) * (digamma(ci) + log(si));
+        expectedLogPhiDist
+            += -gammalnC[i] - ci * logB[i] - ci + (ci - 1) * (digammaC[i] + logB[i]);
 
         expectedLogPosteriorParts[0]
-            += (digamma(ci) + log(si)) * ((nTimes - 1) * 0.5 + prior.phis[i].c - 1);
+            += (digammaC[i] + logB[i]) * ((nTimes - 1) * 0.5 + ciPrior - 1);
 
         expectedLogPosteriorParts[9]
-            += -2 * gammaln(ciPrior) - 2 * ciPrior * log(siPrior) - si * ci / siPrior;
+            += -2 * gammalnCPrior[i] - 2 * ciPrior * logBPrior[i] - si * ci / siPrior;
     }
 
     expectedLogPosteriorParts[1] = -log(2 * M_PI) * (nTimes - 1 + 0.5 * nAlphas + 0.5 * nTheta);
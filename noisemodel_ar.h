@@ -90,6 +90,9 @@ public:
         const MVNDist &theta, const MVNDist &thetaPrior, const LinearFwdModel &model,
         const NEWMAT::ColumnVector &data) const;
 
+    /** Masked time points are not supported - throws if any are given */
+    virtual void SetMaskedTimepoints(const std::vector<int> &masked);
+
 protected:
     std::string ar1Type;
     int NumAlphas() const; // converts the above string into a number
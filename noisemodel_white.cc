@@ -9,20 +9,87 @@
 #include "noisemodel_white.h"
 
 #include "easylog.h"
+#include "fwdmodel_linear.h"
+#include "linalg.h"
 #include "noisemodel.h"
 #include "rundata.h"
+#include "simd_kernels.h"
+#include "sparse_matrix.h"
 #include "tools.h"
 
 #include <miscmaths/miscmaths.h>
 #include <newmat.h>
 
+#include <algorithm>
 #include <ostream>
 #include <string>
 
-using MISCMATHS::digamma;
+using fabber::MaskRows;
 using namespace NEWMAT;
 using namespace std;
 
+/**
+ * Jacobian of a linearized model with masked time points removed
+ *
+ * If the model provides a sparse Jacobian it is used for the products,
+ * so their cost scales with the number of non-zero entries rather than
+ * the full size of the matrix
+ */
+class MaskedJacobian
+{
+public:
+    MaskedJacobian(const LinearFwdModel &linear, const vector<int> &masked)
+        : m_is_sparse(linear.SparseJacobian() != NULL)
+    {
+        if (m_is_sparse)
+            m_sparse = linear.SparseJacobian()->MaskRows(masked);
+        else
+            m_dense = MaskRows(linear.Jacobian(), masked);
+    }
+
+    int Nrows() const
+    {
+        return m_is_sparse ? m_sparse.Nrows() : m_dense.Nrows();
+    }
+
+    /** @return J * x */
+    ReturnMatrix Times(const ColumnVector &x) const
+    {
+        if (m_is_sparse)
+            return m_sparse.Multiply(x);
+        return fabber::linalg::Multiply(m_dense, x);
+    }
+
+    /** @return J' * y */
+    ReturnMatrix TransposeTimes(const ColumnVector &y) const
+    {
+        if (m_is_sparse)
+            return m_sparse.TransposeMultiply(y);
+        return fabber::linalg::Multiply(m_dense, y, true);
+    }
+
+    /** @return J' * W * J for diagonal W */
+    ReturnMatrix CrossProduct(const DiagonalMatrix &w) const
+    {
+        if (m_is_sparse)
+            return m_sparse.CrossProduct(w);
+        return fabber::linalg::CrossProduct(m_dense, w);
+    }
+
+    /** @return dense form of the Jacobian */
+    const Matrix &Dense() const
+    {
+        if (m_is_sparse && m_dense.Nrows() != m_sparse.Nrows())
+            m_dense = m_sparse.Dense();
+        return m_dense;
+    }
+
+private:
+    bool m_is_sparse;
+    fabber::SparseMatrix m_sparse;
+    mutable Matrix m_dense;
+};
+
 NoiseModel *WhiteNoiseModel::NewInstance()
 {
     return new WhiteNoiseModel();
@@ -99,6 +166,7 @@ void WhiteNoiseModel::Initialize(FabberRunData &args)
     // data.
     phiPattern = args.GetStringDefault("noise-pattern", "1");
     assert(phiPattern.length() > 0);
+    m_logged_pattern_len = 0;
 
     // This is just a quick way to validate the input. It will not
     // set up the pattern correctly as that requires the data length
@@ -114,6 +182,60 @@ void WhiteNoiseModel::Initialize(FabberRunData &args)
     phiprior = convertTo<double>(args.GetStringDefault("prior-noise-stddev", "-1"));
     if (phiprior < 0 && phiprior != -1)
         throw InvalidOptionValue("prior-noise-stddev", stringify(phiprior), "Must be > 0");
+
+    // Structure of the posterior covariance of the model parameters
+    m_cov_type = args.GetStringDefault("posterior-cov", "full");
+    m_cov_blocks.clear();
+    if (m_cov_type == "block")
+    {
+        m_cov_blocks = args.GetIntList("cov-block", 1);
+        if (m_cov_blocks.empty())
+            throw MandatoryOptionMissing("cov-block1");
+    }
+    else if (m_cov_type != "full" && m_cov_type != "diag")
+    {
+        throw InvalidOptionValue("posterior-cov", m_cov_type, "Must be full, diag or block");
+    }
+}
+
+vector<int> WhiteNoiseModel::GetCovBlocks(int nparams) const
+{
+    if (m_cov_type == "diag")
+    {
+        return vector<int>(nparams, 1);
+    }
+    else if (m_cov_type == "block")
+    {
+        int total = 0;
+        for (unsigned int b = 0; b < m_cov_blocks.size(); b++)
+            total += m_cov_blocks[b];
+        if (total != nparams)
+            throw InvalidOptionValue("cov-block<n>", stringify(total),
+                "Block sizes must add up to the number of model parameters ("
+                    + stringify(nparams) + ")");
+        return m_cov_blocks;
+    }
+    else
+    {
+        return vector<int>(1, nparams);
+    }
+}
+
+double WhiteNoiseModel::CovTrace(
+    const SymmetricMatrix &cov, const Matrix &J, const DiagonalMatrix &Q) const
+{
+    vector<int> blocks = GetCovBlocks(cov.Nrows());
+    double trace = 0;
+    int first = 1;
+    for (unsigned int b = 0; b < blocks.size(); b++)
+    {
+        int last = first + blocks[b] - 1;
+        Matrix Jb = J.Columns(first, last);
+        SymmetricMatrix JQJ = fabber::linalg::CrossProduct(Jb, Q);
+        trace += (cov.SymSubMatrix(first, last) * JQJ).Trace();
+        first = last + 1;
+    }
+    return trace;
 }
 
 int WhiteNoiseModel::NumParams()
@@ -163,6 +285,16 @@ void WhiteNoiseModel::HardcodedInitialDists(NoiseParams &priorIn, NoiseParams &p
     }
 }
 
+void WhiteNoiseModel::SetMaskedTimepoints(const std::vector<int> &masked)
+{
+    NoiseModel::SetMaskedTimepoints(masked);
+
+    // Regenerate the Qis for the same data length
+    int dataLen = Qis.empty() ? phiPattern.length() : Qis[0].Nrows();
+    Qis.clear();
+    MakeQis(dataLen);
+}
+
 void WhiteNoiseModel::MakeQis(int dataLen) const
 {
     if (!Qis.empty() && Qis[0].Nrows() == dataLen)
@@ -199,7 +331,13 @@ void WhiteNoiseModel::MakeQis(int dataLen) const
     while ((int)pat.size() < dataLen)
         pat.push_back(pat.at(pat.size() - patternLen));
 
-    LOG << "WhiteNoiseMode::Pattern of phis used is " << pat << endl;
+    // Only log the pattern when the data length changes, not every
+    // time the masked time points change
+    if (dataLen != m_logged_pattern_len)
+    {
+        LOG << "WhiteNoiseMode::Pattern of phis used is " << pat << endl;
+        m_logged_pattern_len = dataLen;
+    }
 
     // Regenerate Qis. This is a vector of
     // diagonal matrices, one for each parameter (Phi).
@@ -214,15 +352,37 @@ void WhiteNoiseModel::MakeQis(int dataLen) const
     // and set the diagonal element in the Qi matrix
     // to 1. So each Qi matrix has elements to define
     // what samples it applies to
+    vector<bool> masked(dataLen, false);
+    for (unsigned int i = 0; i < m_masked_tpoints.size(); i++)
+    {
+        int t = m_masked_tpoints[i];
+        if (t >= 1 && t <= dataLen)
+            masked[t - 1] = true;
+    }
     for (int d = 1; d <= dataLen; d++)
     {
         // Only flag a time point as relevant if it is not masked
-        if (std::find(m_masked_tpoints.begin(), m_masked_tpoints.end(), d)
-            == m_masked_tpoints.end())
+        if (!masked[d - 1])
         {
             Qis.at(pat.at(d - 1) - 1)(d, d) = 1;
         }
     }
+
+    // Same again, but with the masked time points removed
+    int nUnmasked = std::count(masked.begin(), masked.end(), false);
+    m_unmasked_qis.clear();
+    DiagonalMatrix unmaskedZeroes(nUnmasked);
+    unmaskedZeroes = 0.0;
+    m_unmasked_qis.resize(nPhis, unmaskedZeroes);
+    int u = 1;
+    for (int d = 1; d <= dataLen; d++)
+    {
+        if (!masked[d - 1])
+        {
+            m_unmasked_qis.at(pat.at(d - 1) - 1)(u, u) = 1;
+            u++;
+        }
+    }
 }
 
 void WhiteNoiseModel::UpdateNoise(NoiseParams &noise, const NoiseParams &noisePrior,
@@ -231,13 +391,16 @@ void WhiteNoiseModel::UpdateNoise(NoiseParams &noise, const NoiseParams &noisePr
     WhiteParams &posterior = dynamic_cast<WhiteParams &>(noise);
     const WhiteParams &prior = dynamic_cast<const WhiteParams &>(noisePrior);
 
-    const Matrix &J = linear.Jacobian();
-    ColumnVector k = data - linear.Offset() + J * (linear.Centre() - theta.means);
+    // Masked time points are removed so they do not contribute to the cost
+    // of the matrix products
+    MaskedJacobian J(linear, m_masked_tpoints);
+    ColumnVector k = MaskRows(data - linear.Offset(), m_masked_tpoints);
+    k += J.Times(linear.Centre() - theta.means);
 
     // Check there are the same number of Qis in this model and in the
     // prior and posterior parameter sets.
     MakeQis(data.Nrows());
-    const int nPhis = Qis.size();
+    const int nPhis = m_unmasked_qis.size();
     assert(nPhis == posterior.nPhis);
     assert(nPhis == prior.nPhis);
 
@@ -245,20 +408,29 @@ void WhiteNoiseModel::UpdateNoise(NoiseParams &noise, const NoiseParams &noisePr
     for (int i = 1; i <= nPhis; i++)
     {
         // Each Phi matrix is a diagonal matrix of same size size as the
-        // number of time samples in the data
-        const DiagonalMatrix &Qi = Qis[i - 1];
-
-        // This is calculating the 2nd and 3rd terms of RHS of Eq (22) in Chappel et al 2009
-        double tmp = (k.t() * Qi * k).AsScalar() + (theta.GetCovariance() * J.t() * Qi * J).Trace();
-
-        // This is Eq (22) in Chappel et al 2009
-        posterior.phis[i - 1].b = 1 / (tmp * 0.5 + 1 / prior.phis[i - 1].b);
+        // number of unmasked time samples in the data
+        const DiagonalMatrix &Qi = m_unmasked_qis[i - 1];
 
         // Number of data sample points which use this parameter.
         // Should be an integer
         double nTimes = Qi.Trace();
         assert(nTimes == int(nTimes));
 
+        // If all the time points using this parameter are masked
+        // there is nothing to update it with
+        if (nTimes == 0)
+            continue;
+
+        // This is calculating the 2nd and 3rd terms of RHS of Eq (22) in Chappel et al 2009
+        double tmp = fabber::simd::WeightedSumSquares(k.Store(), Qi.Store(), k.Nrows());
+        if (m_cov_type == "full")
+            tmp += (theta.GetCovariance() * J.CrossProduct(Qi)).Trace();
+        else
+            tmp += CovTrace(theta.GetCovariance(), J.Dense(), Qi);
+
+        // This is Eq (22) in Chappel et al 2009
+        posterior.phis[i - 1].b = 1 / (tmp * 0.5 + 1 / prior.phis[i - 1].b);
+
         // This is Eq (21) in Chappel et al 2009
         posterior.phis[i - 1].c = (nTimes - 1) * 0.5 + prior.phis[i - 1].c;
 
@@ -279,20 +451,30 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
     const WhiteParams &noise = dynamic_cast<const WhiteParams &>(noiseIn);
 
     const ColumnVector &ml = linear.Centre();
-    const ColumnVector &gml = linear.Offset();
-    const Matrix &J = linear.Jacobian();
+
+    // Masked time points are removed so they do not contribute to the cost
+    // of the matrix products
+    MaskedJacobian J(linear, m_masked_tpoints);
+    ColumnVector residual = MaskRows(data - linear.Offset(), m_masked_tpoints);
+    ColumnVector y = residual + J.Times(ml);
 
     // Make sure Qis are up-to-date
     MakeQis(data.Nrows());
-    assert(Qis.size() == (unsigned)noise.nPhis);
+    assert(m_unmasked_qis.size() == (unsigned)noise.nPhis);
 
     // Marginalize over phi distributions
     // Qis are diagonal matrices with 1 only where that phi applies.
     // Adding up all the Qis will give you the identity matrix.
-    DiagonalMatrix X(data.Nrows());
+    DiagonalMatrix X(J.Nrows());
     X = 0;
-    for (unsigned i = 1; i <= Qis.size(); i++)
-        X += Qis[i - 1] * noise.phis[i - 1].CalcMean();
+    for (unsigned i = 1; i <= m_unmasked_qis.size(); i++)
+        X += m_unmasked_qis[i - 1] * noise.phis[i - 1].CalcMean();
+
+    if (m_cov_type != "full")
+    {
+        UpdateThetaBlocks(X, J.Dense(), y, ml, theta, thetaPrior, thetaWithoutPrior, LMalpha);
+        return;
+    }
 
     // Update Lambda (model precisions)
     //
@@ -300,8 +482,7 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
     //
     // use << instead of = because this is considered a lossy assignment
     // (since NEWMAT isn't smart enough to know J'*X*J is always symmetric)
-    SymmetricMatrix Ltmp;
-    Ltmp << J.t() * X * J;
+    SymmetricMatrix Ltmp = J.CrossProduct(X);
     theta.SetPrecisions(thetaPrior.GetPrecisions() + Ltmp);
 
     // Error checking
@@ -318,7 +499,8 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
     // Update m (model means)
     //
     // This is the first term of RHS of Eq (20) in Chappel et al (2009)
-    ColumnVector mTmp = J.t() * X * (data - gml + J * ml);
+    ColumnVector Xy = X * y;
+    ColumnVector mTmp = J.TransposeTimes(Xy);
     if (LMalpha <= 0.0)
     {
         // Normal update (NB the LM update reduces to this when alpha=0 strictly)
@@ -338,7 +520,8 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
         precdiag << prec;
 
         // a different (but equivalent) form for the LM update
-        Delta = J.t() * X * (data - gml) + thetaPrior.GetPrecisions() * thetaPrior.means
+        ColumnVector Xresidual = X * residual;
+        Delta = J.TransposeTimes(Xresidual) + thetaPrior.GetPrecisions() * thetaPrior.means
             - thetaPrior.GetPrecisions() * ml;
         try
         {
@@ -362,22 +545,138 @@ void WhiteNoiseModel::UpdateTheta(const NoiseParams &noiseIn, MVNDist &theta,
     }
 }
 
+void WhiteNoiseModel::UpdateThetaBlocks(const DiagonalMatrix &X, const Matrix &J,
+    const ColumnVector &y, const ColumnVector &ml, MVNDist &theta, const MVNDist &thetaPrior,
+    MVNDist *thetaWithoutPrior, float LMalpha) const
+{
+    const int nparams = theta.GetSize();
+    vector<int> blocks = GetCovBlocks(nparams);
+    const SymmetricMatrix &priorPrec = thetaPrior.GetPrecisions();
+    ColumnVector priorTerm = priorPrec * thetaPrior.means;
+
+    // Means are updated one block at a time, starting from the current
+    // values. s is the linear model prediction for the current means and
+    // is kept up to date as each block changes
+    ColumnVector m = theta.means;
+    ColumnVector s = J * m;
+
+    SymmetricMatrix cov(nparams);
+    cov = 0;
+    SymmetricMatrix covWithoutPrior;
+    ColumnVector meansWithoutPrior;
+    if (thetaWithoutPrior != NULL)
+    {
+        covWithoutPrior.ReSize(nparams);
+        covWithoutPrior = 0;
+        meansWithoutPrior.ReSize(nparams);
+    }
+
+    int first = 1;
+    for (unsigned int b = 0; b < blocks.size(); b++)
+    {
+        int last = first + blocks[b] - 1;
+        Matrix Jb = J.Columns(first, last);
+        Matrix XJb = X * Jb;
+        ColumnVector mb = m.Rows(first, last);
+
+        // This block of J'XJ and of the posterior precision
+        SymmetricMatrix Lb;
+        Lb << fabber::linalg::Multiply(Jb, XJb, true);
+        SymmetricMatrix blockPrior = priorPrec.SymSubMatrix(first, last);
+        SymmetricMatrix precb = Lb + blockPrior;
+
+        // As Eq (20) in Chappel et al (2009) but with the terms coupling this
+        // block to the others moved to the RHS using their current means
+        ColumnVector Jty = XJb.t() * y;
+        ColumnVector coupling = XJb.t() * s - Lb * mb + priorPrec.Rows(first, last) * m
+            - blockPrior * mb;
+        ColumnVector rhs = Jty + priorTerm.Rows(first, last) - coupling;
+
+        SymmetricMatrix covb;
+        try
+        {
+            covb = precb.i();
+        }
+        catch (Exception)
+        {
+            WARN_ONCE("WhiteNoiseModel: block precision was singular, adding 1e-10 to diagonal");
+            covb = (precb + IdentityMatrix(blocks[b]) * 1e-10).i();
+        }
+
+        ColumnVector mbNew;
+        if (LMalpha <= 0.0)
+        {
+            mbNew = covb * rhs;
+        }
+        else
+        {
+            // LM update as in Appendix C of Chappel et al (2009), restricted
+            // to this block
+            DiagonalMatrix precdiag;
+            precdiag << precb;
+            try
+            {
+                mbNew = (precb + LMalpha * precdiag).i()
+                    * (rhs + LMalpha * precdiag * ml.Rows(first, last));
+            }
+            catch (Exception)
+            {
+                WARN_ONCE("WhiteNoiseMode: matrix was singular in LM update");
+                mbNew = mb;
+            }
+        }
+
+        s += Jb * (mbNew - mb);
+        m.Rows(first, last) = mbNew;
+        for (int i = 1; i <= blocks[b]; i++)
+        {
+            for (int j = 1; j <= i; j++)
+                cov(first + i - 1, first + j - 1) = covb(i, j);
+        }
+
+        if (thetaWithoutPrior != NULL)
+        {
+            SymmetricMatrix covbWithoutPrior = Lb.i();
+            meansWithoutPrior.Rows(first, last) = covbWithoutPrior * Jty;
+            for (int i = 1; i <= blocks[b]; i++)
+            {
+                for (int j = 1; j <= i; j++)
+                    covWithoutPrior(first + i - 1, first + j - 1) = covbWithoutPrior(i, j);
+            }
+        }
+        first = last + 1;
+    }
+
+    // Setting the covariance directly means the full precision matrix
+    // is never inverted
+    theta.SetCovariance(cov);
+    theta.means = m;
+
+    if (thetaWithoutPrior != NULL)
+    {
+        thetaWithoutPrior->SetSize(nparams);
+        thetaWithoutPrior->SetCovariance(covWithoutPrior);
+        thetaWithoutPrior->means = meansWithoutPrior;
+    }
+}
+
 double WhiteNoiseModel::CalcFreeEnergy(const NoiseParams &noiseIn, const NoiseParams &noisePriorIn,
     const MVNDist &theta, const MVNDist &thetaPrior, const LinearFwdModel &linear,
     const ColumnVector &data) const
 {
-    const int nPhis = Qis.size();
+    MakeQis(data.Nrows());
+    const int nPhis = m_unmasked_qis.size();
     const WhiteParams &noise = dynamic_cast<const WhiteParams &>(noiseIn);
     const WhiteParams &noisePrior = dynamic_cast<const WhiteParams &>(noisePriorIn);
 
-    // Calculate some matrices we will need
-    const Matrix &J = linear.Jacobian();
-    ColumnVector k = data - linear.Offset() + J * (linear.Centre() - theta.means);
+    // Calculate some matrices we will need, excluding masked time points
+    MaskedJacobian J(linear, m_masked_tpoints);
+    ColumnVector k = MaskRows(data - linear.Offset(), m_masked_tpoints);
+    k += J.Times(linear.Centre() - theta.means);
     const SymmetricMatrix &Linv = theta.GetCovariance();
 
     // some values we will need
-    int nTimes = data.Nrows()
-        - m_masked_tpoints.size(); //*NB assume that each row is an individual time point
+    int nTimes = J.Nrows(); //*NB assume that each row is an individual time point
     int nTheta = theta.means.Nrows();
 
     // The following is based on noisemodel_ar::CalcFreeEnergy, modified to remove ar parts - MAC
@@ -385,35 +684,82 @@ double WhiteNoiseModel::CalcFreeEnergy(const NoiseParams &noiseIn, const NoisePa
     // are noted
 
     // calcualte individual parts of the free energy
+    double logDetPrec;
+    if (m_cov_type == "full")
+    {
+        logDetPrec = theta.GetPrecisions().LogDeterminant().LogValue();
+    }
+    else
+    {
+        // Covariance is block diagonal so avoid inverting it
+        vector<int> blocks = GetCovBlocks(nTheta);
+        logDetPrec = 0;
+        int first = 1;
+        for (unsigned int b = 0; b < blocks.size(); b++)
+        {
+            int last = first + blocks[b] - 1;
+            logDetPrec -= Linv.SymSubMatrix(first, last).LogDeterminant().LogValue();
+            first = last + 1;
+        }
+    }
+
     double expectedLogThetaDist = // bits arising from the factorised posterior for theta
-        +0.5 * theta.GetPrecisions().LogDeterminant().LogValue()
-        - 0.5 * nTheta * (log(2 * M_PI) + 1);
+        +0.5 * logDetPrec - 0.5 * nTheta * (log(2 * M_PI) + 1);
 
     double expectedLogPhiDist = 0; // bits arising fromt he factorised posterior for phi
     vector<double> expectedLogPosteriorParts(10); // bits arising from the likelihood
     for (int i = 0; i < 10; i++)
         expectedLogPosteriorParts[i] = 0;
 
+    // Special functions of all the phis are evaluated together using the vectorised kernels
+    vector<double> c(nPhis), b(nPhis), cPrior(nPhis), bPrior(nPhis);
     for (int i = 0; i < nPhis; i++)
     {
-        double si = noise.phis[i].b;
-        double ci = noise.phis[i].c;
-        double siPrior = noisePrior.phis[i].b;
-        double ciPrior = noisePrior.phis[i].c;
+        c[i] = noise.phis[i].c;
+        b[i] = noise.phis[i].b;
+        cPrior[i] = noisePrior.phis[i].c;
+        bPrior[i] = noisePrior.phis[i].b;
+    }
+    vector<double> gammalnC(nPhis), digammaC(nPhis), logB(nPhis);
+    vector<double> gammalnCPrior(nPhis), logBPrior(nPhis);
+    fabber::simd::LogGamma(&c[0], &gammalnC[0], nPhis);
+    fabber::simd::Digamma(&c[0], &digammaC[0], nPhis);
+    fabber::simd::Log(&b[0], &logB[0], nPhis);
+    fabber::simd::LogGamma(&cPrior[0], &gammalnCPrior[0], nPhis);
+    fabber::simd::Log(&bPrior[0], &logBPrior[0], nPhis);
+
+    for (int i = 0; i < nPhis; i++)
+    {
+        double si = b[i];
+        double ci = c[i];
+        double siPrior = bPrior[i];
+        double ciPrior = cPrior[i];
 
-        expectedLogPhiDist += -gammaln(ci) - ci * log(si) - ci + (ci - 1) * (digamma(ci) + log(si));
+        expectedLogPhiDist
+            += -gammalnC[i] - ci * logB[i] - ci + (ci - 1) * (digammaC[i] + logB[i]);
 
-        expectedLogPosteriorParts[0] += (digamma(ci) + log(si))
-            * ((Qis[i].Trace()) * 0.5 + ciPrior - 1); // nTimes using phi_{i+1} = Qis[i].Trace()
+        // nTimes using phi_{i+1} = Qis[i].Trace()
+        expectedLogPosteriorParts[0]
+            += (digammaC[i] + logB[i]) * ((m_unmasked_qis[i].Trace()) * 0.5 + ciPrior - 1);
 
         expectedLogPosteriorParts[9]
-            += -gammaln(ciPrior) - ciPrior * log(siPrior) - si * ci / siPrior;
+            += -gammalnCPrior[i] - ciPrior * logBPrior[i] - si * ci / siPrior;
     }
 
     expectedLogPosteriorParts[1] = 0; //*NB not required
 
-    expectedLogPosteriorParts[2]
-        = -0.5 * (k.t() * k).AsScalar() - 0.5 * (J.t() * J * Linv).Trace(); //*NB remove Qsum
+    DiagonalMatrix I(nTimes);
+    I = 1;
+    if (m_cov_type == "full")
+    {
+        expectedLogPosteriorParts[2] = -0.5 * fabber::simd::Dot(k.Store(), k.Store(), k.Nrows())
+            - 0.5 * (J.CrossProduct(I) * Linv).Trace(); //*NB remove Qsum
+    }
+    else
+    {
+        expectedLogPosteriorParts[2]
+            = -0.5 * fabber::simd::Dot(k.Store(), k.Store(), k.Nrows()) - 0.5 * CovTrace(Linv, J.Dense(), I);
+    }
 
     expectedLogPosteriorParts[3] = +0.5 * thetaPrior.GetPrecisions().LogDeterminant().LogValue()
         - 0.5 * nTimes * log(2 * M_PI) - 0.5 * nTheta * log(2 * M_PI);
@@ -423,7 +769,24 @@ double WhiteNoiseModel::CalcFreeEnergy(const NoiseParams &noiseIn, const NoisePa
               * (theta.means - thetaPrior.means))
               .AsScalar();
 
-    expectedLogPosteriorParts[5] = -0.5 * (Linv * thetaPrior.GetPrecisions()).Trace();
+    if (m_cov_type == "full")
+    {
+        expectedLogPosteriorParts[5] = -0.5 * (Linv * thetaPrior.GetPrecisions()).Trace();
+    }
+    else
+    {
+        // Only the diagonal blocks of the prior precision contribute to the trace
+        vector<int> blocks = GetCovBlocks(nTheta);
+        const SymmetricMatrix &priorPrec = thetaPrior.GetPrecisions();
+        int first = 1;
+        for (unsigned int b = 0; b < blocks.size(); b++)
+        {
+            int last = first + blocks[b] - 1;
+            expectedLogPosteriorParts[5] -= 0.5
+                * (Linv.SymSubMatrix(first, last) * priorPrec.SymSubMatrix(first, last)).Trace();
+            first = last + 1;
+        }
+    }
 
     expectedLogPosteriorParts[6] = 0; //*NB not required
 
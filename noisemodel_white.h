@@ -73,6 +73,8 @@ public:
         const MVNDist &theta, const MVNDist &thetaPrior, const LinearFwdModel &model,
         const NEWMAT::ColumnVector &data) const;
 
+    virtual void SetMaskedTimepoints(const std::vector<int> &masked);
+
 protected:
     /** Pattern of noise distributions as they apply to points in time series */
     std::string phiPattern;
@@ -90,6 +92,52 @@ protected:
      */
     mutable std::vector<NEWMAT::DiagonalMatrix> Qis;
 
+    /**
+     * As Qis but with masked time points removed entirely
+     *
+     * These are used with the Jacobian and residuals after masked rows
+     * have been removed, so masked time points do not contribute to the
+     * cost of the matrix products.
+     */
+    mutable std::vector<NEWMAT::DiagonalMatrix> m_unmasked_qis;
+
+    /**
+     * Structure of the model parameter posterior covariance - full, diag or block
+     *
+     * In diag and block mode the posterior is factorised over groups of parameters
+     * (mean field) so the cost of the theta update is linear in the number of groups
+     * rather than requiring inversion of the full precision matrix
+     */
+    std::string m_cov_type;
+
+    /** Sizes of consecutive groups of parameters which share a covariance (block mode) */
+    std::vector<int> m_cov_blocks;
+
+    /** Get the sizes of the covariance groups for a given number of parameters */
+    std::vector<int> GetCovBlocks(int nparams) const;
+
+    /**
+     * Mean-field update of the model parameters where the posterior covariance
+     * is block diagonal
+     *
+     * The means of each block are updated in turn, given the current means of
+     * the other blocks, so only the blocks of the precision matrix are inverted
+     */
+    void UpdateThetaBlocks(const NEWMAT::DiagonalMatrix &X, const NEWMAT::Matrix &J,
+        const NEWMAT::ColumnVector &y, const NEWMAT::ColumnVector &ml, MVNDist &theta,
+        const MVNDist &thetaPrior, MVNDist *thetaWithoutPrior, float LMalpha) const;
+
+    /**
+     * Calculate the trace of (Cov * J' * Q * J), using only the diagonal blocks
+     * of the covariance when it is block diagonal
+     */
+    double CovTrace(const NEWMAT::SymmetricMatrix &cov, const NEWMAT::Matrix &J,
+        const NEWMAT::DiagonalMatrix &Q) const;
+
+    /** Data length for which the phi pattern was last logged */
+    mutable int m_logged_pattern_len;
+
     /** Create Qis vector */
     void MakeQis(int dataLen) const;
+
 };
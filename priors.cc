@@ -12,6 +12,7 @@
 
 #include "dist_mvn.h"
 #include "rundata.h"
+#include "simd_kernels.h"
 #include "tools.h"
 
 #include <miscmaths/miscmaths.h>
@@ -24,7 +25,6 @@
 
 using namespace std;
 using namespace NEWMAT;
-using MISCMATHS::digamma;
 
 std::ostream &operator<<(std::ostream &out, const Prior &prior)
 {
@@ -176,8 +176,9 @@ double ARDPrior::ApplyToMVN(MVNDist *prior, const RunContext &ctx)
 
     // Calculate the free energy contribution from ARD term
     // (Chappel et al 2009, end of Appendix D)
-    double b = 2 / new_cov;
-    return -1.5 * (log(b) + digamma(0.5)) - 0.5 - gammaln(0.5) - 0.5 * log(b);
+    double b = 2 / new_cov, logb;
+    fabber::simd::Log(&b, &logb, 1);
+    return -1.5 * (logb + DIGAMMA_HALF) - 0.5 - GAMMALN_HALF - 0.5 * logb;
 }
 
 SpatialPrior::SpatialPrior(const Parameter &p, FabberRunData &rundata)
@@ -124,6 +124,21 @@ public:
     virtual void DumpInfo(std::ostream &out) const;
     virtual double ApplyToMVN(MVNDist *prior, const RunContext &ctx);
 
+    /** @return current spatial precision */
+    double GetaK() const
+    {
+        return m_aK;
+    }
+
+    /**
+     * Set the spatial precision, e.g. from a previous fit. It will be used
+     * until it is next recalculated
+     */
+    void SetaK(double aK)
+    {
+        m_aK = aK;
+    }
+
 protected:
     double CalculateaK(const RunContext &ctx);
     double m_aK;
@@ -0,0 +1,348 @@
+/*  progressive_output.cc - Output images written voxel by voxel during a run
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "progressive_output.h"
+
+#include "rundata.h"
+
+#include <newmat.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace NEWMAT;
+using namespace std;
+
+namespace fabber
+{
+/** Size of the NIFTI-1 header */
+static const int NIFTI_HEADER_SIZE = 348;
+
+/** Header, followed by the 4 byte extension flag */
+static const int NIFTI_VOX_OFFSET = 352;
+
+static const int16_t NIFTI_TYPE_FLOAT32 = 16;
+
+/** Units of mm and seconds */
+static const char NIFTI_UNITS = 2 | 8;
+
+NiftiGeometry::NiftiGeometry()
+    : xform_code(0)
+    , xform(IdentityMatrix(4))
+{
+    for (int i = 0; i < 3; i++)
+    {
+        dims[i] = 1;
+        pixdims[i] = 1;
+    }
+}
+
+template <class T> static void Put(char *header, int offset, T val)
+{
+    memcpy(header + offset, &val, sizeof(T));
+}
+
+/**
+ * Quaternion representation of the rotation part of a transform, as used
+ * by the NIFTI qform
+ *
+ * This is the same method as nifti_mat44_to_quatern in niftiio, which is
+ * not used so that the core library does not depend on it. The columns
+ * are normalised and the nearest orthogonal matrix is found by polar
+ * decomposition, so shears and scalings are discarded.
+ *
+ * @param quatern On exit b, c and d parameters of the quaternion
+ * @param qfac On exit -1 if the transform includes a reflection, otherwise 1
+ */
+static void MatrixToQuatern(const Matrix &xform, float quatern[3], float &qfac)
+{
+    Matrix r = xform.SubMatrix(1, 3, 1, 3);
+    for (int c = 1; c <= 3; c++)
+    {
+        double norm = sqrt(r.Column(c).SumSquare());
+        for (int row = 1; row <= 3; row++)
+        {
+            if (norm == 0)
+                r(row, c) = (row == c) ? 1 : 0;
+            else
+                r(row, c) /= norm;
+        }
+    }
+
+    // Polar decomposition by iterating r = (r + r^-T) / 2
+    for (int it = 0; it < 100; it++)
+    {
+        Matrix next = (r + r.i().t()) * 0.5;
+        double change = (next - r).MaximumAbsoluteValue();
+        r = next;
+        if (change < 1e-9)
+            break;
+    }
+
+    if (r.Determinant() > 0)
+    {
+        qfac = 1;
+    }
+    else
+    {
+        qfac = -1;
+        for (int row = 1; row <= 3; row++)
+        {
+            r(row, 3) = -r(row, 3);
+        }
+    }
+
+    double a = r(1, 1) + r(2, 2) + r(3, 3) + 1, b, c, d;
+    if (a > 0.5)
+    {
+        a = 0.5 * sqrt(a);
+        b = 0.25 * (r(3, 2) - r(2, 3)) / a;
+        c = 0.25 * (r(1, 3) - r(3, 1)) / a;
+        d = 0.25 * (r(2, 1) - r(1, 2)) / a;
+    }
+    else
+    {
+        double xd = 1 + r(1, 1) - (r(2, 2) + r(3, 3));
+        double yd = 1 + r(2, 2) - (r(1, 1) + r(3, 3));
+        double zd = 1 + r(3, 3) - (r(1, 1) + r(2, 2));
+        if (xd > 1)
+        {
+            b = 0.5 * sqrt(xd);
+            c = 0.25 * (r(1, 2) + r(2, 1)) / b;
+            d = 0.25 * (r(1, 3) + r(3, 1)) / b;
+            a = 0.25 * (r(3, 2) - r(2, 3)) / b;
+        }
+        else if (yd > 1)
+        {
+            c = 0.5 * sqrt(yd);
+            b = 0.25 * (r(1, 2) + r(2, 1)) / c;
+            d = 0.25 * (r(2, 3) + r(3, 2)) / c;
+            a = 0.25 * (r(1, 3) - r(3, 1)) / c;
+        }
+        else
+        {
+            d = 0.5 * sqrt(zd);
+            b = 0.25 * (r(1, 3) + r(3, 1)) / d;
+            c = 0.25 * (r(2, 3) + r(3, 2)) / d;
+            a = 0.25 * (r(2, 1) - r(1, 2)) / d;
+        }
+        if (a < 0)
+        {
+            b = -b;
+            c = -c;
+            d = -d;
+        }
+    }
+    quatern[0] = b;
+    quatern[1] = c;
+    quatern[2] = d;
+}
+
+/**
+ * Fill in a NIFTI-1 header. Fields which are not set are zero
+ */
+static void MakeNiftiHeader(char *header, const NiftiGeometry &geom, int nvols, int intent_code)
+{
+    memset(header, 0, NIFTI_VOX_OFFSET);
+    Put<int32_t>(header, 0, NIFTI_HEADER_SIZE);
+    header[38] = 'r';
+
+    Put<int16_t>(header, 40, nvols > 1 ? 4 : 3);
+    for (int d = 0; d < 3; d++)
+    {
+        Put<int16_t>(header, 42 + 2 * d, geom.dims[d]);
+    }
+    Put<int16_t>(header, 48, nvols);
+    Put<int16_t>(header, 50, 1);
+    Put<int16_t>(header, 52, 1);
+    Put<int16_t>(header, 54, 1);
+
+    Put<int16_t>(header, 68, intent_code);
+    Put<int16_t>(header, 70, NIFTI_TYPE_FLOAT32);
+    Put<int16_t>(header, 72, 32);
+    float quatern[3] = { 0, 0, 0 }, qfac = 1;
+    if (geom.xform_code > 0)
+        MatrixToQuatern(geom.xform, quatern, qfac);
+    Put<float>(header, 76, qfac);
+    for (int d = 0; d < 3; d++)
+    {
+        Put<float>(header, 80 + 4 * d, geom.pixdims[d]);
+    }
+    Put<float>(header, 92, 1); // TR
+    Put<float>(header, 108, NIFTI_VOX_OFFSET);
+    Put<float>(header, 112, 1); // scl_slope
+    header[123] = NIFTI_UNITS;
+
+    strncpy(header + 148, "Fabber progressive output", 79);
+
+    // The transform is written as both the qform and the sform, as FSL does
+    // when saving an image, so it is used by software which reads either
+    Put<int16_t>(header, 252, geom.xform_code);
+    Put<int16_t>(header, 254, geom.xform_code);
+    for (int d = 0; d < 3; d++)
+    {
+        Put<float>(header, 256 + 4 * d, quatern[d]);
+        Put<float>(header, 268 + 4 * d, geom.xform(d + 1, 4));
+    }
+    for (int r = 0; r < 3; r++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            Put<float>(header, 280 + 16 * r + 4 * c, geom.xform(r + 1, c + 1));
+        }
+    }
+    memcpy(header + 344, "n+1\0", 4);
+}
+
+MappedNiftiOutput::MappedNiftiOutput(const string &filename, const NiftiGeometry &geom,
+    int nvols, const vector<int> &offsets, bool compress, int intent_code)
+    : m_filename(filename + ".nii")
+    , m_nvols(nvols)
+    , m_offsets(offsets)
+    , m_compress(compress)
+    , m_volsize(long(geom.dims[0]) * geom.dims[1] * geom.dims[2])
+    , m_size(NIFTI_VOX_OFFSET + size_t(m_volsize) * nvols * sizeof(float))
+    , m_map(NULL)
+    , m_min(0)
+    , m_max(0)
+{
+    for (unsigned int v = 0; v < offsets.size(); v++)
+    {
+        if ((offsets[v] < 0) || (offsets[v] >= m_volsize))
+            throw FabberInternalError("Voxel outside image for progressive output");
+    }
+
+#ifndef _WIN32
+    int fd = open(m_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        throw FabberRunDataError("Could not open file for writing: " + m_filename);
+    }
+    // Extending the file fills it with zeros, which is what unwritten voxels should be
+    if (ftruncate(fd, m_size) != 0)
+    {
+        close(fd);
+        throw FabberRunDataError("Could not set size of file: " + m_filename);
+    }
+    void *map = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        throw FabberRunDataError("Could not map file: " + m_filename);
+    }
+    m_map = static_cast<char *>(map);
+    MakeNiftiHeader(m_map, geom, nvols, intent_code);
+#else
+    throw FabberRunDataError("Progressive output is not supported on this platform");
+#endif
+}
+
+MappedNiftiOutput::~MappedNiftiOutput()
+{
+    Unmap();
+}
+
+void MappedNiftiOutput::Unmap()
+{
+#ifndef _WIN32
+    if (m_map)
+    {
+        munmap(m_map, m_size);
+        m_map = NULL;
+    }
+#endif
+}
+
+void MappedNiftiOutput::SetVoxel(int v, const ColumnVector &values)
+{
+    if (!m_map)
+        throw FabberInternalError("Progressive output has been closed: " + m_filename);
+    if ((v < 1) || (v > int(m_offsets.size())) || (values.Nrows() != m_nvols))
+        throw FabberInternalError("Invalid voxel data for progressive output: " + m_filename);
+
+    float *data = reinterpret_cast<float *>(m_map + NIFTI_VOX_OFFSET);
+    for (int t = 0; t < m_nvols; t++)
+    {
+        float val = values(t + 1);
+        data[m_offsets[v - 1] + t * m_volsize] = val;
+        if (val < m_min)
+            m_min = val;
+        if (val > m_max)
+            m_max = val;
+    }
+}
+
+void MappedNiftiOutput::SetVolume(int t, const float *values)
+{
+    if (!m_map)
+        throw FabberInternalError("Progressive output has been closed: " + m_filename);
+    if ((t < 1) || (t > m_nvols))
+        throw FabberInternalError("Invalid volume for progressive output: " + m_filename);
+
+    float *data = reinterpret_cast<float *>(m_map + NIFTI_VOX_OFFSET) + (t - 1) * m_volsize;
+    for (unsigned int v = 0; v < m_offsets.size(); v++)
+    {
+        data[m_offsets[v]] = values[v];
+        if (values[v] < m_min)
+            m_min = values[v];
+        if (values[v] > m_max)
+            m_max = values[v];
+    }
+}
+
+void MappedNiftiOutput::Close()
+{
+    if (!m_map)
+        return;
+
+    // cal_max and cal_min
+    Put<float>(m_map, 124, m_max);
+    Put<float>(m_map, 128, m_min);
+
+#ifndef _WIN32
+    if (m_compress)
+    {
+        string gzname = m_filename + ".gz";
+        gzFile gz = gzopen(gzname.c_str(), "wb");
+        bool ok = (gz != NULL);
+        size_t done = 0;
+        while (ok && (done < m_size))
+        {
+            // gzwrite takes an unsigned int so write large files in chunks
+            unsigned int chunk = (unsigned int)min(m_size - done, size_t(1 << 30));
+            ok = (gzwrite(gz, m_map + done, chunk) == int(chunk));
+            done += chunk;
+        }
+        if (gz && (gzclose(gz) != Z_OK))
+            ok = false;
+        if (!ok)
+        {
+            Unmap();
+            throw FabberRunDataError("Could not write compressed file: " + gzname);
+        }
+        Unmap();
+        remove(m_filename.c_str());
+        m_filename = gzname;
+        return;
+    }
+    msync(m_map, m_size, MS_SYNC);
+#endif
+    Unmap();
+}
+}
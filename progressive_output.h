@@ -0,0 +1,124 @@
+/*  progressive_output.h - Output images written voxel by voxel during a run
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <newmat.h>
+
+#include <string>
+#include <vector>
+
+namespace fabber
+{
+/**
+ * Output image which is written voxel by voxel as results become available
+ *
+ * Created by FabberRunData::CreateProgressiveOutput. Voxels which have not
+ * been written are zero.
+ */
+class ProgressiveOutput
+{
+public:
+    virtual ~ProgressiveOutput()
+    {
+    }
+
+    /**
+     * Write the values for a voxel
+     *
+     * @param v Voxel index, starting at 1, in the same order as the voxel data
+     * @param values One value for each volume
+     */
+    virtual void SetVoxel(int v, const NEWMAT::ColumnVector &values) = 0;
+
+    /** Finish writing the output. No more voxels can be written */
+    virtual void Close() = 0;
+};
+
+/**
+ * Position and orientation of the image grid for a NIFTI output
+ */
+struct NiftiGeometry
+{
+    NiftiGeometry();
+
+    /** Number of voxels in x, y and z */
+    int dims[3];
+
+    /** Voxel size in mm */
+    float pixdims[3];
+
+    /** NIFTI transform code of xform, 0 if there is no transform */
+    int xform_code;
+
+    /** 4x4 transformation from voxel indices to mm */
+    NEWMAT::Matrix xform;
+};
+
+/**
+ * Uncompressed NIFTI-1 image of 32 bit floats written through a memory map
+ *
+ * The file is created at its full size when the output is created, so other
+ * programs can open it while the run is in progress and see the voxels
+ * written so far. Only the pages containing written voxels use memory.
+ * Not supported on Windows.
+ */
+class MappedNiftiOutput : public ProgressiveOutput
+{
+public:
+    /**
+     * @param filename File name, without extension. ``.nii`` is added
+     * @param geom Image grid
+     * @param nvols Number of volumes
+     * @param offsets Offset of each voxel within a volume, i.e.
+     *                x + nx * (y + ny * z) for voxel indices x, y, z
+     * @param compress If true, the file is replaced with a gzipped copy
+     *                 (``.nii.gz``) when it is closed
+     * @param intent_code NIFTI intent code, e.g. 1005 (symmetric matrix) for MVN data
+     */
+    MappedNiftiOutput(const std::string &filename, const NiftiGeometry &geom, int nvols,
+        const std::vector<int> &offsets, bool compress, int intent_code = 0);
+
+    /** Unmaps the file. It is not compressed unless Close was called */
+    virtual ~MappedNiftiOutput();
+
+    virtual void SetVoxel(int v, const NEWMAT::ColumnVector &values);
+
+    /**
+     * Write one volume for all voxels at once
+     *
+     * @param t Volume index, starting at 1
+     * @param values One value for each voxel, in the same order as the offsets
+     */
+    void SetVolume(int t, const float *values);
+
+    /** Set the display range from the values written, and compress if required */
+    virtual void Close();
+
+    /** @return name of the file, which is the compressed file once closed with compression */
+    const std::string &GetFilename() const
+    {
+        return m_filename;
+    }
+
+private:
+    void Unmap();
+
+    std::string m_filename;
+    int m_nvols;
+    std::vector<int> m_offsets;
+    bool m_compress;
+
+    /** Number of voxels in a volume */
+    long m_volsize;
+
+    /** Size of the mapped file in bytes */
+    size_t m_size;
+    char *m_map;
+
+    /** Range of the values written so far */
+    float m_min, m_max;
+};
+}
@@ -517,6 +517,7 @@ class Fabber:
         self.errbuf = create_string_buffer(255)
         self.outbuf = create_string_buffer(1000000)
         self.progress_cb_type = CFUNCTYPE(None, c_int, c_int)
+        self.log_cb_type = CFUNCTYPE(None, c_int, c_char_p)
         self._init_clib()
 
     def get_methods(self):
@@ -631,13 +632,16 @@ class Fabber:
 
         return self.run_with_data(rundata, data, mask, progress_cb)
 
-    def run_with_data(self, rundata, data, mask=None, progress_cb=None):
+    def run_with_data(self, rundata, data, mask=None, progress_cb=None, log_cb=None):
         """
         Run fabber
 
         :param data: Dictionary of data: string key, Numpy array value
         :param mask: Mask as Numpy array, or None if no mask
         :param progress_cb: Callable which will be called periodically during processing
+        :param log_cb: Callable which will be called with the level and text of each log line
+                       while the run is in progress. If given, the log is not stored in the
+                       returned FabberRun
         :return: On success, a FabberRun instance
         """
         if not data.has_key("data"):
@@ -649,7 +653,60 @@ class Fabber:
         # Make suitable for passing to int* c function
         mask = np.ascontiguousarray(mask.flatten(order='F'), dtype=np.int32)
 
-        self._init_clib()
+        models = self._get_model_list(rundata)
+        if len(models) > 1:
+            # Model comparison run. Output from each model is prefixed with the
+            # model name, so find the output of each model in turn
+            model_keys = ["model%i" % (m + 1) for m in range(len(models))]
+            output_items = ["model_index"] + ["model_prob_" + model for model in models]
+            for model in models:
+                model_rundata = dict([(k, v) for k, v in rundata.items() if k not in model_keys])
+                model_rundata["model"] = model
+                self._init_clib()
+                self._set_opts(model_rundata)
+                output_items += [model + "_" + item for item in self._get_output_items(rundata)]
+            self._init_clib()
+            self._set_opts(rundata)
+        else:
+            self._init_clib()
+            self._set_opts(rundata)
+            output_items = self._get_output_items(rundata)
+
+        retdata, log = {}, ""
+        self._trycall(self.clib.fabber_set_extent, self.handle, s[0], s[1], s[2], mask, self.errbuf)
+        for key, item in data.items():
+            if len(item.shape) == 3:
+                size = 1
+            else:
+                size = item.shape[3]
+            item = np.ascontiguousarray(item.flatten(order='F'), dtype=np.float32)
+            self._trycall(self.clib.fabber_set_data, self.handle, key, size, item, self.errbuf)
+
+        progress_cb_func = self.progress_cb_type(0)
+        if progress_cb is not None:
+            progress_cb_func = self.progress_cb_type(progress_cb)
+
+        if log_cb is not None:
+            log_cb_func = self.log_cb_type(log_cb)
+            self._trycall(self.clib.fabber_dorun_stream, self.handle, 0, log_cb_func, self.errbuf, progress_cb_func)
+        else:
+            self._trycall(self.clib.fabber_dorun, self.handle, len(self.outbuf), self.outbuf, self.errbuf, progress_cb_func)
+            log = self.outbuf.value
+        for key in output_items:
+            size = self._trycall(self.clib.fabber_get_data_size, self.handle, key, self.errbuf)
+
+            arr = np.ascontiguousarray(np.empty(nv * size, dtype=np.float32))
+            self._trycall(self.clib.fabber_get_data, self.handle, key, arr, self.errbuf)
+            if size > 1:
+                arr = arr.reshape([s[0], s[1], s[2], size], order='F')
+            else:
+                arr = arr.reshape([s[0], s[1], s[2]], order='F')
+            retdata[key] = arr
+
+        return FabberRun(retdata, log)
+
+    def _set_opts(self, rundata):
+        """ Set options in the current Fabber context """
         for key, value in rundata.items():
             # Fabber interprets boolean values as 'option given=True, not given=False. Option value must be blank
             if type(value) == bool:
@@ -658,6 +715,18 @@ class Fabber:
                 else:
                     continue
             self._trycall(self.clib.fabber_set_opt, self.handle, str(key), str(value), self.errbuf)
+
+    def _get_model_list(self, rundata):
+        """ Models to be fitted - more than one for a model comparison run using model1, model2, ... """
+        if "model" in rundata:
+            return [rundata["model"]]
+        models = []
+        while "model%i" % (len(models) + 1) in rundata:
+            models.append(rundata["model%i" % (len(models) + 1)])
+        return models
+
+    def _get_output_items(self, rundata):
+        """ Names of the outputs of a run of the model whose options have been set """
         self._trycall(self.clib.fabber_get_model_params, self.handle, len(self.outbuf), self.outbuf, self.errbuf)
         params = self.outbuf.value.splitlines()
 
@@ -682,35 +751,7 @@ class Fabber:
             output_items.append("finalMVN")
         if "save-model-extras" in rundata:
             output_items += self.get_model_outputs()
-
-        retdata, log = {}, ""
-        self._trycall(self.clib.fabber_set_extent, self.handle, s[0], s[1], s[2], mask, self.errbuf)
-        for key, item in data.items():
-            if len(item.shape) == 3:
-                size = 1
-            else:
-                size = item.shape[3]
-            item = np.ascontiguousarray(item.flatten(order='F'), dtype=np.float32)
-            self._trycall(self.clib.fabber_set_data, self.handle, key, size, item, self.errbuf)
-
-        progress_cb_func = self.progress_cb_type(0)
-        if progress_cb is not None:
-            progress_cb_func = self.progress_cb_type(progress_cb)
-
-        self._trycall(self.clib.fabber_dorun, self.handle, len(self.outbuf), self.outbuf, self.errbuf, progress_cb_func)
-        log = self.outbuf.value
-        for key in output_items:
-            size = self._trycall(self.clib.fabber_get_data_size, self.handle, key, self.errbuf)
-
-            arr = np.ascontiguousarray(np.empty(nv * size, dtype=np.float32))
-            self._trycall(self.clib.fabber_get_data, self.handle, key, arr, self.errbuf)
-            if size > 1:
-                arr = arr.reshape([s[0], s[1], s[2], size], order='F')
-            else:
-                arr = arr.reshape([s[0], s[1], s[2]], order='F')
-            retdata[key] = arr
-
-        return FabberRun(retdata, log)
+        return output_items
 
     def __del__(self):
         self._destroy_handle()
@@ -744,6 +785,7 @@ class Fabber:
             self.clib.fabber_get_data_size.argtypes = [c_void_p, c_char_p, c_char_p]
             self.clib.fabber_get_data.argtypes = [c_void_p, c_char_p, c_float_arr, c_char_p]
             self.clib.fabber_dorun.argtypes = [c_void_p, c_uint, c_char_p, c_char_p, self.progress_cb_type]
+            self.clib.fabber_dorun_stream.argtypes = [c_void_p, c_int, self.log_cb_type, c_char_p, self.progress_cb_type]
             self.clib.fabber_destroy.argtypes = [c_void_p]
 
             self.clib.fabber_get_options.argtypes = [c_void_p, c_char_p, c_char_p, c_uint, c_char_p, c_char_p]
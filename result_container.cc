@@ -0,0 +1,440 @@
+/*  result_container.cc - Single file container for masked voxel results
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "result_container.h"
+
+#include "progressive_output.h"
+#include "rundata.h"
+
+#include <newmat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace NEWMAT;
+using namespace std;
+
+namespace fabber
+{
+static const char MAGIC[8] = { 'F', 'A', 'B', 'R', 'E', 'S', '\0', '\0' };
+static const int32_t VERSION = 1;
+
+/** Position of the index position in the header */
+static const int INDEX_POS_OFFSET = 112;
+
+/** Size of the header, not including the voxel offsets */
+static const int HEADER_SIZE = 120;
+
+static int64_t Align(int64_t pos)
+{
+    return (pos + 7) & ~int64_t(7);
+}
+
+static void Seek(FILE *f, int64_t pos)
+{
+#ifdef _WIN32
+    int ret = _fseeki64(f, pos, SEEK_SET);
+#else
+    int ret = fseeko(f, off_t(pos), SEEK_SET);
+#endif
+    if (ret != 0)
+        throw FabberRunDataError("Could not seek in result container");
+}
+
+template <class T> static void Write(FILE *f, T val)
+{
+    if (fwrite(&val, sizeof(T), 1, f) != 1)
+        throw FabberRunDataError("Could not write to result container");
+}
+
+static void WriteBytes(FILE *f, const void *data, size_t size)
+{
+    if ((size > 0) && (fwrite(data, 1, size, f) != size))
+        throw FabberRunDataError("Could not write to result container");
+}
+
+ResultContainerWriter::ResultContainerWriter(const string &filename, const NiftiGeometry &geom,
+    const vector<int> &offsets, bool compress)
+    : m_filename(filename)
+    , m_file(NULL)
+    , m_nvoxels(offsets.size())
+    , m_compress(compress)
+    , m_end(0)
+{
+    m_file = fopen(filename.c_str(), "w+b");
+    if (!m_file)
+        throw FabberRunDataError("Could not open file for writing: " + filename);
+
+    try
+    {
+        WriteHeader(geom, offsets);
+    }
+    catch (...)
+    {
+        fclose(m_file);
+        throw;
+    }
+}
+
+void ResultContainerWriter::WriteHeader(const NiftiGeometry &geom, const vector<int> &offsets)
+{
+    WriteBytes(m_file, MAGIC, sizeof(MAGIC));
+    Write<int32_t>(m_file, VERSION);
+    for (int d = 0; d < 3; d++)
+    {
+        Write<int32_t>(m_file, geom.dims[d]);
+    }
+    for (int d = 0; d < 3; d++)
+    {
+        Write<float>(m_file, geom.pixdims[d]);
+    }
+    Write<int32_t>(m_file, geom.xform_code);
+    for (int r = 1; r <= 4; r++)
+    {
+        for (int c = 1; c <= 4; c++)
+        {
+            Write<float>(m_file, geom.xform(r, c));
+        }
+    }
+    Write<int32_t>(m_file, m_nvoxels);
+    Write<int32_t>(m_file, 0);
+    Write<int64_t>(m_file, 0);
+    for (int v = 0; v < m_nvoxels; v++)
+    {
+        Write<int32_t>(m_file, offsets[v]);
+    }
+
+    m_end = Align(HEADER_SIZE + int64_t(m_nvoxels) * sizeof(int32_t));
+    WriteIndex();
+}
+
+ResultContainerWriter::~ResultContainerWriter()
+{
+    if (m_file)
+        fclose(m_file);
+}
+
+void ResultContainerWriter::Add(const string &name, const Matrix &data, int intent_code)
+{
+    if (data.Ncols() != m_nvoxels)
+        throw FabberInternalError("Output " + name + " has the wrong number of voxels for the "
+                                  "result container");
+
+    ResultEntry entry;
+    entry.nvols = data.Nrows();
+    entry.intent_code = intent_code;
+    entry.compressed = m_compress;
+    entry.pos = m_end;
+
+    // The data is written over the old index, which is written again afterwards
+    Seek(m_file, m_end);
+    vector<float> vol(m_nvoxels);
+    vector<Bytef> block;
+    int64_t size = 0;
+    for (int t = 1; t <= entry.nvols; t++)
+    {
+        for (int v = 0; v < m_nvoxels; v++)
+        {
+            vol[v] = data(t, v + 1);
+        }
+        size_t bytes = vol.size() * sizeof(float);
+        if (m_compress)
+        {
+            uLongf block_size = compressBound(bytes);
+            block.resize(block_size);
+            if (compress2(&block[0], &block_size, reinterpret_cast<const Bytef *>(&vol[0]),
+                    bytes, Z_DEFAULT_COMPRESSION)
+                != Z_OK)
+            {
+                throw FabberRunDataError("Could not compress output " + name);
+            }
+            WriteBytes(m_file, &block[0], block_size);
+            entry.block_size.push_back(block_size);
+            size += block_size;
+        }
+        else
+        {
+            WriteBytes(m_file, &vol[0], bytes);
+            size += bytes;
+        }
+    }
+    m_end = Align(m_end + size);
+
+    if (m_entries.find(name) == m_entries.end())
+        m_names.push_back(name);
+    m_entries[name] = entry;
+    WriteIndex();
+}
+
+void ResultContainerWriter::WriteIndex()
+{
+    Seek(m_file, m_end);
+    Write<int32_t>(m_file, m_names.size());
+    for (unsigned int i = 0; i < m_names.size(); i++)
+    {
+        const ResultEntry &entry = m_entries[m_names[i]];
+        Write<int32_t>(m_file, m_names[i].size());
+        WriteBytes(m_file, m_names[i].data(), m_names[i].size());
+        Write<int32_t>(m_file, entry.nvols);
+        Write<int32_t>(m_file, entry.intent_code);
+        Write<int32_t>(m_file, entry.compressed ? 1 : 0);
+        Write<int64_t>(m_file, entry.pos);
+        for (unsigned int t = 0; t < entry.block_size.size(); t++)
+        {
+            Write<int64_t>(m_file, entry.block_size[t]);
+        }
+    }
+
+    // Only point the header at the new index once it is complete
+    fflush(m_file);
+    Seek(m_file, INDEX_POS_OFFSET);
+    Write<int64_t>(m_file, m_end);
+    if (fflush(m_file) != 0)
+        throw FabberRunDataError("Could not write to result container: " + m_filename);
+}
+
+/**
+ * Read a value from a position in the container which has been range checked
+ */
+template <class T> static T Get(const char *data, int64_t pos)
+{
+    T val;
+    memcpy(&val, data + pos, sizeof(T));
+    return val;
+}
+
+ResultContainer::ResultContainer(const string &filename)
+    : m_filename(filename)
+    , m_data(NULL)
+    , m_size(0)
+{
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw DataNotFound(filename, "Could not open result container");
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            m_data = static_cast<const char *>(map);
+            m_size = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+    if (!m_data)
+    {
+        // Memory mapping not available so read the whole file
+        ifstream is(filename.c_str(), ios::in | ios::binary);
+        if (!is)
+            throw DataNotFound(filename, "Could not open result container");
+        m_buffer.assign(istreambuf_iterator<char>(is), istreambuf_iterator<char>());
+        m_size = m_buffer.size();
+        if (m_size > 0)
+            m_data = &m_buffer[0];
+    }
+
+    try
+    {
+        ReadIndex();
+    }
+    catch (...)
+    {
+        Unmap();
+        throw;
+    }
+}
+
+void ResultContainer::ReadIndex()
+{
+    if ((m_size < HEADER_SIZE) || (memcmp(m_data, MAGIC, sizeof(MAGIC)) != 0))
+        throw FabberRunDataError("Not a Fabber result container: " + m_filename);
+    if (Get<int32_t>(m_data, 8) != VERSION)
+        throw FabberRunDataError("Unsupported result container version: " + m_filename);
+
+    for (int d = 0; d < 3; d++)
+    {
+        m_geom.dims[d] = Get<int32_t>(m_data, 12 + 4 * d);
+        m_geom.pixdims[d] = Get<float>(m_data, 24 + 4 * d);
+    }
+    m_geom.xform_code = Get<int32_t>(m_data, 36);
+    for (int r = 0; r < 4; r++)
+    {
+        for (int c = 0; c < 4; c++)
+        {
+            m_geom.xform(r + 1, c + 1) = Get<float>(m_data, 40 + 16 * r + 4 * c);
+        }
+    }
+    int nvoxels = Get<int32_t>(m_data, 104);
+    int64_t pos = Get<int64_t>(m_data, INDEX_POS_OFFSET);
+
+    CheckRange(HEADER_SIZE, int64_t(nvoxels) * sizeof(int32_t));
+    m_offsets.resize(nvoxels);
+    for (int v = 0; v < nvoxels; v++)
+    {
+        m_offsets[v] = Get<int32_t>(m_data, HEADER_SIZE + 4 * v);
+    }
+
+    CheckRange(pos, sizeof(int32_t));
+    int noutputs = Get<int32_t>(m_data, pos);
+    pos += sizeof(int32_t);
+    for (int i = 0; i < noutputs; i++)
+    {
+        CheckRange(pos, sizeof(int32_t));
+        int len = Get<int32_t>(m_data, pos);
+        CheckRange(pos + 4, int64_t(len) + 4 * 3 + 8);
+        string name(m_data + pos + 4, len);
+        pos += 4 + len;
+
+        ResultEntry entry;
+        entry.nvols = Get<int32_t>(m_data, pos);
+        entry.intent_code = Get<int32_t>(m_data, pos + 4);
+        entry.compressed = Get<int32_t>(m_data, pos + 8) != 0;
+        entry.pos = Get<int64_t>(m_data, pos + 12);
+        pos += 20;
+
+        int64_t size = int64_t(entry.nvols) * nvoxels * sizeof(float);
+        if (entry.compressed)
+        {
+            CheckRange(pos, int64_t(entry.nvols) * sizeof(int64_t));
+            size = 0;
+            for (int t = 0; t < entry.nvols; t++)
+            {
+                entry.block_size.push_back(Get<int64_t>(m_data, pos));
+                size += entry.block_size.back();
+                pos += sizeof(int64_t);
+            }
+        }
+        CheckRange(entry.pos, size);
+
+        if (m_entries.find(name) == m_entries.end())
+            m_names.push_back(name);
+        m_entries[name] = entry;
+    }
+}
+
+ResultContainer::~ResultContainer()
+{
+    Unmap();
+}
+
+void ResultContainer::Unmap()
+{
+#ifndef _WIN32
+    if (m_data && m_buffer.empty())
+        munmap(const_cast<char *>(m_data), m_size);
+#endif
+    m_data = NULL;
+}
+
+void ResultContainer::CheckRange(int64_t pos, int64_t size) const
+{
+    if ((pos < 0) || (size < 0) || (pos + size > m_size))
+        throw FabberRunDataError("Result container is truncated or corrupt: " + m_filename);
+}
+
+const ResultEntry &ResultContainer::GetEntry(const string &name) const
+{
+    map<string, ResultEntry>::const_iterator iter = m_entries.find(name);
+    if (iter == m_entries.end())
+        throw DataNotFound(name, "Not found in result container " + m_filename);
+    return iter->second;
+}
+
+const float *ResultContainer::GetMappedVolume(const string &name, int t) const
+{
+    const ResultEntry &entry = GetEntry(name);
+    if ((t < 1) || (t > entry.nvols))
+        throw FabberInternalError("Invalid volume for output " + name);
+    if (entry.compressed)
+        return NULL;
+
+    // Outputs start on an 8 byte boundary so this is correctly aligned
+    int64_t pos = entry.pos + int64_t(t - 1) * GetNumVoxels() * sizeof(float);
+    return reinterpret_cast<const float *>(m_data + pos);
+}
+
+void ResultContainer::GetVolume(const string &name, int t, vector<float> &values) const
+{
+    values.resize(GetNumVoxels());
+    const float *mapped = GetMappedVolume(name, t);
+    if (values.empty())
+        return;
+    if (mapped)
+    {
+        memcpy(&values[0], mapped, values.size() * sizeof(float));
+        return;
+    }
+
+    const ResultEntry &entry = GetEntry(name);
+    int64_t pos = entry.pos;
+    for (int i = 0; i < t - 1; i++)
+    {
+        pos += entry.block_size[i];
+    }
+    uLongf bytes = values.size() * sizeof(float);
+    if ((uncompress(reinterpret_cast<Bytef *>(&values[0]), &bytes,
+             reinterpret_cast<const Bytef *>(m_data + pos), entry.block_size[t - 1])
+            != Z_OK)
+        || (bytes != values.size() * sizeof(float)))
+    {
+        throw FabberRunDataError("Could not decompress output " + name + " in " + m_filename);
+    }
+}
+
+Matrix ResultContainer::GetData(const string &name) const
+{
+    const ResultEntry &entry = GetEntry(name);
+    Matrix data(entry.nvols, GetNumVoxels());
+    vector<float> values;
+    for (int t = 1; t <= entry.nvols; t++)
+    {
+        GetVolume(name, t, values);
+        for (int v = 1; v <= GetNumVoxels(); v++)
+        {
+            data(t, v) = values[v - 1];
+        }
+    }
+    return data;
+}
+
+string ResultContainer::ExportNifti(const string &name, const string &filename, bool compress) const
+{
+    const ResultEntry &entry = GetEntry(name);
+    MappedNiftiOutput output(filename, m_geom, entry.nvols, m_offsets, compress, entry.intent_code);
+    vector<float> values;
+    for (int t = 1; t <= entry.nvols; t++)
+    {
+        const float *mapped = GetMappedVolume(name, t);
+        if (!mapped)
+        {
+            GetVolume(name, t, values);
+            mapped = values.empty() ? NULL : &values[0];
+        }
+        if (mapped)
+            output.SetVolume(t, mapped);
+    }
+    output.Close();
+    return output.GetFilename();
+}
+}
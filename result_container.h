@@ -0,0 +1,213 @@
+/*  result_container.h - Single file container for masked voxel results
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include "progressive_output.h"
+
+#include <newmat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fabber
+{
+/**
+ * Layout of a result container file
+ *
+ * All values are in native byte order. The header is followed by the offset
+ * of each masked voxel within a volume, stored once for all outputs. Each
+ * output is then stored as 32 bit floats, one volume after another with the
+ * voxels of a volume contiguous, starting on an 8 byte boundary so an
+ * uncompressed file can be memory mapped and used directly. If compressed,
+ * each volume is a separate zlib block so volumes can still be read
+ * individually. The index of outputs follows the last output and is rewritten
+ * whenever an output is added, so the file is usable as soon as each output
+ * has been written.
+ *
+ *   Header:  char magic[8], int32 version, int32 dims[3], float pixdims[3],
+ *            int32 xform_code, float xform[16], int32 nvoxels, int32 unused,
+ *            int64 index_pos, int32 offsets[nvoxels]
+ *   Index:   int32 noutputs, then for each output: int32 name_len,
+ *            char name[name_len], int32 nvols, int32 intent_code,
+ *            int32 compressed, int64 pos, int64 block_size[nvols] if compressed
+ */
+struct ResultEntry
+{
+    ResultEntry()
+        : nvols(0)
+        , intent_code(0)
+        , compressed(false)
+        , pos(0)
+    {
+    }
+
+    int nvols;
+    int intent_code;
+    bool compressed;
+
+    /** File position of the first volume */
+    int64_t pos;
+
+    /** Compressed size of each volume. Empty if not compressed */
+    std::vector<int64_t> block_size;
+};
+
+/**
+ * Writes outputs to a result container file as they are saved
+ */
+class ResultContainerWriter
+{
+public:
+    /**
+     * Create the file, replacing any existing file
+     *
+     * @param filename File name including extension
+     * @param geom Image grid, used when exporting to NIFTI
+     * @param offsets Offset of each voxel within a volume, i.e.
+     *                x + nx * (y + ny * z) for voxel indices x, y, z
+     * @param compress If true, outputs are stored as zlib compressed volumes
+     */
+    ResultContainerWriter(const std::string &filename, const NiftiGeometry &geom,
+        const std::vector<int> &offsets, bool compress);
+    ~ResultContainerWriter();
+
+    /**
+     * Add an output
+     *
+     * If an output with the same name has already been added it is replaced,
+     * although its data is not removed from the file.
+     *
+     * @param name Name of the output, e.g. mean_c0
+     * @param data Output data, one column per voxel and one row per volume
+     * @param intent_code NIFTI intent code to use when exporting
+     */
+    void Add(const std::string &name, const NEWMAT::Matrix &data, int intent_code = 0);
+
+    const std::string &GetFilename() const
+    {
+        return m_filename;
+    }
+
+private:
+    void WriteHeader(const NiftiGeometry &geom, const std::vector<int> &offsets);
+    void WriteIndex();
+
+    std::string m_filename;
+    FILE *m_file;
+    int m_nvoxels;
+    bool m_compress;
+
+    /** Names of the outputs in the order they were added */
+    std::vector<std::string> m_names;
+    std::map<std::string, ResultEntry> m_entries;
+
+    /** End of the output data, where the index is written */
+    int64_t m_end;
+};
+
+/**
+ * Reads a result container file
+ *
+ * The file is memory mapped, so opening a container and reading a few
+ * outputs is fast however many outputs it holds.
+ */
+class ResultContainer
+{
+public:
+    /**
+     * @param filename Container file name including extension
+     * @throw DataNotFound if the file could not be opened
+     * @throw FabberRunDataError if the file is not a valid result container
+     */
+    explicit ResultContainer(const std::string &filename);
+    ~ResultContainer();
+
+    /** @return names of the outputs, in the order they were added */
+    const std::vector<std::string> &GetNames() const
+    {
+        return m_names;
+    }
+
+    int GetNumVoxels() const
+    {
+        return int(m_offsets.size());
+    }
+
+    /** @return offset of each voxel within a volume */
+    const std::vector<int> &GetOffsets() const
+    {
+        return m_offsets;
+    }
+
+    const NiftiGeometry &GetGeometry() const
+    {
+        return m_geom;
+    }
+
+    /** @throw DataNotFound if there is no output with this name */
+    const ResultEntry &GetEntry(const std::string &name) const;
+
+    /**
+     * Get a volume of an output
+     *
+     * @param name Output name
+     * @param t Volume index, starting at 1
+     * @param values Set to one value for each voxel
+     */
+    void GetVolume(const std::string &name, int t, std::vector<float> &values) const;
+
+    /**
+     * Get a volume of an output without copying it
+     *
+     * @return pointer to the values for each voxel within the mapped file, or
+     *         NULL if the output is compressed
+     */
+    const float *GetMappedVolume(const std::string &name, int t) const;
+
+    /**
+     * Get all the data of an output
+     *
+     * @return Matrix with one column per voxel and one row per volume, as
+     *         passed to FabberRunData::SaveVoxelData
+     */
+    NEWMAT::Matrix GetData(const std::string &name) const;
+
+    /**
+     * Write an output as a NIFTI image
+     *
+     * @param name Output name
+     * @param filename File name without extension
+     * @param compress If true, write a gzipped ``.nii.gz`` file
+     * @return name of the file written
+     */
+    std::string ExportNifti(const std::string &name, const std::string &filename,
+        bool compress = false) const;
+
+private:
+    /** Read the header and index of outputs */
+    void ReadIndex();
+    void Unmap();
+
+    /** Check that a range of the file can be read */
+    void CheckRange(int64_t pos, int64_t size) const;
+
+    std::string m_filename;
+    const char *m_data;
+    int64_t m_size;
+
+    /** File contents, if they could not be memory mapped */
+    std::vector<char> m_buffer;
+
+    NiftiGeometry m_geom;
+    std::vector<int> m_offsets;
+    std::vector<std::string> m_names;
+    std::map<std::string, ResultEntry> m_entries;
+};
+}
@@ -11,13 +11,17 @@
 #include "easylog.h"
 #include "fwdmodel.h"
 #include "inference.h"
+#include "linalg.h"
 #include "setup.h"
+#include "simd_kernels.h"
 #include "version.h"
 
 #include <newmat.h>
 
+#include <algorithm>
 #include <errno.h>
 #include <fstream>
+#include <math.h>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -148,6 +152,16 @@ static OptionSpec OPTIONS[] = {
     { "evaluate", OPT_STR, "Evaluate model. Set to name of output required or blank for default output. Requires model configuration options, --evaluate-params and --evaluate-nt", OPT_NONREQ, "" },
     { "evaluate-params", OPT_MATRIX, "List of parameter values for evaluation", OPT_NONREQ, "" },
     { "evaluate-nt", OPT_INT, "Number of time points for evaluation - must be consistent with model options where appropriate", OPT_NONREQ, "" },
+    { "convert-matrix", OPT_MATRIX, "Convert an ASCII or VEST matrix file to binary format for faster loading, then exit. Output file is given by --convert-output", OPT_NONREQ, "" },
+    { "convert-output", OPT_STR, "Output file for --convert-matrix. Default is the input file name with .bin appended", OPT_NONREQ, "" },
+    { "export-container", OPT_FILE, "Export outputs from a result container (see --save-container) "
+                                    "to NIFTI images in the same directory, then exit",
+        OPT_NONREQ, "" },
+    { "export-output", OPT_STR, "Name of the output to export with --export-container. Default "
+                                "is to export all outputs",
+        OPT_NONREQ, "" },
+    { "export-compress", OPT_BOOL, "Write gzipped NIFTI images with --export-container",
+        OPT_NONREQ, "" },
     { "simple-output", OPT_BOOL, "Instead of usual standard output, simply output series of lines each giving progress as percentage", OPT_NONREQ, "" },
     { "output", OPT_STR, "Directory for output files (including logfile)", OPT_REQ, "" },
     { "overwrite", OPT_BOOL, "If set will overwrite existing output. If not set, new output "
@@ -158,9 +172,16 @@ static OptionSpec OPTIONS[] = {
         OPT_NONREQ, "" },
     { "method", OPT_STR, "Use this inference method", OPT_REQ, "" },
     { "model", OPT_STR, "Use this forward model", OPT_REQ, "" },
+    { "model<n>", OPT_STR, "Fit multiple forward models for n=1, 2, 3... to the same data and "
+                           "compare them using the free energy. Replaces --model",
+        OPT_NONREQ, "" },
     { "loadmodels", OPT_FILE,
         "Load models dynamically from the specified filename, which should be a DLL/shared library",
         OPT_NONREQ, "" },
+    { "write-model-manifest", OPT_FILE, "Write a manifest listing the models in a DLL/shared library, "
+                                        "then exit. Libraries with a manifest are only opened when "
+                                        "one of their models is used",
+        OPT_NONREQ, "" },
     { "data", OPT_TIMESERIES, "Specify a single input data file", OPT_REQ, "" },
     { "data<n>", OPT_TIMESERIES, "Specify multiple data files for n=1, 2, 3...", OPT_NONREQ, "" },
     { "data-order", OPT_STR, "If multiple data files are specified, how they will be handled: "
@@ -191,12 +212,28 @@ static OptionSpec OPTIONS[] = {
     { "save-noise-mean", OPT_BOOL, "Output the noise means. The noise distribution inferred is the precision of a Gaussian noise source", OPT_NONREQ, "" },
     { "save-noise-std", OPT_BOOL, "Output the noise standard deviations. ", OPT_NONREQ, "" },
     { "save-free-energy", OPT_BOOL, "Output the free energy, if calculated. ", OPT_NONREQ, "" },
+    { "progressive-output", OPT_BOOL, "Create the parameter mean, standard deviation and free "
+                                      "energy outputs, and a map of the number of iterations, at the "
+                                      "start of the run and write each voxel as it finishes. Voxelwise "
+                                      "VB only",
+        OPT_NONREQ, "" },
+    { "save-container", OPT_BOOL, "Save all outputs to a single file, results.fabres, in the "
+                                  "output directory instead of separate images. Only masked "
+                                  "voxels are stored. Use --export-container to convert to NIFTI",
+        OPT_NONREQ, "" },
+    { "save-container-compress", OPT_BOOL, "Compress each volume stored in the result container",
+        OPT_NONREQ, "" },
     { "optfile", OPT_BOOL, "File containing additional options, one per line, in the same form as "
                            "specified on the command line",
         OPT_NONREQ, "" },
     { "debug", OPT_BOOL,
         "Output large amounts of debug information. ONLY USE WITH VERY SMALL NUMBERS OF VOXELS",
         OPT_NONREQ, "" },
+    { "eval-cache-size", OPT_INT, "Number of model evaluations to remember for each voxel so that "
+                                  "repeated evaluations with the same parameters are not recalculated. "
+                                  "Uses memory for each voxel, so mainly useful for expensive models. "
+                                  "0 disables the cache",
+        OPT_NONREQ, "0" },
     { "" },
 };
 
@@ -255,6 +292,8 @@ void FabberRunData::Run(ProgressCheck *progress)
     m_progress = progress;
     LOG << "FabberRunData::FABBER release: " << fabber_version() << endl;
     LOG << "FabberRunData::Last commit: " << fabber_source_date() << endl;
+    LOG << "FabberRunData::Vectorised kernels: " << fabber::simd::InstructionSet() << endl;
+    LOG << "FabberRunData::Linear algebra backend: " << fabber::linalg::Backend() << endl;
 
     time_t startTime;
     time(&startTime);
@@ -262,8 +301,36 @@ void FabberRunData::Run(ProgressCheck *progress)
 
     LogParams();
 
+    vector<string> models = GetStringList("model");
+    if (models.empty())
+    {
+        throw MandatoryOptionMissing("model");
+    }
+    else if (models.size() == 1)
+    {
+        RunModel(models[0]);
+    }
+    else
+    {
+        RunModelComparison(models);
+    }
+
+    LOG << "FabberRunData::All done." << endl;
+
+    // Options should all have been used by now, so complain if there's anything left.
+    CheckAllOptionsUsed();
+
+    time_t endTime;
+    time(&endTime);
+    LOG << "FabberRunData::Start time: " << ctime(&startTime); // Bizarrely, ctime() ends with a \n.
+    LOG << "FabberRunData::End time: " << ctime(&endTime);
+    LOG << "FabberRunData::Duration: " << endTime - startTime << " seconds." << endl;
+}
+
+void FabberRunData::RunModel(const string &model_name, vector<double> *fe)
+{
     // Set the forward model
-    std::auto_ptr<FwdModel> fwd_model(FwdModel::NewFromName(GetString("model")));
+    std::auto_ptr<FwdModel> fwd_model(FwdModel::NewFromName(model_name));
 
     // For backwards compatibility - model may not have called superclass initialize
     fwd_model->SetLogger(m_log);
@@ -277,7 +344,8 @@ void FabberRunData::Run(ProgressCheck *progress)
     // Write the paramnames.txt file if required
     if (GetBool("dump-param-names"))
     {
-        ofstream paramFile((GetStringDefault("output", ".") + "/paramnames.txt").c_str());
+        ofstream paramFile(
+            (GetStringDefault("output", ".") + "/" + m_save_prefix + "paramnames.txt").c_str());
         for (unsigned i = 0; i < params.size(); i++)
         {
             paramFile << params[i].name << endl;
@@ -298,16 +366,99 @@ void FabberRunData::Run(ProgressCheck *progress)
     LOG << "FabberRunData::Saving results " << endl;
     infer->SaveResults(*this);
 
-    LOG << "FabberRunData::All done." << endl;
+    if (fe && !infer->GetFreeEnergy(*fe))
+    {
+        throw InvalidOptionValue("method", GetString("method"),
+            "Inference method does not calculate the free energy required for model comparison");
+    }
+}
 
-    // Options should all have been used by now, so complain if there's anything left.
-    CheckAllOptionsUsed();
+void FabberRunData::RunModelComparison(const vector<string> &models)
+{
+    LOG << "FabberRunData::Model comparison run with " << models.size() << " models" << endl;
+    for (unsigned int m = 0; m < models.size(); m++)
+    {
+        LOG << "FabberRunData::Model " << m + 1 << ": " << models[m] << endl;
+        if (std::find(models.begin(), models.begin() + m, models[m]) != models.begin() + m)
+        {
+            throw InvalidOptionValue(
+                "model" + stringify(m + 1), models[m], "Model already specified");
+        }
+    }
 
-    time_t endTime;
-    time(&endTime);
-    LOG << "FabberRunData::Start time: " << ctime(&startTime); // Bizarrely, ctime() ends with a \n.
-    LOG << "FabberRunData::End time: " << ctime(&endTime);
-    LOG << "FabberRunData::Duration: " << endTime - startTime << " seconds." << endl;
+    // The free energy is needed for every model so make sure it is calculated
+    // and kept, restoring the caller's setting afterwards. Loading the data and
+    // coordinates here means that they are cached and shared by all the models
+    bool had_save_fe = HaveKey("save-free-energy");
+    string save_fe = had_save_fe ? m_params["save-free-energy"] : "";
+    SetBool("save-free-energy");
+
+    int nvoxels = 0;
+    vector<vector<double> > fes(models.size());
+    try
+    {
+        nvoxels = GetVoxelCoords().Ncols();
+        GetMainVoxelData();
+        for (unsigned int m = 0; m < models.size(); m++)
+        {
+            LOG << "FabberRunData::Fitting model " << models[m] << endl;
+            SetSavePrefix(models[m] + "_");
+            RunModel(models[m], &fes[m]);
+            SetSavePrefix("");
+        }
+    }
+    catch (...)
+    {
+        SetSavePrefix("");
+        if (had_save_fe)
+            Set("save-free-energy", save_fe);
+        else
+            Unset("save-free-energy");
+        throw;
+    }
+    if (had_save_fe)
+        Set("save-free-energy", save_fe);
+    else
+        Unset("save-free-energy");
+
+    // Best model by free energy and posterior model probabilities assuming
+    // a uniform prior over the models. Probabilities are calculated relative
+    // to the maximum free energy to avoid overflow
+    LOG << "FabberRunData::Comparing models" << endl;
+    Matrix model_index(1, nvoxels);
+    Matrix model_prob(models.size(), nvoxels);
+    vector<int> num_best(models.size(), 0);
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        unsigned int best = 0;
+        for (unsigned int m = 1; m < models.size(); m++)
+        {
+            if (fes[m].at(v - 1) > fes[best].at(v - 1))
+                best = m;
+        }
+        model_index(1, v) = best + 1;
+        num_best[best]++;
+
+        double total = 0;
+        for (unsigned int m = 0; m < models.size(); m++)
+        {
+            model_prob(m + 1, v) = exp(fes[m].at(v - 1) - fes[best].at(v - 1));
+            total += model_prob(m + 1, v);
+        }
+        for (unsigned int m = 0; m < models.size(); m++)
+        {
+            model_prob(m + 1, v) /= total;
+        }
+    }
+
+    for (unsigned int m = 0; m < models.size(); m++)
+    {
+        LOG << "FabberRunData::Model " << models[m] << " has highest free energy in "
+            << num_best[m] << " voxels" << endl;
+        Matrix prob = model_prob.Row(m + 1);
+        SaveVoxelData("model_prob_" + models[m], prob);
+    }
+    SaveVoxelData("model_index", model_index);
 }
 
 static string trim(string const &str)
@@ -932,9 +1083,9 @@ void FabberRunData::SetVoxelData(string key, const NEWMAT::Matrix &data)
 void FabberRunData::SaveVoxelData(
     const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type)
 {
-    LOG << "FabberRunData::Saving to memory: " << filename << endl;
+    LOG << "FabberRunData::Saving to memory: " << m_save_prefix + filename << endl;
     // FIXME what should we do with data_type?
-    SetVoxelData(filename, data);
+    SetVoxelData(m_save_prefix + filename, data);
 }
 
 void FabberRunData::SetVoxelCoords(const NEWMAT::Matrix &coords)
@@ -25,6 +25,11 @@
 /** Include deprecated compatibility methods */
 #define DEPRECATED 7
 
+namespace fabber
+{
+class ProgressiveOutput;
+}
+
 /**
  * Option types
  *
@@ -204,9 +209,25 @@ public:
 
     /**
      * Run fabber
+     *
+     * If more than one forward model is given (model1, model2, ...) each model
+     * is fitted in turn to the same data and a model comparison is performed
+     * using the free energy. See \ref RunModelComparison
      */
     void Run(ProgressCheck *check = 0);
 
+    /**
+     * Set a prefix which will be prepended to the name of all voxel data saved
+     * using SaveVoxelData.
+     *
+     * This is used in model comparison runs so that the output from each model
+     * is kept separate.
+     */
+    void SetSavePrefix(const std::string &prefix)
+    {
+        m_save_prefix = prefix;
+    }
+
     /**
      * Parse command line arguments into run data
      *
@@ -413,6 +434,24 @@ public:
     virtual void SaveVoxelData(
         const std::string &filename, NEWMAT::Matrix &coords, VoxelDataType data_type = VDT_SCALAR);
 
+    /**
+     * Create an output which is written voxel by voxel during the run
+     *
+     * Used with --progressive-output so that results can be inspected before
+     * the run finishes and are not built up in memory first.
+     *
+     * @param filename Filename to write to, as for SaveVoxelData
+     * @param nvols Number of values for each voxel
+     * @return New output which the caller must close and delete, or NULL if
+     *         progressive output is not supported. The data should then be
+     *         saved with SaveVoxelData as normal
+     */
+    virtual fabber::ProgressiveOutput *CreateProgressiveOutput(
+        const std::string &filename, int nvols)
+    {
+        return NULL;
+    }
+
     /**
      * Get the voxel co-ordinates
      *
@@ -619,6 +658,33 @@ public:
 
 protected:
     void init(bool compat_options);
+
+    /**
+     * Fit a single forward model to the data and save the results
+     *
+     * @param model_name Name of forward model
+     * @param fe If not NULL, will be set to the final free energy for each voxel.
+     *           An exception is thrown if the inference method cannot provide it
+     */
+    void RunModel(const std::string &model_name, std::vector<double> *fe = NULL);
+
+    /**
+     * Fit multiple forward models to the same data and compare them
+     *
+     * The data, coordinates and other voxel data is loaded once and shared
+     * between the models. Output from each model is saved with the model
+     * name as a prefix, e.g. poly_mean_c0. In addition the following
+     * model comparison output is saved:
+     *
+     *  - model_index: Index (starting at 1) of the model with the highest
+     *    free energy in each voxel
+     *  - model_prob_<name>: Posterior probability of each model, assuming
+     *    equal prior probabilities for each model
+     *
+     * @param models Names of the forward models to compare
+     */
+    void RunModelComparison(const std::vector<std::string> &models);
+
     void AddKeyEqualsValue(const std::string &key, bool trim_comments = false);
     void CheckAllOptionsUsed() const;
     const NEWMAT::Matrix &GetMainVoxelDataMultiple();
@@ -666,6 +732,9 @@ protected:
 
     std::string m_outdir;
 
+    /** Prefix for names of saved voxel data, see SetSavePrefix */
+    std::string m_save_prefix;
+
     EasyLog m_default_log;
 };
 
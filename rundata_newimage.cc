@@ -10,12 +10,15 @@
 #include "rundata_newimage.h"
 
 #include "easylog.h"
+#include "progressive_output.h"
 #include "rundata.h"
 
 #include <newimage/newimage.h>
 #include <newimage/newimageio.h>
 #include <newmat.h>
 
+#include <stdlib.h>
+
 #include <ostream>
 #include <string>
 #include <vector>
@@ -144,7 +147,6 @@ const Matrix &FabberRunDataNewimage::LoadVoxelData(const std::string &filename)
 void FabberRunDataNewimage::SaveVoxelData(
     const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type)
 {
-    LOG << "FabberRunDataNewimage::Saving to nifti: " << filename << endl;
     int nifti_intent_code;
     switch (data_type)
     {
@@ -155,6 +157,27 @@ void FabberRunDataNewimage::SaveVoxelData(
         nifti_intent_code = NIFTI_INTENT_NONE;
     }
 
+    // Outputs given as an absolute path are always saved as separate files
+    if (GetBool("save-container") && (filename[0] != '/'))
+    {
+        if (!m_container.get())
+        {
+            fabber::NiftiGeometry geom;
+            vector<int> offsets;
+            GetOutputGrid(geom, offsets);
+            string filepath = GetOutputDir() + "/results.fabres";
+            LOG << "FabberRunDataNewimage::Creating result container: " << filepath << endl;
+            m_container.reset(new fabber::ResultContainerWriter(
+                filepath, geom, offsets, GetBool("save-container-compress")));
+        }
+        LOG << "FabberRunDataNewimage::Saving to result container: " << m_save_prefix + filename
+            << endl;
+        m_container->Add(m_save_prefix + filename, data, nifti_intent_code);
+        return;
+    }
+
+    LOG << "FabberRunDataNewimage::Saving to nifti: " << m_save_prefix + filename << endl;
+
     int data_size = data.Nrows();
     volume4D<float> output(m_extent[0], m_extent[1], m_extent[2], data_size);
     if (m_have_mask)
@@ -169,16 +192,78 @@ void FabberRunDataNewimage::SaveVoxelData(
     output.set_intent(nifti_intent_code, 0, 0, 0);
     output.setDisplayMaximumMinimum(output.max(), output.min());
 
+    save_volume4D(output, OutputFilename(filename));
+}
+
+string FabberRunDataNewimage::OutputFilename(const std::string &filename)
+{
     if (filename[0] == '/')
     {
-        // Absolute path
-        save_volume4D(output, filename);
+        // Absolute path - prefix applies to the file name only
+        size_t slash = filename.rfind('/');
+        return filename.substr(0, slash + 1) + m_save_prefix + filename.substr(slash + 1);
     }
     else
     {
         // Relative path
-        string filepath = GetOutputDir() + "/" + filename;
-        save_volume4D(output, filepath);
+        return GetOutputDir() + "/" + m_save_prefix + filename;
+    }
+}
+
+fabber::ProgressiveOutput *FabberRunDataNewimage::CreateProgressiveOutput(
+    const std::string &filename, int nvols)
+{
+    // Outputs are saved at the end when using a result container
+    if (GetBool("save-container"))
+        return NULL;
+
+    fabber::NiftiGeometry geom;
+    vector<int> offsets;
+    GetOutputGrid(geom, offsets);
+
+    // Compress if the other outputs are compressed. save_volume4D uses FSLOUTPUTTYPE
+    // to decide this, but progressive outputs can only be single file NIFTI
+    const char *type_env = getenv("FSLOUTPUTTYPE");
+    string output_type = type_env ? type_env : "NIFTI_GZ";
+    if ((output_type != "NIFTI") && (output_type != "NIFTI_GZ"))
+    {
+        WARN_ONCE("Progressive outputs are written as NIFTI, not FSLOUTPUTTYPE=" + output_type);
+    }
+    bool compress = (output_type.size() > 3)
+        && (output_type.substr(output_type.size() - 3) == "_GZ");
+
+    string filepath = OutputFilename(filename);
+    LOG << "FabberRunDataNewimage::Creating progressive output: " << filepath << endl;
+    return new fabber::MappedNiftiOutput(filepath, geom, nvols, offsets, compress);
+}
+
+void FabberRunDataNewimage::GetOutputGrid(fabber::NiftiGeometry &geom, vector<int> &offsets)
+{
+    // Use the same image grid as SaveVoxelData, which takes it from the mask
+    // or the first data loaded
+    geom.dims[0] = m_extent[0];
+    geom.dims[1] = m_extent[1];
+    geom.dims[2] = m_extent[2];
+    geom.pixdims[0] = m_mask.xdim();
+    geom.pixdims[1] = m_mask.ydim();
+    geom.pixdims[2] = m_mask.zdim();
+    if (m_mask.sform_code() > 0)
+    {
+        geom.xform_code = m_mask.sform_code();
+        geom.xform = m_mask.sform_mat();
+    }
+    else if (m_mask.qform_code() > 0)
+    {
+        geom.xform_code = m_mask.qform_code();
+        geom.xform = m_mask.qform_mat();
+    }
+
+    const Matrix &coords = GetVoxelCoords();
+    offsets.resize(coords.Ncols());
+    for (int v = 1; v <= coords.Ncols(); v++)
+    {
+        offsets[v - 1] = int(coords(1, v))
+            + m_extent[0] * (int(coords(2, v)) + m_extent[1] * int(coords(3, v)));
     }
 }
 
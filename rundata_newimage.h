@@ -15,12 +15,15 @@
 #pragma once
 
 #ifndef NO_NEWIMAGE
+#include "result_container.h"
 #include "rundata.h"
 
 #include "newimage/newimage.h"
 #include "newmat.h"
 
+#include <memory>
 #include <string>
+#include <vector>
 
 /**
  * Run data which uses NEWIMAGE to load NIFTII files
@@ -35,10 +38,25 @@ public:
     virtual void SaveVoxelData(
         const std::string &filename, NEWMAT::Matrix &data, VoxelDataType data_type = VDT_SCALAR);
 
+    /**
+     * Create a memory mapped NIFTI file with the same image grid as the data
+     */
+    virtual fabber::ProgressiveOutput *CreateProgressiveOutput(
+        const std::string &filename, int nvols);
+
 private:
+    /** Full path of an output file, without extension */
+    std::string OutputFilename(const std::string &filename);
+
+    /** Image grid of the outputs, and the offset of each voxel within a volume */
+    void GetOutputGrid(fabber::NiftiGeometry &geom, std::vector<int> &offsets);
+
     void SetCoordsFromExtent(int nx, int ny, int nz);
     NEWIMAGE::volume<float> m_mask;
     bool m_have_mask;
+
+    /** Container which outputs are saved to if --save-container is given */
+    std::auto_ptr<fabber::ResultContainerWriter> m_container;
 };
 
 #endif /* NO_NEWIMAGE */
@@ -22,6 +22,11 @@
 #include "fwdmodel_poly.h"
 
 #include "convergence.h"
+#include "thread_pool.h"
+
+// Guards the reference count and setup/destruction of the factories
+static fabber_mutex_t setup_mutex = FABBER_MUTEX_INITIALIZER;
+static int setup_refcount = 0;
 
 void FabberSetup::SetupDefaultInferenceTechniques()
 {
@@ -55,9 +60,16 @@ void FabberSetup::SetupDefaultConvergenceDetectors()
     factory->Add("freduce", &FreduceConvergenceDetector::NewInstance);
     factory->Add("trialmode", &TrialModeConvergenceDetector::NewInstance);
     factory->Add("lm", &LMConvergenceDetector::NewInstance);
+    factory->Add("pchange", &ParamChangeConvergenceDetector::NewInstance);
 }
 
 void FabberSetup::SetupDefaults()
+{
+    ScopedLock lock(setup_mutex);
+    RegisterDefaults();
+}
+
+void FabberSetup::RegisterDefaults()
 {
     FabberSetup::SetupDefaultInferenceTechniques();
     FabberSetup::SetupDefaultNoiseModels();
@@ -66,8 +78,38 @@ void FabberSetup::SetupDefaults()
 }
 
 void FabberSetup::Destroy()
+{
+    ScopedLock lock(setup_mutex);
+    if (setup_refcount == 0)
+    {
+        DestroyFactories();
+    }
+}
+
+void FabberSetup::DestroyFactories()
 {
     FwdModelFactory::Destroy();
     NoiseModelFactory::Destroy();
     InferenceTechniqueFactory::Destroy();
+    ConvergenceDetectorFactory::Destroy();
+}
+
+void FabberSetup::AddRef()
+{
+    ScopedLock lock(setup_mutex);
+    setup_refcount++;
+    RegisterDefaults();
+}
+
+void FabberSetup::Release()
+{
+    ScopedLock lock(setup_mutex);
+    if (setup_refcount > 0)
+    {
+        setup_refcount--;
+    }
+    if (setup_refcount == 0)
+    {
+        DestroyFactories();
+    }
 }
@@ -44,6 +44,30 @@ public:
     static void SetupDefaultConvergenceDetectors();
     /**
      * Destroy all singleton factory instances.
+     *
+     * Has no effect while any references taken using AddRef are outstanding
      */
     static void Destroy();
+
+    /**
+     * Take a reference to the factories, setting up the defaults if required
+     *
+     * Each independent user of Fabber within a process (e.g. each handle
+     * created by the C API) should take a reference and call Release when
+     * finished, so that the factories are not destroyed while other users
+     * are still running. Thread-safe.
+     */
+    static void AddRef();
+
+    /**
+     * Release a reference taken using AddRef
+     *
+     * The factories are destroyed when the last reference is released.
+     * Thread-safe.
+     */
+    static void Release();
+
+private:
+    static void RegisterDefaults();
+    static void DestroyFactories();
 };
@@ -0,0 +1,159 @@
+/*  simd_kernels.cc - Scalar kernels and runtime CPU dispatch
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "simd_kernels.h"
+#include "simd_special.h"
+
+#include <stdlib.h>
+#include <string>
+
+using namespace std;
+
+namespace fabber
+{
+namespace simd
+{
+static double ScalarDot(const double *a, const double *b, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static double ScalarWeightedSumSquares(const double *x, const double *w, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += w[i] * x[i] * x[i];
+    }
+    return sum;
+}
+
+static void ScalarSubtract(const double *a, const double *b, double *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = a[i] - b[i];
+    }
+}
+
+static const KernelTable SCALAR_KERNELS = { "scalar", ScalarDot, ScalarWeightedSumSquares,
+    ScalarSubtract, special::LogArray, special::ExpArray, special::DigammaArray,
+    special::LogGammaArray };
+
+/**
+ * @return kernels for the named instruction set if they were built and the
+ *         CPU supports them, otherwise NULL
+ */
+static const KernelTable *FindKernels(const string &name)
+{
+    if (name == "scalar")
+        return &SCALAR_KERNELS;
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+#ifdef FABBER_HAVE_AVX512
+    if ((name == "avx512") && __builtin_cpu_supports("avx512f"))
+        return Avx512Kernels();
+#endif
+#ifdef FABBER_HAVE_AVX2
+    if ((name == "avx2") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return Avx2Kernels();
+#endif
+#endif
+    return NULL;
+}
+
+/**
+ * @return the best kernels supported by the CPU, honouring FABBER_SIMD
+ */
+static const KernelTable *SelectKernels()
+{
+    const char *env = getenv("FABBER_SIMD");
+    if (env)
+    {
+        const KernelTable *kernels = FindKernels(env);
+        if (kernels)
+            return kernels;
+    }
+
+    const char *preference[] = { "avx512", "avx2" };
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++)
+    {
+        const KernelTable *kernels = FindKernels(preference[i]);
+        if (kernels)
+            return kernels;
+    }
+    return &SCALAR_KERNELS;
+}
+
+/**
+ * @return reference to the kernels in use
+ *
+ * These are selected on first use rather than during static initialization,
+ * as functions such as gammaln may be called from static initializers in
+ * other files before a global here had been set up
+ */
+static const KernelTable *&Kernels()
+{
+    static const KernelTable *kernels = SelectKernels();
+    return kernels;
+}
+
+double Dot(const double *a, const double *b, int n)
+{
+    return Kernels()->dot(a, b, n);
+}
+
+double WeightedSumSquares(const double *x, const double *w, int n)
+{
+    return Kernels()->wsumsq(x, w, n);
+}
+
+void Subtract(const double *a, const double *b, double *out, int n)
+{
+    Kernels()->subtract(a, b, out, n);
+}
+
+void Log(const double *x, double *out, int n)
+{
+    Kernels()->log(x, out, n);
+}
+
+void Exp(const double *x, double *out, int n)
+{
+    Kernels()->exp(x, out, n);
+}
+
+void Digamma(const double *x, double *out, int n)
+{
+    Kernels()->digamma(x, out, n);
+}
+
+void LogGamma(const double *x, double *out, int n)
+{
+    Kernels()->lgamma(x, out, n);
+}
+
+string InstructionSet()
+{
+    return Kernels()->name;
+}
+
+bool SetInstructionSet(const string &name)
+{
+    const KernelTable *kernels = (name == "auto") ? SelectKernels() : FindKernels(name);
+    if (!kernels)
+        return false;
+    Kernels() = kernels;
+    return true;
+}
+}
+}
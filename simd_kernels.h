@@ -0,0 +1,126 @@
+/*  simd_kernels.h - Vectorised numerical kernels with runtime CPU dispatch
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <string>
+
+namespace fabber
+{
+/**
+ * Low-level numerical kernels used in hot loops
+ *
+ * Each kernel may be compiled for several instruction sets (e.g. AVX2,
+ * AVX-512) in addition to a portable scalar version. The best version
+ * supported by the CPU is selected the first time any kernel is used, so a
+ * single binary can make use of newer instruction sets where they are
+ * available without requiring them.
+ *
+ * The selection can be overridden by setting the FABBER_SIMD environment
+ * variable to the name of an instruction set (scalar, avx2, avx512). If the
+ * named instruction set is not available the normal selection is used.
+ *
+ * Kernels operate on contiguous arrays of doubles, which can be obtained
+ * from NEWMAT vectors and diagonal matrices using Store(). Results from
+ * different instruction sets may differ in the last few bits because
+ * the order of summation differs.
+ */
+namespace simd
+{
+/**
+ * @return sum of a[i] * b[i]
+ */
+double Dot(const double *a, const double *b, int n);
+
+/**
+ * @return sum of w[i] * x[i]^2, i.e. x' W x for diagonal W
+ */
+double WeightedSumSquares(const double *x, const double *w, int n);
+
+/**
+ * Set out[i] = a[i] - b[i]. out may be the same array as a or b
+ */
+void Subtract(const double *a, const double *b, double *out, int n);
+
+/*
+ * Special functions
+ *
+ * These are written without branches or library calls so that each
+ * instruction set gets a vectorised version. The accuracy is the same
+ * for every instruction set, and is generally better than the scalar
+ * MISCMATHS/tools.h functions they replace. Each sets out[i] = f(x[i]),
+ * and out may be the same array as x.
+ */
+
+/**
+ * Natural logarithm. Relative error below 2 ulp for all positive x,
+ * including subnormals. log(0) = -inf, log(inf) = inf and negative x gives NaN
+ */
+void Log(const double *x, double *out, int n);
+
+/**
+ * Exponential. Relative error below 2 ulp. Results below the smallest normal
+ * double (x < -708.39) are flushed to zero and x > 709.78 gives inf
+ */
+void Exp(const double *x, double *out, int n);
+
+/**
+ * Digamma function for x > 0. Absolute error below 1e-13 and relative
+ * error below 1e-14 except close to the zero at x = 1.4616. x <= 0 gives NaN
+ */
+void Digamma(const double *x, double *out, int n);
+
+/**
+ * Log of the gamma function for x > 0. Absolute error below 1e-13 for
+ * x < 1e6 and relative error below 1e-14 beyond that. lgamma(0) = inf and
+ * x < 0 gives NaN
+ */
+void LogGamma(const double *x, double *out, int n);
+
+/**
+ * @return name of the instruction set of the kernels currently in use
+ */
+std::string InstructionSet();
+
+/**
+ * Select the instruction set to use
+ *
+ * Only intended for testing and benchmarking. This is not thread safe, so
+ * must not be called while other threads may be using the kernels.
+ *
+ * @param name Name of instruction set, or "auto" to select the best one
+ *             supported by the CPU
+ * @return true if the instruction set was selected, false if it is not
+ *         available in this build or on this CPU, in which case the current
+ *         selection is unchanged
+ */
+bool SetInstructionSet(const std::string &name);
+
+/**
+ * Set of kernels compiled for one instruction set
+ */
+struct KernelTable
+{
+    const char *name;
+    double (*dot)(const double *a, const double *b, int n);
+    double (*wsumsq)(const double *x, const double *w, int n);
+    void (*subtract)(const double *a, const double *b, double *out, int n);
+    void (*log)(const double *x, double *out, int n);
+    void (*exp)(const double *x, double *out, int n);
+    void (*digamma)(const double *x, double *out, int n);
+    void (*lgamma)(const double *x, double *out, int n);
+};
+
+#ifdef FABBER_HAVE_AVX2
+/** Kernels compiled with AVX2/FMA instructions in simd_kernels_avx2.cc */
+const KernelTable *Avx2Kernels();
+#endif
+
+#ifdef FABBER_HAVE_AVX512
+/** Kernels compiled with AVX-512 instructions in simd_kernels_avx512.cc */
+const KernelTable *Avx512Kernels();
+#endif
+}
+}
@@ -0,0 +1,86 @@
+/*  simd_kernels_avx2.cc - Kernels compiled for AVX2 and FMA
+
+ This file must be compiled with -mavx2 -mfma. Its functions are only
+ called if the CPU supports these instructions.
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "simd_kernels.h"
+#include "simd_special.h"
+
+#include <immintrin.h>
+
+namespace fabber
+{
+namespace simd
+{
+/** Add the four elements of a vector */
+static inline double HorizontalSum(__m256d v)
+{
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+static double Avx2Dot(const double *a, const double *b, int n)
+{
+    // Two accumulators to hide FMA latency
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        sum0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), sum0);
+        sum1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), sum1);
+    }
+    double sum = HorizontalSum(_mm256_add_pd(sum0, sum1));
+    for (; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static double Avx2WeightedSumSquares(const double *x, const double *w, int n)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256d x0 = _mm256_loadu_pd(x + i);
+        __m256d x1 = _mm256_loadu_pd(x + i + 4);
+        sum0 = _mm256_fmadd_pd(_mm256_mul_pd(x0, x0), _mm256_loadu_pd(w + i), sum0);
+        sum1 = _mm256_fmadd_pd(_mm256_mul_pd(x1, x1), _mm256_loadu_pd(w + i + 4), sum1);
+    }
+    double sum = HorizontalSum(_mm256_add_pd(sum0, sum1));
+    for (; i < n; i++)
+    {
+        sum += w[i] * x[i] * x[i];
+    }
+    return sum;
+}
+
+static void Avx2Subtract(const double *a, const double *b, double *out, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm256_storeu_pd(out + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++)
+    {
+        out[i] = a[i] - b[i];
+    }
+}
+
+static const KernelTable AVX2_KERNELS = { "avx2", Avx2Dot, Avx2WeightedSumSquares, Avx2Subtract,
+    special::LogArray, special::ExpArray, special::DigammaArray, special::LogGammaArray };
+
+const KernelTable *Avx2Kernels()
+{
+    return &AVX2_KERNELS;
+}
+}
+}
@@ -0,0 +1,86 @@
+/*  simd_kernels_avx512.cc - Kernels compiled for AVX-512
+
+ This file must be compiled with -mavx512f. Its functions are only
+ called if the CPU supports these instructions.
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "simd_kernels.h"
+#include "simd_special.h"
+
+#include <immintrin.h>
+
+namespace fabber
+{
+namespace simd
+{
+/** Add the eight elements of a vector */
+static inline double HorizontalSum(__m512d v)
+{
+    double vals[8];
+    _mm512_storeu_pd(vals, v);
+    return ((vals[0] + vals[1]) + (vals[2] + vals[3])) + ((vals[4] + vals[5]) + (vals[6] + vals[7]));
+}
+
+static double Avx512Dot(const double *a, const double *b, int n)
+{
+    __m512d sum = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        sum = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), sum);
+    }
+    if (i < n)
+    {
+        // Masked load of the remaining elements, the rest are zero
+        __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+        sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i), sum);
+    }
+    return HorizontalSum(sum);
+}
+
+static double Avx512WeightedSumSquares(const double *x, const double *w, int n)
+{
+    __m512d sum = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512d xi = _mm512_loadu_pd(x + i);
+        sum = _mm512_fmadd_pd(_mm512_mul_pd(xi, xi), _mm512_loadu_pd(w + i), sum);
+    }
+    if (i < n)
+    {
+        __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+        __m512d xi = _mm512_maskz_loadu_pd(mask, x + i);
+        sum = _mm512_fmadd_pd(_mm512_mul_pd(xi, xi), _mm512_maskz_loadu_pd(mask, w + i), sum);
+    }
+    return HorizontalSum(sum);
+}
+
+static void Avx512Subtract(const double *a, const double *b, double *out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm512_storeu_pd(out + i, _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+    }
+    if (i < n)
+    {
+        __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_pd(out + i, mask,
+            _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i)));
+    }
+}
+
+static const KernelTable AVX512_KERNELS = { "avx512", Avx512Dot, Avx512WeightedSumSquares,
+    Avx512Subtract, special::LogArray, special::ExpArray, special::DigammaArray,
+    special::LogGammaArray };
+
+const KernelTable *Avx512Kernels()
+{
+    return &AVX512_KERNELS;
+}
+}
+}
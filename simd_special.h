@@ -0,0 +1,259 @@
+/*  simd_special.h - Branch-free special functions for the vectorised kernels
+
+ This header is included by each of the kernel files so that the functions
+ are compiled separately for each instruction set. The functions use only
+ arithmetic, comparisons and bit manipulation, with no branches or library
+ calls, so loops over them can be vectorised by the compiler. It is not
+ part of the public interface - use the array functions in simd_kernels.h.
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace fabber
+{
+namespace simd
+{
+namespace special
+{
+static const double LN2_HI = 6.93147180369123816490e-01;
+static const double LN2_LO = 1.90821492927058770002e-10;
+static const double LOG2E = 1.44269504088896338700e+00;
+static const double SQRT2 = 1.41421356237309514547e+00;
+static const double HALF_LOG_2PI = 9.18938533204672741780e-01;
+
+/** Adding and subtracting this rounds a double of magnitude < 2^51 to an integer */
+static const double ROUND_MAGIC = 6755399441055744.0;
+
+static inline uint64_t Bits(double x)
+{
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static inline double FromBits(uint64_t bits)
+{
+    double x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static inline double Infinity()
+{
+    return FromBits(0x7ff0000000000000ULL);
+}
+
+static inline double NaN()
+{
+    return FromBits(0x7ff8000000000000ULL);
+}
+
+/**
+ * Natural logarithm for positive finite x, without special cases
+ *
+ * x is split into m * 2^e with m in [sqrt(1/2), sqrt(2)), and log(m) found from
+ * the series for atanh((m-1)/(m+1)). Relative error is below 2 ulp for all
+ * positive finite x including subnormals.
+ */
+static inline double LogPositive(double x)
+{
+    // Scale subnormals into the normal range
+    bool subnormal = x < DBL_MIN;
+    double xs = x * (subnormal ? 18014398509481984.0 : 1.0); // 2^54
+    double eoffset = subnormal ? -54.0 : 0.0;
+
+    uint64_t bits = Bits(xs);
+    double e = double(int32_t(bits >> 52) & 0x7ff) - 1023.0 + eoffset;
+    double m = FromBits((bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+    bool high = m > SQRT2;
+    m *= high ? 0.5 : 1.0;
+    e += high ? 1.0 : 0.0;
+
+    double s = (m - 1.0) / (m + 1.0);
+    double z = s * s;
+    // |s| < 0.172 so terms beyond z^10 are below rounding error
+    double poly = 1.0 / 21;
+    poly = poly * z + 1.0 / 19;
+    poly = poly * z + 1.0 / 17;
+    poly = poly * z + 1.0 / 15;
+    poly = poly * z + 1.0 / 13;
+    poly = poly * z + 1.0 / 11;
+    poly = poly * z + 1.0 / 9;
+    poly = poly * z + 1.0 / 7;
+    poly = poly * z + 1.0 / 5;
+    poly = poly * z + 1.0 / 3;
+    double logm = 2.0 * s + 2.0 * s * z * poly;
+    return (e * LN2_HI + logm) + e * LN2_LO;
+}
+
+/**
+ * Natural logarithm
+ *
+ * As LogPositive but returns -inf for 0, NaN for negative x or NaN, and inf
+ * for inf.
+ */
+static inline double Log(double x)
+{
+    double result = LogPositive(x);
+    result = (x == Infinity()) ? x : result;
+    result = (x == 0) ? -Infinity() : result;
+    result = ((x < 0) | (x != x)) ? NaN() : result;
+    return result;
+}
+
+/**
+ * Exponential
+ *
+ * Uses exp(x) = 2^k * exp(r) with |r| <= ln(2)/2 and a degree 13 Taylor
+ * series for exp(r). Relative error is below 2 ulp for results in the normal
+ * range. Results for x < -708.39, which would be subnormal, are flushed to
+ * zero. Returns inf for x > 709.78 and NaN for NaN.
+ */
+static inline double Exp(double x)
+{
+    double xc = x < -708.39 ? -708.39 : x;
+    xc = xc > 709.78 ? 709.78 : xc;
+
+    // Round x / ln(2) to the nearest integer k
+    double k = (xc * LOG2E + ROUND_MAGIC) - ROUND_MAGIC;
+    double r = (xc - k * LN2_HI) - k * LN2_LO;
+
+    double poly = 1.0 / 6227020800.0;
+    poly = poly * r + 1.0 / 479001600.0;
+    poly = poly * r + 1.0 / 39916800.0;
+    poly = poly * r + 1.0 / 3628800.0;
+    poly = poly * r + 1.0 / 362880.0;
+    poly = poly * r + 1.0 / 40320.0;
+    poly = poly * r + 1.0 / 5040.0;
+    poly = poly * r + 1.0 / 720.0;
+    poly = poly * r + 1.0 / 120.0;
+    poly = poly * r + 1.0 / 24.0;
+    poly = poly * r + 1.0 / 6.0;
+    poly = poly * r + 0.5;
+    poly = poly * r + 1.0;
+    poly = poly * r + 1.0;
+
+    // Multiply by 2^k in two halves so that k = 1024 does not overflow
+    // the exponent
+    int32_t k1 = int32_t(k) / 2;
+    int32_t k2 = int32_t(k) - k1;
+    double scale1 = FromBits(uint64_t(int64_t(k1 + 1023)) << 52);
+    double scale2 = FromBits(uint64_t(int64_t(k2 + 1023)) << 52);
+    double result = (poly * scale1) * scale2;
+
+    result = (x > 709.78) ? Infinity() : result;
+    result = (x < -708.39) ? 0.0 : result;
+    result = (x != x) ? x : result;
+    return result;
+}
+
+/**
+ * Digamma function for x > 0
+ *
+ * For x < 8 the recurrence psi(x) = psi(x + 8) - sum(1 / (x + i)) is used to
+ * shift the argument, then the asymptotic series is used up to the y^-14
+ * term. Absolute error is below 1e-13 for all x > 0, and relative error is
+ * below 1e-14 away from the zero at x = 1.4616. Returns NaN for x <= 0.
+ */
+static inline double Digamma(double x)
+{
+    bool shift = x < 8;
+    double recip = 1.0 / x + 1.0 / (x + 1) + 1.0 / (x + 2) + 1.0 / (x + 3) + 1.0 / (x + 4)
+        + 1.0 / (x + 5) + 1.0 / (x + 6) + 1.0 / (x + 7);
+    double y = x + (shift ? 8.0 : 0.0);
+    recip *= shift ? 1.0 : 0.0;
+
+    double yi = 1.0 / y;
+    double z = yi * yi;
+    // Bernoulli number coefficients B_2k / 2k
+    double poly = 1.0 / 12;
+    poly = poly * z - 691.0 / 32760;
+    poly = poly * z + 1.0 / 132;
+    poly = poly * z - 1.0 / 240;
+    poly = poly * z + 1.0 / 252;
+    poly = poly * z - 1.0 / 120;
+    poly = poly * z + 1.0 / 12;
+    double result = LogPositive(y) - 0.5 * yi - z * poly - recip;
+
+    result = (x == Infinity()) ? x : result;
+    result = ((x > 0) | (x != x)) ? result : NaN();
+    return result;
+}
+
+/**
+ * Log of the gamma function for x > 0
+ *
+ * For x < 8 the recurrence lgamma(x) = lgamma(x + 8) - log(x(x+1)...(x+7)) is
+ * used to shift the argument, then Stirling's series is used up to the y^-13
+ * term. Absolute error is below 1e-13 for 0 < x < 1e6 and relative error below
+ * 1e-14 beyond that. Returns inf for x = 0 and NaN for x < 0.
+ */
+static inline double LogGamma(double x)
+{
+    // The product is only needed for x < 8 so clamp x to avoid overflow
+    bool shift = x < 8;
+    double xp = shift ? x : 8.0;
+    double prod = xp * (xp + 1) * (xp + 2) * (xp + 3) * (xp + 4) * (xp + 5) * (xp + 6) * (xp + 7);
+    double logprod = LogPositive(prod) * (shift ? 1.0 : 0.0);
+    double y = x + (shift ? 8.0 : 0.0);
+
+    double yi = 1.0 / y;
+    double z = yi * yi;
+    double poly = 1.0 / 156;
+    poly = poly * z - 691.0 / 360360;
+    poly = poly * z + 1.0 / 1188;
+    poly = poly * z - 1.0 / 1680;
+    poly = poly * z + 1.0 / 1260;
+    poly = poly * z - 1.0 / 360;
+    poly = poly * z + 1.0 / 12;
+    double result = (y - 0.5) * LogPositive(y) - y + HALF_LOG_2PI + yi * poly - logprod;
+
+    result = ((x == 0) | (x == Infinity())) ? Infinity() : result;
+    result = ((x < 0) | (x != x)) ? NaN() : result;
+    return result;
+}
+
+/*
+ * Array versions. Each kernel file takes the address of these so that it
+ * gets its own copy compiled for its instruction set
+ */
+static inline void LogArray(const double *x, double *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = Log(x[i]);
+    }
+}
+
+static inline void ExpArray(const double *x, double *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = Exp(x[i]);
+    }
+}
+
+static inline void DigammaArray(const double *x, double *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = Digamma(x[i]);
+    }
+}
+
+static inline void LogGammaArray(const double *x, double *out, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = LogGamma(x[i]);
+    }
+}
+}
+}
+}
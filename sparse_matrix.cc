@@ -0,0 +1,215 @@
+/*  sparse_matrix.cc - Compressed-column sparse matrix
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "sparse_matrix.h"
+
+#include <newmat.h>
+
+#include <assert.h>
+#include <math.h>
+#include <vector>
+
+using namespace NEWMAT;
+using namespace std;
+
+namespace fabber
+{
+SparseMatrix::SparseMatrix()
+    : m_nrows(0)
+    , m_ncols(0)
+    , m_col_start(1, 0)
+{
+    IndexRows();
+}
+
+SparseMatrix::SparseMatrix(const Matrix &dense, double tol)
+    : m_nrows(dense.Nrows())
+    , m_ncols(dense.Ncols())
+{
+    m_col_start.reserve(m_ncols + 1);
+    for (int c = 1; c <= m_ncols; c++)
+    {
+        m_col_start.push_back(m_vals.size());
+        for (int r = 1; r <= m_nrows; r++)
+        {
+            double val = dense(r, c);
+            if (fabs(val) > tol)
+            {
+                m_row_idx.push_back(r - 1);
+                m_vals.push_back(val);
+            }
+        }
+    }
+    m_col_start.push_back(m_vals.size());
+    IndexRows();
+}
+
+double SparseMatrix::Sparsity(const Matrix &dense, double tol)
+{
+    int size = dense.Nrows() * dense.Ncols();
+    if (size == 0)
+        return 0;
+
+    int zeros = 0;
+    for (int r = 1; r <= dense.Nrows(); r++)
+    {
+        for (int c = 1; c <= dense.Ncols(); c++)
+        {
+            if (fabs(dense(r, c)) <= tol)
+                zeros++;
+        }
+    }
+    return double(zeros) / size;
+}
+
+void SparseMatrix::IndexRows()
+{
+    // Count entries in each row, then fill in by walking the columns
+    // in order so entries within each row are sorted by column
+    m_row_start.assign(m_nrows + 1, 0);
+    for (size_t i = 0; i < m_row_idx.size(); i++)
+    {
+        m_row_start[m_row_idx[i] + 1]++;
+    }
+    for (int r = 0; r < m_nrows; r++)
+    {
+        m_row_start[r + 1] += m_row_start[r];
+    }
+
+    m_row_cols.resize(m_vals.size());
+    m_row_vals.resize(m_vals.size());
+    vector<int> next(m_row_start.begin(), m_row_start.end() - 1);
+    for (int c = 0; c < m_ncols; c++)
+    {
+        for (int i = m_col_start[c]; i < m_col_start[c + 1]; i++)
+        {
+            int pos = next[m_row_idx[i]]++;
+            m_row_cols[pos] = c;
+            m_row_vals[pos] = m_vals[i];
+        }
+    }
+}
+
+ReturnMatrix SparseMatrix::Dense() const
+{
+    Matrix dense(m_nrows, m_ncols);
+    dense = 0;
+    for (int c = 0; c < m_ncols; c++)
+    {
+        for (int i = m_col_start[c]; i < m_col_start[c + 1]; i++)
+        {
+            dense(m_row_idx[i] + 1, c + 1) = m_vals[i];
+        }
+    }
+    dense.Release();
+    return dense;
+}
+
+ReturnMatrix SparseMatrix::Multiply(const ColumnVector &x) const
+{
+    assert(x.Nrows() == m_ncols);
+    ColumnVector result(m_nrows);
+    result = 0;
+    for (int c = 0; c < m_ncols; c++)
+    {
+        double xc = x(c + 1);
+        if (xc == 0)
+            continue;
+        for (int i = m_col_start[c]; i < m_col_start[c + 1]; i++)
+        {
+            result(m_row_idx[i] + 1) += m_vals[i] * xc;
+        }
+    }
+    result.Release();
+    return result;
+}
+
+ReturnMatrix SparseMatrix::TransposeMultiply(const ColumnVector &y) const
+{
+    assert(y.Nrows() == m_nrows);
+    ColumnVector result(m_ncols);
+    for (int c = 0; c < m_ncols; c++)
+    {
+        double sum = 0;
+        for (int i = m_col_start[c]; i < m_col_start[c + 1]; i++)
+        {
+            sum += m_vals[i] * y(m_row_idx[i] + 1);
+        }
+        result(c + 1) = sum;
+    }
+    result.Release();
+    return result;
+}
+
+ReturnMatrix SparseMatrix::CrossProduct(const DiagonalMatrix &w) const
+{
+    assert(w.Nrows() == m_nrows);
+
+    // Sum of the outer products of each row, so the cost depends on the
+    // number of non-zero entries in each row rather than the number of columns
+    SymmetricMatrix result(m_ncols);
+    result = 0;
+    for (int r = 0; r < m_nrows; r++)
+    {
+        double wr = w(r + 1);
+        if (wr == 0)
+            continue;
+        for (int i = m_row_start[r]; i < m_row_start[r + 1]; i++)
+        {
+            double wv = wr * m_row_vals[i];
+            for (int j = m_row_start[r]; j <= i; j++)
+            {
+                result(m_row_cols[i] + 1, m_row_cols[j] + 1) += wv * m_row_vals[j];
+            }
+        }
+    }
+    result.Release();
+    return result;
+}
+
+SparseMatrix SparseMatrix::MaskRows(const vector<int> &masked_rows) const
+{
+    if (masked_rows.empty())
+        return *this;
+
+    // New index for each row, or -1 if masked
+    vector<int> new_row(m_nrows, 0);
+    for (size_t i = 0; i < masked_rows.size(); i++)
+    {
+        int r = masked_rows[i];
+        if (r >= 1 && r <= m_nrows)
+            new_row[r - 1] = -1;
+    }
+    int nrows = 0;
+    for (int r = 0; r < m_nrows; r++)
+    {
+        if (new_row[r] >= 0)
+            new_row[r] = nrows++;
+    }
+
+    SparseMatrix masked;
+    masked.m_nrows = nrows;
+    masked.m_ncols = m_ncols;
+    masked.m_col_start.clear();
+    masked.m_col_start.reserve(m_ncols + 1);
+    for (int c = 0; c < m_ncols; c++)
+    {
+        masked.m_col_start.push_back(masked.m_vals.size());
+        for (int i = m_col_start[c]; i < m_col_start[c + 1]; i++)
+        {
+            int r = new_row[m_row_idx[i]];
+            if (r >= 0)
+            {
+                masked.m_row_idx.push_back(r);
+                masked.m_vals.push_back(m_vals[i]);
+            }
+        }
+    }
+    masked.m_col_start.push_back(masked.m_vals.size());
+    masked.IndexRows();
+    return masked;
+}
+}
@@ -0,0 +1,110 @@
+/*  sparse_matrix.h - Compressed-column sparse matrix
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <newmat.h>
+
+#include <vector>
+
+namespace fabber
+{
+/**
+ * Sparse matrix stored in compressed-column form
+ *
+ * Intended for large design matrices where most entries are zero,
+ * e.g. FIR or multi-session designs. Only the operations needed by
+ * the linear forward model and white noise model are provided. The
+ * cost of each is proportional to the number of non-zero entries
+ * rather than the full size of the matrix.
+ *
+ * A row-wise index of the same entries is also kept, as this is
+ * needed for efficient calculation of J'WJ
+ */
+class SparseMatrix
+{
+public:
+    /**
+     * Create an empty (0x0) matrix
+     */
+    SparseMatrix();
+
+    /**
+     * Create from a dense matrix
+     *
+     * @param dense Dense matrix
+     * @param tol Entries whose absolute value is no greater than this are
+     *            treated as zero
+     */
+    explicit SparseMatrix(const NEWMAT::Matrix &dense, double tol = 0);
+
+    /**
+     * Fraction of entries in a dense matrix which are zero
+     */
+    static double Sparsity(const NEWMAT::Matrix &dense, double tol = 0);
+
+    int Nrows() const
+    {
+        return m_nrows;
+    }
+    int Ncols() const
+    {
+        return m_ncols;
+    }
+    /** Number of non-zero entries stored */
+    int NonZeros() const
+    {
+        return m_vals.size();
+    }
+
+    /**
+     * @return dense copy of the matrix
+     */
+    NEWMAT::ReturnMatrix Dense() const;
+
+    /**
+     * @return Matrix-vector product A * x
+     */
+    NEWMAT::ReturnMatrix Multiply(const NEWMAT::ColumnVector &x) const;
+
+    /**
+     * @return A' * y
+     */
+    NEWMAT::ReturnMatrix TransposeMultiply(const NEWMAT::ColumnVector &y) const;
+
+    /**
+     * @return A' * W * A as a symmetric matrix, for diagonal W
+     */
+    NEWMAT::ReturnMatrix CrossProduct(const NEWMAT::DiagonalMatrix &w) const;
+
+    /**
+     * @return copy with the specified rows removed
+     *
+     * @param masked_rows Rows to remove, indexed from 1
+     */
+    SparseMatrix MaskRows(const std::vector<int> &masked_rows) const;
+
+private:
+    /** Build the row-wise index from the column-wise data */
+    void IndexRows();
+
+    int m_nrows;
+    int m_ncols;
+
+    /** Index into m_row_idx/m_vals of the first entry in each column, plus one past the end */
+    std::vector<int> m_col_start;
+    /** Row of each entry, indexed from 0 */
+    std::vector<int> m_row_idx;
+    /** Value of each entry */
+    std::vector<double> m_vals;
+
+    /** Index into m_row_cols/m_row_vals of the first entry in each row, plus one past the end */
+    std::vector<int> m_row_start;
+    /** Column of each entry in row order, indexed from 0 */
+    std::vector<int> m_row_cols;
+    /** Value of each entry in row order */
+    std::vector<double> m_row_vals;
+};
+}
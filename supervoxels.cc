@@ -0,0 +1,260 @@
+/*  supervoxels.cc - Clustering of voxels into supervoxels
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "supervoxels.h"
+
+#include <newmat.h>
+
+#include <algorithm>
+#include <functional>
+#include <math.h>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace NEWMAT;
+using namespace std;
+
+namespace fabber
+{
+/** Number of times the supervoxels are grown, reseeding each time */
+static const int NUM_ROUNDS = 3;
+
+Supervoxels::Supervoxels(const Matrix &data, const Matrix &coords,
+    const vector<vector<int> > &neighbours, int nsv, double compactness, int spatial_dims)
+    : m_data(data)
+    , m_coords(coords)
+    , m_neighbours(neighbours)
+    , m_spatial_dims(max(1, min(spatial_dims, 3)))
+    , m_data_scale(0)
+    , m_dist_scale(0)
+{
+    int nvoxels = data.Ncols();
+    int ntimes = data.Nrows();
+    if (nvoxels == 0)
+        return;
+    nsv = max(1, min(nsv, nvoxels));
+
+    // Data differences are measured relative to the variance across voxels, summed
+    // over time points, so the compactness does not depend on the units of the data
+    double var = 0;
+    for (int t = 1; t <= ntimes; t++)
+    {
+        double mean = 0, meansq = 0;
+        for (int v = 1; v <= nvoxels; v++)
+        {
+            mean += data(t, v);
+            meansq += data(t, v) * data(t, v);
+        }
+        mean /= nvoxels;
+        var += meansq / nvoxels - mean * mean;
+    }
+    if (var > 0)
+        m_data_scale = 1 / var;
+
+    // Seeds are placed on a regular grid in the dimensions where voxels are
+    // neighbours, spaced so there are about nsv of them
+    int spacing = int(pow(double(nvoxels) / nsv, 1.0 / m_spatial_dims) + 0.5);
+    spacing = max(1, spacing);
+    m_dist_scale = compactness / (spacing * spacing);
+
+    vector<double> origin(m_spatial_dims);
+    for (int d = 1; d <= m_spatial_dims; d++)
+    {
+        origin[d - 1] = coords.Row(d).Minimum();
+    }
+
+    vector<int> seeds;
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        bool seed = true;
+        for (int d = 1; d <= m_spatial_dims; d++)
+        {
+            int pos = int(coords(d, v) - origin[d - 1] + 0.5);
+            seed = seed && (pos % spacing == spacing / 2);
+        }
+        if (seed)
+            seeds.push_back(v);
+    }
+
+    vector<ColumnVector> means, centres;
+    for (unsigned int s = 0; s < seeds.size(); s++)
+    {
+        means.push_back(data.Column(seeds[s]));
+        centres.push_back(coords.Column(seeds[s]));
+    }
+
+    for (int round = 0; round < NUM_ROUNDS; round++)
+    {
+        Grow(seeds, means, centres);
+
+        // Reseed from the mean data and centre of each supervoxel, using the
+        // member voxel closest to them as the new seed
+        means.resize(Num());
+        centres.resize(Num());
+        seeds.resize(Num());
+        for (int s = 0; s < Num(); s++)
+        {
+            means[s].ReSize(ntimes);
+            means[s] = 0;
+            centres[s].ReSize(coords.Nrows());
+            centres[s] = 0;
+            for (unsigned int i = 0; i < m_members[s].size(); i++)
+            {
+                means[s] += data.Column(m_members[s][i]);
+                centres[s] += coords.Column(m_members[s][i]);
+            }
+            means[s] /= m_members[s].size();
+            centres[s] /= m_members[s].size();
+
+            double best = -1;
+            for (unsigned int i = 0; i < m_members[s].size(); i++)
+            {
+                double cost = Cost(m_members[s][i], means[s], centres[s]);
+                if ((best < 0) || (cost < best))
+                {
+                    best = cost;
+                    seeds[s] = m_members[s][i];
+                }
+            }
+        }
+    }
+}
+
+double Supervoxels::Cost(int v, const ColumnVector &mean, const ColumnVector &centre) const
+{
+    double diff = 0;
+    for (int t = 1; t <= m_data.Nrows(); t++)
+    {
+        double d = m_data(t, v) - mean(t);
+        diff += d * d;
+    }
+    double dist = 0;
+    for (int d = 1; d <= m_coords.Nrows(); d++)
+    {
+        double x = m_coords(d, v) - centre(d);
+        dist += x * x;
+    }
+    return diff * m_data_scale + dist * m_dist_scale;
+}
+
+void Supervoxels::Grow(
+    vector<int> &seeds, vector<ColumnVector> &means, vector<ColumnVector> &centres)
+{
+    // Candidate voxel for a supervoxel: cost, (voxel, supervoxel)
+    typedef pair<double, pair<int, int> > Candidate;
+    priority_queue<Candidate, vector<Candidate>, greater<Candidate> > queue;
+
+    int nvoxels = m_data.Ncols();
+    vector<int> labels(nvoxels, 0);
+    for (unsigned int s = 0; s < seeds.size(); s++)
+    {
+        queue.push(Candidate(0, make_pair(seeds[s], s + 1)));
+    }
+
+    int next = 1;
+    while (true)
+    {
+        while (!queue.empty())
+        {
+            int v = queue.top().second.first;
+            int s = queue.top().second.second;
+            queue.pop();
+            if (labels[v - 1] != 0)
+                continue;
+
+            labels[v - 1] = s;
+            const vector<int> &nn = m_neighbours[v - 1];
+            for (vector<int>::const_iterator n = nn.begin(); n != nn.end(); ++n)
+            {
+                if (labels[*n - 1] == 0)
+                {
+                    double cost = Cost(*n, means[s - 1], centres[s - 1]);
+                    queue.push(Candidate(cost, make_pair(*n, s)));
+                }
+            }
+        }
+
+        // Voxels not connected to any seed start a new supervoxel
+        while ((next <= nvoxels) && (labels[next - 1] != 0))
+            next++;
+        if (next > nvoxels)
+            break;
+        seeds.push_back(next);
+        means.push_back(m_data.Column(next));
+        centres.push_back(m_coords.Column(next));
+        queue.push(Candidate(0, make_pair(next, int(seeds.size()))));
+    }
+
+    // A seed can be taken by another supervoxel at the same cost, so remove
+    // empty supervoxels and renumber the rest
+    vector<int> renumber(seeds.size() + 1, 0);
+    for (int v = 0; v < nvoxels; v++)
+    {
+        renumber[labels[v]] = 1;
+    }
+    int num = 0;
+    for (unsigned int s = 1; s < renumber.size(); s++)
+    {
+        if (renumber[s])
+            renumber[s] = ++num;
+    }
+
+    m_labels.resize(nvoxels);
+    m_members.clear();
+    m_members.resize(num);
+    for (int v = 1; v <= nvoxels; v++)
+    {
+        m_labels[v - 1] = renumber[labels[v - 1]];
+        m_members[m_labels[v - 1] - 1].push_back(v);
+    }
+}
+
+Matrix Supervoxels::Average(const Matrix &voxeldata) const
+{
+    Matrix result(voxeldata.Nrows(), Num());
+    result = 0;
+    for (int s = 1; s <= Num(); s++)
+    {
+        const vector<int> &members = m_members[s - 1];
+        for (unsigned int i = 0; i < members.size(); i++)
+        {
+            for (int r = 1; r <= voxeldata.Nrows(); r++)
+            {
+                result(r, s) += voxeldata(r, members[i]);
+            }
+        }
+        for (int r = 1; r <= voxeldata.Nrows(); r++)
+        {
+            result(r, s) /= members.size();
+        }
+    }
+    return result;
+}
+
+vector<vector<int> > Supervoxels::Neighbours(const vector<vector<int> > &neighbours) const
+{
+    vector<set<int> > adjacent(Num());
+    for (unsigned int v = 1; v <= m_labels.size(); v++)
+    {
+        int s = m_labels[v - 1];
+        const vector<int> &nn = neighbours[v - 1];
+        for (vector<int>::const_iterator n = nn.begin(); n != nn.end(); ++n)
+        {
+            if (m_labels[*n - 1] != s)
+                adjacent[s - 1].insert(m_labels[*n - 1]);
+        }
+    }
+
+    vector<vector<int> > result(Num());
+    for (int s = 0; s < Num(); s++)
+    {
+        result[s].assign(adjacent[s].begin(), adjacent[s].end());
+    }
+    return result;
+}
+}
@@ -0,0 +1,111 @@
+/*  supervoxels.h - Clustering of voxels into supervoxels
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <newmat.h>
+
+#include <vector>
+
+namespace fabber
+{
+/**
+ * Clustering of voxels into supervoxels
+ *
+ * Supervoxels are connected groups of neighbouring voxels with similar
+ * data. They are formed by seeded region growing over the voxel neighbour
+ * graph, starting from seeds on a regular grid. Voxels are added in order
+ * of their cost of joining a supervoxel, which combines the difference
+ * between the voxel data and the mean data of the supervoxel with the
+ * distance of the voxel from its centre (as in SLIC). The growing is
+ * repeated a few times, each time reseeding from the supervoxel means and
+ * centres.
+ *
+ * Supervoxels never cross gaps in the neighbour graph, so every connected
+ * part of the mask gets at least one supervoxel.
+ */
+class Supervoxels
+{
+public:
+    /**
+     * @param data Voxel data, one column per voxel
+     * @param coords Voxel co-ordinates, one column per voxel
+     * @param neighbours Nearest neighbours of each voxel, indexed from 1.
+     *                   Must be symmetric
+     * @param nsv Approximate number of supervoxels required
+     * @param compactness Weight of the distance from the supervoxel centre,
+     *                    in units of the seed spacing, relative to the data
+     *                    difference, in units of the data variance
+     * @param spatial_dims Number of dimensions in which voxels are neighbours
+     */
+    Supervoxels(const NEWMAT::Matrix &data, const NEWMAT::Matrix &coords,
+        const std::vector<std::vector<int> > &neighbours, int nsv, double compactness,
+        int spatial_dims);
+
+    /** @return number of supervoxels */
+    int Num() const
+    {
+        return m_members.size();
+    }
+
+    /** @return supervoxel of each voxel, indexed from 1 */
+    const std::vector<int> &Labels() const
+    {
+        return m_labels;
+    }
+
+    /** @return voxels in each supervoxel, indexed from 1 */
+    const std::vector<std::vector<int> > &Members() const
+    {
+        return m_members;
+    }
+
+    /**
+     * Average voxelwise data over each supervoxel
+     *
+     * @param voxeldata Matrix with one column per voxel
+     * @return Matrix with one column per supervoxel
+     */
+    NEWMAT::Matrix Average(const NEWMAT::Matrix &voxeldata) const;
+
+    /**
+     * Calculate nearest neighbours of each supervoxel
+     *
+     * Two supervoxels are neighbours if any of their voxels are neighbours
+     *
+     * @param neighbours Voxel neighbours as passed to the constructor
+     * @return Neighbours of each supervoxel, indexed from 1
+     */
+    std::vector<std::vector<int> > Neighbours(
+        const std::vector<std::vector<int> > &neighbours) const;
+
+private:
+    /**
+     * Grow supervoxels from seeds, replacing the existing labels
+     *
+     * @param seeds Seed voxel of each supervoxel. Voxels which cannot be
+     *              reached from any seed become new seeds
+     * @param means Data to compare voxels to for each supervoxel
+     * @param centres Centre of each supervoxel
+     */
+    void Grow(std::vector<int> &seeds, std::vector<NEWMAT::ColumnVector> &means,
+        std::vector<NEWMAT::ColumnVector> &centres);
+
+    /** Cost of adding a voxel to a supervoxel */
+    double Cost(int v, const NEWMAT::ColumnVector &mean, const NEWMAT::ColumnVector &centre) const;
+
+    const NEWMAT::Matrix &m_data;
+    const NEWMAT::Matrix &m_coords;
+    const std::vector<std::vector<int> > &m_neighbours;
+    int m_spatial_dims;
+
+    /** Scale factors for the data difference and the distance */
+    double m_data_scale;
+    double m_dist_scale;
+
+    std::vector<int> m_labels;
+    std::vector<std::vector<int> > m_members;
+};
+}
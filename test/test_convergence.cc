@@ -304,4 +304,165 @@ TEST_F(ConvergenceTest, TestTrialModeConvergenceDetectorReduce)
     }
     ASSERT_EQ(true, c->Test(F - 2 * MAXTRIALS * FCHANGE));
 }
+
+TEST_F(ConvergenceTest, TestParamChangeConvergenceDetector)
+{
+    int MAXITERS = 37;
+    double MEANCHANGE = 0.001;
+    double VARCHANGE = 0.01;
+
+    rundata.Set("max-iterations", MAXITERS);
+    rundata.Set("max-mean-change", MEANCHANGE);
+    rundata.Set("max-var-change", VARCHANGE);
+    ConvergenceDetector *c = ConvergenceDetector::NewFromName("pchange");
+    c->Initialize(rundata);
+
+    ASSERT_EQ(false, c->UseF());
+    ASSERT_EQ(true, c->UseParams());
+
+    MVNDist post(2);
+    NEWMAT::SymmetricMatrix cov(2);
+    cov = 0;
+    cov(1, 1) = 1;
+    cov(2, 2) = 4;
+    post.means << 10 << 0;
+    post.SetCovariance(cov);
+
+    // No previous values to compare to
+    c->UpdateParams(post);
+    ASSERT_EQ(false, c->Test(0));
+    ASSERT_EQ(true, c->NeedSave());
+
+    // Mean of first parameter changes by too much
+    post.means(1) = 10 * (1 + 2 * MEANCHANGE);
+    c->UpdateParams(post);
+    ASSERT_EQ(false, c->Test(0));
+
+    // Second mean is zero so change is relative to its std dev
+    post.means(2) = 2 * MEANCHANGE * 0.5;
+    c->UpdateParams(post);
+    ASSERT_EQ(true, c->Test(0));
+
+    // Variance change
+    c->Reset();
+    c->UpdateParams(post);
+    ASSERT_EQ(false, c->Test(0));
+    cov(1, 1) = 1 + 2 * VARCHANGE;
+    post.SetCovariance(cov);
+    c->UpdateParams(post);
+    ASSERT_EQ(false, c->Test(0));
+    c->UpdateParams(post);
+    ASSERT_EQ(true, c->Test(0));
+    ASSERT_EQ(false, c->NeedRevert());
+
+    // Non-finite parameters converge immediately and revert
+    c->Reset();
+    post.means(1) = post.means(1) / 0.0;
+    c->UpdateParams(post);
+    ASSERT_EQ(true, c->Test(0));
+    ASSERT_EQ(false, c->NeedSave());
+    ASSERT_EQ(true, c->NeedRevert());
+
+    // Max iterations
+    c->Reset();
+    post.means << 10 << 0;
+    for (int i = 0; i < MAXITERS - 1; i++)
+    {
+        post.means(1) = post.means(1) * 2;
+        c->UpdateParams(post);
+        ASSERT_EQ(false, c->Test(0));
+    }
+    post.means(1) = post.means(1) * 2;
+    c->UpdateParams(post);
+    ASSERT_EQ(true, c->Test(0));
+}
+
+TEST_F(ConvergenceTest, TestSpatialConvergenceDetector)
+{
+    int MAXITERS = 37;
+    int MINITERS = 3;
+    double AKCHANGE = 0.01;
+    double MEANCHANGE = 0.01;
+
+    rundata.Set("max-iterations", MAXITERS);
+    rundata.Set("spatial-min-iterations", MINITERS);
+    rundata.Set("spatial-ak-change", AKCHANGE);
+    rundata.Set("spatial-mean-change", MEANCHANGE);
+    rundata.Set("spatial-mean-percentile", 50);
+    SpatialConvergenceDetector c;
+    c.Initialize(rundata);
+
+    ASSERT_EQ(true, c.UseF());
+    ASSERT_EQ(true, c.UseParams());
+
+    MVNDist post1(1), post2(1);
+    NEWMAT::SymmetricMatrix cov(1);
+    cov(1, 1) = 1;
+    post1.means << 10;
+    post1.SetCovariance(cov);
+    post2 = post1;
+    std::vector<double> aK(1, 1.0);
+
+    // Nothing changes but the minimum number of iterations is still done
+    for (int i = 0; i < MINITERS - 1; i++)
+    {
+        c.UpdateaK(aK);
+        c.UpdateParams(post1);
+        c.UpdateParams(post2);
+        ASSERT_EQ(false, c.Test(-100));
+        ASSERT_EQ(true, c.NeedSave());
+    }
+    c.UpdateaK(aK);
+    c.UpdateParams(post1);
+    c.UpdateParams(post2);
+    ASSERT_EQ(true, c.Test(-100));
+    ASSERT_EQ(false, c.NeedRevert());
+
+    // Spatial precision keeps changing
+    c.Reset();
+    for (int i = 0; i < MINITERS + 1; i++)
+    {
+        aK[0] = aK[0] * (1 + 2 * AKCHANGE);
+        c.UpdateaK(aK);
+        c.UpdateParams(post1);
+        c.UpdateParams(post2);
+        ASSERT_EQ(false, c.Test(-100));
+    }
+
+    // Means of one voxel keep changing, but only half the voxels need to converge
+    c.Reset();
+    for (int i = 0; i < MINITERS - 1; i++)
+    {
+        post2.means(1) = post2.means(1) * 2;
+        c.UpdateaK(aK);
+        c.UpdateParams(post1);
+        c.UpdateParams(post2);
+        ASSERT_EQ(false, c.Test(-100));
+    }
+    post2.means(1) = post2.means(1) * 2;
+    c.UpdateaK(aK);
+    c.UpdateParams(post1);
+    c.UpdateParams(post2);
+    ASSERT_EQ(true, c.Test(-100));
+
+    // Free energy decreases. Ignored before the minimum number of iterations,
+    // afterwards it stops and asks for the previous iteration to be restored
+    c.Reset();
+    for (int i = 0; i < MINITERS - 1; i++)
+    {
+        ASSERT_EQ(false, c.Test(-100 - i));
+        ASSERT_EQ(true, c.NeedSave());
+    }
+    ASSERT_EQ(true, c.Test(-200));
+    ASSERT_EQ(false, c.NeedSave());
+    ASSERT_EQ(true, c.NeedRevert());
+
+    // Max iterations
+    c.Reset();
+    for (int i = 0; i < MAXITERS - 1; i++)
+    {
+        ASSERT_EQ(false, c.Test(-100 + i));
+    }
+    ASSERT_EQ(true, c.Test(-100 + MAXITERS));
+}
 }
@@ -7,11 +7,18 @@
 #include "gtest/gtest.h"
 
 #include "easylog.h"
+#include "fwdmodel.h"
+#include "fwdmodel_linear.h"
 #include "inference.h"
 #include "rundata.h"
 #include "setup.h"
 
 #include <fstream>
+#include <memory>
+#include <sstream>
+
+#include <math.h>
+#include <stdlib.h>
 
 namespace
 {
@@ -37,6 +44,45 @@ protected:
     {
     }
 
+    /**
+     * Set up coordinates for a cube of voxels, ordered with x varying fastest,
+     * and a data matrix of zeros with a column for each voxel
+     */
+    void MakeVoxels(int vsize, int ntimes, NEWMAT::Matrix &voxelCoords, NEWMAT::Matrix &data)
+    {
+        voxelCoords.ReSize(3, vsize * vsize * vsize);
+        data.ReSize(ntimes, vsize * vsize * vsize);
+        data = 0;
+        int v = 1;
+        for (int z = 0; z < vsize; z++)
+        {
+            for (int y = 0; y < vsize; y++)
+            {
+                for (int x = 0; x < vsize; x++)
+                {
+                    voxelCoords(1, v) = x;
+                    voxelCoords(2, v) = y;
+                    voxelCoords(3, v) = z;
+                    v++;
+                }
+            }
+        }
+    }
+
+    /**
+     * Get a count from the log, e.g. "Vb::Reused 12 of ..."
+     *
+     * @param text Log text which is immediately followed by the count
+     * @return the count, or -1 if the text is not in the log
+     */
+    int LoggedCount(const string &log, const string &text)
+    {
+        size_t pos = log.find(text);
+        if (pos == string::npos)
+            return -1;
+        return atoi(log.c_str() + pos + text.size());
+    }
+
     bool FloatEq(double d1, double d2, double epsilon = 0.001)
     {
         double diff = d1 - d2;
@@ -633,6 +679,1011 @@ TEST_F(InferenceMethodTest, MaskedTimepointsArNoise)
     ASSERT_THROW(rundata.Run(), InvalidOptionValue);
 }
 
+// Test that using a subset of time points for the early iterations
+// gives the same answer as a full fit
+TEST_F(InferenceMethodTest, SubsampleTimepoints)
+{
+    int NTIMES = 40;
+    int VSIZE = 3;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    // Data fitted to a cubic function
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + (1.5 * VAL) * (n + 1) * (n + 1)
+                - 2 * VAL * (n + 1) * (n + 1) * (n + 1);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("max-iterations", "20");
+    rundata.Set("degree", "3");
+    rundata.Set("method", "vb");
+    rundata.Set("subsample-stride", "8");
+    rundata.Run();
+
+    NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c0");
+    ASSERT_EQ(mean.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(FloatEq(VAL, mean(1, i + 1)));
+    }
+    mean = rundata.GetVoxelData("mean_c2");
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(FloatEq(VAL * 1.5, mean(1, i + 1)));
+    }
+    mean = rundata.GetVoxelData("mean_c3");
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(FloatEq(-VAL * 2, mean(1, i + 1)));
+    }
+
+    // AR noise does not support masked time points
+    rundata.Set("noise", "ar");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+
+// Test mean-field fitting with a diagonal posterior covariance. Means
+// should converge to the same values as with the full covariance
+TEST_F(InferenceMethodTest, DiagonalPosteriorCovariance)
+{
+    int NTIMES = 10;
+    int VSIZE = 3;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + (1.5 * VAL) * (n + 1);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("max-iterations", "100");
+    rundata.Set("degree", "1");
+    rundata.Set("method", "vb");
+    rundata.Set("posterior-cov", "diag");
+    rundata.Run();
+
+    NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c0");
+    ASSERT_EQ(mean.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(FloatEq(VAL, mean(1, i + 1)));
+    }
+    mean = rundata.GetVoxelData("mean_c1");
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(FloatEq(VAL * 1.5, mean(1, i + 1)));
+    }
+
+    // Block sizes must match the number of parameters
+    rundata.Set("posterior-cov", "block");
+    rundata.Set("cov-block1", "1");
+    rundata.Set("cov-block2", "2");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+
+// Test fitting with a block diagonal posterior covariance. The regressors
+// of the design are orthogonal so the parameters are uncorrelated, and
+// the result should match the full covariance
+TEST_F(InferenceMethodTest, BlockPosteriorCovariance)
+{
+    int NTIMES = 12;
+    int VSIZE = 3;
+    float VAL = 2;
+    int NPARAMS = 3;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+    string FILENAME = "test_block_basis.mat";
+
+    // Constant, ramp centred on zero and a +1, -1, -1, +1 pattern which is
+    // orthogonal to both
+    NEWMAT::Matrix basis(NTIMES, NPARAMS);
+    for (int n = 0; n < NTIMES; n++)
+    {
+        basis(n + 1, 1) = 1;
+        basis(n + 1, 2) = n - (NTIMES - 1) * 0.5;
+        basis(n + 1, 3) = (n % 4 == 0 || n % 4 == 3) ? 1 : -1;
+    }
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL * basis(n + 1, 1) + 0.5 * VAL * basis(n + 1, 2)
+                - 2 * VAL * basis(n + 1, 3) + 0.01 * ((7 * n + 3 * v) % 5 - 2);
+        }
+    }
+
+    ofstream os;
+    os.open(FILENAME.c_str(), ios::out);
+    for (int n = 0; n < NTIMES; n++)
+    {
+        for (int p = 0; p < NPARAMS; p++)
+        {
+            os << basis(n + 1, p + 1) << " ";
+        }
+        os << endl;
+    }
+    os.close();
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "linear");
+    rundata.Set("basis", FILENAME);
+    rundata.Set("max-iterations", "20");
+    rundata.Set("method", "vb");
+    rundata.SetBool("save-free-energy");
+    rundata.Run();
+
+    vector<NEWMAT::Matrix> full_means;
+    for (int p = 0; p < NPARAMS; p++)
+    {
+        full_means.push_back(rundata.GetVoxelData("mean_Parameter_" + stringify(p + 1)));
+    }
+    NEWMAT::Matrix full_fe = rundata.GetVoxelData("freeEnergy");
+
+    // The constant on its own, then the other two together
+    rundata.Set("posterior-cov", "block");
+    rundata.Set("cov-block1", "1");
+    rundata.Set("cov-block2", "2");
+    rundata.Run();
+    remove(FILENAME.c_str());
+
+    for (int p = 0; p < NPARAMS; p++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_Parameter_" + stringify(p + 1));
+        ASSERT_EQ(mean.Ncols(), n_voxels);
+        for (int i = 0; i < n_voxels; i++)
+        {
+            ASSERT_TRUE(FloatEq(full_means[p](1, i + 1), mean(1, i + 1)));
+        }
+    }
+
+    // Restricting the posterior can only make the free energy worse
+    NEWMAT::Matrix block_fe = rundata.GetVoxelData("freeEnergy");
+    ASSERT_EQ(block_fe.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(block_fe(1, i + 1) == block_fe(1, i + 1));
+        ASSERT_LT(fabs(block_fe(1, i + 1)), HUGE_VAL);
+        ASSERT_LE(block_fe(1, i + 1), full_fe(1, i + 1) + 1e-6 * (1 + fabs(full_fe(1, i + 1))));
+    }
+}
+
+// Test that evaluating the Jacobian on multiple threads gives the same
+// result as evaluating it serially
+TEST_F(InferenceMethodTest, ParallelJacobian)
+{
+    int NTIMES = 10;
+    int VSIZE = 2;
+    float VAL = 1.5;
+    int DEGREE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + (VAL * v) * (n + 1) - (0.1 * VAL) * (n + 1) * (n + 1);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", stringify(DEGREE));
+    rundata.Set("max-iterations", "20");
+    rundata.Set("method", "vb");
+    rundata.Set("jacobian-threads", "1");
+    rundata.Run();
+
+    vector<NEWMAT::Matrix> serial_means;
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        serial_means.push_back(rundata.GetVoxelData("mean_c" + stringify(i)));
+    }
+
+    rundata.Set("jacobian-threads", "4");
+    rundata.Run();
+
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c" + stringify(i));
+        ASSERT_EQ(mean.Ncols(), n_voxels);
+        for (int j = 0; j < n_voxels; j++)
+        {
+            ASSERT_TRUE(FloatEq(serial_means[i](1, j + 1), mean(1, j + 1)));
+        }
+    }
+
+    // Pinning the threads to processors should not change anything either
+    rundata.SetBool("jacobian-pin-threads");
+    rundata.Run();
+
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c" + stringify(i));
+        ASSERT_EQ(mean.Ncols(), n_voxels);
+        for (int j = 0; j < n_voxels; j++)
+        {
+            ASSERT_TRUE(FloatEq(serial_means[i](1, j + 1), mean(1, j + 1)));
+        }
+    }
+}
+
+// Test that the model evaluation cache gives the same results as evaluating
+// every time, and that repeated evaluations are found in the cache
+TEST_F(InferenceMethodTest, EvaluationCache)
+{
+    int NTIMES = 10;
+    int VSIZE = 2;
+    float VAL = 1.5;
+    int DEGREE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + (VAL * v) * (n + 1) - (0.1 * VAL) * (n + 1) * (n + 1);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", stringify(DEGREE));
+    rundata.Set("max-iterations", "20");
+    rundata.Set("method", "vb");
+    rundata.SetBool("save-model-fit");
+    rundata.Run();
+
+    vector<NEWMAT::Matrix> uncached_means;
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        uncached_means.push_back(rundata.GetVoxelData("mean_c" + stringify(i)));
+    }
+    NEWMAT::Matrix uncached_fit = rundata.GetVoxelData("modelfit");
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+    rundata.SetLogger(&log);
+    rundata.Set("eval-cache-size", "4");
+    rundata.Run();
+    log.StopLog();
+
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c" + stringify(i));
+        ASSERT_EQ(mean.Ncols(), n_voxels);
+        for (int j = 0; j < n_voxels; j++)
+        {
+            ASSERT_EQ(uncached_means[i](1, j + 1), mean(1, j + 1));
+        }
+    }
+    NEWMAT::Matrix fit = rundata.GetVoxelData("modelfit");
+    for (int j = 0; j < n_voxels; j++)
+    {
+        for (int t = 0; t < NTIMES; t++)
+        {
+            ASSERT_EQ(uncached_fit(t + 1, j + 1), fit(t + 1, j + 1));
+        }
+    }
+
+    ASSERT_NE(string::npos, logstr.str().find("FwdModel::Evaluation cache: "));
+
+    // Repeated evaluation for the same voxel is a hit, a different voxel is a miss,
+    // and so is a voxel whose evaluations have been forgotten
+    std::auto_ptr<FwdModel> model(FwdModel::NewFromName("poly"));
+    EasyLog model_log;
+    stringstream model_logstr;
+    model_log.StartLog(model_logstr);
+    rundata.SetLogger(&model_log);
+    model->Initialize(rundata);
+    model->SetEvaluationCacheSize(4);
+
+    NEWMAT::ColumnVector params(DEGREE + 1), result1, result2, result3, result4;
+    params << 1.5 << -0.3 << 0.02;
+    model->PassData(1, data.Column(1), voxelCoords.Column(1));
+    model->EvaluateFabber(params, result1);
+    model->EvaluateFabber(params, result2);
+    model->PassData(2, data.Column(2), voxelCoords.Column(2));
+    model->EvaluateFabber(params, result3);
+    model->ForgetEvaluations(1);
+    model->PassData(1, data.Column(1), voxelCoords.Column(1));
+    model->EvaluateFabber(params, result4);
+    model->ReportEvaluationCache();
+    model_log.StopLog();
+
+    ASSERT_EQ(NTIMES, result1.Nrows());
+    for (int t = 1; t <= NTIMES; t++)
+    {
+        ASSERT_EQ(result1(t), result2(t));
+        ASSERT_EQ(result1(t), result3(t));
+        ASSERT_EQ(result1(t), result4(t));
+    }
+    ASSERT_NE(string::npos, model_logstr.str().find("Evaluation cache: 1 hits, 3 misses"));
+}
+
+// Test that keeping the Jacobian when the centre barely moves does not change
+// the result. The poly model is linear so the Jacobian never changes anyway
+TEST_F(InferenceMethodTest, RecentreTolerance)
+{
+    int NTIMES = 10;
+    int VSIZE = 2;
+    float VAL = 1.5;
+    int DEGREE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + (VAL * v) * (n + 1) - (0.1 * VAL) * (n + 1) * (n + 1);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", stringify(DEGREE));
+    rundata.Set("max-iterations", "20");
+    rundata.Set("method", "vb");
+    rundata.Set("recentre-tol", "0");
+    rundata.Run();
+
+    vector<NEWMAT::Matrix> full_means, full_stds;
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        full_means.push_back(rundata.GetVoxelData("mean_c" + stringify(i)));
+        full_stds.push_back(rundata.GetVoxelData("std_c" + stringify(i)));
+    }
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+    rundata.SetLogger(&log);
+    rundata.Set("recentre-tol", "0.1");
+    rundata.Run();
+    log.StopLog();
+
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c" + stringify(i));
+        NEWMAT::Matrix sd = rundata.GetVoxelData("std_c" + stringify(i));
+        ASSERT_EQ(mean.Ncols(), n_voxels);
+        ASSERT_EQ(sd.Ncols(), n_voxels);
+        for (int j = 0; j < n_voxels; j++)
+        {
+            ASSERT_TRUE(FloatEq(full_means[i](1, j + 1), mean(1, j + 1)));
+            ASSERT_TRUE(FloatEq(full_stds[i](1, j + 1), sd(1, j + 1)));
+        }
+    }
+
+    // The Jacobian must actually have been kept for some of the recentres
+    ASSERT_GT(LoggedCount(logstr.str(), "Vb::Kept the existing Jacobian for "), 0);
+
+    // Negative tolerance is not allowed
+    rundata.Set("recentre-tol", "-1");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+
+// Test that reusing the Jacobian columns of stabilised parameters does not
+// change the result. The poly model is linear so the Jacobian never changes, see
+// JacobianFreezingColumns for a nonlinear model
+TEST_F(InferenceMethodTest, JacobianFreezing)
+{
+    int NTIMES = 10;
+    int VSIZE = 2;
+    float VAL = 1.5;
+    int DEGREE = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + (VAL * v) * (n + 1) - (0.1 * VAL) * (n + 1) * (n + 1);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", stringify(DEGREE));
+    rundata.Set("max-iterations", "20");
+    rundata.Set("method", "vb");
+    rundata.Run();
+
+    vector<NEWMAT::Matrix> full_means;
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        full_means.push_back(rundata.GetVoxelData("mean_c" + stringify(i)));
+    }
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+    rundata.SetLogger(&log);
+    rundata.Set("jacobian-freeze-tol", "0.01");
+    rundata.Set("jacobian-refresh", "3");
+    rundata.Run();
+    log.StopLog();
+
+    for (int i = 0; i <= DEGREE; i++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c" + stringify(i));
+        ASSERT_EQ(mean.Ncols(), n_voxels);
+        for (int j = 0; j < n_voxels; j++)
+        {
+            ASSERT_TRUE(FloatEq(full_means[i](1, j + 1), mean(1, j + 1)));
+        }
+    }
+    ASSERT_GT(LoggedCount(logstr.str(), "Vb::Reused "), 0);
+
+    // Must do at least one iteration between full refreshes
+    rundata.Set("jacobian-refresh", "0");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+
+// Nonlinear model A * exp(-R * t) for t = 1..DECAY_NTIMES, for testing the
+// linearized model directly
+const int DECAY_NTIMES = 10;
+class ExpDecayModel : public FwdModel
+{
+public:
+    virtual void EvaluateModel(const NEWMAT::ColumnVector &params, NEWMAT::ColumnVector &result,
+        const std::string &key = "") const
+    {
+        result.ReSize(DECAY_NTIMES);
+        for (int t = 1; t <= DECAY_NTIMES; t++)
+        {
+            result(t) = params(1) * exp(-params(2) * t);
+        }
+    }
+};
+
+// Test that frozen Jacobian columns are kept when the linearized model
+// is recentred while the other columns are recalculated
+TEST_F(InferenceMethodTest, JacobianFreezingColumns)
+{
+    ExpDecayModel model;
+    LinearizedFwdModel lin(&model);
+
+    NEWMAT::ColumnVector centre(2);
+    centre(1) = 2;
+    centre(2) = 0.1;
+    lin.ReCentre(centre);
+    NEWMAT::Matrix before = lin.Jacobian();
+
+    // Move both parameters but freeze the column for R
+    NEWMAT::ColumnVector moved(2);
+    moved(1) = 3;
+    moved(2) = 0.3;
+    vector<bool> frozen(2, false);
+    frozen[1] = true;
+    lin.ReCentre(moved, frozen);
+    NEWMAT::Matrix after = lin.Jacobian();
+    ASSERT_EQ(DECAY_NTIMES, after.Nrows());
+    ASSERT_EQ(2, after.Ncols());
+    for (int t = 1; t <= DECAY_NTIMES; t++)
+    {
+        // dY/dA = exp(-R * t) is recalculated at the new centre
+        ASSERT_NEAR(exp(-0.3 * t), after(t, 1), 1e-6);
+        ASSERT_GT(fabs(after(t, 1) - before(t, 1)), 1e-3);
+        // dY/dR is unchanged even though it is now wrong
+        ASSERT_EQ(before(t, 2), after(t, 2));
+    }
+
+    // The offset is still correct at the new centre
+    NEWMAT::ColumnVector expected, actual;
+    model.EvaluateModel(moved, expected);
+    lin.EvaluateModel(moved, actual);
+    for (int t = 1; t <= DECAY_NTIMES; t++)
+    {
+        ASSERT_NEAR(expected(t), actual(t), 1e-9);
+    }
+
+    // Without freezing, every column is recalculated
+    lin.ReCentre(moved, vector<bool>(2, false));
+    after = lin.Jacobian();
+    for (int t = 1; t <= DECAY_NTIMES; t++)
+    {
+        ASSERT_NEAR(exp(-0.3 * t), after(t, 1), 1e-6);
+        ASSERT_NEAR(-3 * t * exp(-0.3 * t), after(t, 2), 1e-4);
+    }
+}
+
+// Test the linear model with a mostly-zero design matrix, which is stored
+// in sparse form. Results should match the dense form
+TEST_F(InferenceMethodTest, SparseLinearDesign)
+{
+    int NSESSIONS = 5;
+    int NPERSESSION = 4;
+    int NTIMES = NSESSIONS * NPERSESSION;
+    int VSIZE = 3;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+    string FILENAME = "test_sparse_basis.mat";
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            // Small noise which averages to zero within each session
+            data(n + 1, v) = VAL * (n / NPERSESSION + 1) + (n % 2 == 0 ? 0.1 : -0.1);
+        }
+    }
+
+    // One regressor per session, so 80% of the design matrix is zero
+    ofstream os;
+    os.open(FILENAME.c_str(), ios::out);
+    for (int n = 0; n < NTIMES; n++)
+    {
+        for (int s = 0; s < NSESSIONS; s++)
+        {
+            os << (n / NPERSESSION == s ? 1 : 0) << " ";
+        }
+        os << endl;
+    }
+    os.close();
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "linear");
+    rundata.Set("basis", FILENAME);
+    rundata.Set("max-iterations", "20");
+    rundata.Set("method", "vb");
+    rundata.SetBool("save-free-energy");
+    rundata.Run();
+
+    vector<NEWMAT::Matrix> sparse_means;
+    for (int s = 0; s < NSESSIONS; s++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_Parameter_" + stringify(s + 1));
+        ASSERT_EQ(mean.Ncols(), n_voxels);
+        for (int i = 0; i < n_voxels; i++)
+        {
+            ASSERT_TRUE(FloatEq(VAL * (s + 1), mean(1, i + 1)));
+        }
+        sparse_means.push_back(mean);
+    }
+    NEWMAT::Matrix sparse_fe = rundata.GetVoxelData("freeEnergy");
+
+    // Force the dense form
+    rundata.Set("sparse-basis-threshold", "1");
+    rundata.Run();
+    remove(FILENAME.c_str());
+
+    NEWMAT::Matrix dense_fe = rundata.GetVoxelData("freeEnergy");
+    for (int s = 0; s < NSESSIONS; s++)
+    {
+        NEWMAT::Matrix mean = rundata.GetVoxelData("mean_Parameter_" + stringify(s + 1));
+        for (int i = 0; i < n_voxels; i++)
+        {
+            ASSERT_TRUE(FloatEq(sparse_means[s](1, i + 1), mean(1, i + 1)));
+        }
+    }
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(FloatEq(1, sparse_fe(1, i + 1) / dense_fe(1, i + 1)));
+    }
+}
+
+// Test that deduplicating voxels with identical data gives the same
+// result as fitting every voxel
+TEST_F(InferenceMethodTest, DedupVoxels)
+{
+    int NTIMES = 10;
+    int VSIZE = 4;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    // Only two distinct data timeseries
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        int x = voxelCoords(1, v);
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL * (1 + x % 2) * (n + 1) + (n % 3);
+        }
+    }
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", "1");
+    rundata.Set("method", "vb");
+    rundata.SetBool("save-free-energy");
+    rundata.Run();
+    NEWMAT::Matrix mean = rundata.GetVoxelData("mean_c1");
+    NEWMAT::Matrix fe = rundata.GetVoxelData("freeEnergy");
+
+    FabberRunData rundata_dedup;
+    rundata_dedup.SetVoxelCoords(voxelCoords);
+    rundata_dedup.SetVoxelData("data", data);
+    rundata_dedup.Set("noise", "white");
+    rundata_dedup.Set("model", "poly");
+    rundata_dedup.Set("degree", "1");
+    rundata_dedup.Set("method", "vb");
+    rundata_dedup.SetBool("save-free-energy");
+    rundata_dedup.SetBool("dedup-voxels");
+    rundata_dedup.Run();
+    NEWMAT::Matrix mean_dedup = rundata_dedup.GetVoxelData("mean_c1");
+    NEWMAT::Matrix fe_dedup = rundata_dedup.GetVoxelData("freeEnergy");
+
+    ASSERT_EQ(mean_dedup.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_FLOAT_EQ(mean(1, i + 1), mean_dedup(1, i + 1));
+        ASSERT_FLOAT_EQ(fe(1, i + 1), fe_dedup(1, i + 1));
+    }
+}
+
+// Test screening of voxels with no signal. Half the voxels contain only low level
+// noise, which should be flagged and left at the prior
+TEST_F(InferenceMethodTest, ScreenVoxels)
+{
+    int NTIMES = 10;
+    int VSIZE = 4;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        int x = voxelCoords(1, v);
+        for (int n = 0; n < NTIMES; n++)
+        {
+            double noise = 0.01 * ((7 * n + 3 * v) % 5 - 2);
+            data(n + 1, v) = noise + ((x < VSIZE / 2) ? 0 : VAL * (n + 1));
+        }
+    }
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+
+    FabberRunData rundata;
+    rundata.SetLogger(&log);
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", "1");
+    rundata.Set("method", "vb");
+    rundata.Set("screen-snr", "3");
+    rundata.SetBool("save-free-energy");
+    rundata.Run();
+    log.StopLog();
+
+    ASSERT_NE(string::npos,
+        logstr.str().find("Vb::Screening: 32 of 64 voxels have SNR below 3 and will not be fitted"));
+
+    NEWMAT::Matrix screened = rundata.GetVoxelData("screened");
+    NEWMAT::Matrix snr = rundata.GetVoxelData("screen_snr");
+    NEWMAT::Matrix slope = rundata.GetVoxelData("mean_c1");
+    NEWMAT::Matrix Fskip = rundata.GetVoxelData("freeEnergy");
+    ASSERT_EQ(screened.Ncols(), n_voxels);
+    ASSERT_EQ(snr.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        if (voxelCoords(1, i + 1) < VSIZE / 2)
+        {
+            ASSERT_EQ(1, screened(1, i + 1));
+            ASSERT_LT(snr(1, i + 1), 3);
+            // Prior mean is zero
+            ASSERT_TRUE(FloatEq(1, slope(1, i + 1) + 1));
+        }
+        else
+        {
+            ASSERT_EQ(0, screened(1, i + 1));
+            ASSERT_TRUE(FloatEq(VAL, slope(1, i + 1), 0.01));
+        }
+    }
+
+    // Reduced iterations for screened voxels rather than skipping them
+    logstr.str("");
+    log.StartLog(logstr);
+    rundata.Set("screen-action", "reduce");
+    rundata.Run();
+    log.StopLog();
+    ASSERT_NE(string::npos, logstr.str().find("will be fitted with at most 2 iterations"));
+
+    // Skipped voxels have the free energy of the prior, which should be no
+    // better than that of a full fit
+    rundata.Set("screen-snr", "0");
+    rundata.Run();
+    NEWMAT::Matrix Ffit = rundata.GetVoxelData("freeEnergy");
+    for (int i = 0; i < n_voxels; i++)
+    {
+        if (voxelCoords(1, i + 1) < VSIZE / 2)
+        {
+            ASSERT_TRUE(Fskip(1, i + 1) == Fskip(1, i + 1));
+            ASSERT_NE(0, Fskip(1, i + 1));
+            ASSERT_LE(Fskip(1, i + 1), Ffit(1, i + 1));
+        }
+    }
+
+    rundata.Set("screen-snr", "3");
+    rundata.Set("screen-action", "ignore");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+
+// Test voxelwise VB with a time budget. With plenty of time the result should be
+// the same as without a budget, with almost no time every voxel should still be output
+TEST_F(InferenceMethodTest, TimeBudget)
+{
+    int NTIMES = 10;
+    int VSIZE = 4;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        int x = voxelCoords(1, v);
+        for (int n = 0; n < NTIMES; n++)
+        {
+            double noise = 0.01 * ((7 * n + 3 * v) % 5 - 2);
+            data(n + 1, v) = noise + VAL * x * (n + 1);
+        }
+    }
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+
+    FabberRunData rundata;
+    rundata.SetLogger(&log);
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", "1");
+    rundata.Set("method", "vb");
+    rundata.Run();
+    NEWMAT::Matrix expected = rundata.GetVoxelData("mean_c1");
+
+    rundata.Set("time-budget", "1000");
+    rundata.Run();
+    log.StopLog();
+    ASSERT_NE(string::npos, logstr.str().find("Vb::Time budget: 64 of 64 voxels converged"));
+
+    NEWMAT::Matrix converged = rundata.GetVoxelData("converged");
+    NEWMAT::Matrix slope = rundata.GetVoxelData("mean_c1");
+    ASSERT_EQ(converged.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_EQ(1, converged(1, i + 1));
+        ASSERT_TRUE(FloatEq(expected(1, i + 1), slope(1, i + 1)));
+    }
+
+    // The free energy is used to share out the time but is only saved if requested
+    ASSERT_THROW(rundata.GetVoxelData("freeEnergy"), DataNotFound);
+
+    // Out of time after the first voxel - all voxels are still output
+    logstr.str("");
+    log.StartLog(logstr);
+    rundata.Set("time-budget", "1e-9");
+    rundata.SetBool("save-free-energy");
+    rundata.Run();
+    log.StopLog();
+    ASSERT_NE(string::npos, logstr.str().find("Vb::Time budget: ran out of time"));
+    ASSERT_NE(string::npos, logstr.str().find("and 63 voxels not started"));
+
+    converged = rundata.GetVoxelData("converged");
+    slope = rundata.GetVoxelData("mean_c1");
+    NEWMAT::Matrix fe = rundata.GetVoxelData("freeEnergy");
+    ASSERT_EQ(converged.Ncols(), n_voxels);
+    ASSERT_EQ(slope.Ncols(), n_voxels);
+    ASSERT_EQ(fe.Ncols(), n_voxels);
+    ASSERT_EQ(0, converged(1, n_voxels));
+
+    // Voxels which were not started have the prior, whose mean is zero, and
+    // its free energy rather than zero
+    for (int i = 1; i < n_voxels; i++)
+    {
+        ASSERT_TRUE(FloatEq(1, slope(1, i + 1) + 1));
+        ASSERT_TRUE(fe(1, i + 1) == fe(1, i + 1));
+        ASSERT_NE(0, fe(1, i + 1));
+    }
+}
+
+// Test spatial VB initialized from supervoxels. The data has two regions with different
+// slopes which the supervoxels should not cross, so the full resolution iterations
+// should start close to the solution
+TEST_F(InferenceMethodTest, Supervoxels)
+{
+    int NTIMES = 10;
+    int VSIZE = 6;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        int x = voxelCoords(1, v);
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + VAL * (x < VSIZE / 2 ? 1 : 3) * (n + 1);
+        }
+    }
+
+    EasyLog log;
+    stringstream logstr;
+    log.StartLog(logstr);
+
+    FabberRunData rundata;
+    rundata.SetLogger(&log);
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model", "poly");
+    rundata.Set("degree", "1");
+    rundata.Set("method", "spatialvb");
+    rundata.Set("param-spatial-priors", "MM");
+    rundata.Set("max-iterations", "3");
+    rundata.Set("supervoxels", "8");
+    rundata.Run();
+    log.StopLog();
+
+    ASSERT_NE(string::npos, logstr.str().find("Vb::Clustered 216 voxels into "));
+    ASSERT_NE(string::npos, logstr.str().find("*** Supervoxel iteration *** 10"));
+
+    NEWMAT::Matrix offset = rundata.GetVoxelData("mean_c0");
+    NEWMAT::Matrix slope = rundata.GetVoxelData("mean_c1");
+    ASSERT_EQ(slope.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        double expected = VAL * (voxelCoords(1, i + 1) < VSIZE / 2 ? 1 : 3);
+        ASSERT_TRUE(FloatEq(VAL, offset(1, i + 1), 0.05));
+        ASSERT_TRUE(FloatEq(expected, slope(1, i + 1), 0.05));
+    }
+
+    // Negative number of supervoxels is not allowed
+    rundata.Set("supervoxels", "-1");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+
+// Test comparison of multiple models fitted to the same data. The data is
+// quadratic so the polynomial model should be preferred over a straight line
+TEST_F(InferenceMethodTest, ModelComparison)
+{
+    int NTIMES = 10;
+    int VSIZE = 3;
+    float VAL = 2;
+    int n_voxels = VSIZE * VSIZE * VSIZE;
+    string FILENAME = "test_compare_basis.mat";
+
+    NEWMAT::Matrix voxelCoords, data;
+    MakeVoxels(VSIZE, NTIMES, voxelCoords, data);
+    for (int v = 1; v <= n_voxels; v++)
+    {
+        for (int n = 0; n < NTIMES; n++)
+        {
+            data(n + 1, v) = VAL + VAL * (n + 1) * (n + 1);
+        }
+    }
+
+    // Straight line design matrix for the linear model
+    ofstream os;
+    os.open(FILENAME.c_str(), ios::out);
+    for (int n = 0; n < NTIMES; n++)
+    {
+        os << "1 " << n + 1 << endl;
+    }
+    os.close();
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model1", "poly");
+    rundata.Set("model2", "linear");
+    rundata.Set("degree", "2");
+    rundata.Set("basis", FILENAME);
+    rundata.Set("max-iterations", "20");
+    rundata.Set("method", "vb");
+    rundata.Run();
+    remove(FILENAME.c_str());
+
+    // The free energy is saved for each model without changing the options
+    ASSERT_FALSE(rundata.HaveKey("save-free-energy"));
+
+    // Per-model output
+    NEWMAT::Matrix mean = rundata.GetVoxelData("poly_mean_c2");
+    ASSERT_EQ(mean.Ncols(), n_voxels);
+    mean = rundata.GetVoxelData("linear_mean_Parameter_1");
+    ASSERT_EQ(mean.Ncols(), n_voxels);
+    ASSERT_EQ(rundata.GetVoxelData("poly_freeEnergy").Ncols(), n_voxels);
+    ASSERT_EQ(rundata.GetVoxelData("linear_freeEnergy").Ncols(), n_voxels);
+
+    // Model comparison output
+    NEWMAT::Matrix idx = rundata.GetVoxelData("model_index");
+    NEWMAT::Matrix prob_poly = rundata.GetVoxelData("model_prob_poly");
+    NEWMAT::Matrix prob_linear = rundata.GetVoxelData("model_prob_linear");
+    ASSERT_EQ(idx.Nrows(), 1);
+    ASSERT_EQ(idx.Ncols(), n_voxels);
+    for (int i = 0; i < n_voxels; i++)
+    {
+        ASSERT_EQ(1, idx(1, i + 1));
+        ASSERT_TRUE(FloatEq(1, prob_poly(1, i + 1) + prob_linear(1, i + 1)));
+        ASSERT_TRUE(prob_poly(1, i + 1) > prob_linear(1, i + 1));
+    }
+}
+
+// The same model cannot be given twice in a model comparison run
+TEST_F(InferenceMethodTest, ModelComparisonDuplicateModel)
+{
+    NEWMAT::Matrix voxelCoords, data;
+    data.ReSize(3, 1);
+    data << 1 << 2 << 3;
+    voxelCoords.ReSize(3, 1);
+    voxelCoords << 1 << 1 << 1;
+
+    FabberRunData rundata;
+    rundata.SetVoxelCoords(voxelCoords);
+    rundata.SetVoxelData("data", data);
+    rundata.Set("noise", "white");
+    rundata.Set("model1", "poly");
+    rundata.Set("model2", "poly");
+    rundata.Set("degree", "1");
+    rundata.Set("method", "vb");
+    ASSERT_THROW(rundata.Run(), InvalidOptionValue);
+}
+
 INSTANTIATE_TEST_CASE_P(
     MethodTests, InferenceMethodTest, ::testing::Values("vb", "nlls", "spatialvb"));
 
@@ -0,0 +1,128 @@
+// Tests for the dense linear algebra backend
+
+#include "gtest/gtest.h"
+
+#include "linalg.h"
+
+#include <newmat.h>
+
+#include <math.h>
+
+using namespace NEWMAT;
+
+namespace
+{
+// Fill a matrix with arbitrary but reproducible values
+void Fill(Matrix &m, double seed)
+{
+    for (int r = 1; r <= m.Nrows(); r++)
+    {
+        for (int c = 1; c <= m.Ncols(); c++)
+        {
+            m(r, c) = sin(seed + r * 1.3 + c * 0.7);
+        }
+    }
+}
+
+void AssertMatrixNear(const Matrix &expected, const Matrix &actual, double tol = 1e-10)
+{
+    ASSERT_EQ(expected.Nrows(), actual.Nrows());
+    ASSERT_EQ(expected.Ncols(), actual.Ncols());
+    for (int r = 1; r <= expected.Nrows(); r++)
+    {
+        for (int c = 1; c <= expected.Ncols(); c++)
+        {
+            ASSERT_NEAR(expected(r, c), actual(r, c), tol);
+        }
+    }
+}
+
+// Positive definite test matrix
+SymmetricMatrix Spd(int n)
+{
+    Matrix A(n + 2, n);
+    Fill(A, 0.5);
+    SymmetricMatrix S;
+    S << A.t() * A + IdentityMatrix(n);
+    return S;
+}
+
+TEST(LinalgTest, Multiply)
+{
+    Matrix A(5, 3), B(3, 4), C(5, 4);
+    Fill(A, 0);
+    Fill(B, 1);
+    Fill(C, 2);
+    AssertMatrixNear(A * B, fabber::linalg::Multiply(A, B));
+    AssertMatrixNear(A.t() * C, fabber::linalg::Multiply(A, C, true));
+
+    ColumnVector x(3);
+    Fill(x, 3);
+    ColumnVector Ax = fabber::linalg::Multiply(A, x);
+    AssertMatrixNear(A * x, Ax);
+}
+
+TEST(LinalgTest, CrossProduct)
+{
+    Matrix J(9, 4);
+    Fill(J, 0);
+    DiagonalMatrix W(9);
+    for (int i = 1; i <= 9; i++)
+    {
+        W(i) = (i % 3 == 0) ? 0 : i * 0.5;
+    }
+    SymmetricMatrix result = fabber::linalg::CrossProduct(J, W);
+    AssertMatrixNear(J.t() * W * J, result);
+
+    // Negative weights are allowed
+    W(2) = -1;
+    result = fabber::linalg::CrossProduct(J, W);
+    AssertMatrixNear(J.t() * W * J, result);
+
+    SymmetricMatrix X = Spd(9);
+    result = fabber::linalg::CrossProduct(J, X);
+    AssertMatrixNear(J.t() * X * J, result);
+}
+
+// Non-square and single row/column shapes, where a backend that got the
+// storage order of NEWMAT matrices wrong would give transposed or scrambled
+// results
+TEST(LinalgTest, MatchesNewmatShapes)
+{
+    const int shapes[][3] = { { 1, 7, 1 }, { 7, 1, 6 }, { 2, 9, 3 }, { 9, 2, 1 }, { 6, 6, 4 } };
+    for (unsigned int i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++)
+    {
+        int m = shapes[i][0], k = shapes[i][1], n = shapes[i][2];
+        Matrix A(m, k), B(k, n), C(m, n);
+        Fill(A, i);
+        Fill(B, i + 1);
+        Fill(C, i + 2);
+        AssertMatrixNear(A * B, fabber::linalg::Multiply(A, B));
+        AssertMatrixNear(A.t() * C, fabber::linalg::Multiply(A, C, true));
+
+        DiagonalMatrix W(m);
+        for (int r = 1; r <= m; r++)
+        {
+            W(r) = r * 0.25;
+        }
+        SymmetricMatrix result = fabber::linalg::CrossProduct(A, W);
+        AssertMatrixNear(A.t() * W * A, result);
+
+        // Matrix-vector and inner products
+        ColumnVector x(k), y(m);
+        Fill(x, i + 3);
+        Fill(y, i + 4);
+        AssertMatrixNear(A * x, fabber::linalg::Multiply(A, x));
+        AssertMatrixNear(A.t() * y, fabber::linalg::Multiply(A, y, true));
+        AssertMatrixNear(y.t() * y, fabber::linalg::Multiply(y, y, true));
+    }
+}
+
+TEST(LinalgTest, InvertSPD)
+{
+    SymmetricMatrix A = Spd(6);
+    SymmetricMatrix inv;
+    ASSERT_TRUE(fabber::linalg::InvertSPD(A, inv));
+    AssertMatrixNear(IdentityMatrix(6), A * inv);
+}
+}
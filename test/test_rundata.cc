@@ -4,10 +4,24 @@
 #include "gtest/gtest.h"
 
 #include "easylog.h"
+#include "fabber_capi.h"
+#include "fwdmodel.h"
+#include "progressive_output.h"
+#include "result_container.h"
 #include "rundata.h"
 #include "setup.h"
+#include "tools.h"
 
+#include <algorithm>
 #include <fstream>
+#include <iterator>
+#include <memory>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <utime.h>
 
 namespace
 {
@@ -511,4 +525,488 @@ TEST_F(RunDataTest, ClearVoxelData)
     ASSERT_THROW(rundata.GetVoxelData("data2"), DataNotFound);
     ASSERT_THROW(rundata.GetVoxelData("data3"), DataNotFound);
 }
+
+// Test that ASCII, VEST and binary matrix files are detected and
+// all give the same matrix
+TEST_F(RunDataTest, MatrixFileFormats)
+{
+    int NROWS = 4;
+    int NCOLS = 3;
+    string ASCII_FILENAME = "test_matrix_ascii.mat";
+    string VEST_FILENAME = "test_matrix_vest.mat";
+    string BINARY_FILENAME = "test_matrix.bin";
+
+    NEWMAT::Matrix mat(NROWS, NCOLS);
+    for (int r = 1; r <= NROWS; r++)
+    {
+        for (int c = 1; c <= NCOLS; c++)
+        {
+            mat(r, c) = r * 1.5 - c * 0.25;
+        }
+    }
+
+    ofstream os;
+    os.open(ASCII_FILENAME.c_str(), ios::out);
+    os << mat;
+    os.close();
+
+    os.open(VEST_FILENAME.c_str(), ios::out);
+    os << "/NumWaves " << NCOLS << endl;
+    os << "/NumPoints " << NROWS << endl;
+    os << "/Matrix" << endl;
+    os << mat;
+    os.close();
+
+    fabber::write_binary_matrix(mat, BINARY_FILENAME);
+
+    NEWMAT::Matrix ascii = fabber::read_matrix_file(ASCII_FILENAME);
+    NEWMAT::Matrix vest = fabber::read_matrix_file(VEST_FILENAME);
+    NEWMAT::Matrix binary = fabber::read_matrix_file(BINARY_FILENAME);
+    remove(ASCII_FILENAME.c_str());
+    remove(VEST_FILENAME.c_str());
+    remove(BINARY_FILENAME.c_str());
+
+    ASSERT_EQ(NROWS, ascii.Nrows());
+    ASSERT_EQ(NCOLS, ascii.Ncols());
+    ASSERT_EQ(NROWS, vest.Nrows());
+    ASSERT_EQ(NCOLS, vest.Ncols());
+    ASSERT_EQ(NROWS, binary.Nrows());
+    ASSERT_EQ(NCOLS, binary.Ncols());
+    for (int r = 1; r <= NROWS; r++)
+    {
+        for (int c = 1; c <= NCOLS; c++)
+        {
+            ASSERT_TRUE(FloatEq(mat(r, c), ascii(r, c)));
+            ASSERT_TRUE(FloatEq(mat(r, c), vest(r, c)));
+            // Binary format is exact
+            ASSERT_EQ(mat(r, c), binary(r, c));
+        }
+    }
+}
+
+// Test that a binary matrix is read back exactly as written, including
+// for non-square and single row/column matrices where a transposed or
+// scrambled layout would show up
+TEST_F(RunDataTest, MatrixFileBinaryRoundTrip)
+{
+    string FILENAME = "test_matrix_roundtrip.bin";
+    int SHAPES[][2] = { { 5, 3 }, { 3, 5 }, { 1, 7 }, { 7, 1 } };
+    for (int i = 0; i < 4; i++)
+    {
+        int nrows = SHAPES[i][0];
+        int ncols = SHAPES[i][1];
+        NEWMAT::Matrix mat(nrows, ncols);
+        for (int r = 1; r <= nrows; r++)
+        {
+            for (int c = 1; c <= ncols; c++)
+            {
+                mat(r, c) = r * 100 + c + 0.125;
+            }
+        }
+        fabber::write_binary_matrix(mat, FILENAME);
+        NEWMAT::Matrix binary = fabber::read_matrix_file(FILENAME);
+        remove(FILENAME.c_str());
+
+        ASSERT_EQ(nrows, binary.Nrows());
+        ASSERT_EQ(ncols, binary.Ncols());
+        for (int r = 1; r <= nrows; r++)
+        {
+            for (int c = 1; c <= ncols; c++)
+            {
+                ASSERT_EQ(mat(r, c), binary(r, c));
+            }
+        }
+    }
+}
+
+// Test that a truncated binary matrix file is rejected
+TEST_F(RunDataTest, MatrixFileBinaryTruncated)
+{
+    string FILENAME = "test_matrix_truncated.bin";
+    NEWMAT::Matrix mat(10, 10);
+    mat = 1;
+    fabber::write_binary_matrix(mat, FILENAME);
+
+    // Rewrite the file without the last value
+    ifstream is(FILENAME.c_str(), ios::in | ios::binary);
+    string contents((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+    is.close();
+    ofstream os(FILENAME.c_str(), ios::out | ios::binary | ios::trunc);
+    os.write(contents.data(), contents.size() - sizeof(double));
+    os.close();
+
+    ASSERT_THROW(fabber::read_matrix_file(FILENAME), FabberRunDataError);
+    remove(FILENAME.c_str());
+    ASSERT_THROW(fabber::read_matrix_file(FILENAME), DataNotFound);
+}
+
+#ifndef _WIN32
+// Test that a progressive output is readable as a NIFTI file while it is
+// being written, with unwritten voxels zero
+TEST_F(RunDataTest, ProgressiveOutput)
+{
+    string FILENAME = "test_progressive";
+    fabber::NiftiGeometry geom;
+    geom.dims[0] = 3;
+    geom.dims[1] = 2;
+    geom.dims[2] = 2;
+    geom.pixdims[0] = 2.5;
+    // Radiological orientation, so the qform has a reflection
+    geom.xform_code = 1;
+    geom.xform(1, 1) = -2.5;
+    geom.xform(1, 4) = 10;
+    geom.xform(2, 4) = -5;
+
+    // Voxels in a different order to the image
+    vector<int> offsets;
+    offsets.push_back(11);
+    offsets.push_back(0);
+    offsets.push_back(4);
+    fabber::MappedNiftiOutput output(FILENAME, geom, 2, offsets, false);
+    ASSERT_EQ(FILENAME + ".nii", output.GetFilename());
+
+    NEWMAT::ColumnVector values(2);
+    values << 1.5 << -2;
+    output.SetVoxel(1, values);
+    values << 7 << 3.25;
+    output.SetVoxel(3, values);
+    ASSERT_THROW(output.SetVoxel(4, values), FabberInternalError);
+
+    ifstream is(output.GetFilename().c_str(), ios::in | ios::binary);
+    string contents((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+    is.close();
+    ASSERT_EQ(352 + 12 * 2 * sizeof(float), contents.size());
+
+    int32_t sizeof_hdr;
+    int16_t dims[5];
+    float pixdim, vox_offset;
+    memcpy(&sizeof_hdr, contents.data(), 4);
+    memcpy(dims, contents.data() + 40, 10);
+    memcpy(&pixdim, contents.data() + 80, 4);
+    memcpy(&vox_offset, contents.data() + 108, 4);
+    ASSERT_EQ(348, sizeof_hdr);
+    ASSERT_EQ(4, dims[0]);
+    ASSERT_EQ(3, dims[1]);
+    ASSERT_EQ(2, dims[2]);
+    ASSERT_EQ(2, dims[3]);
+    ASSERT_EQ(2, dims[4]);
+    ASSERT_EQ(2.5, pixdim);
+    ASSERT_EQ(352, vox_offset);
+    ASSERT_EQ(string("n+1"), string(contents.data() + 344));
+
+    // Transform is written as both the qform and the sform
+    int16_t xform_codes[2];
+    float qfac, quatern[6], srow_x[4];
+    memcpy(xform_codes, contents.data() + 252, 4);
+    memcpy(&qfac, contents.data() + 76, 4);
+    memcpy(quatern, contents.data() + 256, 24);
+    memcpy(srow_x, contents.data() + 280, 16);
+    ASSERT_EQ(1, xform_codes[0]);
+    ASSERT_EQ(1, xform_codes[1]);
+    ASSERT_EQ(-1, qfac);
+    // Reflection in x is a rotation of 180 degrees about y with qfac -1
+    ASSERT_NEAR(0, quatern[0], 1e-6);
+    ASSERT_NEAR(1, quatern[1], 1e-6);
+    ASSERT_NEAR(0, quatern[2], 1e-6);
+    ASSERT_EQ(10, quatern[3]);
+    ASSERT_EQ(-5, quatern[4]);
+    ASSERT_EQ(0, quatern[5]);
+    ASSERT_EQ(-2.5, srow_x[0]);
+    ASSERT_EQ(10, srow_x[3]);
+
+    float data[24];
+    memcpy(data, contents.data() + 352, sizeof(data));
+    for (int i = 0; i < 24; i++)
+    {
+        if (i == 11)
+            ASSERT_EQ(1.5, data[i]);
+        else if (i == 23)
+            ASSERT_EQ(-2, data[i]);
+        else if (i == 4)
+            ASSERT_EQ(7, data[i]);
+        else if (i == 16)
+            ASSERT_EQ(3.25, data[i]);
+        else
+            ASSERT_EQ(0, data[i]);
+    }
+
+    output.Close();
+    ASSERT_THROW(output.SetVoxel(1, values), FabberInternalError);
+    remove(output.GetFilename().c_str());
+}
+
+// Test that a compressed progressive output replaces the uncompressed file
+TEST_F(RunDataTest, ProgressiveOutputCompress)
+{
+    string FILENAME = "test_progressive_compress";
+    fabber::NiftiGeometry geom;
+    geom.dims[0] = 10;
+    vector<int> offsets(1, 5);
+    fabber::MappedNiftiOutput output(FILENAME, geom, 1, offsets, true);
+    NEWMAT::ColumnVector values(1);
+    values = 4;
+    output.SetVoxel(1, values);
+    output.Close();
+
+    ASSERT_EQ(FILENAME + ".nii.gz", output.GetFilename());
+    ifstream is((FILENAME + ".nii").c_str());
+    ASSERT_FALSE(is.good());
+    ifstream gz(output.GetFilename().c_str());
+    ASSERT_TRUE(gz.good());
+    gz.close();
+    remove(output.GetFilename().c_str());
+}
+
+// Test that outputs can be written to a result container and read back,
+// with and without compression, and exported to NIFTI
+TEST_F(RunDataTest, ResultContainer)
+{
+    for (int compress = 0; compress <= 1; compress++)
+    {
+        string FILENAME = "test_results.fabres";
+        fabber::NiftiGeometry geom;
+        geom.dims[0] = 4;
+        geom.dims[1] = 3;
+        geom.dims[2] = 2;
+        geom.pixdims[2] = 3.5;
+        vector<int> offsets;
+        offsets.push_back(23);
+        offsets.push_back(1);
+        offsets.push_back(6);
+
+        NEWMAT::Matrix mean(1, 3), mvn(3, 3);
+        for (int v = 1; v <= 3; v++)
+        {
+            mean(1, v) = v * 1.5;
+            for (int t = 1; t <= 3; t++)
+                mvn(t, v) = t - v * 0.25;
+        }
+        {
+            fabber::ResultContainerWriter writer(FILENAME, geom, offsets, compress);
+            writer.Add("mean_c0", mean);
+            writer.Add("finalMVN", mvn, 1005);
+            mean(1, 2) = -7;
+            writer.Add("mean_c0", mean);
+        }
+
+        fabber::ResultContainer results(FILENAME);
+        ASSERT_EQ(3, results.GetNumVoxels());
+        ASSERT_EQ(2, int(results.GetNames().size()));
+        ASSERT_EQ("mean_c0", results.GetNames()[0]);
+        ASSERT_EQ("finalMVN", results.GetNames()[1]);
+        ASSERT_EQ(6, results.GetOffsets()[2]);
+        ASSERT_EQ(2, results.GetGeometry().dims[2]);
+        ASSERT_EQ(3.5, results.GetGeometry().pixdims[2]);
+        ASSERT_EQ(1005, results.GetEntry("finalMVN").intent_code);
+        ASSERT_EQ(compress != 0, results.GetMappedVolume("mean_c0", 1) == NULL);
+        ASSERT_THROW(results.GetEntry("mean_c1"), DataNotFound);
+
+        NEWMAT::Matrix data = results.GetData("mean_c0");
+        ASSERT_EQ(1, data.Nrows());
+        ASSERT_EQ(1.5, data(1, 1));
+        ASSERT_EQ(-7, data(1, 2));
+        ASSERT_EQ(4.5, data(1, 3));
+        data = results.GetData("finalMVN");
+        ASSERT_EQ(3, data.Nrows());
+        for (int v = 1; v <= 3; v++)
+        {
+            for (int t = 1; t <= 3; t++)
+                ASSERT_EQ(mvn(t, v), data(t, v));
+        }
+
+        string nifti = results.ExportNifti("finalMVN", "test_results_mvn");
+        ifstream is(nifti.c_str(), ios::in | ios::binary);
+        string contents((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+        is.close();
+        ASSERT_EQ(352 + 24 * 3 * sizeof(float), contents.size());
+        int16_t intent;
+        memcpy(&intent, contents.data() + 68, 2);
+        ASSERT_EQ(1005, intent);
+        float value;
+        memcpy(&value, contents.data() + 352 + (24 * 2 + 6) * 4, 4);
+        ASSERT_EQ(mvn(3, 3), value);
+        remove(nifti.c_str());
+        remove(FILENAME.c_str());
+    }
+}
+#endif
+
+// Test that the factories are kept while references are held
+TEST_F(RunDataTest, FactoryReferenceCounting)
+{
+    FabberSetup::AddRef();
+    FabberSetup::AddRef();
+    FabberSetup::Release();
+    ASSERT_TRUE(FwdModelFactory::GetInstance()->HasName("poly"));
+
+    // Destroy has no effect while a reference is held
+    FabberSetup::Destroy();
+    ASSERT_TRUE(FwdModelFactory::GetInstance()->HasName("poly"));
+
+    FabberSetup::Release();
+    ASSERT_FALSE(FwdModelFactory::GetInstance()->HasName("poly"));
+}
+
+static void *FactoryUser(void *)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        FabberSetup::AddRef();
+        std::auto_ptr<FwdModel> model(FwdModel::NewFromName("poly"));
+        FabberSetup::Release();
+    }
+    return NULL;
+}
+
+// Test that the factories can be used from multiple threads while
+// references are taken and released
+TEST_F(RunDataTest, FactoryConcurrentUse)
+{
+    int NTHREADS = 4;
+    FabberSetup::AddRef();
+    vector<pthread_t> threads(NTHREADS);
+    for (int t = 0; t < NTHREADS; t++)
+    {
+        ASSERT_EQ(0, pthread_create(&threads[t], NULL, FactoryUser, NULL));
+    }
+    for (int t = 0; t < NTHREADS; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    ASSERT_TRUE(FwdModelFactory::GetInstance()->HasName("poly"));
+    FabberSetup::Release();
+}
+
+#ifndef _WIN32
+static bool Contains(const vector<string> &names, const string &name)
+{
+    return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+// Test that the models listed in an up to date manifest are known without
+// opening the library, and that an out of date manifest is ignored
+TEST_F(RunDataTest, ModelManifest)
+{
+    string LIBRARY = "test_manifest_models.so";
+    FabberSetup::SetupDefaults();
+
+    // Not a real library, so it fails if it is actually opened
+    ofstream lib(LIBRARY.c_str());
+    lib << "not a library" << endl;
+    lib.close();
+
+    string manifest = FwdModel::ManifestFilename(LIBRARY);
+    ofstream os(manifest.c_str());
+    os << "# Test models" << endl;
+    os << "manifest_test_a" << endl;
+    os << "  manifest_test_b  # comment" << endl;
+    os.close();
+
+    // Library older than the manifest
+    struct utimbuf times;
+    times.actime = times.modtime = time(NULL) - 100;
+    ASSERT_EQ(0, utime(LIBRARY.c_str(), &times));
+
+    FwdModel::LoadFromDynamicLibrary(LIBRARY);
+    vector<string> known = FwdModel::GetKnown();
+    ASSERT_TRUE(Contains(known, "manifest_test_a"));
+    ASSERT_TRUE(Contains(known, "manifest_test_b"));
+    ASSERT_TRUE(Contains(known, "poly"));
+
+    // The library is only opened when one of its models is used
+    ASSERT_THROW(FwdModel::NewFromName("manifest_test_a"), InvalidOptionValue);
+
+    // Library modified after the manifest was written
+    os.open(manifest.c_str());
+    os << "manifest_test_c" << endl;
+    os.close();
+    times.actime = times.modtime = time(NULL) + 100;
+    ASSERT_EQ(0, utime(LIBRARY.c_str(), &times));
+
+    ASSERT_THROW(FwdModel::LoadFromDynamicLibrary(LIBRARY), InvalidOptionValue);
+    known = FwdModel::GetKnown();
+    ASSERT_FALSE(Contains(known, "manifest_test_c"));
+
+    remove(manifest.c_str());
+    remove(LIBRARY.c_str());
+    FabberSetup::Destroy();
+}
+#endif
+
+// Test that the model parameters can be found through the C API for a
+// model comparison run, using the first model
+TEST_F(RunDataTest, CapiModelParamsComparison)
+{
+    char err_buf[FABBER_ERR_MAXC + 1];
+    char out_buf[1000];
+    void *fab = fabber_new(err_buf);
+    ASSERT_TRUE(fab != NULL);
+    ASSERT_EQ(0, fabber_set_opt(fab, "model1", "poly", err_buf));
+    ASSERT_EQ(0, fabber_set_opt(fab, "model2", "linear", err_buf));
+    ASSERT_EQ(0, fabber_set_opt(fab, "degree", "1", err_buf));
+    ASSERT_EQ(0, fabber_get_model_params(fab, sizeof(out_buf), out_buf, err_buf));
+    ASSERT_EQ(string("c0\nc1\n"), string(out_buf));
+    fabber_destroy(fab);
+
+    // No model at all
+    fab = fabber_new(err_buf);
+    ASSERT_TRUE(fab != NULL);
+    ASSERT_NE(0, fabber_get_model_params(fab, sizeof(out_buf), out_buf, err_buf));
+    fabber_destroy(fab);
+}
+
+static int g_log_lines[4];
+
+static void CountLogLines(int level, const char *line)
+{
+    if (level >= 0 && level <= 3)
+        g_log_lines[level]++;
+}
+
+// Test that the streaming log delivers lines at the requested levels
+TEST_F(RunDataTest, StreamingLog)
+{
+    int NT = 10;
+    vector<float> data(NT);
+    for (int t = 0; t < NT; t++)
+    {
+        data[t] = 3.5 + 1.2 * t;
+    }
+    char err_buf[FABBER_ERR_MAXC + 1];
+
+    for (int min_level = FABBER_LOG_INFO; min_level <= FABBER_LOG_ERROR; min_level++)
+    {
+        void *fab = fabber_new(err_buf);
+        ASSERT_TRUE(fab != NULL);
+        ASSERT_EQ(0, fabber_set_extent(fab, 1, 1, 1, NULL, err_buf));
+        ASSERT_EQ(0, fabber_set_data(fab, "data", NT, &data[0], err_buf));
+        ASSERT_EQ(0, fabber_set_opt(fab, "model", "poly", err_buf));
+        ASSERT_EQ(0, fabber_set_opt(fab, "method", "vb", err_buf));
+        ASSERT_EQ(0, fabber_set_opt(fab, "noise", "white", err_buf));
+        ASSERT_EQ(0, fabber_set_opt(fab, "degree", "1", err_buf));
+        ASSERT_EQ(0, fabber_set_opt(fab, "print-free-energy", "", err_buf));
+
+        memset(g_log_lines, 0, sizeof(g_log_lines));
+        ASSERT_EQ(0, fabber_dorun_stream(fab, min_level, CountLogLines, err_buf, NULL));
+        if (min_level == FABBER_LOG_INFO)
+            ASSERT_GT(g_log_lines[FABBER_LOG_INFO], 0);
+        else
+            ASSERT_EQ(0, g_log_lines[FABBER_LOG_INFO]);
+        ASSERT_EQ(0, g_log_lines[FABBER_LOG_ERROR]);
+        fabber_destroy(fab);
+    }
+
+    // Errors are delivered at the error level
+    void *fab = fabber_new(err_buf);
+    ASSERT_TRUE(fab != NULL);
+    ASSERT_EQ(0, fabber_set_extent(fab, 1, 1, 1, NULL, err_buf));
+    ASSERT_EQ(0, fabber_set_opt(fab, "model", "poly", err_buf));
+    ASSERT_EQ(0, fabber_set_opt(fab, "method", "vb", err_buf));
+    ASSERT_EQ(0, fabber_set_opt(fab, "noise", "white", err_buf));
+    memset(g_log_lines, 0, sizeof(g_log_lines));
+    ASSERT_NE(0, fabber_dorun_stream(fab, FABBER_LOG_ERROR, CountLogLines, err_buf, NULL));
+    ASSERT_GT(g_log_lines[FABBER_LOG_ERROR], 0);
+    ASSERT_EQ(0, g_log_lines[FABBER_LOG_INFO]);
+    fabber_destroy(fab);
+}
 }
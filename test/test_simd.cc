@@ -0,0 +1,166 @@
+// Tests for vectorised kernels
+
+#include "gtest/gtest.h"
+
+#include "simd_kernels.h"
+
+#include <miscmaths/miscmaths.h>
+
+#include <math.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+class SimdTest : public ::testing::TestWithParam<string>
+{
+protected:
+    virtual void SetUp()
+    {
+        m_previous = fabber::simd::InstructionSet();
+    }
+
+    virtual void TearDown()
+    {
+        fabber::simd::SetInstructionSet(m_previous);
+    }
+
+    string m_previous;
+};
+
+// Test each kernel against a simple loop for lengths which do and do not
+// fill whole vectors, and with unaligned data
+TEST_P(SimdTest, MatchesScalar)
+{
+    if (!fabber::simd::SetInstructionSet(GetParam()))
+    {
+        // Not available on this build or CPU
+        return;
+    }
+    ASSERT_EQ(GetParam(), fabber::simd::InstructionSet());
+
+    for (int n = 0; n < 40; n++)
+    {
+        vector<double> a(n + 1), b(n + 1), out(n + 1);
+        for (int i = 0; i <= n; i++)
+        {
+            a[i] = sin(i + 1.0);
+            b[i] = cos(i * 0.3) + 2;
+        }
+        const double *a1 = &a[0] + 1;
+
+        double dot = 0, wsumsq = 0;
+        for (int i = 0; i < n; i++)
+        {
+            dot += a1[i] * b[i];
+            wsumsq += b[i] * a1[i] * a1[i];
+        }
+        ASSERT_NEAR(dot, fabber::simd::Dot(a1, &b[0], n), 1e-12);
+        ASSERT_NEAR(wsumsq, fabber::simd::WeightedSumSquares(a1, &b[0], n), 1e-12);
+
+        fabber::simd::Subtract(a1, &b[0], &out[0], n);
+        for (int i = 0; i < n; i++)
+        {
+            ASSERT_DOUBLE_EQ(a1[i] - b[i], out[i]);
+        }
+    }
+}
+
+// Test the special functions against MISCMATHS and the C library over a wide
+// range of arguments, to the accuracy documented in simd_kernels.h
+TEST_P(SimdTest, SpecialFunctions)
+{
+    if (!fabber::simd::SetInstructionSet(GetParam()))
+    {
+        return;
+    }
+
+    vector<double> x;
+    for (int i = -300; i <= 300; i++)
+    {
+        x.push_back(pow(10.0, i) * 1.2345);
+    }
+    for (int i = 1; i <= 200; i++)
+    {
+        // Gamma shape parameters are mostly in this range
+        x.push_back(i * 0.05);
+    }
+    int n = x.size();
+    vector<double> out(n);
+
+    fabber::simd::Log(&x[0], &out[0], n);
+    for (int i = 0; i < n; i++)
+    {
+        ASSERT_NEAR(log(x[i]), out[i], 4.5e-16 * fabs(log(x[i])));
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        double e = log(x[i]) * (i % 2 ? 1 : -1);
+        vector<double> in(1, e);
+        fabber::simd::Exp(&in[0], &out[i], 1);
+        ASSERT_NEAR(exp(e), out[i], 4.5e-16 * exp(e));
+    }
+
+    fabber::simd::Digamma(&x[0], &out[0], n);
+    for (int i = 0; i < n; i++)
+    {
+        if (x[i] > 1e-100 && x[i] < 1e100)
+        {
+            double expected = MISCMATHS::digamma(x[i]);
+            ASSERT_NEAR(expected, out[i], 1e-10 * max(1.0, fabs(expected)));
+        }
+    }
+
+    fabber::simd::LogGamma(&x[0], &out[0], n);
+    for (int i = 0; i < n; i++)
+    {
+        double expected = lgamma(x[i]);
+        ASSERT_NEAR(expected, out[i], 1e-13 * max(1.0, fabs(expected)));
+    }
+}
+
+// Test the special cases and that the output can overwrite the input
+TEST_P(SimdTest, SpecialFunctionLimits)
+{
+    if (!fabber::simd::SetInstructionSet(GetParam()))
+    {
+        return;
+    }
+
+    double x[] = { 0, -1, HUGE_VAL };
+    double out[3];
+    fabber::simd::Log(x, out, 3);
+    ASSERT_TRUE(out[0] == -HUGE_VAL);
+    ASSERT_TRUE(out[1] != out[1]);
+    ASSERT_TRUE(out[2] == HUGE_VAL);
+    fabber::simd::Digamma(x, out, 2);
+    ASSERT_TRUE(out[0] != out[0]);
+    ASSERT_TRUE(out[1] != out[1]);
+    fabber::simd::LogGamma(x, out, 2);
+    ASSERT_TRUE(out[0] == HUGE_VAL);
+    ASSERT_TRUE(out[1] != out[1]);
+
+    double e[] = { 1000, -1000, 0 };
+    fabber::simd::Exp(e, e, 3);
+    ASSERT_TRUE(e[0] == HUGE_VAL);
+    ASSERT_EQ(0, e[1]);
+    ASSERT_EQ(1, e[2]);
+}
+
+INSTANTIATE_TEST_CASE_P(SimdTests, SimdTest, ::testing::Values("scalar", "avx2", "avx512"));
+
+// Test that unknown instruction sets are rejected and auto selection works
+TEST(SimdSelectTest, Select)
+{
+    string current = fabber::simd::InstructionSet();
+    ASSERT_FALSE(fabber::simd::SetInstructionSet("notaninstructionset"));
+    ASSERT_EQ(current, fabber::simd::InstructionSet());
+    ASSERT_TRUE(fabber::simd::SetInstructionSet("scalar"));
+    ASSERT_EQ("scalar", fabber::simd::InstructionSet());
+    ASSERT_TRUE(fabber::simd::SetInstructionSet("auto"));
+    fabber::simd::SetInstructionSet(current);
+}
+}
@@ -0,0 +1,354 @@
+/*  thread_pool.cc - Simple pool of worker threads
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+
+#include "thread_pool.h"
+
+#include "rundata.h"
+
+#include <stdio.h>
+
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+using namespace std;
+
+int ThreadPool::NumProcessors()
+{
+#ifndef _WIN32
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs > 0)
+        return int(nprocs);
+#endif
+    return 1;
+}
+
+vector<int> ThreadPool::ParseCpuList(const string &list)
+{
+    vector<int> cpus;
+    stringstream ss(list);
+    string range;
+    while (getline(ss, range, ','))
+    {
+        int first, last;
+        int nread = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (nread == 1)
+            last = first;
+        else if (nread != 2)
+            continue;
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            if (cpu >= 0)
+                cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+#ifdef __linux__
+/**
+ * Read a CPU list from a sysfs file, returning an empty list if not available
+ */
+static vector<int> ReadCpuList(const string &filename)
+{
+    ifstream file(filename.c_str());
+    string list;
+    if (file && getline(file, list))
+        return ThreadPool::ParseCpuList(list);
+    return vector<int>();
+}
+#endif
+
+vector<vector<int> > ThreadPool::NumaNodes()
+{
+    vector<vector<int> > nodes;
+    vector<int> allowed;
+#ifdef __linux__
+    // Only use processors this process is allowed to run on, e.g. when
+    // restricted by taskset or a batch scheduler
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &mask))
+                allowed.push_back(cpu);
+        }
+    }
+
+    vector<int> node_ids = ReadCpuList("/sys/devices/system/node/online");
+    for (size_t n = 0; n < node_ids.size(); n++)
+    {
+        ostringstream filename;
+        filename << "/sys/devices/system/node/node" << node_ids[n] << "/cpulist";
+        vector<int> node_cpus = ReadCpuList(filename.str());
+        vector<int> cpus;
+        for (size_t c = 0; c < node_cpus.size(); c++)
+        {
+            if (allowed.empty() || CPU_ISSET(node_cpus[c], &mask))
+                cpus.push_back(node_cpus[c]);
+        }
+        if (!cpus.empty())
+            nodes.push_back(cpus);
+    }
+#endif
+
+    if (nodes.empty())
+    {
+        if (allowed.empty())
+        {
+            for (int cpu = 0; cpu < NumProcessors(); cpu++)
+            {
+                allowed.push_back(cpu);
+            }
+        }
+        nodes.push_back(allowed);
+    }
+    return nodes;
+}
+
+vector<int> ThreadPool::PinningOrder()
+{
+    vector<vector<int> > nodes = NumaNodes();
+    int current = -1;
+#ifdef __linux__
+    current = sched_getcpu();
+#endif
+
+    // Find the caller's node
+    size_t home = 0;
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        for (size_t c = 0; c < nodes[n].size(); c++)
+        {
+            if (nodes[n][c] == current)
+                home = n;
+        }
+    }
+
+    vector<int> order;
+    bool have_current = false;
+    for (size_t c = 0; c < nodes[home].size(); c++)
+    {
+        if (nodes[home][c] == current)
+            have_current = true;
+        else
+            order.push_back(nodes[home][c]);
+    }
+    if (have_current)
+        order.push_back(current);
+    for (size_t n = 0; n < nodes.size(); n++)
+    {
+        if (n != home)
+            order.insert(order.end(), nodes[n].begin(), nodes[n].end());
+    }
+    return order;
+}
+
+#ifdef _WIN32
+
+ThreadPool::ThreadPool(int nthreads, bool pin)
+    : m_nthreads(1)
+    , m_pinned(false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+}
+
+void ThreadPool::Run(const vector<ThreadTask *> &tasks)
+{
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        tasks[i]->Run();
+    }
+}
+
+#else
+
+ThreadPool::ThreadPool(int nthreads, bool pin)
+    : m_nthreads(nthreads < 1 ? 1 : nthreads)
+    , m_pinned(false)
+    , m_tasks(NULL)
+    , m_next(0)
+    , m_remaining(0)
+    , m_shutdown(false)
+    , m_failed(false)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_work_cond, NULL);
+    pthread_cond_init(&m_done_cond, NULL);
+
+    vector<int> cpus;
+    if (pin)
+    {
+        cpus = PinningOrder();
+    }
+    m_pinned = !cpus.empty();
+
+    for (int i = 1; i < m_nthreads; i++)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+#ifdef __linux__
+        // Set the affinity before the thread starts so its stack and any
+        // memory it allocates are placed on the local node
+        if (!cpus.empty())
+        {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            CPU_SET(cpus[(i - 1) % cpus.size()], &mask);
+            if (pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask) != 0)
+                m_pinned = false;
+        }
+#else
+        m_pinned = false;
+#endif
+        pthread_t thread;
+        int ret = pthread_create(&thread, &attr, WorkerMain, this);
+        pthread_attr_destroy(&attr);
+        if (ret != 0)
+        {
+            // Carry on with the threads we have
+            break;
+        }
+        m_threads.push_back(thread);
+    }
+    m_nthreads = m_threads.size() + 1;
+    if (m_threads.empty())
+        m_pinned = false;
+}
+
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_shutdown = true;
+    pthread_cond_broadcast(&m_work_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    for (size_t i = 0; i < m_threads.size(); i++)
+    {
+        pthread_join(m_threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&m_done_cond);
+    pthread_cond_destroy(&m_work_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void *ThreadPool::WorkerMain(void *pool)
+{
+    static_cast<ThreadPool *>(pool)->WorkerLoop();
+    return NULL;
+}
+
+void ThreadPool::WorkerLoop()
+{
+    pthread_mutex_lock(&m_mutex);
+    while (true)
+    {
+        while (!m_shutdown && ((m_tasks == NULL) || (m_next >= m_tasks->size())))
+        {
+            pthread_cond_wait(&m_work_cond, &m_mutex);
+        }
+        if (m_shutdown)
+            break;
+
+        ThreadTask *task = (*m_tasks)[m_next++];
+        pthread_mutex_unlock(&m_mutex);
+        RunTask(task);
+        pthread_mutex_lock(&m_mutex);
+
+        m_remaining--;
+        if (m_remaining == 0)
+            pthread_cond_broadcast(&m_done_cond);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void ThreadPool::RunTask(ThreadTask *task)
+{
+    string error;
+    try
+    {
+        task->Run();
+        return;
+    }
+    catch (const exception &e)
+    {
+        error = e.what();
+    }
+    catch (...)
+    {
+        error = "Unknown exception";
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    if (!m_failed)
+    {
+        m_failed = true;
+        m_error = error;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void ThreadPool::Run(const vector<ThreadTask *> &tasks)
+{
+    if ((m_nthreads == 1) || (tasks.size() <= 1))
+    {
+        // Nothing to gain from other threads
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            tasks[i]->Run();
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_tasks = &tasks;
+    m_next = 0;
+    m_remaining = tasks.size();
+    m_failed = false;
+    m_error = "";
+    pthread_cond_broadcast(&m_work_cond);
+
+    // Calling thread takes tasks too
+    while (m_next < tasks.size())
+    {
+        ThreadTask *task = tasks[m_next++];
+        pthread_mutex_unlock(&m_mutex);
+        RunTask(task);
+        pthread_mutex_lock(&m_mutex);
+        m_remaining--;
+    }
+    while (m_remaining > 0)
+    {
+        pthread_cond_wait(&m_done_cond, &m_mutex);
+    }
+    m_tasks = NULL;
+    bool failed = m_failed;
+    string error = m_error;
+    pthread_mutex_unlock(&m_mutex);
+
+    if (failed)
+    {
+        throw FabberInternalError("Exception in worker thread: " + error);
+    }
+}
+
+#endif
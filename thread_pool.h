@@ -0,0 +1,182 @@
+/*  thread_pool.h - Simple pool of worker threads and locking
+
+ Copyright (C) 2017 University of Oxford  */
+
+/*  CCOPYRIGHT */
+#pragma once
+
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+typedef int fabber_mutex_t;
+#define FABBER_MUTEX_INITIALIZER 0
+#else
+typedef pthread_mutex_t fabber_mutex_t;
+#define FABBER_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+
+/**
+ * Holds a lock on a mutex for the lifetime of the object
+ *
+ * The mutex should be statically initialized using FABBER_MUTEX_INITIALIZER.
+ * On platforms without pthreads no locking is done.
+ */
+class ScopedLock
+{
+public:
+    explicit ScopedLock(fabber_mutex_t &mutex)
+        : m_mutex(mutex)
+    {
+#ifndef _WIN32
+        pthread_mutex_lock(&m_mutex);
+#endif
+    }
+
+    ~ScopedLock()
+    {
+#ifndef _WIN32
+        pthread_mutex_unlock(&m_mutex);
+#endif
+    }
+
+private:
+    // Not copyable
+    ScopedLock(const ScopedLock &);
+    ScopedLock &operator=(const ScopedLock &);
+
+    fabber_mutex_t &m_mutex;
+};
+
+/**
+ * A unit of work to be run by a ThreadPool
+ */
+class ThreadTask
+{
+public:
+    virtual ~ThreadTask()
+    {
+    }
+
+    /**
+     * Do the work. May be called from any thread
+     */
+    virtual void Run() = 0;
+};
+
+/**
+ * Fixed-size pool of worker threads
+ *
+ * Tasks are submitted in batches using Run, which blocks until all
+ * tasks in the batch are complete. The calling thread also runs tasks
+ * so a pool of N threads creates N-1 worker threads.
+ *
+ * Optionally the worker threads can be pinned to processors, filling the
+ * NUMA node of the calling thread first. This keeps the workers close to
+ * the memory the caller is working on, and stops the scheduler moving
+ * them between sockets. Pinning is only supported on Linux and is
+ * silently ignored elsewhere.
+ *
+ * On platforms without pthreads tasks are always run serially in the
+ * calling thread.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * @param nthreads Total number of threads to use, including the caller
+     * @param pin If true, pin each worker thread to a processor
+     */
+    explicit ThreadPool(int nthreads, bool pin = false);
+    ~ThreadPool();
+
+    /**
+     * @return the number of threads used to run tasks, including the caller
+     */
+    int NumThreads() const
+    {
+        return m_nthreads;
+    }
+
+    /**
+     * Run a batch of tasks and wait for them all to complete
+     *
+     * If any task throws an exception, the remaining tasks are still run
+     * and a FabberInternalError is then thrown describing the first failure.
+     * When running serially exceptions propagate unchanged.
+     */
+    void Run(const std::vector<ThreadTask *> &tasks);
+
+    /**
+     * @return the number of processors available, or 1 if not known
+     */
+    static int NumProcessors();
+
+    /**
+     * @return processors available to this process, grouped by NUMA node
+     *
+     * If the NUMA topology cannot be determined all processors are returned
+     * as a single node
+     */
+    static std::vector<std::vector<int> > NumaNodes();
+
+    /**
+     * Order in which processors are assigned to pinned worker threads
+     *
+     * Processors on the same NUMA node as the calling thread come first,
+     * with the caller's own processor last among them, followed by the
+     * other nodes in order.
+     */
+    static std::vector<int> PinningOrder();
+
+    /**
+     * Parse a Linux CPU list, e.g. "0-3,8,10-11"
+     *
+     * @return processor numbers in the list. Invalid entries are ignored
+     */
+    static std::vector<int> ParseCpuList(const std::string &list);
+
+    /**
+     * @return true if the worker threads were pinned to processors
+     */
+    bool IsPinned() const
+    {
+        return m_pinned;
+    }
+
+private:
+    // Not copyable
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    int m_nthreads;
+    bool m_pinned;
+
+#ifndef _WIN32
+    static void *WorkerMain(void *pool);
+    void WorkerLoop();
+
+    /** Run one task, recording any exception. Called without the lock held */
+    void RunTask(ThreadTask *task);
+
+    std::vector<pthread_t> m_threads;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_work_cond;
+    pthread_cond_t m_done_cond;
+
+    /** Current batch, or NULL if idle */
+    const std::vector<ThreadTask *> *m_tasks;
+    /** Index of next task in the batch to be started */
+    size_t m_next;
+    /** Number of tasks in the batch not yet completed */
+    size_t m_remaining;
+    bool m_shutdown;
+
+    bool m_failed;
+    std::string m_error;
+#endif
+};
@@ -9,11 +9,25 @@
 #include "tools.h"
 
 #include "easylog.h"
+#include "simd_kernels.h"
 
 #include <miscmaths/miscmaths.h>
 #include <newmat.h>
 
+#include <ctype.h>
+#include <fstream>
+#include <iterator>
 #include <limits>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 using NEWMAT::Matrix;
@@ -23,21 +37,227 @@ using MISCMATHS::read_ascii_matrix;
 
 namespace fabber
 {
-Matrix read_matrix_file(std::string filename)
+static const char BINARY_MATRIX_MAGIC[8] = { 'F', 'A', 'B', 'M', 'A', 'T', 'R', 'X' };
+static const uint32_t BINARY_MATRIX_VERSION = 1;
+
+// Written in native byte order so files from a machine of different
+// endianness can be detected rather than silently misread
+static const uint32_t BINARY_MATRIX_BYTE_ORDER = 0x01020304;
+
+struct BinaryMatrixHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t nrows;
+    uint64_t ncols;
+};
+
+enum MatrixFileFormat
 {
-    // Detect if file contains a VEST matrix or not
+    MATRIX_ASCII,
+    MATRIX_VEST,
+    MATRIX_BINARY
+};
+
+static MatrixFileFormat DetectMatrixFormat(const string &filename)
+{
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    if (!in)
+    {
+        throw DataNotFound(filename, "File is invalid or does not exist");
+    }
+
+    char magic[sizeof(BINARY_MATRIX_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if ((in.gcount() == sizeof(magic)) && (memcmp(magic, BINARY_MATRIX_MAGIC, sizeof(magic)) == 0))
+    {
+        return MATRIX_BINARY;
+    }
+
+    // VEST files start with /Keyword header lines, ASCII matrices
+    // with numbers
+    in.clear();
+    in.seekg(0);
+    char c;
+    while (in.get(c) && isspace(c))
+    {
+    }
+    if (in && (c == '/'))
+    {
+        return MATRIX_VEST;
+    }
+    return MATRIX_ASCII;
+}
+
+static Matrix BinaryMatrixFromBuffer(const char *buf, size_t size, const string &filename)
+{
+    BinaryMatrixHeader header;
+    if (size < sizeof(header))
+    {
+        throw FabberRunDataError("Binary matrix file is truncated: " + filename);
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (memcmp(header.magic, BINARY_MATRIX_MAGIC, sizeof(header.magic)) != 0)
+    {
+        throw FabberRunDataError("Not a binary matrix file: " + filename);
+    }
+    if (header.byte_order != BINARY_MATRIX_BYTE_ORDER)
+    {
+        throw FabberRunDataError("Binary matrix file has different byte order: " + filename);
+    }
+    if (header.version != BINARY_MATRIX_VERSION)
+    {
+        throw FabberRunDataError(
+            "Unsupported binary matrix file version " + stringify(header.version) + ": " + filename);
+    }
+    int max_dim = numeric_limits<int>::max();
+    if ((header.nrows > uint64_t(max_dim)) || (header.ncols > uint64_t(max_dim)))
+    {
+        throw FabberRunDataError("Binary matrix file has invalid dimensions: " + filename);
+    }
+    uint64_t nvals = header.nrows * header.ncols;
+    if ((size - sizeof(header)) / sizeof(double) != nvals || (size - sizeof(header)) % sizeof(double) != 0)
+    {
+        throw FabberRunDataError("Binary matrix file size does not match its header: " + filename);
+    }
+
+    // Values are stored row by row, as written by write_binary_matrix. Element
+    // access is used rather than Store() as the storage order of the matrix
+    // library is not necessarily row-major (e.g. armawrap)
+    int nrows = int(header.nrows), ncols = int(header.ncols);
+    Matrix mat(nrows, ncols);
+    const char *data = buf + sizeof(header);
+    for (int r = 0; r < nrows; r++)
+    {
+        for (int c = 0; c < ncols; c++)
+        {
+            double val;
+            memcpy(&val, data + (uint64_t(r) * ncols + c) * sizeof(double), sizeof(double));
+            mat(r + 1, c + 1) = val;
+        }
+    }
+    return mat;
+}
+
+Matrix read_binary_matrix(const string &filename)
+{
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw DataNotFound(filename, "File is invalid or does not exist");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw DataNotFound(filename, "Could not get file size");
+    }
+    size_t size = st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        throw FabberRunDataError("Binary matrix file is truncated: " + filename);
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        throw DataNotFound(filename, "Could not map file");
+    }
+
     try
     {
-        return read_vest(filename);
+        Matrix mat = BinaryMatrixFromBuffer(static_cast<const char *>(map), size, filename);
+        munmap(map, size);
+        return mat;
     }
     catch (...)
     {
-        // Do not care why this failed, if it was 'file not found'
-        // we will discover that now we try to read it as ASCII
+        munmap(map, size);
+        throw;
+    }
+#else
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    if (!in)
+    {
+        throw DataNotFound(filename, "File is invalid or does not exist");
+    }
+    vector<char> buf((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    return BinaryMatrixFromBuffer(buf.empty() ? NULL : &buf[0], buf.size(), filename);
+#endif
+}
+
+void write_binary_matrix(const Matrix &mat, const string &filename)
+{
+    BinaryMatrixHeader header;
+    memcpy(header.magic, BINARY_MATRIX_MAGIC, sizeof(header.magic));
+    header.version = BINARY_MATRIX_VERSION;
+    header.byte_order = BINARY_MATRIX_BYTE_ORDER;
+    header.nrows = mat.Nrows();
+    header.ncols = mat.Ncols();
+
+    ofstream out(filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out)
+    {
+        throw FabberRunDataError("Could not open file for writing: " + filename);
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    // Write a row at a time to limit the size of the temporary buffer
+    vector<double> row(mat.Ncols());
+    for (int r = 1; r <= mat.Nrows(); r++)
+    {
+        for (int c = 1; c <= mat.Ncols(); c++)
+        {
+            row[c - 1] = mat(r, c);
+        }
+        if (!row.empty())
+        {
+            out.write(reinterpret_cast<const char *>(&row[0]), row.size() * sizeof(double));
+        }
+    }
+    out.close();
+    if (!out)
+    {
+        throw FabberRunDataError("Error writing binary matrix file: " + filename);
+    }
+}
+
+Matrix read_matrix_file(std::string filename)
+{
+    // Detect the format up front rather than trying each reader in turn, so
+    // large files are only parsed once
+    switch (DetectMatrixFormat(filename))
+    {
+    case MATRIX_BINARY:
+        return read_binary_matrix(filename);
+    case MATRIX_VEST:
+        return read_vest(filename);
+    default:
         return read_ascii_matrix(filename);
     }
 }
 
+// Flags for which rows are kept. Avoids searching the masked list for
+// every row which is quadratic when a large fraction of rows are masked
+static vector<bool> KeptRows(int nrows, const vector<int> &masked_rows, int &nkept)
+{
+    vector<bool> keep(nrows, true);
+    nkept = nrows;
+    for (unsigned int i = 0; i < masked_rows.size(); i++)
+    {
+        int r = masked_rows[i];
+        if (r >= 1 && r <= nrows && keep[r - 1])
+        {
+            keep[r - 1] = false;
+            nkept--;
+        }
+    }
+    return keep;
+}
+
 ReturnMatrix MaskRows(Matrix m, vector<int> masked_rows)
 {
     if (masked_rows.size() == 0)
@@ -46,11 +266,13 @@ ReturnMatrix MaskRows(Matrix m, vector<int> masked_rows)
     }
     else
     {
-        NEWMAT::Matrix masked(m.Nrows() - masked_rows.size(), m.Ncols());
+        int nkept;
+        vector<bool> keep = KeptRows(m.Nrows(), masked_rows, nkept);
+        NEWMAT::Matrix masked(nkept, m.Ncols());
         int masked_row = 1;
         for (int r = 1; r <= m.Nrows(); r++)
         {
-            if (std::find(masked_rows.begin(), masked_rows.end(), r) == masked_rows.end())
+            if (keep[r - 1])
             {
                 masked.Row(masked_row) = m.Row(r);
                 masked_row++;
@@ -68,11 +290,13 @@ ReturnMatrix MaskRows(ColumnVector v, vector<int> masked_rows)
     }
     else
     {
-        NEWMAT::ColumnVector masked(v.Nrows() - masked_rows.size());
+        int nkept;
+        vector<bool> keep = KeptRows(v.Nrows(), masked_rows, nkept);
+        NEWMAT::ColumnVector masked(nkept);
         int masked_row = 1;
         for (int r = 1; r <= v.Nrows(); r++)
         {
-            if (std::find(masked_rows.begin(), masked_rows.end(), r) == masked_rows.end())
+            if (keep[r - 1])
             {
                 masked(masked_row) = v(r);
                 masked_row++;
@@ -85,15 +309,9 @@ ReturnMatrix MaskRows(ColumnVector v, vector<int> masked_rows)
 
 double gammaln(double x)
 {
-    ColumnVector series(7);
-    series << 2.5066282746310005 << 76.18009172947146 << -86.50532032941677 << 24.01409824083091
-           << -1.231739572450155 << 0.1208650973866179e-2 << -0.5395239384953e-5;
-
-    double total = 1.000000000190015;
-    for (int i = 2; i <= series.Nrows(); i++)
-        total += series(i) / (x + i - 1);
-
-    return log(series(1) * total / x) + (x + 0.5) * log(x + 5.5) - x - 5.5;
+    double result;
+    fabber::simd::LogGamma(&x, &result, 1);
+    return result;
 }
 
 double DescendingZeroFinder::FindZero() const
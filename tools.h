@@ -19,17 +19,44 @@ namespace fabber
 /**
  * Read 'small' matrix from file.
  *
- * The matrix may be in ASCII or VEST format
+ * The matrix may be in ASCII, VEST or Fabber binary format. The format
+ * is detected from the start of the file so it is only parsed once.
  */
 NEWMAT::Matrix read_matrix_file(std::string filename);
 
+/**
+ * Read matrix from a file in Fabber binary format
+ *
+ * The format is a fixed 32 byte header (magic bytes, version, byte order
+ * marker, number of rows and columns) followed by the data as 64 bit
+ * floating point values in row order. The file is memory-mapped where
+ * possible, so large design matrices load without any text parsing.
+ */
+NEWMAT::Matrix read_binary_matrix(const std::string &filename);
+
+/**
+ * Write matrix to a file in Fabber binary format
+ */
+void write_binary_matrix(const NEWMAT::Matrix &mat, const std::string &filename);
+
 NEWMAT::ReturnMatrix MaskRows(NEWMAT::Matrix m, std::vector<int> masked_rows);
 NEWMAT::ReturnMatrix MaskRows(NEWMAT::ColumnVector v, std::vector<int> masked_rows);
 }
 
-// Calculate log-gamma from a Taylor expansion; good to one part in 2e-10.
+/**
+ * Log of the gamma function for x > 0
+ *
+ * Uses fabber::simd::LogGamma - see simd_kernels.h for accuracy. When evaluating
+ * for several values it is faster to use fabber::simd::LogGamma directly
+ */
 double gammaln(double x);
 
+/** digamma(0.5), which occurs in the free energy of ARD priors */
+const double DIGAMMA_HALF = -1.96351002602142347944;
+
+/** gammaln(0.5) = log(sqrt(pi)), which occurs in the free energy of ARD priors */
+const double GAMMALN_HALF = 0.57236494292470008707;
+
 /**
  * Base class for a generic 1-dimensional function which takes a double and returns a double
  *